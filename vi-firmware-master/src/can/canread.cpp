@@ -15,6 +15,37 @@ using openxc::pipeline::publish;
 namespace pipeline = openxc::pipeline;
 namespace time = openxc::util::time;
 
+// Only publish a coalesced value to an output interface if it has at least
+// this much room, enough for a typical serialized simple message.
+#define LATEST_VALUE_MIN_CAPACITY 96
+
+/* Private: The latest unpublished value of a translated signal.
+ *
+ * signal - The signal, or NULL if this entry is free.
+ * type - The type of the value, either a number or a boolean.
+ * numericValue - The value, if it's a number.
+ * booleanValue - The value, if it's a boolean.
+ * timestamp - The receive timestamp of the CAN message with the value.
+ * dirtySinks - The pipeline sinks that haven't been sent the value yet, a bit
+ *      for each sink index.
+ */
+typedef struct {
+    CanSignal* signal;
+    openxc_DynamicField_Type type;
+    float numericValue;
+    bool booleanValue;
+    uint32_t timestamp;
+    uint8_t dirtySinks;
+} LatestValue;
+
+static LatestValue latestValues[LATEST_VALUE_TABLE_SIZE];
+static int nextLatestValue;
+// Entries that were used and released again, and how many entries have ever
+// been used - every entry past that is free, too.
+static uint8_t freeLatestValues[LATEST_VALUE_TABLE_SIZE];
+static int freeLatestValueCount;
+static int usedLatestValueCount;
+
 float openxc::can::read::parseSignalBitfield(CanSignal* signal,
         const CanMessage* message) {
     return bitfield_parse_float(message->data, CAN_MESSAGE_SIZE,
@@ -71,7 +102,8 @@ static void buildBaseSimpleVehicleMessage(openxc_VehicleMessage* message,
 
 void openxc::can::read::publishVehicleMessage(const char* name,
         openxc_DynamicField* value, openxc_DynamicField* event,
-        openxc::pipeline::Pipeline* pipeline) {
+        openxc::pipeline::Pipeline* pipeline, const uint32_t* timestamp,
+        uint8_t sinks) {
     openxc_VehicleMessage message = {0};
     buildBaseSimpleVehicleMessage(&message, name);
 
@@ -85,7 +117,7 @@ void openxc::can::read::publishVehicleMessage(const char* name,
         message.simple_message.event = *event;
     }
 
-    pipeline::publish(&message, pipeline);
+    pipeline::publish(&message, pipeline, timestamp, NULL, sinks);
 }
 
 void openxc::can::read::publishVehicleMessage(const char* name,
@@ -150,7 +182,7 @@ void openxc::can::read::passthroughMessage(CanBus* bus, CanMessage* message,
         memcpy(vehicleMessage.can_message.data.bytes, message->data,
                 adjustedSize);
 
-        pipeline::publish(&vehicleMessage, pipeline);
+        pipeline::publish(&vehicleMessage, pipeline, &message->timestamp);
     }
 
     if(messageDefinition != NULL) {
@@ -158,6 +190,108 @@ void openxc::can::read::passthroughMessage(CanBus* bus, CanMessage* message,
     }
 }
 
+/* Private: Keep the value as the latest for the signal, replacing any value
+ * that hasn't been published yet. The signal's entry is found through its
+ * latestValue index rather than by searching the table.
+ *
+ * Returns false if the value can't be coalesced and should be published
+ * immediately - it's a string, no sinks want it, or there's no room left in
+ * the table.
+ */
+static bool storeLatestValue(CanSignal* signal, openxc_DynamicField* value,
+        uint32_t timestamp, Pipeline* pipeline) {
+    if(value->type != openxc_DynamicField_Type_NUM &&
+            value->type != openxc_DynamicField_Type_BOOL) {
+        return false;
+    }
+
+    uint8_t sinks = pipeline::subscribedSinks(pipeline, MessageClass::SIMPLE);
+    if(sinks == 0) {
+        return false;
+    }
+
+    LatestValue* entry = NULL;
+    if(signal->latestValue > 0 &&
+            latestValues[signal->latestValue - 1].signal == signal) {
+        entry = &latestValues[signal->latestValue - 1];
+    } else {
+        int index;
+        if(freeLatestValueCount > 0) {
+            index = freeLatestValues[--freeLatestValueCount];
+        } else if(usedLatestValueCount < LATEST_VALUE_TABLE_SIZE) {
+            index = usedLatestValueCount++;
+        } else {
+            return false;
+        }
+        entry = &latestValues[index];
+        entry->signal = signal;
+        signal->latestValue = index + 1;
+    }
+
+    entry->type = value->type;
+    entry->numericValue = value->numeric_value;
+    entry->booleanValue = value->boolean_value;
+    entry->timestamp = timestamp;
+    entry->dirtySinks = sinks;
+    return true;
+}
+
+static void releaseLatestValue(LatestValue* entry) {
+    entry->signal->latestValue = 0;
+    entry->signal = NULL;
+    freeLatestValues[freeLatestValueCount++] = entry - latestValues;
+}
+
+/* Private: Returns the sinks with enough room for another coalesced value, a
+ * bit for each sink index.
+ */
+static uint8_t readySinks(Pipeline* pipeline) {
+    uint8_t sinks = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        if(pipeline::sendCapacity(pipeline, i) >= LATEST_VALUE_MIN_CAPACITY) {
+            sinks |= 1 << i;
+        }
+    }
+    return sinks;
+}
+
+void openxc::can::read::publishLatestValues(Pipeline* pipeline) {
+    if(!getConfiguration()->coalesceOutput) {
+        return;
+    }
+
+    uint8_t subscribed = pipeline::subscribedSinks(pipeline,
+            MessageClass::SIMPLE);
+    uint8_t ready = readySinks(pipeline);
+    int i;
+    for(i = 0; i < LATEST_VALUE_TABLE_SIZE && ready != 0; i++) {
+        LatestValue* entry = &latestValues[
+                (nextLatestValue + i) % LATEST_VALUE_TABLE_SIZE];
+        if(entry->signal == NULL) {
+            continue;
+        }
+
+        // Don't wait on sinks that went away since the value was stored
+        entry->dirtySinks &= subscribed;
+        uint8_t sinks = entry->dirtySinks & ready;
+        if(sinks != 0) {
+            openxc_DynamicField value = entry->type ==
+                    openxc_DynamicField_Type_BOOL ?
+                        payload::wrapBoolean(entry->booleanValue) :
+                        payload::wrapNumber(entry->numericValue);
+            entry->dirtySinks &= ~sinks;
+            publishVehicleMessage(entry->signal->genericName, &value, NULL,
+                    pipeline, &entry->timestamp, sinks);
+            ready = readySinks(pipeline);
+        }
+
+        if(entry->dirtySinks == 0) {
+            releaseLatestValue(entry);
+        }
+    }
+    nextLatestValue = (nextLatestValue + i) % LATEST_VALUE_TABLE_SIZE;
+}
+
 void openxc::can::read::translateSignal(CanSignal* signal,
         const CanMessage* message,
         CanSignal* signals, int signalCount,
@@ -173,13 +307,119 @@ void openxc::can::read::translateSignal(CanSignal* signal,
     // decide to send the signal or not.
     openxc_DynamicField decodedValue = openxc::can::read::decodeSignal(signal,
             value, signals, signalCount, &send);
-    if(send && shouldSend(signal, value)) {
-        openxc::can::read::publishVehicleMessage(signal->genericName, &decodedValue, pipeline);
+    if(send && shouldSend(signal, value) &&
+            (!getConfiguration()->coalesceOutput ||
+                !storeLatestValue(signal, &decodedValue,
+                    message->timestamp, pipeline))) {
+        openxc::can::read::publishVehicleMessage(signal->genericName,
+                &decodedValue, NULL, pipeline, &message->timestamp);
     }
     signal->received = true;
     signal->lastValue = value;
 }
 
+/* Private: A table of the signals that belong to each message definition.
+ *
+ * messages - The message array the table was built for.
+ * messageCount - The length of the messages array.
+ * signals - The signal array the table was built for.
+ * signalCount - The length of the signals array.
+ * offsets - For each message, the offset in 'order' of its first signal. The
+ *      signals for message i are order[offsets[i]] to order[offsets[i + 1] - 1].
+ * order - Indices into the signals array, grouped by message.
+ */
+static struct {
+    CanMessageDefinition* messages;
+    int messageCount;
+    CanSignal* signals;
+    int signalCount;
+    uint16_t offsets[MAX_INDEXED_MESSAGE_COUNT + 1];
+    uint16_t order[MAX_INDEXED_SIGNAL_COUNT];
+} signalFanout;
+
+static bool signalInMessages(CanSignal* signal,
+        CanMessageDefinition* messages, int messageCount) {
+    return signal->message >= messages &&
+            signal->message < messages + messageCount;
+}
+
+/* Private: Rebuild the signal fan-out table with a counting sort, which keeps
+ * each message's signals in their original order.
+ */
+static void buildSignalFanout(CanMessageDefinition* messages,
+        int messageCount, CanSignal* signals, int signalCount) {
+    memset(signalFanout.offsets, 0, sizeof(signalFanout.offsets));
+    for(int i = 0; i < signalCount; i++) {
+        if(signalInMessages(&signals[i], messages, messageCount)) {
+            ++signalFanout.offsets[signals[i].message - messages + 1];
+        }
+    }
+
+    for(int i = 0; i < messageCount; i++) {
+        signalFanout.offsets[i + 1] += signalFanout.offsets[i];
+    }
+
+    // Filling in the signals moves each offset up to the start of the next
+    // message, so shift them back down afterwards.
+    for(int i = 0; i < signalCount; i++) {
+        if(signalInMessages(&signals[i], messages, messageCount)) {
+            signalFanout.order[
+                signalFanout.offsets[signals[i].message - messages]++] = i;
+        }
+    }
+
+    for(int i = messageCount; i > 0; i--) {
+        signalFanout.offsets[i] = signalFanout.offsets[i - 1];
+    }
+    signalFanout.offsets[0] = 0;
+
+    signalFanout.messages = messages;
+    signalFanout.messageCount = messageCount;
+    signalFanout.signals = signals;
+    signalFanout.signalCount = signalCount;
+}
+
+void openxc::can::read::translateSignals(CanBus* bus,
+        const CanMessage* message, CanMessageDefinition* messages,
+        int messageCount, CanSignal* signals, int signalCount,
+        Pipeline* pipeline) {
+    CanMessageDefinition* definition = lookupMessageDefinition(bus,
+            message->id, message->format, messages, messageCount);
+    if(definition == NULL || signals == NULL || signalCount <= 0) {
+        return;
+    }
+
+    if(messageCount > MAX_INDEXED_MESSAGE_COUNT ||
+            signalCount > MAX_INDEXED_SIGNAL_COUNT) {
+        for(int i = 0; i < signalCount; i++) {
+            if(signals[i].message == definition) {
+                translateSignal(&signals[i], message, signals, signalCount,
+                        pipeline);
+            }
+        }
+        return;
+    }
+
+    if(definition < messages || definition >= messages + messageCount) {
+        // A dynamic definition, which never has any signals.
+        return;
+    }
+
+    if(messages != signalFanout.messages ||
+            messageCount != signalFanout.messageCount ||
+            signals != signalFanout.signals ||
+            signalCount != signalFanout.signalCount) {
+        buildSignalFanout(messages, messageCount, signals, signalCount);
+    }
+
+    int messageIndex = definition - messages;
+    for(int i = signalFanout.offsets[messageIndex];
+            i < signalFanout.offsets[messageIndex + 1]; i++) {
+        translateSignal(&signals[signalFanout.order[i]], message, signals,
+                signalCount, pipeline);
+    }
+}
+
 bool openxc::can::read::shouldSend(CanSignal* signal, float value) {
     bool send = true;
     if(time::conditionalTick(&signal->frequencyClock) ||
@@ -5,6 +5,15 @@
 #include "pipeline.h"
 #include "openxc.pb.h"
 
+// Signal sets larger than this fall back to a linear search in
+// translateSignals.
+#define MAX_INDEXED_SIGNAL_COUNT 1024
+
+// The number of distinct signals that can be waiting to be published at once
+// when coalescing output. Beyond that, new signals are published immediately.
+// Each signal keeps its index in a uint8_t, so this must be less than 256.
+#define LATEST_VALUE_TABLE_SIZE 64
+
 namespace openxc {
 namespace can {
 namespace read {
@@ -25,11 +34,56 @@ namespace read {
  *
  * The decoder returns an openxc_DynamicField, which may contain a number,
  * string or boolean.
+ *
+ * If the coalesceOutput configuration option is enabled, a numeric or boolean
+ * value is not published right away - it replaces any unpublished value for
+ * the same signal, and goes out on the next call to publishLatestValues(...).
+ *
+ * The published value carries the receive timestamp of the message it was
+ * parsed from.
  */
 void translateSignal(CanSignal* signal,
         const CanMessage* message, CanSignal* signals, int signalCount,
         openxc::pipeline::Pipeline* pipeline);
 
+/* Public: Parse and publish every signal contained in a received CAN message.
+ *
+ * The signals for each message definition are found with a table that groups
+ * the signals array by message, built the first time a given pair of message
+ * and signal arrays is seen. A frame only touches its own signals, so the cost
+ * doesn't grow with the size of the full signal set. Signals are translated in
+ * the same order they appear in the signals array.
+ *
+ * If the arrays are larger than MAX_INDEXED_MESSAGE_COUNT or
+ * MAX_INDEXED_SIGNAL_COUNT, this falls back to checking every signal.
+ *
+ * bus - The CAN bus on which this message was received.
+ * message - The received CAN message.
+ * messages - The list of all predefined CAN messages.
+ * messageCount - The length of the messages array.
+ * signals - An array of all active signals.
+ * signalCount - The length of the signals array.
+ * pipeline - The pipeline to send the translated signals on.
+ */
+void translateSignals(CanBus* bus, const CanMessage* message,
+        CanMessageDefinition* messages, int messageCount,
+        CanSignal* signals, int signalCount,
+        openxc::pipeline::Pipeline* pipeline);
+
+/* Public: Publish the latest unpublished value of translated signals to each
+ * output interface, for as long as that interface has room for them. This does
+ * nothing unless the coalesceOutput configuration option is enabled.
+ *
+ * Each value is kept until every interface subscribed to it when it arrived
+ * has been sent it, so a slow interface gets the freshest value when it
+ * catches up without holding back the others. Signals are published
+ * round-robin, picking up where the last call stopped, so every signal gets a
+ * turn when the output can't keep up.
+ *
+ * pipeline - The pipeline to publish the values on.
+ */
+void publishLatestValues(openxc::pipeline::Pipeline* pipeline);
+
 /* Public: Publish a CAN message to the pipeline without any parsing or
  * processing - just encapsulate it in a VehicleMessage.
  *
@@ -44,6 +98,8 @@ void translateSignal(CanSignal* signal,
  *      received message must be in this list or it will not be published.
  * messageCount - The length of the messages array.
  * pipeline - The pipeline to send the raw message.
+ *
+ * The message's receive timestamp is passed along to the pipeline.
  */
 void passthroughMessage(CanBus* bus, CanMessage* message,
         CanMessageDefinition* messages, int messageCount,
@@ -58,9 +114,15 @@ void passthroughMessage(CanBus* bus, CanMessage* message,
  * value - The value for the value field of the OpenXC message.
  * event - The event for the event field of the OpenXC message.
  * pipeline - The pipeline to publish the message.
+ * timestamp - (optional) When the CAN message the value came from was
+ *      received, in microseconds.
+ * sinks - (optional) Only publish to these sinks in the pipeline, a mask with a
+ *      bit for each sink index.
  */
 void publishVehicleMessage(const char* name, openxc_DynamicField* value,
-        openxc_DynamicField* event, openxc::pipeline::Pipeline* pipeline);
+        openxc_DynamicField* event, openxc::pipeline::Pipeline* pipeline,
+        const uint32_t* timestamp=NULL,
+        uint8_t sinks=ALL_PIPELINE_SINKS);
 
 /* Public: Publish a simple vehicle message to the pipeline with no event.
  *
@@ -12,12 +12,16 @@ namespace config = openxc::config;
 
 using openxc::util::log::debug;
 using openxc::util::statistics::DeltaStatistic;
+using openxc::can::updateAcceptanceFilterTable;
 
 const int openxc::can::CAN_ACTIVE_TIMEOUT_S = 5;
 
 void openxc::can::initializeCommon(CanBus* bus) {
     debug("Initializing CAN node %d...", bus->address);
-    QUEUE_INIT(CanMessage, &bus->receiveQueue);
+    for(int i = 0; i < CAN_RECEIVE_CLASS_COUNT; i++) {
+        QUEUE_INIT(CanMessage, &bus->receiveQueues[i]);
+        bus->classMessagesDropped[i] = 0;
+    }
     QUEUE_INIT(CanMessage, &bus->sendQueue);
 
     LIST_INIT(&bus->acceptanceFilters);
@@ -26,6 +30,9 @@ void openxc::can::initializeCommon(CanBus* bus) {
         LIST_INSERT_HEAD(&bus->freeAcceptanceFilters,
                 &bus->acceptanceFilterEntries[i], entries);
     }
+    memset(bus->standardFilterBitmap, 0, sizeof(bus->standardFilterBitmap));
+    memset(bus->filterIndexes, 0, sizeof(bus->filterIndexes));
+    bus->activeFilterIndex = 0;
 
     bus->writeHandler = openxc::can::write::sendMessage;
     bus->lastMessageReceived = 0;
@@ -35,6 +42,7 @@ void openxc::can::initializeCommon(CanBus* bus) {
         LIST_INSERT_HEAD(&bus->freeMessageDefinitions,
                 &bus->definitionEntries[i], entries);
     }
+    memset(bus->dynamicMessageTable, 0, sizeof(bus->dynamicMessageTable));
 
     statistics::initialize(&bus->totalMessageStats);
     statistics::initialize(&bus->droppedMessageStats);
@@ -42,6 +50,7 @@ void openxc::can::initializeCommon(CanBus* bus) {
     statistics::initialize(&bus->receivedDataStats);
     statistics::initialize(&bus->sendQueueStats);
     statistics::initialize(&bus->receiveQueueStats);
+    statistics::initialize(&bus->receiveBatchStats);
 }
 
 void openxc::can::destroy(CanBus* bus) {
@@ -139,11 +148,68 @@ CanCommand* openxc::can::lookupCommand(const char* name, CanCommand* commands,
     }
 }
 
+/* Private: A sorted index of the most recently searched array of predefined
+ * CAN messages.
+ *
+ * messages - The array that was indexed.
+ * messageCount - The length of the indexed array.
+ * order - Indices into the messages array, sorted by bus, ID and format.
+ */
+static struct {
+    CanMessageDefinition* messages;
+    int messageCount;
+    uint16_t order[MAX_INDEXED_MESSAGE_COUNT];
+} messageIndex;
+
+/* Private: Order a message definition against a (bus, id, format) key.
+ *
+ * Returns a negative number if the key sorts before the message, a positive
+ * number if it sorts after and 0 if they match.
+ */
+static int compareMessageKey(const CanBus* bus, uint32_t id,
+        CanMessageFormat format, const CanMessageDefinition* message) {
+    if(bus != message->bus) {
+        return (uintptr_t)bus < (uintptr_t)message->bus ? -1 : 1;
+    }
+    if(id != message->id) {
+        return id < message->id ? -1 : 1;
+    }
+    if(format != message->format) {
+        return format < message->format ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Private: Rebuild the sorted index for a new array of predefined messages.
+ *
+ * This is an insertion sort, which is fine since it only runs when the active
+ * message set changes. It's stable, so definitions that share a key stay in
+ * their original order.
+ */
+static void indexMessages(CanMessageDefinition* messages, int messageCount) {
+    for(int i = 0; i < messageCount; i++) {
+        CanMessageDefinition* message = &messages[i];
+        int j = i;
+        while(j > 0 && compareMessageKey(message->bus, message->id,
+                    message->format,
+                    &messages[messageIndex.order[j - 1]]) < 0) {
+            messageIndex.order[j] = messageIndex.order[j - 1];
+            --j;
+        }
+        messageIndex.order[j] = i;
+    }
+    messageIndex.messages = messages;
+    messageIndex.messageCount = messageCount;
+}
+
 /* Private: Retreive a CanMessage struct from the array given the message's ID
  * and the bus it should occur on.
  *
+ * If more than one definition matches, the last one in the array is returned.
+ *
  * bus - The CanBus to search for the message.
  * id - The ID of the CAN message.
+ * format - The format of the ID of the message.
  * messages - The list of CAN messages to search.
  * messageCount - The length of the messages array.
  *
@@ -152,13 +218,80 @@ CanCommand* openxc::can::lookupCommand(const char* name, CanCommand* commands,
 static CanMessageDefinition* lookupMessage(CanBus* bus, uint32_t id,
         CanMessageFormat format,
         CanMessageDefinition* messages, int messageCount) {
-    CanMessageDefinition* message = NULL;
-    for(int i = 0; i < messageCount; i++) {
-        if(messages[i].bus == bus && messages[i].id == id) {
-            message = &messages[i];
+    if(messages == NULL || messageCount <= 0) {
+        return NULL;
+    }
+
+    if(messageCount > MAX_INDEXED_MESSAGE_COUNT) {
+        CanMessageDefinition* message = NULL;
+        for(int i = 0; i < messageCount; i++) {
+            if(!compareMessageKey(bus, id, format, &messages[i])) {
+                message = &messages[i];
+            }
         }
+        return message;
+    }
+
+    if(messages != messageIndex.messages ||
+            messageCount != messageIndex.messageCount) {
+        indexMessages(messages, messageCount);
+    }
+
+    // Find the first index entry that sorts after the key - the one before it
+    // is the last matching definition, if there is one.
+    int low = 0;
+    int high = messageCount;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(compareMessageKey(bus, id, format,
+                    &messages[messageIndex.order[middle]]) < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    if(low > 0 && !compareMessageKey(bus, id, format,
+                &messages[messageIndex.order[low - 1]])) {
+        return &messages[messageIndex.order[low - 1]];
+    }
+    return NULL;
+}
+
+/* Private: Find the slot in the bus' dynamic message table for a message.
+ *
+ * The table uses open addressing with linear probing, and is always larger than
+ * MAX_DYNAMIC_MESSAGE_COUNT so there is at least one empty slot.
+ *
+ * Returns the index of the slot holding the matching definition, or of the
+ * empty slot where it should be inserted.
+ */
+static int findDynamicMessageSlot(CanBus* bus, uint32_t id,
+        CanMessageFormat format) {
+    uint32_t hash = ((id << 1) | format) * 2654435761u;
+    int slot = (hash ^ (hash >> 16)) & (DYNAMIC_MESSAGE_TABLE_SIZE - 1);
+    CanMessageDefinitionListEntry* entry;
+    while((entry = bus->dynamicMessageTable[slot]) != NULL &&
+            (entry->definition.id != id ||
+                entry->definition.format != format)) {
+        slot = (slot + 1) & (DYNAMIC_MESSAGE_TABLE_SIZE - 1);
+    }
+    return slot;
+}
+
+/* Private: Empty a slot in the dynamic message table, and re-insert the rest
+ * of its probe cluster so none of those entries become unreachable.
+ */
+static void removeDynamicMessageSlot(CanBus* bus, int slot) {
+    bus->dynamicMessageTable[slot] = NULL;
+    slot = (slot + 1) & (DYNAMIC_MESSAGE_TABLE_SIZE - 1);
+    CanMessageDefinitionListEntry* entry;
+    while((entry = bus->dynamicMessageTable[slot]) != NULL) {
+        bus->dynamicMessageTable[slot] = NULL;
+        bus->dynamicMessageTable[findDynamicMessageSlot(bus,
+                entry->definition.id, entry->definition.format)] = entry;
+        slot = (slot + 1) & (DYNAMIC_MESSAGE_TABLE_SIZE - 1);
     }
-    return message;
 }
 
 CanMessageDefinition* openxc::can::lookupMessageDefinition(CanBus* bus,
@@ -168,12 +301,10 @@ CanMessageDefinition* openxc::can::lookupMessageDefinition(CanBus* bus,
     CanMessageDefinition* message = lookupMessage(bus, id, format,
             predefinedMessages, predefinedMessageCount);
     if(message == NULL) {
-        CanMessageDefinitionListEntry* entry;
-        LIST_FOREACH(entry, &bus->dynamicMessages, entries) {
-            if(entry->definition.id == id) {
-                message = &entry->definition;
-                break;
-            }
+        CanMessageDefinitionListEntry* entry = bus->dynamicMessageTable[
+                findDynamicMessageSlot(bus, id, format)];
+        if(entry != NULL) {
+            message = &entry->definition;
         }
     }
     return message;
@@ -201,10 +332,13 @@ bool openxc::can::registerMessageDefinition(CanBus* bus, uint32_t id,
         LIST_REMOVE(entry, entries);
         entry->definition.bus = bus;
         entry->definition.id = id;
+        entry->definition.format = format;
         entry->definition.frequencyClock = {bus->maxMessageFrequency};
         entry->definition.forceSendChanged = true;
 
         LIST_INSERT_HEAD(&bus->dynamicMessages, entry, entries);
+        bus->dynamicMessageTable[findDynamicMessageSlot(bus, id, format)] =
+                entry;
         message = &entry->definition;
     }
     return message != NULL;
@@ -212,17 +346,12 @@ bool openxc::can::registerMessageDefinition(CanBus* bus, uint32_t id,
 
 bool openxc::can::unregisterMessageDefinition(CanBus* bus, uint32_t id,
         CanMessageFormat format) {
-    CanMessageDefinitionListEntry* entry, *match = NULL;
-    LIST_FOREACH(entry, &bus->dynamicMessages, entries) {
-        if(entry->definition.id == id) {
-            match = entry;
-            break;
-        }
-    }
-
+    int slot = findDynamicMessageSlot(bus, id, format);
+    CanMessageDefinitionListEntry* match = bus->dynamicMessageTable[slot];
     if(match != NULL) {
-        LIST_REMOVE(entry, entries);
-        LIST_INSERT_HEAD(&bus->freeMessageDefinitions, entry, entries);
+        removeDynamicMessageSlot(bus, slot);
+        LIST_REMOVE(match, entries);
+        LIST_INSERT_HEAD(&bus->freeMessageDefinitions, match, entries);
         return true;
     }
     return false;
@@ -238,6 +367,17 @@ bool openxc::can::signalsWritable(CanBus* bus, CanSignal* signals,
     return false;
 }
 
+/* Private: Return the number of received messages waiting in all of a bus'
+ * receive queues.
+ */
+static int receiveQueueLength(CanBus* bus) {
+    int length = 0;
+    for(int i = 0; i < CAN_RECEIVE_CLASS_COUNT; i++) {
+        length += QUEUE_LENGTH(CanMessage, &bus->receiveQueues[i]);
+    }
+    return length;
+}
+
 void openxc::can::logBusStatistics(CanBus* buses, const int busCount) {
     if(!config::getConfiguration()->calculateMetrics) {
         return;
@@ -277,21 +417,26 @@ void openxc::can::logBusStatistics(CanBus* buses, const int busCount) {
             statistics::update(&bus->sendQueueStats,
                     QUEUE_LENGTH(CanMessage, &bus->sendQueue));
             statistics::update(&bus->receiveQueueStats,
-                    QUEUE_LENGTH(CanMessage, &bus->receiveQueue));
+                    receiveQueueLength(bus));
 
             if(bus->totalMessageStats.total > 0) {
                 debug("CAN%d Rx queue length: %d, avg: %f percent",
-                        bus->address,
-                        QUEUE_LENGTH(CanMessage, &bus->receiveQueue),
+                        bus->address, receiveQueueLength(bus),
                         statistics::exponentialMovingAverage(
                             &bus->receiveQueueStats) /
-                                QUEUE_MAX_LENGTH(CanMessage) * 100);
+                                (QUEUE_MAX_LENGTH(CanMessage) *
+                                    CAN_RECEIVE_CLASS_COUNT) * 100);
                 debug("CAN%d Tx queue length: %d, avg: %f percent",
                         bus->address,
                         QUEUE_LENGTH(CanMessage, &bus->sendQueue),
                         statistics::exponentialMovingAverage(
                             &bus->sendQueueStats) /
                                 QUEUE_MAX_LENGTH(CanMessage) * 100);
+                debug("CAN%d Rx messages per loop avg: %f, max: %d",
+                        bus->address,
+                        statistics::exponentialMovingAverage(
+                            &bus->receiveBatchStats),
+                        statistics::maximum(&bus->receiveBatchStats));
                 debug("CAN%d msgs Rx: %d (%dKB)",
                         bus->address, bus->receivedMessageStats.total,
                         bus->receivedDataStats.total);
@@ -301,6 +446,11 @@ void openxc::can::logBusStatistics(CanBus* buses, const int busCount) {
                             &bus->droppedMessageStats) /
                             statistics::exponentialMovingAverage(
                                 &bus->totalMessageStats) * 100);
+                debug("CAN%d dropped diagnostic: %d, message set: %d, "
+                        "passthrough: %d", bus->address,
+                        bus->classMessagesDropped[RECEIVE_CLASS_DIAGNOSTIC],
+                        bus->classMessagesDropped[RECEIVE_CLASS_MESSAGE_SET],
+                        bus->classMessagesDropped[RECEIVE_CLASS_PASSTHROUGH]);
                 debug("CAN%d avg throughput: %fKB / s", bus->address,
                         statistics::exponentialMovingAverage(
                             &bus->receivedDataStats) /
@@ -336,8 +486,8 @@ void openxc::can::logBusStatistics(CanBus* buses, const int busCount) {
         lastTimeLogged = time::systemTimeMs();
 
         for(int i = 0; i < busCount; i++) {
-            if(QUEUE_LENGTH(CanMessage, &buses[i].receiveQueue) ==
-                    QUEUE_MAX_LENGTH(CanMessage)) {
+            if(receiveQueueLength(&buses[i]) ==
+                    QUEUE_MAX_LENGTH(CanMessage) * CAN_RECEIVE_CLASS_COUNT) {
                 debug("Dropped CAN messages while running stats on bus %d", i);
             }
         }
@@ -372,6 +522,163 @@ bool openxc::can::configureDefaultFilters(CanBus* bus,
     return status;
 }
 
+// The mask for exact and range acceptance filters.
+#define FULL_ACCEPTANCE_FILTER_MASK 0xffffffff
+
+/* Private: Return the bits that can be set in an ID of the given format.
+ */
+static uint32_t idWidthMask(CanMessageFormat format) {
+    return format == CanMessageFormat::STANDARD ? 0x7ff : 0x1fffffff;
+}
+
+static bool isMaskFilter(AcceptanceFilterListEntry* entry) {
+    return entry->mask != FULL_ACCEPTANCE_FILTER_MASK;
+}
+
+/* Private: Add a range of IDs to a sorted list of ranges, merging it with any
+ * ranges it overlaps or is adjacent to.
+ *
+ * Returns false if the range needs a new slot and the list is full.
+ */
+static bool insertRange(AcceptanceFilterRange* ranges, int* count,
+        const int maxRanges, uint32_t first, uint32_t last) {
+    int position = 0;
+    while(position < *count && ranges[position].last + 1 < first) {
+        ++position;
+    }
+
+    if(position < *count && ranges[position].first <= last + 1) {
+        AcceptanceFilterRange* merged = &ranges[position];
+        merged->first = MIN(merged->first, first);
+        merged->last = MAX(merged->last, last);
+
+        int next = position + 1;
+        while(next < *count && ranges[next].first <= merged->last + 1) {
+            merged->last = MAX(merged->last, ranges[next].last);
+            ++next;
+        }
+
+        int removed = next - position - 1;
+        for(int i = position + 1; i + removed < *count; i++) {
+            ranges[i] = ranges[i + removed];
+        }
+        *count -= removed;
+        return true;
+    }
+
+    if(*count >= maxRanges) {
+        return false;
+    }
+
+    for(int i = *count; i > position; i--) {
+        ranges[i] = ranges[i - 1];
+    }
+    ranges[position].first = first;
+    ranges[position].last = last;
+    ++*count;
+    return true;
+}
+
+/* Private: Add the ranges of IDs matched by an acceptance filter to a sorted
+ * list of ranges.
+ *
+ * The ignored bits of a mask filter below the lowest required bit make each
+ * range, and every combination of the ignored bits above it starts another.
+ */
+static bool insertFilterRanges(AcceptanceFilterListEntry* entry,
+        AcceptanceFilterRange* ranges, int* count, const int maxRanges) {
+    if(!isMaskFilter(entry)) {
+        return insertRange(ranges, count, maxRanges, entry->filter,
+                entry->lastFilter);
+    }
+
+    uint32_t ignored = ~entry->mask & idWidthMask(entry->format);
+    uint32_t trailing = ignored & ~(ignored + 1);
+    uint32_t scattered = ignored & ~trailing;
+    uint32_t combination = 0;
+    do {
+        uint32_t first = entry->filter | combination;
+        if(!insertRange(ranges, count, maxRanges, first, first | trailing)) {
+            return false;
+        }
+        combination = (combination - scattered) & scattered;
+    } while(combination != 0);
+    return true;
+}
+
+int openxc::can::compactAcceptanceFilters(CanBus* bus,
+        CanMessageFormat format, AcceptanceFilterRange* ranges,
+        const int maxRanges) {
+    int count = 0;
+    AcceptanceFilterListEntry* entry;
+    LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
+        if(entry->format == format && !insertFilterRanges(entry, ranges,
+                    &count, maxRanges)) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+/* Private: Rebuild the filters checked by shouldAcceptMessage from the list of
+ * acceptance filters.
+ *
+ * The CAN interrupt handler may be checking the filters at the same time, so
+ * the bitmap is built on the stack and copied a word at a time, and the rest
+ * of the index is built in the copy that isn't in use before switching to it.
+ */
+static void indexAcceptanceFilters(CanBus* bus) {
+    uint32_t bitmap[STANDARD_ID_COUNT / 32] = {0};
+    AcceptanceFilterIndex* index =
+            &bus->filterIndexes[!bus->activeFilterIndex];
+    int extendedRangeCount = 0;
+    int diagnosticRangeCount = 0;
+    index->maskCount = 0;
+
+    AcceptanceFilterListEntry* entry;
+    LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
+        if(isMaskFilter(entry)) {
+            for(uint32_t id = 0; id < STANDARD_ID_COUNT; id++) {
+                if((id & entry->mask) == entry->filter) {
+                    bitmap[id / 32] |= 1UL << (id % 32);
+                }
+            }
+
+            if(entry->format == CanMessageFormat::EXTENDED &&
+                    index->maskCount < MAX_ACCEPTANCE_FILTER_MASKS) {
+                index->maskValues[index->maskCount] = entry->filter;
+                index->masks[index->maskCount] = entry->mask;
+                ++index->maskCount;
+            }
+            continue;
+        }
+
+        for(uint32_t id = entry->filter;
+                id <= entry->lastFilter && id < STANDARD_ID_COUNT; id++) {
+            bitmap[id / 32] |= 1UL << (id % 32);
+        }
+
+        // Each list entry adds at most one range, so these always fit
+        if(entry->lastFilter >= STANDARD_ID_COUNT) {
+            insertRange(index->extendedRanges, &extendedRangeCount,
+                    MAX_ACCEPTANCE_FILTERS,
+                    MAX(entry->filter, STANDARD_ID_COUNT), entry->lastFilter);
+        }
+
+        if(entry->receiveClass == RECEIVE_CLASS_DIAGNOSTIC) {
+            insertRange(index->diagnosticRanges, &diagnosticRangeCount,
+                    MAX_ACCEPTANCE_FILTERS, entry->filter, entry->lastFilter);
+        }
+    }
+    index->extendedRangeCount = extendedRangeCount;
+    index->diagnosticRangeCount = diagnosticRangeCount;
+
+    for(size_t i = 0; i < STANDARD_ID_COUNT / 32; i++) {
+        bus->standardFilterBitmap[i] = bitmap[i];
+    }
+    bus->activeFilterIndex = !bus->activeFilterIndex;
+}
+
 static AcceptanceFilterListEntry* popListEntry(AcceptanceFilterList* list) {
     AcceptanceFilterListEntry* result = LIST_FIRST(list);
     if(result != NULL) {
@@ -380,15 +687,45 @@ static AcceptanceFilterListEntry* popListEntry(AcceptanceFilterList* list) {
     return result;
 }
 
-bool openxc::can::addAcceptanceFilter(CanBus* bus, uint32_t id,
-        CanMessageFormat format, CanBus* buses, int busCount) {
+static AcceptanceFilterListEntry* findAcceptanceFilter(CanBus* bus,
+        uint32_t filter, uint32_t lastFilter, uint32_t mask,
+        CanReceiveClass receiveClass) {
     AcceptanceFilterListEntry* entry;
     LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
-        if(entry->filter == id) {
-            ++entry->activeUserCount;
-            debug("Filter for 0x%x already exists -- bumped user count to %d",
-                    id, entry->activeUserCount);
-            return true;
+        if(entry->filter == filter && entry->lastFilter == lastFilter &&
+                entry->mask == mask && entry->receiveClass == receiveClass) {
+            break;
+        }
+    }
+    return entry;
+}
+
+static bool addAcceptanceFilterEntry(CanBus* bus, uint32_t filter,
+        uint32_t lastFilter, uint32_t mask, CanMessageFormat format,
+        CanReceiveClass receiveClass, CanBus* buses, const int busCount) {
+    AcceptanceFilterListEntry* entry = findAcceptanceFilter(bus, filter,
+            lastFilter, mask, receiveClass);
+    if(entry != NULL) {
+        ++entry->activeUserCount;
+        debug("Filter for 0x%x already exists -- bumped user count to %d",
+                filter, entry->activeUserCount);
+        return true;
+    }
+
+    if(mask != FULL_ACCEPTANCE_FILTER_MASK &&
+            format == CanMessageFormat::EXTENDED) {
+        int maskCount = 0;
+        LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
+            if(isMaskFilter(entry) &&
+                    entry->format == CanMessageFormat::EXTENDED) {
+                ++maskCount;
+            }
+        }
+
+        if(maskCount >= MAX_ACCEPTANCE_FILTER_MASKS) {
+            debug("All extended mask filter slots already taken, "
+                    "can't add 0x%lx/0x%lx", filter, mask);
+            return false;
         }
     }
 
@@ -396,14 +733,18 @@ bool openxc::can::addAcceptanceFilter(CanBus* bus, uint32_t id,
             &bus->freeAcceptanceFilters);
     if(availableFilter == NULL) {
         debug("All acceptance filter slots already taken, can't add 0x%lx",
-                id);
+                filter);
         return false;
     }
 
-    availableFilter->filter = id;
+    availableFilter->filter = filter;
+    availableFilter->lastFilter = lastFilter;
+    availableFilter->mask = mask;
     availableFilter->format = format;
+    availableFilter->receiveClass = receiveClass;
     availableFilter->activeUserCount = 1;
     LIST_INSERT_HEAD(&bus->acceptanceFilters, availableFilter, entries);
+    indexAcceptanceFilters(bus);
     debug("Added acceptance filter for 0x%x on bus %d", availableFilter->filter,
             bus->address);
     bool status = updateAcceptanceFilterTable(buses, busCount);
@@ -412,19 +753,16 @@ bool openxc::can::addAcceptanceFilter(CanBus* bus, uint32_t id,
                 availableFilter->filter, bus->address);
         LIST_REMOVE(availableFilter, entries);
         LIST_INSERT_HEAD(&bus->freeAcceptanceFilters, availableFilter, entries);
+        indexAcceptanceFilters(bus);
     }
     return status;
 }
 
-void openxc::can::removeAcceptanceFilter(CanBus* bus, uint32_t id,
-        CanMessageFormat format, CanBus* buses, const int busCount) {
-    AcceptanceFilterListEntry* entry;
-    LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
-        if(entry->filter == id) {
-            break;
-        }
-    }
-
+static void removeAcceptanceFilterEntry(CanBus* bus, uint32_t filter,
+        uint32_t lastFilter, uint32_t mask, CanReceiveClass receiveClass,
+        CanBus* buses, const int busCount) {
+    AcceptanceFilterListEntry* entry = findAcceptanceFilter(bus, filter,
+            lastFilter, mask, receiveClass);
     if(entry != NULL) {
         --entry->activeUserCount;
         debug("Decremented active user count for filter 0x%x to %d",
@@ -433,11 +771,81 @@ void openxc::can::removeAcceptanceFilter(CanBus* bus, uint32_t id,
             debug("No active users - disabling filter");
             LIST_REMOVE(entry, entries);
             LIST_INSERT_HEAD(&bus->freeAcceptanceFilters, entry, entries);
+            indexAcceptanceFilters(bus);
             updateAcceptanceFilterTable(buses, busCount);
         }
     }
 }
 
+/* Private: Split a mask filter into the value and mask to store for it.
+ *
+ * Returns true if the mask only ignores the lowest bits of the ID, in which
+ * case it's stored as the range from 'first' to 'last' instead.
+ */
+static bool normalizeMaskFilter(uint32_t id, uint32_t mask,
+        CanMessageFormat format, uint32_t* first, uint32_t* last,
+        uint32_t* normalizedMask) {
+    uint32_t width = idWidthMask(format);
+    *normalizedMask = mask & width;
+    uint32_t ignored = ~mask & width;
+    *first = id & *normalizedMask;
+    *last = *first | ignored;
+    return (ignored & (ignored + 1)) == 0;
+}
+
+bool openxc::can::addAcceptanceFilter(CanBus* bus, uint32_t id,
+        CanMessageFormat format, CanBus* buses, int busCount) {
+    return addAcceptanceFilterRange(bus, id, id, format, buses, busCount);
+}
+
+bool openxc::can::addAcceptanceFilterRange(CanBus* bus, uint32_t firstId,
+        uint32_t lastId, CanMessageFormat format, CanBus* buses,
+        const int busCount, CanReceiveClass receiveClass) {
+    if(lastId < firstId) {
+        debug("Invalid acceptance filter range 0x%lx-0x%lx", firstId, lastId);
+        return false;
+    }
+    return addAcceptanceFilterEntry(bus, firstId, lastId,
+            FULL_ACCEPTANCE_FILTER_MASK, format, receiveClass, buses,
+            busCount);
+}
+
+bool openxc::can::addAcceptanceFilterMask(CanBus* bus, uint32_t id,
+        uint32_t mask, CanMessageFormat format, CanBus* buses,
+        const int busCount) {
+    uint32_t first, last, normalizedMask;
+    if(normalizeMaskFilter(id, mask, format, &first, &last, &normalizedMask)) {
+        return addAcceptanceFilterRange(bus, first, last, format, buses,
+                busCount);
+    }
+    return addAcceptanceFilterEntry(bus, first, first, normalizedMask, format,
+            RECEIVE_CLASS_MESSAGE_SET, buses, busCount);
+}
+
+void openxc::can::removeAcceptanceFilter(CanBus* bus, uint32_t id,
+        CanMessageFormat format, CanBus* buses, const int busCount) {
+    removeAcceptanceFilterRange(bus, id, id, format, buses, busCount);
+}
+
+void openxc::can::removeAcceptanceFilterRange(CanBus* bus, uint32_t firstId,
+        uint32_t lastId, CanMessageFormat format, CanBus* buses,
+        const int busCount, CanReceiveClass receiveClass) {
+    removeAcceptanceFilterEntry(bus, firstId, lastId,
+            FULL_ACCEPTANCE_FILTER_MASK, receiveClass, buses, busCount);
+}
+
+void openxc::can::removeAcceptanceFilterMask(CanBus* bus, uint32_t id,
+        uint32_t mask, CanMessageFormat format, CanBus* buses,
+        const int busCount) {
+    uint32_t first, last, normalizedMask;
+    if(normalizeMaskFilter(id, mask, format, &first, &last, &normalizedMask)) {
+        removeAcceptanceFilterRange(bus, first, last, format, buses, busCount);
+    } else {
+        removeAcceptanceFilterEntry(bus, first, first, normalizedMask,
+                RECEIVE_CLASS_MESSAGE_SET, buses, busCount);
+    }
+}
+
 bool openxc::can::setAcceptanceFilterStatus(CanBus* bus, bool enabled,
         CanBus* buses, const uint busCount) {
     bus->bypassFilters = !enabled;
@@ -446,16 +854,63 @@ bool openxc::can::setAcceptanceFilterStatus(CanBus* bus, bool enabled,
     return updateAcceptanceFilterTable(buses, busCount);
 }
 
-bool openxc::can::shouldAcceptMessage(CanBus* bus, uint32_t messageId) {
-    bool acceptMessage = bus->bypassFilters;
-    if(!acceptMessage) {
-        AcceptanceFilterListEntry* entry;
-        LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
-            if(entry->filter == messageId) {
-                acceptMessage = true;
-                break;
-            }
+/* Private: Binary search a sorted list of ranges for an ID.
+ */
+static bool rangesContain(const AcceptanceFilterRange* ranges, int rangeCount,
+        uint32_t id) {
+    int low = 0;
+    int high = rangeCount;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(ranges[middle].last < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
     }
-    return acceptMessage;
+    return low < rangeCount && ranges[low].first <= id;
+}
+
+/* Private: Check a message ID against the acceptance filters, ignoring whether
+ * they're bypassed.
+ */
+static bool matchesAcceptanceFilters(CanBus* bus, AcceptanceFilterIndex* index,
+        uint32_t messageId) {
+    if(messageId < STANDARD_ID_COUNT) {
+        return (bus->standardFilterBitmap[messageId / 32] >>
+                (messageId % 32)) & 1;
+    }
+
+    if(rangesContain(index->extendedRanges, index->extendedRangeCount,
+                messageId)) {
+        return true;
+    }
+
+    for(int i = 0; i < index->maskCount; i++) {
+        if((messageId & index->masks[i]) == index->maskValues[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool openxc::can::shouldAcceptMessage(CanBus* bus, uint32_t messageId) {
+    return bus->bypassFilters || matchesAcceptanceFilters(bus,
+            &bus->filterIndexes[bus->activeFilterIndex], messageId);
+}
+
+bool openxc::can::classifyMessage(CanBus* bus, uint32_t messageId,
+        CanReceiveClass* receiveClass) {
+    AcceptanceFilterIndex* index = &bus->filterIndexes[bus->activeFilterIndex];
+    if(rangesContain(index->diagnosticRanges, index->diagnosticRangeCount,
+                messageId)) {
+        *receiveClass = RECEIVE_CLASS_DIAGNOSTIC;
+    } else if(matchesAcceptanceFilters(bus, index, messageId)) {
+        *receiveClass = RECEIVE_CLASS_MESSAGE_SET;
+    } else if(bus->bypassFilters) {
+        *receiveClass = RECEIVE_CLASS_PASSTHROUGH;
+    } else {
+        return false;
+    }
+    return true;
 }
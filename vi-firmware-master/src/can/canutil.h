@@ -16,8 +16,17 @@
 #define MAX_ACCEPTANCE_FILTERS 24
 // TODO this takes up a ton of memory
 #define MAX_DYNAMIC_MESSAGE_COUNT 12
+// Must be a power of 2, and comfortably larger than MAX_DYNAMIC_MESSAGE_COUNT
+// to keep the probe sequences short.
+#define DYNAMIC_MESSAGE_TABLE_SIZE 32
+// Predefined message sets larger than this fall back to a linear search.
+#define MAX_INDEXED_MESSAGE_COUNT 512
 
 #define CAN_MESSAGE_SIZE 8
+// The number of distinct 11-bit CAN IDs.
+#define STANDARD_ID_COUNT 2048
+// The most mask filters for extended IDs that can't be reduced to a range.
+#define MAX_ACCEPTANCE_FILTER_MASKS 4
 
 /* Public: The type signature for a CAN signal decoder.
  *
@@ -64,6 +73,24 @@ enum CanMessageFormat {
 };
 typedef enum CanMessageFormat CanMessageFormat;
 
+/* Public: The classes of received CAN messages, in order of priority. Each
+ * class has its own receive queue, so when the firmware falls behind the lower
+ * priority messages are dropped first.
+ *
+ * RECEIVE_CLASS_DIAGNOSTIC - a response to an active diagnostic request.
+ * RECEIVE_CLASS_MESSAGE_SET - a message with an acceptance filter from the
+ *      active message set.
+ * RECEIVE_CLASS_PASSTHROUGH - any other message, received because the
+ *      acceptance filter is bypassed.
+ */
+typedef enum {
+    RECEIVE_CLASS_DIAGNOSTIC,
+    RECEIVE_CLASS_MESSAGE_SET,
+    RECEIVE_CLASS_PASSTHROUGH,
+} CanReceiveClass;
+
+#define CAN_RECEIVE_CLASS_COUNT 3
+
 /* Public: A state encoded (SED) signal's mapping from numerical values to
  * OpenXC state names.
  *
@@ -109,6 +136,8 @@ typedef struct CanSignalState CanSignalState;
  * received    - True if this signal has ever been received.
  * lastValue   - The last received value of the signal. If 'received' is false,
  *      this value is undefined.
+ * latestValue - (private) 1 + the index of the signal's entry in the table of
+ *      values waiting to be published when output is coalesced, or 0.
  */
 struct CanSignal {
     struct CanMessageDefinition* message;
@@ -129,6 +158,7 @@ struct CanSignal {
     SignalEncoder encoder;
     bool received;
     float lastValue;
+    uint8_t latestValue;
 };
 typedef struct CanSignal CanSignal;
 
@@ -165,12 +195,15 @@ typedef struct CanMessageDefinition CanMessageDefinition;
  * format - the format of the message's ID.
  * data  - The message's data field.
  * length - the length of the data array (max 8).
+ * timestamp - When the message was received, in microseconds from
+ *      openxc::util::time::systemTimeUs(); 0 for outgoing messages.
  */
 struct CanMessage {
     uint32_t id;
     CanMessageFormat format;
     uint8_t data[CAN_MESSAGE_SIZE];
     uint8_t length;
+    uint32_t timestamp;
 };
 typedef struct CanMessage CanMessage;
 
@@ -180,18 +213,62 @@ QUEUE_DECLARE(CanMessage, 8);
  *
  * This struct is meant to be used with a LIST type from <sys/queue.h>.
  *
- * filter - the value for the CAN acceptance filter.
+ * A message ID matches the filter if the ID masked with 'mask' is between
+ * 'filter' and 'lastFilter', inclusive. An exact filter has a full mask and
+ * the same first and last ID, a range filter has a full mask and a mask
+ * filter has the same first and last ID.
+ *
+ * filter - the value for the CAN acceptance filter, or the first ID of a
+ *      range.
+ * lastFilter - the last ID of a range, or the same as filter.
+ * mask - the bits of the ID that must match, all set except for mask filters.
+ * receiveClass - the receive queue for messages matching this filter.
  * activeUserCount - The number of active consumers of this filter's messages.
  *      When 0, this filter can be removed.
  * format - the format of the ID for the filter.
  */
 struct AcceptanceFilterListEntry {
     uint32_t filter;
+    uint32_t lastFilter;
+    uint32_t mask;
+    CanReceiveClass receiveClass;
     uint8_t activeUserCount;
     CanMessageFormat format;
     LIST_ENTRY(AcceptanceFilterListEntry) entries;
 };
 
+/* Public: An inclusive range of CAN message IDs.
+ */
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} AcceptanceFilterRange;
+
+/* Private: The acceptance filters for IDs that don't fit in 11 bits and the IDs
+ * of diagnostic responses, in a form that can be checked quickly from an
+ * interrupt handler.
+ *
+ * extendedRanges - the ranges of extended IDs to accept, sorted and without
+ *      any overlap.
+ * extendedRangeCount - the number of extended ID ranges.
+ * maskValues - the values of the extended mask filters that can't be
+ *      expressed as a range.
+ * masks - the masks for each value in maskValues.
+ * maskCount - the number of mask filters.
+ * diagnosticRanges - the ranges of IDs, of either format, with a filter for
+ *      the RECEIVE_CLASS_DIAGNOSTIC class, sorted and without any overlap.
+ * diagnosticRangeCount - the number of diagnostic ranges.
+ */
+typedef struct {
+    AcceptanceFilterRange extendedRanges[MAX_ACCEPTANCE_FILTERS];
+    uint8_t extendedRangeCount;
+    uint32_t maskValues[MAX_ACCEPTANCE_FILTER_MASKS];
+    uint32_t masks[MAX_ACCEPTANCE_FILTER_MASKS];
+    uint8_t maskCount;
+    AcceptanceFilterRange diagnosticRanges[MAX_ACCEPTANCE_FILTERS];
+    uint8_t diagnosticRangeCount;
+} AcceptanceFilterIndex;
+
 /* Private: A type of list containing CAN acceptance filters.
  */
 LIST_HEAD(AcceptanceFilterList, AcceptanceFilterListEntry);
@@ -233,12 +310,22 @@ LIST_HEAD(CanMessageDefinitionList, CanMessageDefinitionListEntry);
  * freeAcceptanceFilters - a list of available slots for acceptance filters.
  * acceptanceFilterEntries - static memory allocated for entires in the
  *      acceptanceFilters and freeAcceptanceFilters list.
+ * standardFilterBitmap - a bit for every 11-bit ID, set if there is an active
+ *      acceptance filter for that ID. This and the extended filters are what
+ *      shouldAcceptMessage checks, so it doesn't have to walk the
+ *      acceptanceFilters list in an interrupt handler.
+ * filterIndexes - two copies of the index of the active acceptance filters
+ *      for IDs that don't fit in 11 bits and for diagnostic responses. One is
+ *      in use while the other is rebuilt.
+ * activeFilterIndex - the position of the copy of filterIndexes in use.
  * dynamicMessages - a list of CAN message IDs ever received on this bus. This
  *      is used for message frequency control and metrics.
  * freeMessageDefinitions - a list of available slots for dynamic message
  *      definitions.
  * definitionEntries - static memory allocated for entires in the
  *      dynamicMessages and freeMessageDefinitions list.
+ * dynamicMessageTable - an open-addressed hash table of the entries in
+ *      dynamicMessages, keyed by message ID and format.
  * writeHandler - a function that actually writes out a CanMessage object to the
  *      CAN interface (implementation is platform specific);
  * lastMessageReceived - the time (in ms) when the last CAN message was
@@ -247,9 +334,10 @@ LIST_HEAD(CanMessageDefinitionList, CanMessageDefinitionListEntry);
  * messagesDropped - A count of the number of CAN messages we knowingly dropped
  * - i.e. we received an interrupt with a new CAN message but the incoming CAN
  *   message queue was full.
+ * classMessagesDropped - messagesDropped split up by CanReceiveClass.
  * sendQueue - a queue of CanMessage instances that need to be written to CAN.
- * receiveQueue - a queue of messages received from CAN that have yet to be
- *      translated.
+ * receiveQueues - queues of messages received from CAN that have yet to be
+ *      translated, one for each CanReceiveClass.
  */
 struct CanBus {
     unsigned int speed;
@@ -264,13 +352,18 @@ struct CanBus {
     AcceptanceFilterList acceptanceFilters;
     AcceptanceFilterList freeAcceptanceFilters;
     AcceptanceFilterListEntry acceptanceFilterEntries[MAX_ACCEPTANCE_FILTERS];
+    uint32_t standardFilterBitmap[STANDARD_ID_COUNT / 32];
+    AcceptanceFilterIndex filterIndexes[2];
+    volatile uint8_t activeFilterIndex;
     CanMessageDefinitionList dynamicMessages;
     CanMessageDefinitionList freeMessageDefinitions;
     CanMessageDefinitionListEntry definitionEntries[MAX_DYNAMIC_MESSAGE_COUNT];
+    CanMessageDefinitionListEntry* dynamicMessageTable[DYNAMIC_MESSAGE_TABLE_SIZE];
     bool (*writeHandler)(const CanBus*, const CanMessage*);
     unsigned long lastMessageReceived;
     unsigned int messagesReceived;
     unsigned int messagesDropped;
+    unsigned int classMessagesDropped[CAN_RECEIVE_CLASS_COUNT];
 
     // TODO These are unnecessary if you aren't calculating metrics, and they do
     // take up a bit of memory.
@@ -280,9 +373,10 @@ struct CanBus {
     openxc::util::statistics::DeltaStatistic receivedDataStats;
     openxc::util::statistics::Statistic sendQueueStats;
     openxc::util::statistics::Statistic receiveQueueStats;
+    openxc::util::statistics::Statistic receiveBatchStats;
 
     QUEUE_TYPE(CanMessage) sendQueue;
-    QUEUE_TYPE(CanMessage) receiveQueue;
+    QUEUE_TYPE(CanMessage) receiveQueues[CAN_RECEIVE_CLASS_COUNT];
 };
 typedef struct CanBus CanBus;
 
@@ -452,6 +546,12 @@ const CanSignalState* lookupSignalState(int value, const CanSignal* signal);
 /* Public: Search all predefined and dynamically configured CAN messages for one
  * matching the given ID.
  *
+ * The predefined messages are searched with a sorted index that is built the
+ * first time a message array is seen (and rebuilt if a different array is
+ * passed in, e.g. after switching message sets), and the dynamic messages are
+ * kept in a small hash table on the bus, so the cost of a lookup doesn't grow
+ * with the size of the message set.
+ *
  * bus - The CanBus to search for the message.
  * id - The ID of the CAN message.
  * format - The format of the ID of the message.
@@ -547,6 +647,32 @@ bool configureDefaultFilters(CanBus* bus, const CanMessageDefinition* messages,
 bool addAcceptanceFilter(CanBus* bus, uint32_t id, CanMessageFormat format,
         CanBus* buses, const int busCount);
 
+/* Public: Configure an acceptance filter for a range of CAN message IDs on the
+ * given bus. The range takes up a single filter slot.
+ *
+ * firstId - The first ID in the range.
+ * lastId - The last ID in the range, inclusive.
+ * receiveClass - The receive queue for messages in the range. Filters for the
+ *      same range with a different class are separate filters.
+ *
+ * See addAcceptanceFilter(...) for the other arguments and return value.
+ */
+bool addAcceptanceFilterRange(CanBus* bus, uint32_t firstId, uint32_t lastId,
+        CanMessageFormat format, CanBus* buses, const int busCount,
+        CanReceiveClass receiveClass=RECEIVE_CLASS_MESSAGE_SET);
+
+/* Public: Configure an acceptance filter on the given bus for every CAN
+ * message ID that matches 'id' in the bits set in 'mask'.
+ *
+ * Masks that only ignore the lowest bits of the ID are stored as a range.
+ * Other masks may need more than one hardware filter, or the hardware
+ * acceptance filter to be bypassed and the messages filtered in software.
+ *
+ * See addAcceptanceFilter(...) for the other arguments and return value.
+ */
+bool addAcceptanceFilterMask(CanBus* bus, uint32_t id, uint32_t mask,
+        CanMessageFormat format, CanBus* buses, const int busCount);
+
 /* Public: Remove a CAN message acceptance filter from the given bus.
  *
  * bus - The CanBus to remove the filter from.
@@ -562,6 +688,35 @@ bool addAcceptanceFilter(CanBus* bus, uint32_t id, CanMessageFormat format,
 void removeAcceptanceFilter(CanBus* bus, uint32_t id, CanMessageFormat format,
         CanBus* buses, const int busCount);
 
+/* Public: Remove an acceptance filter for a range of IDs added with
+ * addAcceptanceFilterRange(...).
+ */
+void removeAcceptanceFilterRange(CanBus* bus, uint32_t firstId, uint32_t lastId,
+        CanMessageFormat format, CanBus* buses, const int busCount,
+        CanReceiveClass receiveClass=RECEIVE_CLASS_MESSAGE_SET);
+
+/* Public: Remove a mask acceptance filter added with
+ * addAcceptanceFilterMask(...).
+ */
+void removeAcceptanceFilterMask(CanBus* bus, uint32_t id, uint32_t mask,
+        CanMessageFormat format, CanBus* buses, const int busCount);
+
+/* Public: Compact the acceptance filters of one format on a bus into as few
+ * ID ranges as possible, for loading into a hardware acceptance filter table.
+ *
+ * Mask filters are expanded into the ranges of IDs they match, and adjacent
+ * or overlapping ranges are merged.
+ *
+ * bus - The bus with the acceptance filters.
+ * format - Only include filters with this ID format.
+ * ranges - An output parameter, the sorted ranges.
+ * maxRanges - The length of the ranges array.
+ *
+ * Returns the number of ranges, or -1 if they don't fit in the array.
+ */
+int compactAcceptanceFilters(CanBus* bus, CanMessageFormat format,
+        AcceptanceFilterRange* ranges, const int maxRanges);
+
 /* Private: Apply the CAN acceptance filter configuration from software (on the
  * CanBus struct) to the actual hardware CAN controllers.
  *
@@ -622,6 +777,10 @@ void logBusStatistics(CanBus* buses, const int busCount);
  * bus has the AF off but we still want to filter on the other, we use this to
  * do software filtering based on the registered CAN messages.
  *
+ * This is called for every received message from the CAN interrupt handler,
+ * so it only tests a bit for standard IDs and does a binary search of the
+ * (few) extended IDs.
+ *
  * bus - The bus the message was received on.
  * messageId - the ID of the message.
  *
@@ -629,6 +788,23 @@ void logBusStatistics(CanBus* buses, const int busCount);
  */
 bool shouldAcceptMessage(CanBus* bus, uint32_t messageId);
 
+/* Public: Perform software CAN message filtering and pick the receive queue
+ * for an accepted message.
+ *
+ * Like shouldAcceptMessage, this is called from the CAN interrupt handler.
+ * Diagnostic responses are found with a binary search of the (few) ranges of
+ * diagnostic filters, before the rest of the filters are checked.
+ *
+ * bus - The bus the message was received on.
+ * messageId - the ID of the message.
+ * receiveClass - An output parameter, the class of the message if it's
+ *      accepted.
+ *
+ * Returns true if the message should be accepted.
+ */
+bool classifyMessage(CanBus* bus, uint32_t messageId,
+        CanReceiveClass* receiveClass);
+
 } // can
 } // openxc
 
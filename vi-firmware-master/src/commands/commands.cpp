@@ -15,13 +15,23 @@
 #include "commands/af_bypass_command.h"
 #include "commands/payload_format_command.h"
 #include "commands/predefined_obd2_command.h"
+#include "commands/subscription_command.h"
 
 using openxc::util::log::debug;
 using openxc::config::getConfiguration;
 using openxc::payload::PayloadFormat;
 using openxc::interface::InterfaceType;
 
-static bool handleComplexCommand(openxc_VehicleMessage* message) {
+namespace json = openxc::payload::json;
+
+// Commands from the UART and network in particular tend to arrive in a few
+// pieces - keep the progress of parsing a JSON command from each type of
+// interface so the next piece picks up where the last one left off.
+static json::StreamState incomingJsonStates[InterfaceType::NETWORK + 1];
+
+static bool handleComplexCommand(openxc_VehicleMessage* message,
+        json::SubscriptionCommand* subscription,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor) {
     bool status = true;
     if(message != NULL && message->has_control_command) {
         openxc_ControlCommand* command = &message->control_command;
@@ -45,25 +55,45 @@ static bool handleComplexCommand(openxc_VehicleMessage* message) {
             status = openxc::commands::handleFilterBypassCommand(command);
             break;
         case openxc_ControlCommand_Type_PAYLOAD_FORMAT:
-            status = openxc::commands::handlePayloadFormatCommand(command);
+            status = openxc::commands::handlePayloadFormatCommand(command,
+                    sourceInterfaceDescriptor);
             break;
         default:
-            status = false;
+            if(command->type == openxc::payload::CONTROL_COMMAND_SUBSCRIBE) {
+                status = openxc::commands::handleSubscriptionCommand(
+                        subscription, sourceInterfaceDescriptor);
+            } else {
+                status = false;
+            }
             break;
         }
     }
     return status;
 }
 
-size_t openxc::commands::handleIncomingMessage(uint8_t payload[], size_t length,
+void openxc::commands::resetIncomingMessage(
         openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor) {
+    json::resetStream(&incomingJsonStates[sourceInterfaceDescriptor->type]);
+}
+
+size_t openxc::commands::handleIncomingMessage(uint8_t payload[], size_t length,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor,
+        bool stream) {
+    if(payload == NULL) {
+        resetIncomingMessage(sourceInterfaceDescriptor);
+        return 0;
+    }
+
     openxc_VehicleMessage message = {0};
+    json::SubscriptionCommand subscription = {0};
     size_t bytesRead = 0;
+    PayloadFormat format = pipeline::getPayloadFormat(
+            &getConfiguration()->pipeline, sourceInterfaceDescriptor);
 
     // TODO Not attempting to deserialize binary messages via UART,
     // see https://github.com/openxc/vi-firmware/issues/313
     if(sourceInterfaceDescriptor->type == InterfaceType::UART &&
-            getConfiguration()->payloadFormat == PayloadFormat::PROTOBUF) {
+            format != PayloadFormat::JSON) {
         return 0;
     }
 
@@ -71,7 +101,10 @@ size_t openxc::commands::handleIncomingMessage(uint8_t payload[], size_t length,
     // wait for more to come in before trying to parse it
     if(length > 2) {
         if((bytesRead = openxc::payload::deserialize(payload, length,
-                getConfiguration()->payloadFormat, &message)) > 0) {
+                format, &message, stream ?
+                    &incomingJsonStates[sourceInterfaceDescriptor->type] :
+                    NULL,
+                &subscription)) > 0) {
             if(validate(&message)) {
                 switch(message.type) {
                 case openxc_VehicleMessage_Type_CAN:
@@ -81,7 +114,8 @@ size_t openxc::commands::handleIncomingMessage(uint8_t payload[], size_t length,
                     handleSimple(&message);
                     break;
                 case openxc_VehicleMessage_Type_CONTROL_COMMAND:
-                    handleComplexCommand(&message);
+                    handleComplexCommand(&message, &subscription,
+                            sourceInterfaceDescriptor);
                     break;
                 default:
                     debug("Incoming message had unrecognized type: %d", message.type);
@@ -129,7 +163,9 @@ static bool validateControlCommand(openxc_VehicleMessage* message) {
             valid =  true;
             break;
         default:
-            valid = false;
+            // A subscription command's parameters are all optional
+            valid = message->control_command.type ==
+                    openxc::payload::CONTROL_COMMAND_SUBSCRIBE;
             break;
         }
     }
@@ -24,10 +24,26 @@ namespace commands {
  * The complete definition for all of the command is in the OpenXC Message
  * Format (https://github.com/openxc/openxc-message-format).
  *
+ * A JSON command that has only partly arrived is tokenized as far as it goes
+ * and picked up again on the next call from the same type of interface. A NULL
+ * payload resets that progress, as processQueue(...) does whenever the front
+ * of its queue changes.
+ *
+ * stream - (optional) False if the payload is a single, complete transfer
+ *      instead of the front of a stream of incoming bytes, e.g. a USB control
+ *      request. It's parsed on its own, without touching the stream's progress.
+ *
  * Returns the number of bytes read from the payload for a complete message, if
  * any was found.
  */
 size_t handleIncomingMessage(uint8_t payload[], size_t payloadLength,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor,
+        bool stream=true);
+
+/* Public: Throw away any partly received command from an interface, e.g.
+ * because its receive queue was just emptied.
+ */
+void resetIncomingMessage(
         openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor);
 
 /* Public: Validate the data in an OpenXC message;
@@ -27,7 +27,21 @@ bool openxc::commands::validatePayloadFormatCommand(openxc_VehicleMessage* messa
     return valid;
 }
 
-bool openxc::commands::handlePayloadFormatCommand(openxc_ControlCommand* command) {
+/* Private: Returns true if the interface has any sinks in the pipeline to
+ * change the format of.
+ */
+static bool hasSinks(openxc::interface::InterfaceDescriptor* descriptor) {
+    pipeline::Pipeline* outputPipeline = &getConfiguration()->pipeline;
+    for(int i = 0; descriptor != NULL && i < outputPipeline->sinkCount; i++) {
+        if(outputPipeline->sinks[i].descriptor == descriptor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool openxc::commands::handlePayloadFormatCommand(openxc_ControlCommand* command,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor) {
     bool status = false;
     PayloadFormat format;
     if(command->has_payload_format_command) {
@@ -37,23 +51,40 @@ bool openxc::commands::handlePayloadFormatCommand(openxc_ControlCommand* command
             switch(messageFormatCommand->format) {
                 case openxc_PayloadFormatCommand_PayloadFormat_JSON:
                     format = PayloadFormat::JSON;
+                    status = true;
                     break;
                 case openxc_PayloadFormatCommand_PayloadFormat_PROTOBUF:
                     format = PayloadFormat::PROTOBUF;
+                    status = true;
+                    break;
+                default:
+                    if(messageFormatCommand->format ==
+                            openxc::payload::PAYLOAD_FORMAT_COMMAND_CAN_BATCH) {
+                        format = PayloadFormat::CAN_BATCH;
+                        status = true;
+                    }
                     break;
             }
-
-            status = true;
         }
     }
 
+    if(status && !hasSinks(sourceInterfaceDescriptor)) {
+        debug("No interface to change the message format of");
+        status = false;
+    }
+
     sendCommandResponse(openxc_ControlCommand_Type_PAYLOAD_FORMAT, status);
 
     if(status) {
-        // Don't change format until we've sent the response
-        getConfiguration()->payloadFormat = format;
+        // Don't change format until we've sent the response. Only the source
+        // interface changes, so a host on one interface can't change the
+        // format out from under another.
+        pipeline::setPayloadFormat(&getConfiguration()->pipeline,
+                sourceInterfaceDescriptor, &format);
         debug("Set message format to %s",
-                format == PayloadFormat::JSON ? "JSON" : "binary" );
+                format == PayloadFormat::JSON ? "JSON" :
+                    format == PayloadFormat::PROTOBUF ? "binary" :
+                        "binary CAN batches");
     }
 
     return status;
@@ -2,13 +2,23 @@
 #define __PAYLOAD_FORMAT_COMMAND_H__
 
 #include "openxc.pb.h"
+#include "interface/interface.h"
 
 namespace openxc {
 namespace commands {
 
 bool validatePayloadFormatCommand(openxc_VehicleMessage* message);
 
-bool handlePayloadFormatCommand(openxc_ControlCommand* command);
+/* Public: Change the payload format of the interface the command arrived on.
+ * Every other interface keeps the format it was using.
+ *
+ * command - The payload format command.
+ * sourceInterfaceDescriptor - The interface the command arrived on.
+ *
+ * Returns true if the format was changed.
+ */
+bool handlePayloadFormatCommand(openxc_ControlCommand* command,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor);
 
 } // namespace commands
 } // namespace openxc
@@ -0,0 +1,47 @@
+#include "subscription_command.h"
+
+#include "config.h"
+#include "util/log.h"
+#include "commands/commands.h"
+
+using openxc::util::log::debug;
+using openxc::config::getConfiguration;
+using openxc::pipeline::SinkFilter;
+using openxc::payload::json::SubscriptionCommand;
+using openxc::interface::InterfaceDescriptor;
+using openxc::interface::descriptorToString;
+
+namespace pipeline = openxc::pipeline;
+
+bool openxc::commands::handleSubscriptionCommand(
+        SubscriptionCommand* subscription,
+        InterfaceDescriptor* sourceInterfaceDescriptor) {
+    SinkFilter filter = {0};
+    bool status = true;
+    if(subscription != NULL) {
+        filter.messageClasses = subscription->messageClasses != 0 ?
+                subscription->messageClasses : 0xff;
+        filter.filterCanIds = subscription->hasCanIdRange;
+        filter.minimumCanId = subscription->minimumCanId;
+        filter.maximumCanId = subscription->maximumCanId;
+        for(int i = 0; i < subscription->signalCount && status; i++) {
+            status = pipeline::addSignalFilter(&filter,
+                    subscription->signals[i].name,
+                    subscription->signals[i].frequency);
+        }
+        filter.enabled = subscription->messageClasses != 0 ||
+                filter.filterCanIds || filter.signalCount > 0;
+    }
+
+    // Respond before the filter is installed, in case it filters out command
+    // responses
+    sendCommandResponse(openxc::payload::CONTROL_COMMAND_SUBSCRIBE, status);
+
+    if(status) {
+        pipeline::setFilter(&getConfiguration()->pipeline,
+                sourceInterfaceDescriptor, filter.enabled ? &filter : NULL);
+        debug("%s subscription for %s", filter.enabled ? "Set" : "Cleared",
+                descriptorToString(sourceInterfaceDescriptor));
+    }
+    return status;
+}
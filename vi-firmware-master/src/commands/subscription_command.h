@@ -0,0 +1,27 @@
+#ifndef __SUBSCRIPTION_COMMAND_H__
+#define __SUBSCRIPTION_COMMAND_H__
+
+#include "openxc.pb.h"
+#include "payload/json.h"
+#include "interface/interface.h"
+
+namespace openxc {
+namespace commands {
+
+/* Public: Install a filter on the output of the interface a subscription
+ * command arrived on, so the host only receives the messages it asked for.
+ *
+ * subscription - The parameters of the command, or NULL if the payload format
+ *      can't include them - then any filter is removed.
+ * sourceInterfaceDescriptor - The interface the command arrived on.
+ *
+ * Returns true if the filter was installed.
+ */
+bool handleSubscriptionCommand(
+        openxc::payload::json::SubscriptionCommand* subscription,
+        openxc::interface::InterfaceDescriptor* sourceInterfaceDescriptor);
+
+} // namespace commands
+} // namespace openxc
+
+#endif // __SUBSCRIPTION_COMMAND_H__
@@ -2,21 +2,45 @@
 #include "signals.h"
 
 using openxc::pipeline::Pipeline;
+using openxc::pipeline::MessageClass;
+using openxc::config::LoggingOutputInterface;
 using openxc::interface::uart::UartDevice;
 using openxc::payload::PayloadFormat;
+using openxc::interface::BackpressurePolicy;
 
 namespace usb = openxc::interface::usb;
+namespace pipeline = openxc::pipeline;
 
 namespace signals = openxc::signals;
 
 static void initialize(openxc::config::Configuration* config) {
-    config->pipeline = {
-        &config->usb,
-        &config->uart,
+    pipeline::initialize(&config->pipeline);
+    pipeline::addSink(&config->pipeline, "USB",
+            &pipeline::USB_SINK_OPERATIONS, &config->usb,
+            &config->usb.descriptor, NON_LOG_MESSAGE_CLASSES);
+    if(config->loggingOutput == LoggingOutputInterface::USB ||
+            config->loggingOutput == LoggingOutputInterface::BOTH) {
+        pipeline::addSink(&config->pipeline, "USB log",
+                &pipeline::USB_LOG_SINK_OPERATIONS, &config->usb,
+                &config->usb.descriptor,
+                MESSAGE_CLASS_MASK(MessageClass::LOG));
+    }
+
+    pipeline::addSink(&config->pipeline, "UART",
+            &pipeline::UART_SINK_OPERATIONS, &config->uart,
+            &config->uart.descriptor, NON_LOG_MESSAGE_CLASSES);
+    if(config->loggingOutput == LoggingOutputInterface::UART ||
+            config->loggingOutput == LoggingOutputInterface::BOTH) {
+        pipeline::addSink(&config->pipeline, "UART log",
+                &pipeline::UART_LOG_SINK_OPERATIONS, NULL, NULL,
+                MESSAGE_CLASS_MASK(MessageClass::LOG));
+    }
+
 #ifdef __USE_NETWORK__
-        &config->network,
+    pipeline::addSink(&config->pipeline, "Network",
+            &pipeline::NETWORK_SINK_OPERATIONS, &config->network,
+            &config->network.descriptor, NON_LOG_MESSAGE_CLASSES);
 #endif // __USE_NETWORK__
-    };
     config->initialized = true;
 }
 
@@ -32,23 +56,31 @@ openxc::config::Configuration* openxc::config::getConfiguration() {
         emulatedData: DEFAULT_EMULATED_DATA_STATUS,
         loggingOutput: DEFAULT_LOGGING_OUTPUT,
         calculateMetrics: DEFAULT_METRICS_STATUS,
+        canReceiveBatchSize: DEFAULT_CAN_RECEIVE_BATCH_SIZE,
+        canReceiveTimeBudgetMs: DEFAULT_CAN_RECEIVE_TIME_BUDGET_MS,
+        backpressureWaitBudgetUs: DEFAULT_BACKPRESSURE_WAIT_US,
+        coalesceOutput: DEFAULT_COALESCE_OUTPUT,
+        emitTimestamps: DEFAULT_EMIT_TIMESTAMPS,
         desiredRunLevel: RunLevel::CAN_ONLY,
         initialized: false,
         runLevel: RunLevel::NOT_RUNNING,
         uart: {
             descriptor: {
-                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_UART
+                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_UART,
+                backpressure: BackpressurePolicy::DEFAULT_BACKPRESSURE_UART
             },
             baudRate: UART_BAUD_RATE
         },
         network: {
             descriptor: {
-                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_NETWORK
+                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_NETWORK,
+                backpressure: BackpressurePolicy::DEFAULT_BACKPRESSURE_NETWORK
             }
         },
         usb: {
             descriptor: {
-                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_USB
+                allowRawWrites: DEFAULT_ALLOW_RAW_WRITE_USB,
+                backpressure: BackpressurePolicy::DEFAULT_BACKPRESSURE_USB
             },
             endpoints: {
                 {IN_ENDPOINT_NUMBER, DATA_ENDPOINT_SIZE,
@@ -75,8 +75,9 @@ typedef enum {
  * messageSetIndex - The index of the currently active message set from the
  *      signals module.
  * version - A string describing the firmware version.
- * payloadFormat - The currently active payload format, from the payload module.
- *      This is used for both input and output.
+ * payloadFormat - The default payload format, from the payload module.
+ *      This is used for both input and output on every interface that hasn't
+ *      been given its own format (see pipeline::setPayloadFormat(...)).
  * recurringObd2Requests - True if the VI should automatically query for
  * supported OBD-II pids and request them at a pre-defined frequency (in the
  *      diagnostics::obd2 module).
@@ -92,6 +93,19 @@ typedef enum {
  * calculateMetrics - If true, metrics on CAN bus and I/O activity will be
  *      calculated and logged. This has serious performance implications at the
  *      moment.
+ * canReceiveBatchSize - The maximum number of received CAN messages to process
+ *      from each bus per pass through the main loop.
+ * canReceiveTimeBudgetMs - If not 0, the maximum time in milliseconds to spend
+ *      processing received CAN messages from each bus per pass through the
+ *      main loop. At least one message is always processed.
+ * backpressureWaitBudgetUs - The maximum time in microseconds to spend waiting
+ *      for room in an output interface's send queue, for interfaces using the
+ *      BOUNDED_WAIT backpressure policy.
+ * coalesceOutput - If true, only the latest value of each translated numeric
+ *      or boolean signal is kept until the output interfaces have room for it,
+ *      instead of queueing every sample.
+ * emitTimestamps - If true, messages published from a received CAN message
+ *      include the time it was received.
  * desiredRunLevel - The desired run level. If this is different from the
  *      current run level, the main loop will make the changes necessary.
  *
@@ -115,6 +129,11 @@ typedef struct {
     bool emulatedData;
     LoggingOutputInterface loggingOutput;
     bool calculateMetrics;
+    uint8_t canReceiveBatchSize;
+    unsigned int canReceiveTimeBudgetMs;
+    unsigned int backpressureWaitBudgetUs;
+    bool coalesceOutput;
+    bool emitTimestamps;
     RunLevel desiredRunLevel;
     bool initialized;
     RunLevel runLevel;
@@ -5,21 +5,38 @@
 #include "util/log.h"
 #include "util/timer.h"
 #include "obd2.h"
+#include "config.h"
 #include <bitfield/bitfield.h>
 #include <limits.h>
 
-#define MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ 10
 #define DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET 0x8
+#define DIAGNOSTIC_POSITIVE_RESPONSE_OFFSET 0x40
+
+#define ISOTP_FRAME_TYPE_SINGLE 0x0
+#define ISOTP_FRAME_TYPE_FIRST 0x1
+#define ISOTP_FRAME_TYPE_CONSECUTIVE 0x2
+#define ISOTP_FRAME_TYPE_FLOW_CONTROL 0x3
+#define ISOTP_FLOW_STATUS_CONTINUE 0x0
+#define ISOTP_MAX_SEPARATION_TIME_MS 0x7f
+#define ISOTP_FIRST_FRAME_DATA_LENGTH 6
+#define ISOTP_CONSECUTIVE_FRAME_DATA_LENGTH 7
+// N_Cr in ISO 15765-2 - how long to wait for the next consecutive frame
+#define ISOTP_CONSECUTIVE_FRAME_TIMEOUT_MS 1000
+// a streamed response is published in chunks that fit the output format's
+// diagnostic response payload
+#define ISOTP_CHUNK_SIZE sizeof(openxc_DiagnosticResponse_payload_t::bytes)
 
 using openxc::diagnostics::ActiveDiagnosticRequest;
 using openxc::diagnostics::DiagnosticsManager;
+using openxc::diagnostics::EcuResponseTime;
+using openxc::diagnostics::IsoTpReceive;
 using openxc::diagnostics::DiagnosticResponseDecoder;
 using openxc::diagnostics::DiagnosticResponseCallback;
 using openxc::diagnostics::passthroughDecoder;
 using openxc::util::log::debug;
 using openxc::can::lookupBus;
-using openxc::can::addAcceptanceFilter;
-using openxc::can::removeAcceptanceFilter;
+using openxc::can::addAcceptanceFilterRange;
+using openxc::can::removeAcceptanceFilterRange;
 using openxc::can::read::publishNumericalMessage;
 using openxc::pipeline::Pipeline;
 using openxc::signals::getCanBuses;
@@ -34,58 +51,450 @@ static bool timedOut(ActiveDiagnosticRequest* request) {
     return time::elapsed(&request->timeoutClock, false);
 }
 
+/* Private: Returns the index of the bus' shims and send schedule.
+ */
+static inline int busIndex(const CanBus* bus) {
+    return bus->address - 1;
+}
+
+/* Private: Returns true if every ECU that had answered a functional broadcast
+ * request on the bus before this one was sent has answered it.
+ */
+static bool knownRespondersAnswered(ActiveDiagnosticRequest* request) {
+    return request->expectedResponders != 0 &&
+            (request->functionalResponders & request->expectedResponders) ==
+                request->expectedResponders;
+}
+
 /* Private: Returns true if a sufficient response has been received for a
  * diagnostic request.
  *
  * This is true when at least one response has been received and the request is
  * configured to not wait for multiple responses. Functional broadcast requests
- * may often wish to wait the full 100ms for modules to respond.
+ * may often wish to wait for the timeout for modules to respond, but don't need
+ * to wait once all of the modules that are known to respond have.
  */
 static bool responseReceived(ActiveDiagnosticRequest* request) {
-    return !request->waitForMultipleResponses &&
-                request->handle.completed;
+    return request->handle.completed && (!request->waitForMultipleResponses ||
+            knownRespondersAnswered(request));
 }
 
 /* Private: Returns true if the request has timed out waiting for a response,
  *      or a sufficient number of responses has been received.
  */
 static bool requestCompleted(ActiveDiagnosticRequest* request) {
-    return responseReceived(request) || (
+    return responseReceived(request) || (request->isoTpReceiveCount == 0 &&
             timedOut(request) && diagnostic_request_sent(&request->handle));
 }
 
+/* Private: Find the range of arbitration IDs that responses to a request
+ * can have - all of the functional response IDs for a functional broadcast
+ * request, otherwise just the one physical response ID.
+ */
+static void getResponseIdRange(uint32_t arbitrationId, uint32_t* firstId,
+        uint32_t* lastId) {
+    if(arbitrationId == OBD2_FUNCTIONAL_BROADCAST_ID) {
+        *firstId = OBD2_FUNCTIONAL_RESPONSE_START;
+        *lastId = OBD2_FUNCTIONAL_RESPONSE_START +
+                OBD2_FUNCTIONAL_RESPONSE_COUNT - 1;
+    } else {
+        *firstId = *lastId = arbitrationId +
+                DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET;
+    }
+}
+
+/* Private: Returns true if the time a (in milliseconds) comes before b,
+ * allowing for the millisecond clock wrapping around.
+ */
+static inline bool sendsBefore(unsigned long a, unsigned long b) {
+    return long(a - b) < 0;
+}
+
+/* Private: Returns the period in milliseconds between sends of a recurring
+ * request.
+ */
+static unsigned long recurringPeriodMs(ActiveDiagnosticRequest* request) {
+    return (unsigned long)(1000 / request->frequencyClock.frequency);
+}
+
+/* Private: Returns true if request a should be sent before request b. As with
+ * the old request lists, of two requests due at the same time the one
+ * scheduled most recently goes first - e.g. a one-time request added to
+ * override an earlier one.
+ */
+static inline bool scheduledBefore(const ActiveDiagnosticRequest* a,
+        const ActiveDiagnosticRequest* b) {
+    if(a->nextSendTime != b->nextSendTime) {
+        return sendsBefore(a->nextSendTime, b->nextSendTime);
+    }
+    return int(a->scheduleSequence - b->scheduleSequence) > 0;
+}
+
+static void swapScheduleEntries(ActiveDiagnosticRequest** schedule, int a,
+        int b) {
+    ActiveDiagnosticRequest* entry = schedule[a];
+    schedule[a] = schedule[b];
+    schedule[b] = entry;
+    schedule[a]->scheduleIndex = a;
+    schedule[b]->scheduleIndex = b;
+}
+
+/* Private: Move the entry at the index up or down the send schedule until the
+ * heap is back in order.
+ */
+static void siftScheduleEntry(ActiveDiagnosticRequest** schedule, int count,
+        int index) {
+    while(index > 0 && scheduledBefore(schedule[index],
+                schedule[(index - 1) / 2])) {
+        swapScheduleEntries(schedule, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+
+    int earliest = index;
+    do {
+        index = earliest;
+        int left = index * 2 + 1;
+        int right = left + 1;
+        if(left < count && scheduledBefore(schedule[left],
+                    schedule[earliest])) {
+            earliest = left;
+        }
+        if(right < count && scheduledBefore(schedule[right],
+                    schedule[earliest])) {
+            earliest = right;
+        }
+        if(earliest != index) {
+            swapScheduleEntries(schedule, index, earliest);
+        }
+    } while(earliest != index);
+}
+
+/* Private: Add the request to its bus' send schedule, to be sent at sendTime.
+ */
+static void scheduleRequest(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* entry, unsigned long sendTime) {
+    int bus = busIndex(entry->bus);
+    entry->nextSendTime = sendTime;
+    entry->scheduleSequence = ++manager->scheduleSequence;
+    entry->scheduleIndex = manager->scheduledCounts[bus]++;
+    manager->sendSchedules[bus][entry->scheduleIndex] = entry;
+    siftScheduleEntry(manager->sendSchedules[bus],
+            manager->scheduledCounts[bus], entry->scheduleIndex);
+}
+
+/* Private: Take the request out of the send schedule, or off the list of
+ * requests waiting on an in flight request - whichever it's in.
+ */
+static void unscheduleRequest(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* entry) {
+    if(entry->scheduleIndex >= 0) {
+        int bus = busIndex(entry->bus);
+        ActiveDiagnosticRequest** schedule = manager->sendSchedules[bus];
+        int last = --manager->scheduledCounts[bus];
+        int index = entry->scheduleIndex;
+        entry->scheduleIndex = -1;
+        if(index != last) {
+            schedule[index] = schedule[last];
+            schedule[index]->scheduleIndex = index;
+            siftScheduleEntry(schedule, last, index);
+        }
+    } else if(entry->blockingRequest != NULL) {
+        ActiveDiagnosticRequest** link = &entry->blockingRequest->nextWaiting;
+        while(*link != entry) {
+            link = &(*link)->nextWaiting;
+        }
+        *link = entry->nextWaiting;
+        entry->nextWaiting = NULL;
+        entry->blockingRequest = NULL;
+    }
+}
+
+/* Private: Find where a request to the arbitration ID on the bus is, or would
+ * be inserted, in the sorted in flight table.
+ */
+static int findInFlightIndex(DiagnosticsManager* manager, const CanBus* bus,
+        uint32_t arbitrationId) {
+    int low = 0;
+    int high = manager->inFlightCount;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        ActiveDiagnosticRequest* candidate = manager->inFlightRequests[middle];
+        if(candidate->bus->address < bus->address ||
+                (candidate->bus->address == bus->address &&
+                    candidate->arbitration_id < arbitrationId)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* Private: Returns the request to the arbitration ID that is in flight on the
+ * bus, or NULL if there isn't one.
+ */
+static ActiveDiagnosticRequest* lookupInFlightRequest(
+        DiagnosticsManager* manager, const CanBus* bus,
+        uint32_t arbitrationId) {
+    int index = findInFlightIndex(manager, bus, arbitrationId);
+    if(index < manager->inFlightCount &&
+            manager->inFlightRequests[index]->bus == bus &&
+            manager->inFlightRequests[index]->arbitration_id ==
+                arbitrationId) {
+        return manager->inFlightRequests[index];
+    }
+    return NULL;
+}
+
+static void addInFlightRequest(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* entry) {
+    int index = findInFlightIndex(manager, entry->bus, entry->arbitration_id);
+    memmove(&manager->inFlightRequests[index + 1],
+            &manager->inFlightRequests[index],
+            (manager->inFlightCount - index) *
+                sizeof(manager->inFlightRequests[0]));
+    manager->inFlightRequests[index] = entry;
+    ++manager->inFlightCount;
+    entry->inFlight = true;
+}
+
+static void releaseIsoTpReceive(IsoTpReceive* receive) {
+    for(int i = 0; i < receive->requestCount; i++) {
+        --receive->requests[i]->isoTpReceiveCount;
+    }
+    receive->requestCount = 0;
+}
+
+/* Private: Stop receiving multi-frame responses for the request. A response
+ * that's also for another request keeps arriving for that one.
+ */
+static void releaseIsoTpReceives(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* entry) {
+    for(int i = 0; entry->isoTpReceiveCount > 0 &&
+            i < MAX_ISOTP_RECEIVE_COUNT; i++) {
+        IsoTpReceive* receive = &manager->isoTpReceives[i];
+        for(int j = 0; j < receive->requestCount; j++) {
+            if(receive->requests[j] == entry) {
+                --entry->isoTpReceiveCount;
+                receive->requests[j] =
+                        receive->requests[--receive->requestCount];
+                break;
+            }
+        }
+    }
+}
+
+/* Private: Find the multi-frame response arriving from an ECU, if any.
+ */
+static IsoTpReceive* findIsoTpReceive(DiagnosticsManager* manager,
+        const CanBus* bus, uint32_t arbitrationId) {
+    for(int i = 0; i < MAX_ISOTP_RECEIVE_COUNT; i++) {
+        IsoTpReceive* receive = &manager->isoTpReceives[i];
+        if(receive->requestCount > 0 && receive->requests[0]->bus == bus &&
+                receive->arbitrationId == arbitrationId) {
+            return receive;
+        }
+    }
+    return NULL;
+}
+
+/* Private: Give up on any multi-frame response whose ECU has stopped sending
+ * it, so its request can time out.
+ */
+static void expireIsoTpReceives(DiagnosticsManager* manager) {
+    unsigned long now = time::systemTimeMs();
+    for(int i = 0; i < MAX_ISOTP_RECEIVE_COUNT; i++) {
+        IsoTpReceive* receive = &manager->isoTpReceives[i];
+        if(receive->requestCount > 0 && now - receive->lastFrameTime >
+                ISOTP_CONSECUTIVE_FRAME_TIMEOUT_MS) {
+            debug("Timed out waiting for the rest of a multi-frame response "
+                    "from 0x%x", receive->arbitrationId);
+            releaseIsoTpReceive(receive);
+        }
+    }
+}
+
+/* Private: Take the request out of the in flight table, and schedule any
+ * requests that were waiting on it to be sent right away.
+ */
+static void removeInFlightRequest(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* entry) {
+    if(!entry->inFlight) {
+        return;
+    }
+
+    releaseIsoTpReceives(manager, entry);
+
+    int index = findInFlightIndex(manager, entry->bus, entry->arbitration_id);
+    --manager->inFlightCount;
+    memmove(&manager->inFlightRequests[index],
+            &manager->inFlightRequests[index + 1],
+            (manager->inFlightCount - index) *
+                sizeof(manager->inFlightRequests[0]));
+    entry->inFlight = false;
+
+    unsigned long now = time::systemTimeMs();
+    ActiveDiagnosticRequest* waiting = entry->nextWaiting;
+    entry->nextWaiting = NULL;
+    while(waiting != NULL) {
+        ActiveDiagnosticRequest* next = waiting->nextWaiting;
+        waiting->nextWaiting = NULL;
+        waiting->blockingRequest = NULL;
+        scheduleRequest(manager, waiting, now);
+        waiting = next;
+    }
+}
+
+/* Private: Park a request that came due while another request to the same
+ * arbitration ID is in flight, until that one completes.
+ */
+static void waitForInFlightRequest(ActiveDiagnosticRequest* blocking,
+        ActiveDiagnosticRequest* entry) {
+    ActiveDiagnosticRequest** link = &blocking->nextWaiting;
+    while(*link != NULL) {
+        link = &(*link)->nextWaiting;
+    }
+    *link = entry;
+    entry->nextWaiting = NULL;
+    entry->blockingRequest = blocking;
+}
+
+static EcuResponseTime* lookupResponseTime(DiagnosticsManager* manager,
+        const CanBus* bus, uint32_t responseId) {
+    for(int i = 0; i < manager->responseTimeCount; i++) {
+        if(manager->responseTimes[i].bus == bus &&
+                manager->responseTimes[i].responseId == responseId) {
+            return &manager->responseTimes[i];
+        }
+    }
+    return NULL;
+}
+
+/* Private: Update the ECU's response time estimate with a new measurement, as
+ * TCP does for its round-trip time (RFC 6298).
+ */
+static void recordResponseTime(DiagnosticsManager* manager, CanBus* bus,
+        uint32_t responseId, unsigned long elapsedMs) {
+    EcuResponseTime* estimate = lookupResponseTime(manager, bus, responseId);
+    if(estimate == NULL) {
+        if(manager->responseTimeCount >= MAX_TRACKED_ECU_COUNT) {
+            return;
+        }
+        estimate = &manager->responseTimes[manager->responseTimeCount++];
+        estimate->bus = bus;
+        estimate->responseId = responseId;
+        estimate->smoothedMs = elapsedMs;
+        estimate->deviationMs = elapsedMs / 2.0;
+    } else {
+        float error = elapsedMs - estimate->smoothedMs;
+        estimate->deviationMs += ((error < 0 ? -error : error) -
+                estimate->deviationMs) / 4;
+        estimate->smoothedMs += error / 8;
+    }
+}
+
+/* Private: Returns how long to wait for the ECU to respond - the smoothed
+ * response time plus 4 times its deviation, as with a TCP retransmission
+ * timeout.
+ */
+static float responseTimeoutMs(const EcuResponseTime* estimate) {
+    float timeout = estimate->smoothedMs + 4 * estimate->deviationMs;
+    if(timeout < MIN_DIAGNOSTIC_TIMEOUT_MS) {
+        timeout = MIN_DIAGNOSTIC_TIMEOUT_MS;
+    } else if(timeout > MAX_DIAGNOSTIC_TIMEOUT_MS) {
+        timeout = MAX_DIAGNOSTIC_TIMEOUT_MS;
+    }
+    return timeout;
+}
+
+/* Private: Returns how long to wait for a response to a request to the
+ * arbitration ID - for a functional broadcast, as long as the slowest ECU known
+ * to answer them takes.
+ *
+ * known - Set to true if any of the ECUs that could answer have answered
+ *      before. If not, the timeout is DEFAULT_DIAGNOSTIC_TIMEOUT_MS.
+ */
+static float lookupTimeoutMs(DiagnosticsManager* manager, const CanBus* bus,
+        uint32_t arbitrationId, bool* known) {
+    float timeout = 0;
+    if(arbitrationId == OBD2_FUNCTIONAL_BROADCAST_ID) {
+        uint8_t responders = manager->functionalResponders[busIndex(bus)];
+        for(int i = 0; i < OBD2_FUNCTIONAL_RESPONSE_COUNT; i++) {
+            const EcuResponseTime* estimate = lookupResponseTime(manager, bus,
+                    OBD2_FUNCTIONAL_RESPONSE_START + i);
+            if((responders & (1 << i)) && estimate != NULL &&
+                    responseTimeoutMs(estimate) > timeout) {
+                timeout = responseTimeoutMs(estimate);
+            }
+        }
+    } else {
+        const EcuResponseTime* estimate = lookupResponseTime(manager, bus,
+                arbitrationId + DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET);
+        if(estimate != NULL) {
+            timeout = responseTimeoutMs(estimate);
+        }
+    }
+
+    *known = timeout > 0;
+    return *known ? timeout : DEFAULT_DIAGNOSTIC_TIMEOUT_MS;
+}
+
+/* Private: Start the request's timeout clock, doubling the timeout for each
+ * time it's been retried.
+ */
+static void startTimeoutClock(DiagnosticsManager* manager,
+        ActiveDiagnosticRequest* request) {
+    bool known;
+    float timeout = lookupTimeoutMs(manager, request->bus,
+            request->arbitration_id, &known) * (1 << request->retries);
+    if(timeout > MAX_DIAGNOSTIC_TIMEOUT_MS) {
+        timeout = MAX_DIAGNOSTIC_TIMEOUT_MS;
+    }
+
+    request->timeoutClock = {0};
+    request->timeoutClock.frequency = 1000 / timeout;
+    time::tick(&request->timeoutClock);
+}
+
 /* Private: Move the entry to the free list and decrement the lock count for any
  * CAN filters it used.
  */
 static void cancelRequest(DiagnosticsManager* manager,
         ActiveDiagnosticRequest* entry) {
+    unscheduleRequest(manager, entry);
+    removeInFlightRequest(manager, entry);
     LIST_INSERT_HEAD(&manager->freeRequestEntries, entry, listEntries);
-    if(entry->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
-        for(uint32_t filter = OBD2_FUNCTIONAL_RESPONSE_START;
-                filter < OBD2_FUNCTIONAL_RESPONSE_START +
-                    OBD2_FUNCTIONAL_RESPONSE_COUNT;
-                filter++) {
-            removeAcceptanceFilter(entry->bus, filter,
-                    CanMessageFormat::STANDARD, getCanBuses(),
-                    getCanBusCount());
-        }
-    } else {
-        removeAcceptanceFilter(entry->bus,
-                entry->arbitration_id +
-                    DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET,
-                CanMessageFormat::STANDARD, getCanBuses(), getCanBusCount());
-    }
+    uint32_t firstResponseId, lastResponseId;
+    getResponseIdRange(entry->arbitration_id, &firstResponseId,
+            &lastResponseId);
+    removeAcceptanceFilterRange(entry->bus, firstResponseId, lastResponseId,
+            CanMessageFormat::STANDARD, getCanBuses(), getCanBusCount(),
+            RECEIVE_CLASS_DIAGNOSTIC);
+}
+
+/* Private: Returns true if a request that's completed should be sent again -
+ * only a one-time request that nothing answered, as a recurring request will be
+ * sent again anyway.
+ */
+static bool shouldRetry(ActiveDiagnosticRequest* entry) {
+    return !entry->recurring && !entry->responded &&
+            entry->retries < MAX_DIAGNOSTIC_RETRIES;
 }
 
 static void cleanupRequest(DiagnosticsManager* manager,
         ActiveDiagnosticRequest* entry, bool force) {
     if(force || (entry->inFlight && requestCompleted(entry))) {
-        entry->inFlight = false;
+        removeInFlightRequest(manager, entry);
 
         char request_string[128] = {0};
         diagnostic_request_to_string(&entry->handle.request,
                 request_string, sizeof(request_string));
-        if(entry->recurring) {
+        if(!force && shouldRetry(entry)) {
+            ++entry->retries;
+            debug("No response, retrying diagnostic request (%d of %d): %s",
+                    entry->retries, MAX_DIAGNOSTIC_RETRIES, request_string);
+            scheduleRequest(manager, entry, time::systemTimeMs());
+        } else if(entry->recurring) {
             TAILQ_REMOVE(&manager->recurringRequests, entry, queueEntries);
             if(force) {
                 cancelRequest(manager, entry);
@@ -94,6 +503,10 @@ static void cleanupRequest(DiagnosticsManager* manager,
                         "of the queue: %s", request_string);
                 TAILQ_INSERT_TAIL(&manager->recurringRequests, entry,
                         queueEntries);
+                entry->retries = 0;
+                scheduleRequest(manager, entry,
+                        entry->frequencyClock.lastTick +
+                            recurringPeriodMs(entry));
             }
         } else {
             debug("Cancelling completed, non-recurring request: %s",
@@ -106,13 +519,24 @@ static void cleanupRequest(DiagnosticsManager* manager,
 
 // clean up the request list, move as many to the free list as possible
 static void cleanupActiveRequests(DiagnosticsManager* manager, bool force) {
-    ActiveDiagnosticRequest* entry, *tmp;
-    LIST_FOREACH_SAFE(entry, &manager->nonrecurringRequests, listEntries, tmp) {
-        cleanupRequest(manager, entry, force);
-    }
+    if(force) {
+        ActiveDiagnosticRequest* entry, *tmp;
+        LIST_FOREACH_SAFE(entry, &manager->nonrecurringRequests, listEntries,
+                tmp) {
+            cleanupRequest(manager, entry, force);
+        }
 
-    TAILQ_FOREACH_SAFE(entry, &manager->recurringRequests, queueEntries, tmp) {
-        cleanupRequest(manager, entry, force);
+        TAILQ_FOREACH_SAFE(entry, &manager->recurringRequests, queueEntries,
+                tmp) {
+            cleanupRequest(manager, entry, force);
+        }
+    } else {
+        expireIsoTpReceives(manager);
+        // Only a request in flight can complete - walk backwards so removing
+        // one doesn't shift the ones still to be checked
+        for(int i = manager->inFlightCount - 1; i >= 0; i--) {
+            cleanupRequest(manager, manager->inFlightRequests[i], force);
+        }
     }
 }
 
@@ -154,6 +578,13 @@ void openxc::diagnostics::reset(DiagnosticsManager* manager) {
     TAILQ_INIT(&manager->recurringRequests);
     LIST_INIT(&manager->nonrecurringRequests);
     LIST_INIT(&manager->freeRequestEntries);
+    for(int i = 0; i < MAX_SHIM_COUNT; i++) {
+        manager->scheduledCounts[i] = 0;
+    }
+    manager->inFlightCount = 0;
+    for(int i = 0; i < MAX_ISOTP_RECEIVE_COUNT; i++) {
+        manager->isoTpReceives[i].requestCount = 0;
+    }
 
     for(int i = 0; i < MAX_SIMULTANEOUS_DIAG_REQUESTS; i++) {
         LIST_INSERT_HEAD(&manager->freeRequestEntries,
@@ -175,62 +606,41 @@ void openxc::diagnostics::initialize(DiagnosticsManager* manager, CanBus* buses,
 
     reset(manager);
     manager->initialized = true;
+    manager->responseTimeCount = 0;
+    for(int i = 0; i < MAX_SHIM_COUNT; i++) {
+        manager->functionalResponders[i] = 0;
+    }
+    setIsoTpFlowControl(manager, DEFAULT_ISOTP_BLOCK_SIZE,
+            DEFAULT_ISOTP_SEPARATION_TIME_MS);
 
     manager->obd2Bus = lookupBus(obd2BusAddress, buses, busCount);
     obd2::initialize(manager);
     debug("Initialized diagnostics");
 }
 
-static inline bool conflicting(ActiveDiagnosticRequest* request,
-        ActiveDiagnosticRequest* candidate) {
-    return (candidate->inFlight && candidate != request &&
-            candidate->bus == request->bus &&
-            candidate->arbitration_id == request->arbitration_id);
-}
-
-
-/* Private: Returns true if there are no other active requests to the same arb
- * ID.
- */
-static inline bool clearToSend(DiagnosticsManager* manager,
-        ActiveDiagnosticRequest* request) {
-    ActiveDiagnosticRequest* entry;
-    LIST_FOREACH(entry, &manager->nonrecurringRequests, listEntries) {
-        if(conflicting(request, entry)) {
-            return false;
-        }
-    }
-
-    TAILQ_FOREACH(entry, &manager->recurringRequests, queueEntries) {
-        if(conflicting(request, entry)) {
-            return false;
-        }
-    }
-    return true;
-}
-
-static inline bool shouldSend(ActiveDiagnosticRequest* request) {
-    return !request->inFlight && (
-            (!request->recurring && !requestCompleted(request)) ||
-            (request->recurring && time::elapsed(&request->frequencyClock,
-                                                 true)));
-}
-
 static void sendRequest(DiagnosticsManager* manager, CanBus* bus,
         ActiveDiagnosticRequest* request) {
-    if(request->bus == bus && shouldSend(request) &&
-            clearToSend(manager, request)) {
-        time::tick(&request->frequencyClock);
-        start_diagnostic_request(&manager->shims[bus->address - 1],
-                &request->handle);
-        if(request->handle.completed && !request->handle.success) {
-            debug("Fatal error sending diagnostic request");
+    time::tick(&request->frequencyClock);
+    start_diagnostic_request(&manager->shims[busIndex(bus)],
+            &request->handle);
+    if(request->handle.completed && !request->handle.success) {
+        debug("Fatal error sending diagnostic request");
+        if(request->recurring) {
+            scheduleRequest(manager, request,
+                    request->frequencyClock.lastTick +
+                        recurringPeriodMs(request));
         } else {
-            request->timeoutClock = {0};
-            request->timeoutClock.frequency = 10;
-            time::tick(&request->timeoutClock);
-            request->inFlight = true;
+            LIST_REMOVE(request, listEntries);
+            cancelRequest(manager, request);
         }
+    } else {
+        request->responded = false;
+        request->functionalResponders = 0;
+        request->expectedResponders = request->arbitration_id ==
+                OBD2_FUNCTIONAL_BROADCAST_ID ?
+                manager->functionalResponders[busIndex(bus)] : 0;
+        startTimeoutClock(manager, request);
+        addInFlightRequest(manager, request);
     }
 }
 
@@ -238,13 +648,20 @@ void openxc::diagnostics::sendRequests(DiagnosticsManager* manager,
         CanBus* bus) {
     cleanupActiveRequests(manager, false);
 
-    ActiveDiagnosticRequest* entry;
-    LIST_FOREACH(entry, &manager->nonrecurringRequests, listEntries) {
-        sendRequest(manager, bus, entry);
-    }
-
-    TAILQ_FOREACH(entry, &manager->recurringRequests, queueEntries) {
-        sendRequest(manager, bus, entry);
+    ActiveDiagnosticRequest** schedule = manager->sendSchedules[busIndex(bus)];
+    unsigned long now = time::systemTimeMs();
+    while(manager->scheduledCounts[busIndex(bus)] > 0 &&
+            !sendsBefore(now, schedule[0]->nextSendTime)) {
+        ActiveDiagnosticRequest* entry = schedule[0];
+        unscheduleRequest(manager, entry);
+
+        ActiveDiagnosticRequest* blocking = lookupInFlightRequest(manager,
+                bus, entry->arbitration_id);
+        if(blocking != NULL) {
+            waitForInFlightRequest(blocking, entry);
+        } else {
+            sendRequest(manager, bus, entry);
+        }
     }
 }
 
@@ -287,16 +704,61 @@ static openxc_VehicleMessage wrapDiagnosticResponseWithSabot(CanBus* bus,
             message.diagnostic_response.has_value = true;
             message.diagnostic_response.value = parsedValue;
         } else {
+            // a longer payload has to be published in chunks, see
+            // publishResponseChunks(...)
+            size_t length = MIN(response->payload_length,
+                    sizeof(message.diagnostic_response.payload.bytes));
             message.diagnostic_response.has_payload = true;
             memcpy(message.diagnostic_response.payload.bytes, response->payload,
-                    response->payload_length);
-            message.diagnostic_response.payload.size = response->payload_length;
+                    length);
+            message.diagnostic_response.payload.size = length;
         }
     }
 
     return message;
 }
 
+/* Private: Publish part of a multi-frame response, with the index of the
+ * chunk or -1 if it's the last one.
+ */
+static void publishResponseChunk(ActiveDiagnosticRequest* entry,
+        uint32_t arbitrationId, const uint8_t* data, size_t length, int frame,
+        Pipeline* pipeline) {
+    const DiagnosticRequest* request = &entry->handle.request;
+    DiagnosticResponse response = {0};
+    response.completed = true;
+    response.success = true;
+    response.multi_frame = true;
+    response.arbitration_id = arbitrationId;
+    response.mode = request->mode;
+    response.has_pid = request->has_pid;
+    response.pid = request->pid;
+    memcpy(response.payload, data, length);
+    response.payload_length = length;
+
+    openxc_VehicleMessage message = wrapDiagnosticResponseWithSabot(
+            entry->bus, entry, &response, 0);
+    pipeline::publish(&message, pipeline, NULL, &frame);
+}
+
+/* Private: Publish a complete response with a payload too long for a single
+ * message in ISOTP_CHUNK_SIZE chunks, the same way a streamed one is.
+ */
+static void publishResponseChunks(ActiveDiagnosticRequest* entry,
+        const DiagnosticResponse* response, Pipeline* pipeline) {
+    int frame = 0;
+    size_t offset = 0;
+    while(response->payload_length - offset > ISOTP_CHUNK_SIZE) {
+        publishResponseChunk(entry, response->arbitration_id,
+                &response->payload[offset], ISOTP_CHUNK_SIZE, frame++,
+                pipeline);
+        offset += ISOTP_CHUNK_SIZE;
+    }
+    publishResponseChunk(entry, response->arbitration_id,
+            &response->payload[offset], response->payload_length - offset, -1,
+            pipeline);
+}
+
 static void relayDiagnosticResponse(DiagnosticsManager* manager,
         ActiveDiagnosticRequest* request,
         const DiagnosticResponse* response, Pipeline* pipeline) {
@@ -305,11 +767,15 @@ static void relayDiagnosticResponse(DiagnosticsManager* manager,
         value = request->decoder(response, value);
     }
 
-    if(response->success && strnlen(request->name, sizeof(request->name)) > 0) {
+    if(request->publishResponses && response->success &&
+            strnlen(request->name, sizeof(request->name)) > 0) {
         // If name, include 'value' instead of payload, and leave of response
         // details.
         publishNumericalMessage(request->name, value, pipeline);
-    } else {
+    } else if(request->publishResponses && request->decoder == NULL &&
+            response->payload_length > ISOTP_CHUNK_SIZE) {
+        publishResponseChunks(request, response, pipeline);
+    } else if(request->publishResponses) {
         // If no name, send full details of response but still include 'value'
         // instead of 'payload' if they provided a decoder. The one case you
         // can't get is the full detailed response with 'value'. We could add
@@ -324,57 +790,367 @@ static void relayDiagnosticResponse(DiagnosticsManager* manager,
     }
 }
 
+/* Private: Returns true if the arbitration ID is one of the functional
+ * addresses that respond to a functional broadcast request.
+ */
+static bool isFunctionalResponse(uint32_t arbitrationId) {
+    return arbitrationId >= OBD2_FUNCTIONAL_RESPONSE_START &&
+            arbitrationId < OBD2_FUNCTIONAL_RESPONSE_START +
+                OBD2_FUNCTIONAL_RESPONSE_COUNT;
+}
+
+/* Private: Note that an ECU has started responding to the request, measuring
+ * its response time from the first response since the request was sent.
+ */
+static void recordResponseStart(DiagnosticsManager* manager, CanBus* bus,
+        ActiveDiagnosticRequest* entry, uint32_t responseId) {
+    bool firstFromEcu = !entry->responded;
+    if(entry->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID &&
+            isFunctionalResponse(responseId)) {
+        firstFromEcu = !(entry->functionalResponders &
+                (1 << (responseId - OBD2_FUNCTIONAL_RESPONSE_START)));
+    }
+
+    if(firstFromEcu && entry->retries == 0) {
+        recordResponseTime(manager, bus, responseId,
+                time::systemTimeMs() - entry->timeoutClock.lastTick);
+    }
+}
+
+/* Private: Note that an ECU has finished responding to the request.
+ */
+static void recordResponse(DiagnosticsManager* manager, CanBus* bus,
+        ActiveDiagnosticRequest* entry, uint32_t responseId) {
+    if(entry->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID &&
+            isFunctionalResponse(responseId)) {
+        uint8_t responder = 1 << (responseId - OBD2_FUNCTIONAL_RESPONSE_START);
+        entry->functionalResponders |= responder;
+        manager->functionalResponders[busIndex(bus)] |= responder;
+    }
+    entry->responded = true;
+}
+
+static uint8_t requestPidLength(const DiagnosticRequest* request) {
+    if(!request->has_pid) {
+        return 0;
+    } else if(request->pid_length != 0) {
+        return request->pid_length;
+    }
+    return request->pid > 0xff ? 2 : 1;
+}
+
+static bool sendFlowControl(DiagnosticsManager* manager, CanBus* bus,
+        uint32_t responseId) {
+    uint8_t data[CAN_MESSAGE_SIZE] = {
+        (ISOTP_FRAME_TYPE_FLOW_CONTROL << 4) | ISOTP_FLOW_STATUS_CONTINUE,
+        manager->isoTpBlockSize, manager->isoTpSeparationTimeMs};
+    return sendDiagnosticCanMessage(bus,
+            responseId - DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET, data,
+            sizeof(data));
+}
+
+/* Private: Add payload bytes of a multi-frame response to its buffer, and if
+ * it's being streamed publish every full chunk - holding back the last one
+ * until it's known to be the last.
+ */
+static void appendIsoTpPayload(IsoTpReceive* receive, const uint8_t* data,
+        size_t length, Pipeline* pipeline) {
+    memcpy(&receive->buffer[receive->bufferLength], data, length);
+    receive->bufferLength += length;
+
+    if(receive->streaming) {
+        while(receive->bufferLength > ISOTP_CHUNK_SIZE) {
+            for(int i = 0; i < receive->requestCount; i++) {
+                publishResponseChunk(receive->requests[i],
+                        receive->arbitrationId, receive->buffer,
+                        ISOTP_CHUNK_SIZE, receive->chunkIndex, pipeline);
+            }
+            ++receive->chunkIndex;
+            receive->bufferLength -= ISOTP_CHUNK_SIZE;
+            memmove(receive->buffer, &receive->buffer[ISOTP_CHUNK_SIZE],
+                    receive->bufferLength);
+        }
+    }
+}
+
+/* Private: Finish a multi-frame response, and hand it to every request it's
+ * for.
+ */
+static void completeIsoTpReceive(DiagnosticsManager* manager, CanBus* bus,
+        IsoTpReceive* receive, Pipeline* pipeline) {
+    ActiveDiagnosticRequest* entries[MAX_ISOTP_RECEIVE_REQUEST_COUNT];
+    int entryCount = receive->requestCount;
+    memcpy(entries, receive->requests, entryCount * sizeof(entries[0]));
+    uint32_t arbitrationId = receive->arbitrationId;
+    bool streaming = receive->streaming;
+
+    DiagnosticResponse response = {0};
+    response.completed = true;
+    response.success = true;
+    response.multi_frame = true;
+    response.arbitration_id = arbitrationId;
+    if(streaming) {
+        for(int i = 0; i < entryCount; i++) {
+            publishResponseChunk(entries[i], arbitrationId, receive->buffer,
+                    receive->bufferLength, -1, pipeline);
+        }
+    } else {
+        memcpy(response.payload, receive->buffer, receive->bufferLength);
+        response.payload_length = receive->bufferLength;
+    }
+    // release the buffer first, the callbacks may start another request
+    releaseIsoTpReceive(receive);
+
+    for(int i = 0; i < entryCount; i++) {
+        ActiveDiagnosticRequest* entry = entries[i];
+        recordResponse(manager, bus, entry, arbitrationId);
+        entry->handle.completed = true;
+        entry->handle.success = true;
+        if(!streaming) {
+            const DiagnosticRequest* request = &entry->handle.request;
+            response.mode = request->mode;
+            response.has_pid = request->has_pid;
+            response.pid = request->pid;
+            relayDiagnosticResponse(manager, entry, &response, pipeline);
+        }
+    }
+
+    for(int i = 0; i < entryCount; i++) {
+        // the callbacks may have already cleaned up or even re-used the
+        // entry, but then it's no longer in flight and this is a no-op
+        cleanupRequest(manager, entries[i], false);
+    }
+}
+
+/* Private: Returns true if the first frame of a multi-frame response is a
+ * positive response to the request that can be received, and sets the length
+ * of the response header (the mode and PID) that comes before its payload.
+ */
+static bool acceptsFirstFrame(ActiveDiagnosticRequest* entry,
+        const CanMessage* message, uint8_t* headerLength, bool* streaming) {
+    const DiagnosticRequest* request = &entry->handle.request;
+    uint16_t length = ((message->data[0] & 0xf) << 8) | message->data[1];
+    *headerLength = 1 + requestPidLength(request);
+    if(message->length < CAN_MESSAGE_SIZE ||
+            length <= ISOTP_CONSECUTIVE_FRAME_DATA_LENGTH ||
+            length <= *headerLength ||
+            message->data[2] != request->mode +
+                DIAGNOSTIC_POSITIVE_RESPONSE_OFFSET) {
+        return false;
+    }
+
+    if(request->has_pid) {
+        uint16_t pid = message->data[3];
+        if(*headerLength > 2) {
+            pid = (pid << 8) | message->data[4];
+        }
+        if(pid != request->pid) {
+            return false;
+        }
+    }
+
+    *streaming = entry->publishResponses && entry->callback == NULL &&
+            entry->decoder == NULL &&
+            strnlen(entry->name, sizeof(entry->name)) == 0;
+    DiagnosticResponse response;
+    size_t payloadLength = length - *headerLength;
+    if(!*streaming && payloadLength > MIN(MAX_ISOTP_REASSEMBLY_LENGTH,
+                sizeof(response.payload))) {
+        debug("Multi-frame response from 0x%x is too long to reassemble "
+                "(%d bytes)", message->id, length);
+        return false;
+    }
+    return true;
+}
+
+/* Private: Start receiving a multi-frame response from its first frame, for
+ * each of the in flight requests it could answer that accepts it - asking the
+ * ECU once to send the rest.
+ */
+static void receiveFirstFrame(DiagnosticsManager* manager, CanBus* bus,
+        ActiveDiagnosticRequest** entries, int entryCount,
+        CanMessage* message, Pipeline* pipeline) {
+    IsoTpReceive* receive = findIsoTpReceive(manager, bus, message->id);
+    if(receive != NULL) {
+        // the ECU started over
+        releaseIsoTpReceive(receive);
+    }
+
+    for(int i = 0; i < MAX_ISOTP_RECEIVE_COUNT && receive == NULL; i++) {
+        if(manager->isoTpReceives[i].requestCount == 0) {
+            receive = &manager->isoTpReceives[i];
+        }
+    }
+
+    uint8_t headerLength = 0;
+    bool streaming = false;
+    for(int i = 0; i < entryCount; i++) {
+        uint8_t entryHeaderLength;
+        bool entryStreaming;
+        if(!acceptsFirstFrame(entries[i], message, &entryHeaderLength,
+                    &entryStreaming)) {
+            continue;
+        }
+
+        if(receive == NULL) {
+            debug("No room to receive multi-frame response from 0x%x",
+                    message->id);
+            return;
+        }
+
+        if(receive->requestCount == 0) {
+            headerLength = entryHeaderLength;
+            streaming = entryStreaming;
+        } else if(entryHeaderLength != headerLength ||
+                entryStreaming != streaming) {
+            debug("Multi-frame response from 0x%x can't be received for "
+                    "both requests, dropping it for one", message->id);
+            continue;
+        }
+
+        recordResponseStart(manager, bus, entries[i], message->id);
+        receive->requests[receive->requestCount++] = entries[i];
+        ++entries[i]->isoTpReceiveCount;
+    }
+
+    if(receive == NULL || receive->requestCount == 0) {
+        return;
+    }
+
+    receive->arbitrationId = message->id;
+    receive->length = ((message->data[0] & 0xf) << 8) | message->data[1];
+    receive->received = ISOTP_FIRST_FRAME_DATA_LENGTH;
+    receive->sequence = 1;
+    receive->framesUntilFlowControl = manager->isoTpBlockSize;
+    receive->lastFrameTime = time::systemTimeMs();
+    receive->streaming = streaming;
+    receive->chunkIndex = 0;
+    receive->bufferLength = 0;
+
+    sendFlowControl(manager, bus, message->id);
+    appendIsoTpPayload(receive, &message->data[2 + headerLength],
+            ISOTP_FIRST_FRAME_DATA_LENGTH - headerLength, pipeline);
+}
+
+/* Private: Add a consecutive frame to the multi-frame response it continues,
+ * finishing the response if it's the last one.
+ */
+static void receiveConsecutiveFrame(DiagnosticsManager* manager, CanBus* bus,
+        CanMessage* message, Pipeline* pipeline) {
+    IsoTpReceive* receive = findIsoTpReceive(manager, bus, message->id);
+    if(receive == NULL) {
+        return;
+    }
+
+    if((message->data[0] & 0xf) != receive->sequence) {
+        debug("Multi-frame response from 0x%x is out of sequence, dropping it",
+                message->id);
+        releaseIsoTpReceive(receive);
+        return;
+    }
+
+    receive->sequence = (receive->sequence + 1) & 0xf;
+    receive->lastFrameTime = time::systemTimeMs();
+    size_t length = MIN(MIN(receive->length - receive->received,
+                ISOTP_CONSECUTIVE_FRAME_DATA_LENGTH), message->length - 1);
+    appendIsoTpPayload(receive, &message->data[1], length, pipeline);
+    receive->received += length;
+
+    if(receive->received >= receive->length) {
+        completeIsoTpReceive(manager, bus, receive, pipeline);
+    } else if(receive->framesUntilFlowControl > 0 &&
+            --receive->framesUntilFlowControl == 0) {
+        receive->framesUntilFlowControl = manager->isoTpBlockSize;
+        sendFlowControl(manager, bus, message->id);
+    }
+}
+
 static void receiveCanMessage(DiagnosticsManager* manager,
         CanBus* bus,
         ActiveDiagnosticRequest* entry,
         CanMessage* message, Pipeline* pipeline) {
-    if(bus == entry->bus && entry->inFlight) {
-        DiagnosticResponse response = diagnostic_receive_can_frame(
-                // TODO eek, is bus address and array index this tightly
-                // coupled?
-                &manager->shims[bus->address - 1],
-                &entry->handle, message->id, message->data, message->length);
-        if(response.completed && entry->handle.completed) {
-            if(entry->handle.success) {
-                relayDiagnosticResponse(manager, entry, &response,
-                        pipeline);
-            } else {
-                debug("Fatal error sending or receiving diagnostic request");
-            }
+    DiagnosticResponse response = diagnostic_receive_can_frame(
+            &manager->shims[busIndex(bus)],
+            &entry->handle, message->id, message->data, message->length);
+    if(response.completed && entry->handle.completed) {
+        recordResponseStart(manager, bus, entry, message->id);
+        recordResponse(manager, bus, entry, message->id);
+        if(entry->handle.success) {
+            relayDiagnosticResponse(manager, entry, &response,
+                    pipeline);
+        } else {
+            debug("Fatal error sending or receiving diagnostic request");
         }
     }
+    // the callback may have already cleaned up or even re-used the entry, but
+    // then it's no longer in flight and this is a no-op
+    cleanupRequest(manager, entry, false);
 }
 
 void openxc::diagnostics::receiveCanMessage(DiagnosticsManager* manager,
         CanBus* bus, CanMessage* message, Pipeline* pipeline) {
-    ActiveDiagnosticRequest* entry;
-    TAILQ_FOREACH(entry, &manager->recurringRequests, queueEntries) {
-        receiveCanMessage(manager, bus, entry, message, pipeline);
+    uint8_t frameType = message->length > 0 ?
+            message->data[0] >> 4 : ISOTP_FRAME_TYPE_SINGLE;
+    if(frameType == ISOTP_FRAME_TYPE_CONSECUTIVE) {
+        receiveConsecutiveFrame(manager, bus, message, pipeline);
+        return;
     }
 
-    LIST_FOREACH(entry, &manager->nonrecurringRequests, listEntries) {
-        receiveCanMessage(manager, bus, entry, message, pipeline);
+    // A response can only be for the in flight request to its arb ID - 8, or
+    // to the functional broadcast ID - look them up directly instead of
+    // offering the frame to every request.
+    if(frameType == ISOTP_FRAME_TYPE_FIRST) {
+        // Only reassemble a multi-frame response once, even if it's for both
+        ActiveDiagnosticRequest* entries[MAX_ISOTP_RECEIVE_REQUEST_COUNT];
+        int entryCount = 0;
+        if(message->id >= DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET &&
+                (entries[entryCount] = lookupInFlightRequest(manager, bus,
+                    message->id - DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET))
+                    != NULL) {
+            ++entryCount;
+        }
+        if(isFunctionalResponse(message->id) &&
+                (entries[entryCount] = lookupInFlightRequest(manager, bus,
+                    OBD2_FUNCTIONAL_BROADCAST_ID)) != NULL) {
+            ++entryCount;
+        }
+        receiveFirstFrame(manager, bus, entries, entryCount, message,
+                pipeline);
+        return;
+    }
+
+    ActiveDiagnosticRequest* entry = NULL;
+    if(message->id >= DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET) {
+        entry = lookupInFlightRequest(manager, bus,
+                message->id - DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET);
+        if(entry != NULL) {
+            receiveCanMessage(manager, bus, entry, message, pipeline);
+        }
+    }
+
+    if(isFunctionalResponse(message->id)) {
+        entry = lookupInFlightRequest(manager, bus,
+                OBD2_FUNCTIONAL_BROADCAST_ID);
+        if(entry != NULL) {
+            receiveCanMessage(manager, bus, entry, message, pipeline);
+        }
     }
-    cleanupActiveRequests(manager, false);
 }
 
-/* Note that this pops it off of whichver list it was on and returns it, so make
- * sure to add it to some other list or it'll be lost.
+/* Private: Find the recurring request matching the bus and request, leaving it
+ * in the recurring list.
  */
 static ActiveDiagnosticRequest* lookupRecurringRequest(
         DiagnosticsManager* manager, const CanBus* bus,
         const DiagnosticRequest* request) {
-    ActiveDiagnosticRequest* existingEntry = NULL, *entry, *tmp;
-    TAILQ_FOREACH_SAFE(entry, &manager->recurringRequests, queueEntries, tmp) {
-        ActiveDiagnosticRequest* candidate = entry;
-        if(candidate->bus == bus && diagnostic_request_equals(
-                    &candidate->handle.request, request)) {
-            TAILQ_REMOVE(&manager->recurringRequests, entry, queueEntries);
-            existingEntry = entry;
-            break;
+    ActiveDiagnosticRequest* entry;
+    TAILQ_FOREACH(entry, &manager->recurringRequests, queueEntries) {
+        if(entry->bus == bus && diagnostic_request_equals(
+                    &entry->handle.request, request)) {
+            return entry;
         }
     }
-    return existingEntry;
+    return NULL;
 }
 
 bool openxc::diagnostics::cancelRecurringRequest(
@@ -382,6 +1158,7 @@ bool openxc::diagnostics::cancelRecurringRequest(
     ActiveDiagnosticRequest* entry = lookupRecurringRequest(manager, bus,
             request);
     if(entry != NULL) {
+        TAILQ_REMOVE(&manager->recurringRequests, entry, queueEntries);
         cancelRequest(manager, entry);
     }
     return entry != NULL;
@@ -399,23 +1176,14 @@ static ActiveDiagnosticRequest* getFreeEntry(DiagnosticsManager* manager) {
 
 static bool updateRequiredAcceptanceFilters(CanBus* bus,
         DiagnosticRequest* request) {
-    bool filterStatus = true;
-    if(request->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
-        for(uint32_t filter = OBD2_FUNCTIONAL_RESPONSE_START;
-                filter < OBD2_FUNCTIONAL_RESPONSE_START +
-                OBD2_FUNCTIONAL_RESPONSE_COUNT;
-                filter++) {
-            filterStatus = filterStatus && addAcceptanceFilter(bus, filter,
-                    CanMessageFormat::STANDARD, getCanBuses(),
-                    getCanBusCount());
-        }
-    } else {
-        filterStatus = addAcceptanceFilter(bus,
-                request->arbitration_id +
-                DIAGNOSTIC_RESPONSE_ARBITRATION_ID_OFFSET,
-                CanMessageFormat::STANDARD,
-                getCanBuses(), getCanBusCount());
-    }
+    // Responses go in the highest priority receive queue, so they aren't
+    // dropped when the bus is busy
+    uint32_t firstResponseId, lastResponseId;
+    getResponseIdRange(request->arbitration_id, &firstResponseId,
+            &lastResponseId);
+    bool filterStatus = addAcceptanceFilterRange(bus, firstResponseId,
+            lastResponseId, CanMessageFormat::STANDARD, getCanBuses(),
+            getCanBusCount(), RECEIVE_CLASS_DIAGNOSTIC);
 
     if(!filterStatus) {
         debug("Couldn't add filter 0x%x to bus %d", request->arbitration_id,
@@ -428,7 +1196,8 @@ static void updateDiagnosticRequestEntry(ActiveDiagnosticRequest* entry,
         DiagnosticsManager* manager, CanBus* bus, DiagnosticRequest* request,
         const char* name, bool waitForMultipleResponses,
         const DiagnosticResponseDecoder decoder,
-        const DiagnosticResponseCallback callback, float frequencyHz) {
+        const DiagnosticResponseCallback callback, float frequencyHz,
+        bool publishResponses) {
     entry->bus = bus;
     entry->arbitration_id = request->arbitration_id;
     entry->handle = generate_diagnostic_request(
@@ -439,16 +1208,24 @@ static void updateDiagnosticRequestEntry(ActiveDiagnosticRequest* entry,
         entry->name[0] = '\0';
     }
     entry->waitForMultipleResponses = waitForMultipleResponses;
+    entry->publishResponses = publishResponses;
 
     entry->decoder = decoder;
     entry->callback = callback;
     entry->recurring = frequencyHz != 0;
     entry->frequencyClock = {0};
     entry->frequencyClock.frequency = entry->recurring ? frequencyHz : 0;
-    // time out after 100ms
+    // the timeout is set for the ECU each time the request is sent
     entry->timeoutClock = {0};
-    entry->timeoutClock.frequency = 10;
     entry->inFlight = false;
+    entry->responded = false;
+    entry->functionalResponders = 0;
+    entry->expectedResponders = 0;
+    entry->retries = 0;
+    entry->isoTpReceiveCount = 0;
+    entry->scheduleIndex = -1;
+    entry->blockingRequest = NULL;
+    entry->nextWaiting = NULL;
 }
 
 bool openxc::diagnostics::addRequest(DiagnosticsManager* manager,
@@ -462,7 +1239,7 @@ bool openxc::diagnostics::addRequest(DiagnosticsManager* manager,
     if(entry != NULL) {
         if(updateRequiredAcceptanceFilters(bus, request)) {
             updateDiagnosticRequestEntry(entry, manager, bus, request, name,
-                    waitForMultipleResponses, decoder, callback, 0);
+                    waitForMultipleResponses, decoder, callback, 0, true);
 
             char request_string[128] = {0};
             diagnostic_request_to_string(&entry->handle.request, request_string,
@@ -473,6 +1250,7 @@ bool openxc::diagnostics::addRequest(DiagnosticsManager* manager,
                     bus->address, request_string);
 
             LIST_INSERT_HEAD(&manager->nonrecurringRequests, entry, listEntries);
+            scheduleRequest(manager, entry, time::systemTimeMs());
         } else {
             added = false;
         }
@@ -482,11 +1260,26 @@ bool openxc::diagnostics::addRequest(DiagnosticsManager* manager,
     return added;
 }
 
-static bool validateOptionalRequestAttributes(float frequencyHz) {
-    if(frequencyHz > MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ) {
-        debug("Requested recurring diagnostic frequency %d is higher "
-                "than maximum of %d", frequencyHz,
-                MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ);
+float openxc::diagnostics::getMaxRecurringFrequency(
+        DiagnosticsManager* manager, CanBus* bus, uint32_t arbitrationId) {
+    bool known;
+    float frequency = 1000 / lookupTimeoutMs(manager, bus, arbitrationId,
+            &known);
+    if(!known || frequency < MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ) {
+        frequency = MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ;
+    } else if(frequency > MAX_ADAPTIVE_DIAGNOSTIC_FREQUENCY_HZ) {
+        frequency = MAX_ADAPTIVE_DIAGNOSTIC_FREQUENCY_HZ;
+    }
+    return frequency;
+}
+
+static bool validateOptionalRequestAttributes(DiagnosticsManager* manager,
+        CanBus* bus, DiagnosticRequest* request, float frequencyHz) {
+    float maxFrequency = openxc::diagnostics::getMaxRecurringFrequency(manager,
+            bus, request->arbitration_id);
+    if(frequencyHz > maxFrequency) {
+        debug("Requested recurring diagnostic frequency %f is higher "
+                "than maximum of %f", frequencyHz, maxFrequency);
         return false;
     }
     return true;
@@ -495,9 +1288,11 @@ static bool validateOptionalRequestAttributes(float frequencyHz) {
 bool openxc::diagnostics::addRecurringRequest(DiagnosticsManager* manager,
         CanBus* bus, DiagnosticRequest* request, const char* name,
         bool waitForMultipleResponses, const DiagnosticResponseDecoder decoder,
-        const DiagnosticResponseCallback callback, float frequencyHz) {
+        const DiagnosticResponseCallback callback, float frequencyHz,
+        bool publishResponses) {
 
-    if(!validateOptionalRequestAttributes(frequencyHz)) {
+    if(!validateOptionalRequestAttributes(manager, bus, request,
+                frequencyHz)) {
         return false;
     }
 
@@ -509,7 +1304,8 @@ bool openxc::diagnostics::addRecurringRequest(DiagnosticsManager* manager,
         if(entry != NULL) {
             if(updateRequiredAcceptanceFilters(bus, request)) {
                 updateDiagnosticRequestEntry(entry, manager, bus, request, name,
-                        waitForMultipleResponses, decoder, callback, frequencyHz);
+                        waitForMultipleResponses, decoder, callback, frequencyHz,
+                        publishResponses);
 
                 char request_string[128] = {0};
                 diagnostic_request_to_string(&entry->handle.request, request_string,
@@ -520,6 +1316,11 @@ bool openxc::diagnostics::addRecurringRequest(DiagnosticsManager* manager,
                         frequencyHz, bus->address, request_string);
 
                 TAILQ_INSERT_HEAD(&manager->recurringRequests, entry, queueEntries);
+                // stagger the first send by up to one period, so recurring
+                // requests added together don't all go out at once
+                scheduleRequest(manager, entry, time::systemTimeMs() +
+                        (entry->recurring ?
+                            rand() % recurringPeriodMs(entry) : 0));
             } else {
                 added = false;
             }
@@ -533,6 +1334,24 @@ bool openxc::diagnostics::addRecurringRequest(DiagnosticsManager* manager,
     return added;
 }
 
+bool openxc::diagnostics::updateRecurringRequestFrequency(
+        DiagnosticsManager* manager, CanBus* bus, DiagnosticRequest* request,
+        float frequencyHz) {
+    if(frequencyHz <= 0 || !validateOptionalRequestAttributes(manager, bus,
+                request, frequencyHz)) {
+        return false;
+    }
+
+    ActiveDiagnosticRequest* entry = lookupRecurringRequest(manager, bus,
+            request);
+    if(entry != NULL) {
+        // the entry is already in the recurring list, and the deadline heap
+        // picks up the new period the next time it's rescheduled
+        entry->frequencyClock.frequency = frequencyHz;
+    }
+    return entry != NULL;
+}
+
 bool openxc::diagnostics::addRecurringRequest(DiagnosticsManager* manager,
         CanBus* bus, DiagnosticRequest* request, const char* name,
         bool waitForMultipleResponses, float frequencyHz) {
@@ -625,6 +1444,13 @@ static bool handleAuthorizedCommand(DiagnosticsManager* manager,
     return status;
 }
 
+void openxc::diagnostics::setIsoTpFlowControl(DiagnosticsManager* manager,
+        uint8_t blockSize, uint8_t separationTimeMs) {
+    manager->isoTpBlockSize = blockSize;
+    manager->isoTpSeparationTimeMs = MIN(separationTimeMs,
+            ISOTP_MAX_SEPARATION_TIME_MS);
+}
+
 bool openxc::diagnostics::handleDiagnosticCommand(
         DiagnosticsManager* manager, openxc_ControlCommand* command) {
     bool status = true;
@@ -12,10 +12,65 @@
 #include "openxc.pb.h"
 
 /* Private: The maximum number of simultanous diagnostic requests. Increasing
- * this number will use more memory on the stack.
+ * this number will use more memory on the stack, but it doesn't slow down the
+ * main loop - only requests that are due to be sent are looked at.
  */
 #define MAX_SIMULTANEOUS_DIAG_REQUESTS 20
 
+/* Public: The highest frequency a recurring diagnostic request can be sent to an
+ * ECU, until its response time is known.
+ */
+#define MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ 10
+
+/* Public: The highest frequency a recurring diagnostic request can be sent to an
+ * ECU that has been answering quickly. See getMaxRecurringFrequency(...).
+ */
+#define MAX_ADAPTIVE_DIAGNOSTIC_FREQUENCY_HZ 50
+
+/* Private: How long to wait for a response from an ECU whose response time
+ * isn't known yet.
+ */
+#define DEFAULT_DIAGNOSTIC_TIMEOUT_MS 100
+
+/* Private: The bounds for the response timeout, however quickly or slowly the
+ * ECU has answered before and however many times the request has been retried.
+ */
+#define MIN_DIAGNOSTIC_TIMEOUT_MS 20
+#define MAX_DIAGNOSTIC_TIMEOUT_MS 1000
+
+/* Private: The number of times a one-time request is re-sent if nothing
+ * answers it, doubling the timeout each time.
+ */
+#define MAX_DIAGNOSTIC_RETRIES 2
+
+/* Private: The number of ECUs (response arbitration IDs) whose response times
+ * are tracked.
+ */
+#define MAX_TRACKED_ECU_COUNT 16
+
+/* Public: The ISO-TP flow control parameters sent to an ECU when it starts a
+ * multi-frame response, until they're changed with setIsoTpFlowControl(...).
+ */
+#define DEFAULT_ISOTP_BLOCK_SIZE 0
+#define DEFAULT_ISOTP_SEPARATION_TIME_MS 0
+
+/* Private: The number of multi-frame responses that can be received at the
+ * same time.
+ */
+#define MAX_ISOTP_RECEIVE_COUNT 2
+
+/* Private: The most in flight requests a single multi-frame response can be
+ * for - the physical request to the ECU, and a functional broadcast.
+ */
+#define MAX_ISOTP_RECEIVE_REQUEST_COUNT 2
+
+/* Private: The longest multi-frame response payload that can be reassembled
+ * for a request with a name, decoder or callback. A response to any other
+ * request is published in chunks as it arrives, so it can be as long as
+ * ISO-TP allows.
+ */
+#define MAX_ISOTP_REASSEMBLY_LENGTH 128
+
 /* Private: The maximum length for a human-readable name for a diagnostic
  * response.
  */
@@ -77,16 +132,43 @@ typedef void (*DiagnosticResponseCallback)(
  *      for a request it will be removed from the active list. If true, the
  *      request will remain active until the timeout clock expires, to allow it
  *      to receive multiple response (e.g. to a functional broadcast request).
+ *      A functional broadcast request also completes once every ECU that has
+ *      answered one before has answered it.
+ * publishResponses - True by default. If false, responses are only passed to
+ *      the callback and not published to the output pipeline.
  *
  * Really Private:
  *
  * inFlight - True if the request has been sent and we are waiting for a
  *      response.
+ * responded - True if anything has answered the request since it was last
+ *      sent.
+ * functionalResponders - For a functional broadcast request, a bit for each
+ *      functional response ID that has answered since it was last sent.
+ * expectedResponders - For a functional broadcast request, the bits for the
+ *      functional response IDs that had answered any functional broadcast
+ *      request before this one was last sent.
+ * retries - The number of times this request has been re-sent because nothing
+ *      answered it. Response times aren't measured from a re-sent request, as
+ *      the response could be to any of the sends.
+ * isoTpReceiveCount - The number of multi-frame responses to this request that
+ *      are still arriving. The request doesn't time out until they finish.
  * frequencyClock - A FrequencyClock struct to control the send rate for a
  *      recurring request. If the request is not reecurring, this attribute is
  *      not used.
  * timeoutClock - A FrequencyClock struct to monitor how long it's been since
  *      this request was sent.
+ * nextSendTime - The time (in milliseconds) this request is next due to be
+ *      sent, the key for its place in the send schedule.
+ * scheduleSequence - Orders requests with the same nextSendTime, the most
+ *      recently scheduled first.
+ * scheduleIndex - The position of this request in its bus' send schedule, or
+ *      -1 if it isn't scheduled.
+ * blockingRequest - If this request came due while another request to the same
+ *      arbitration ID was in flight, the in flight request it's waiting on.
+ * nextWaiting - While this request is in flight, the first request waiting on
+ *      it. While this request is waiting, the next one waiting on the same in
+ *      flight request.
  * queueEntries - Internal data structure reference for when this request is in
  *      the recurring requests queue.
  * listEntries - Internal data structure reference for when this request is in
@@ -101,15 +183,76 @@ struct ActiveDiagnosticRequest {
     DiagnosticResponseCallback callback;
     bool recurring;
     bool waitForMultipleResponses;
+    bool publishResponses;
     bool inFlight;
+    bool responded;
+    uint8_t functionalResponders;
+    uint8_t expectedResponders;
+    uint8_t retries;
+    uint8_t isoTpReceiveCount;
     openxc::util::time::FrequencyClock frequencyClock;
     openxc::util::time::FrequencyClock timeoutClock;
+    unsigned long nextSendTime;
+    unsigned int scheduleSequence;
+    int scheduleIndex;
+    struct ActiveDiagnosticRequest* blockingRequest;
+    struct ActiveDiagnosticRequest* nextWaiting;
 
     TAILQ_ENTRY(ActiveDiagnosticRequest) queueEntries;
     LIST_ENTRY(ActiveDiagnosticRequest) listEntries;
 };
 typedef struct ActiveDiagnosticRequest ActiveDiagnosticRequest;
 
+/* Private: An estimate of how long an ECU takes to respond to a request, kept
+ * the same way as a TCP round-trip time.
+ *
+ * bus - The bus the ECU is on.
+ * responseId - The arbitration ID the ECU responds with.
+ * smoothedMs - A moving average of the ECU's response time.
+ * deviationMs - A moving average of how far each response time is from the
+ *      smoothed response time.
+ */
+typedef struct {
+    CanBus* bus;
+    uint32_t responseId;
+    float smoothedMs;
+    float deviationMs;
+} EcuResponseTime;
+
+/* Private: A multi-frame (ISO-TP) response that is arriving from an ECU.
+ *
+ * requests - The in flight requests the response is for, all on the same bus.
+ * requestCount - The length of the requests array, or 0 if this entry is free.
+ * arbitrationId - The arbitration ID of the responding ECU.
+ * length - The total length of the response, including the mode and PID.
+ * received - The number of bytes of the response received so far.
+ * sequence - The sequence number expected on the next consecutive frame.
+ * framesUntilFlowControl - The number of consecutive frames left before the
+ *      ECU waits for another flow control frame, or 0 if it doesn't.
+ * lastFrameTime - When the last frame of the response was received, in
+ *      milliseconds.
+ * streaming - True if the response is published in chunks as it arrives,
+ *      instead of being reassembled.
+ * chunkIndex - The index of the next chunk of a streaming response.
+ * bufferLength - The number of bytes in buffer.
+ * buffer - The payload reassembled so far or, if streaming, the part of it that
+ *      hasn't been published yet.
+ */
+typedef struct {
+    struct ActiveDiagnosticRequest* requests[MAX_ISOTP_RECEIVE_REQUEST_COUNT];
+    uint8_t requestCount;
+    uint32_t arbitrationId;
+    uint16_t length;
+    uint16_t received;
+    uint8_t sequence;
+    uint8_t framesUntilFlowControl;
+    unsigned long lastFrameTime;
+    bool streaming;
+    int chunkIndex;
+    uint16_t bufferLength;
+    uint8_t buffer[MAX_ISOTP_REASSEMBLY_LENGTH];
+} IsoTpReceive;
+
 LIST_HEAD(DiagnosticRequestList, ActiveDiagnosticRequest);
 TAILQ_HEAD(DiagnosticRequestQueue, ActiveDiagnosticRequest);
 
@@ -136,6 +279,26 @@ TAILQ_HEAD(DiagnosticRequestQueue, ActiveDiagnosticRequest);
  *      requests. This free list is backed by statically allocated entries in
  *      the requestListEntries attribute.
  * requestListEntries - Static allocation for all active diagnostic requests.
+ * sendSchedules - A min-heap of the requests waiting to be sent on each bus,
+ *      ordered by nextSendTime. Only the requests at the top that are due are
+ *      touched when sending.
+ * scheduledCounts - The number of requests in each bus' send schedule.
+ * scheduleSequence - A counter for the scheduleSequence of each request.
+ * inFlightRequests - The requests that have been sent and are waiting for a
+ *      response, sorted by bus address and arbitration ID. At most one request
+ *      per arbitration ID can be in flight on a bus.
+ * inFlightCount - The length of the inFlightRequests array.
+ * responseTimes - The response time estimates for each ECU that has answered a
+ *      request, used to set the timeout for the next request to it.
+ * responseTimeCount - The length of the responseTimes array.
+ * functionalResponders - For each bus, a bit for each functional response ID
+ *      that has answered a functional broadcast request. A functional broadcast
+ *      request is complete once all of them have answered, without waiting for
+ *      the timeout.
+ * isoTpReceives - A pool for the multi-frame responses that are arriving.
+ * isoTpBlockSize - The block size sent in ISO-TP flow control frames.
+ * isoTpSeparationTimeMs - The separation time sent in ISO-TP flow control
+ *      frames.
  * initialized - True if the DiagnosticsManager has been initialized.
  */
 struct DiagnosticsManager {
@@ -145,6 +308,18 @@ struct DiagnosticsManager {
     DiagnosticRequestList nonrecurringRequests;
     DiagnosticRequestList freeRequestEntries;
     ActiveDiagnosticRequest requestListEntries[MAX_SIMULTANEOUS_DIAG_REQUESTS];
+    ActiveDiagnosticRequest* sendSchedules[MAX_SHIM_COUNT][
+            MAX_SIMULTANEOUS_DIAG_REQUESTS];
+    int scheduledCounts[MAX_SHIM_COUNT];
+    unsigned int scheduleSequence;
+    ActiveDiagnosticRequest* inFlightRequests[MAX_SIMULTANEOUS_DIAG_REQUESTS];
+    int inFlightCount;
+    EcuResponseTime responseTimes[MAX_TRACKED_ECU_COUNT];
+    int responseTimeCount;
+    uint8_t functionalResponders[MAX_SHIM_COUNT];
+    IsoTpReceive isoTpReceives[MAX_ISOTP_RECEIVE_COUNT];
+    uint8_t isoTpBlockSize;
+    uint8_t isoTpSeparationTimeMs;
     bool initialized;
 };
 typedef struct DiagnosticsManager DiagnosticsManager;
@@ -169,8 +344,8 @@ void reset(DiagnosticsManager* manager);
 /* Public: Add and send a new recurring diagnostic request.
  *
  * This also adds any neccessary CAN acceptance filters so we can receive the
- * response. If the request is to the functional broadcast ID (0x7df) filters
- * are added for all functional addresses (0x7e8 to 0x7f0).
+ * response. If the request is to the functional broadcast ID (0x7df) a range
+ * filter is added for all functional addresses (0x7e8 to 0x7ef).
  *
  * At most one recurring request can be active for the same arbitration ID, mode
  * and (if set) PID on the same bus at one time. If you try and call
@@ -214,8 +389,10 @@ void reset(DiagnosticsManager* manager);
  * callback - An optional DiagnosticResponseCallback to be notified whenever a
  *      response is received for this request.
  * frequencyHz - The frequency (in Hz) to send the request. A frequency above
- *      MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ is not allowed, and will make this
+ *      getMaxRecurringFrequency(...) is not allowed, and will make this
  *      function return false.
+ * publishResponses - (optional) If false, responses are only passed to the
+ *      callback, for a caller that publishes them itself. Defaults to true.
  *
  * Returns true if the request was added successfully. Returns false if there
  * wasn't a free active request entry, if the frequency was too high or if the
@@ -224,7 +401,8 @@ void reset(DiagnosticsManager* manager);
 bool addRecurringRequest(DiagnosticsManager* manager,
         CanBus* bus, DiagnosticRequest* request, const char* name,
         bool waitForMultipleResponses, const DiagnosticResponseDecoder decoder,
-        const DiagnosticResponseCallback callback, float frequencyHz);
+        const DiagnosticResponseCallback callback, float frequencyHz,
+        bool publishResponses=true);
 
 /* Public: Add and send a new one-time diagnostic request.
  *
@@ -251,6 +429,9 @@ bool addRecurringRequest(DiagnosticsManager* manager,
  * callback - An optional DiagnosticResponseCallback to be notified whenever a
  *      response is received for this request.
  *
+ * If nothing answers the request before it times out, it's re-sent up to
+ * MAX_DIAGNOSTIC_RETRIES times, doubling the timeout each time.
+ *
  * Returns true if the request was added successfully. Returns false if there
  * wasn't a free active request entry, if the frequency was too high or if the
  * CAN acceptance filters could not be configured,
@@ -300,12 +481,65 @@ bool addRequest(DiagnosticsManager* manager, CanBus* bus,
 bool cancelRecurringRequest(DiagnosticsManager* manager, CanBus* bus,
         DiagnosticRequest* request);
 
+/* Public: Change how often an existing recurring diagnostic request is sent.
+ *
+ * The new frequency takes effect from the next time the request is scheduled,
+ * so this is safe to call from a response callback for the same request.
+ *
+ * manager - The manager with the recurring request.
+ * bus - The bus for the recurring request.
+ * request - Match an existing recurring request with the request argument's
+ *      bus, arbitration ID, mode and (if set) pid.
+ * frequencyHz - The new frequency (in Hz), at most
+ *      getMaxRecurringFrequency(...).
+ *
+ * Returns true if a matching recurring request was found and updated.
+ */
+bool updateRecurringRequestFrequency(DiagnosticsManager* manager, CanBus* bus,
+        DiagnosticRequest* request, float frequencyHz);
+
+/* Public: Return the highest frequency a recurring request to the arbitration
+ * ID can be sent.
+ *
+ * This is MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ until the ECU has answered a
+ * request. After that, it's how often the request could be sent if it were only
+ * waiting for the ECU's response timeout - if that's quicker - up to
+ * MAX_ADAPTIVE_DIAGNOSTIC_FREQUENCY_HZ.
+ *
+ * manager - The manager tracking the ECU response times.
+ * bus - The bus the requests are sent on.
+ * arbitrationId - The arbitration ID the requests are sent to.
+ */
+float getMaxRecurringFrequency(DiagnosticsManager* manager, CanBus* bus,
+        uint32_t arbitrationId);
+
+/* Public: Set the ISO-TP flow control parameters sent to an ECU when it starts
+ * a multi-frame response.
+ *
+ * manager - The manager receiving the responses.
+ * blockSize - The number of consecutive frames the ECU may send before waiting
+ *      for another flow control frame, or 0 to send them all without waiting.
+ * separationTimeMs - The minimum time the ECU must leave between consecutive
+ *      frames, up to 127ms.
+ */
+void setIsoTpFlowControl(DiagnosticsManager* manager, uint8_t blockSize,
+        uint8_t separationTimeMs);
+
 /* Public: Handle a newly received CAN message, checking to see if it is a
  *      response to an active requests.
  *
  * This must be called for every new CAN message that is received. It will match
  * it to any existing requests, relay the response and perform any necessary
- * callbacks.
+ * callbacks. A message is only offered to the in flight requests its
+ * arbitration ID could be a response to, so anything else costs a lookup in the
+ * in flight table and nothing more.
+ *
+ * Multi-frame responses are received here too, sending the ECU flow control
+ * frames as needed. If the request has a name, decoder or callback, the
+ * response is reassembled (up to MAX_ISOTP_REASSEMBLY_LENGTH bytes) and handled
+ * like any other. Otherwise it's published as it arrives, in chunks as long as
+ * the output format's diagnostic payload, numbered with a "frame" field that is
+ * -1 for the last chunk.
  *
  * manager - The manager that should receive the CAN message.
  * bus - The bus this message was received from.
@@ -319,7 +553,9 @@ void receiveCanMessage(DiagnosticsManager* manager, CanBus* bus,
  *      frames that need to be sent.
  *
  * This should be called from the main loop of the firmware in order to handle
- * multi-frame requests as quickly as possible.
+ * multi-frame requests as quickly as possible. Only requests that are due are
+ * looked at - a request that comes due while another request to the same
+ * arbitration ID is in flight waits until that one completes.
  *
  * manager - The manager to send the requests for.
  * bus - The bus to send the requests on.
@@ -10,14 +10,37 @@ typedef enum {
     NETWORK = 2
 } InterfaceType;
 
+/* Public: What the pipeline does with a new outgoing message when an
+ * interface's send queue doesn't have room for it.
+ *
+ * BOUNDED_WAIT - Process the output interfaces until there is room, for no
+ *      longer than the configured wait budget. If there's still no room, hold
+ *      the message until there is, or drop it if it can't be held.
+ * DROP_NEWEST - Never wait. Hold the message until there is room, or drop it if
+ *      too many messages are already held.
+ * DROP_OLDEST - Never wait. If too many messages are already held, drop the
+ *      oldest held message to make room for the new one.
+ * COALESCE - Never wait. If a message for the same signal is already held,
+ *      replace its value with the new one. Otherwise behaves like DROP_OLDEST.
+ */
+typedef enum {
+    BOUNDED_WAIT,
+    DROP_NEWEST,
+    DROP_OLDEST,
+    COALESCE
+} BackpressurePolicy;
+
 /* Public:
  *
  * type - The type of this interface, one of InterfaceType.
  * allowRawWrites - if raw CAN messages writes are enabled for a bus and this is
  *      true, accept raw write requests from the USB interface.
+ * backpressure - How to handle outgoing messages when this interface can't
+ *      keep up, one of BackpressurePolicy.
  */
 typedef struct {
     bool allowRawWrites;
+    BackpressurePolicy backpressure;
     InterfaceType type;
 } InterfaceDescriptor;
 
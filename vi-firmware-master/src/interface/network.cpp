@@ -13,6 +13,7 @@ void openxc::interface::network::initializeCommon(NetworkDevice* device) {
         QUEUE_INIT(uint8_t, &device->receiveQueue);
         QUEUE_INIT(uint8_t, &device->sendQueue);
         device->descriptor.type = InterfaceType::NETWORK;
+        commands::resetIncomingMessage(&device->descriptor);
     }
 }
 
@@ -16,6 +16,7 @@ void openxc::interface::uart::initializeCommon(UartDevice* device) {
         QUEUE_INIT(uint8_t, &device->sendQueue);
 
         device->descriptor.type = InterfaceType::UART;
+        openxc::commands::resetIncomingMessage(&device->descriptor);
     }
 }
 
@@ -13,6 +13,7 @@ void openxc::interface::usb::initializeCommon(UsbDevice* usbDevice) {
     }
     usbDevice->configured = false;
     usbDevice->descriptor.type = InterfaceType::USB;
+    commands::resetIncomingMessage(&usbDevice->descriptor);
 }
 
 void openxc::interface::usb::deinitializeCommon(UsbDevice* usbDevice) {
@@ -34,6 +35,12 @@ size_t openxc::interface::usb::handleIncomingMessage(uint8_t payload[], size_t l
             &config::getConfiguration()->usb.descriptor);
 }
 
+size_t openxc::interface::usb::handleControlMessage(uint8_t payload[],
+        size_t length) {
+    return commands::handleIncomingMessage(payload, length,
+            &config::getConfiguration()->usb.descriptor, false);
+}
+
 bool openxc::interface::usb::connected(UsbDevice* device) {
     return device != NULL && device->configured;
 }
@@ -38,10 +38,10 @@ typedef struct {
     uint8_t size;
     UsbEndpointDirection direction;
     QUEUE_TYPE(uint8_t) queue;
+#ifdef __PIC32__
     // This buffer MUST be non-local, so it doesn't get invalidated when it
     // falls off the stack
     uint8_t sendBuffer[USB_SEND_BUFFER_SIZE];
-#ifdef __PIC32__
     char receiveBuffer[MAX_USB_PACKET_SIZE_BYTES];
     USB_HANDLE deviceToHostHandle;
     USB_HANDLE hostToDeviceHandle;
@@ -123,6 +123,12 @@ void deinitializeCommon(UsbDevice*);
 
 size_t handleIncomingMessage(uint8_t payload[], size_t length);
 
+/* Public: Handle a command sent as a single control transfer on the control
+ * endpoint. Unlike handleIncomingMessage(...), it doesn't disturb a command
+ * that's partly received on the bulk OUT endpoint.
+ */
+size_t handleControlMessage(uint8_t payload[], size_t length);
+
 /* Public: Check the connection status of a USB device.
  *
  * Returns true if a USB host is connected.
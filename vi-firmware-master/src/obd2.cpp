@@ -4,7 +4,10 @@
 #include "util/log.h"
 #include "shared_handlers.h"
 #include "config.h"
+#include "can/canread.h"
+#include "storage.h"
 #include <limits.h>
+#include <stdio.h>
 
 namespace time = openxc::util::time;
 
@@ -14,14 +17,45 @@ using openxc::diagnostics::ActiveDiagnosticRequest;
 using openxc::config::getConfiguration;
 using openxc::config::PowerManagement;
 using openxc::config::RunLevel;
+using openxc::can::read::publishNumericalMessage;
 
 #define ENGINE_SPEED_PID 0xc
 #define VEHICLE_SPEED_PID 0xd
+#define VIN_MODE 0x9
+#define VIN_PID 0x2
+#define VIN_LENGTH 17
+
+// The OBD-II standard allows up to 6 PIDs in a single mode 1 request
+#define MAX_PIDS_PER_REQUEST 6
+// The mode and each PID with its data must fit in a response the diagnostics
+// module can reassemble - more than fits in a single frame costs a flow control
+// frame, but that's still cheaper than another request
+#define MAX_PACKED_RESPONSE_LENGTH MAX_ISOTP_REASSEMBLY_LENGTH
+// Don't poll an ECU so often that it spends more than 1/4 of the time
+// answering the same request
+#define POLL_PERIOD_LATENCY_MULTIPLE 4
+// A fast responding ECU can be polled at up to twice the configured frequency
+#define MAX_POLL_FREQUENCY_BOOST 2
+// Only change a poll frequency if it would move by more than 20%
+#define POLL_FREQUENCY_HYSTERESIS 0.2
+
+// Each supported PID query returns a 4 byte bitmap for the next 0x20 PIDs -
+// 0x00 asks about 0x01 to 0x20, and so on up to 0x80
+#define SUPPORTED_PID_RANGE_COUNT 5
+#define SUPPORTED_PID_RANGE_SIZE 0x20
+#define SUPPORTED_PID_BITMAP_LENGTH 4
+
+#define SUPPORTED_PIDS_KEY_PREFIX "pids:"
+#define LAST_VEHICLE_KEY "pids:last"
+#define UNKNOWN_VEHICLE "unknown"
 
 static bool ENGINE_STARTED = false;
 static bool VEHICLE_IN_MOTION = false;
 
 static openxc::util::time::FrequencyClock IGNITION_STATUS_TIMER = {0.5, 0, NULL};
+// How long to wait for every ECU to answer the supported PID queries before
+// deciding the ones that haven't don't support anything there
+static openxc::util::time::FrequencyClock DISCOVERY_TIMER = {0.5, 0, NULL};
 
 /* Private: A representation of an OBD-II PID.
  *
@@ -29,35 +63,97 @@ static openxc::util::time::FrequencyClock IGNITION_STATUS_TIMER = {0.5, 0, NULL}
  * name - A human readable name to use for this PID when published.
  * frequency - The frequency to request this PID if supported by the vehicle
  *      when automatic, recurring OBD-II requests are enabled.
+ * responseLength - The number of data bytes in a response for this PID.
  */
 typedef struct {
     uint8_t pid;
     const char* name;
     float frequency;
+    uint8_t responseLength;
 } Obd2Pid;
 
 /* Private: Pre-defined OBD-II PIDs to query for if supported by the vehicle.
  */
 const Obd2Pid OBD2_PIDS[] = {
-    { pid: ENGINE_SPEED_PID, name: "engine_speed", frequency: 5 },
-    { pid: VEHICLE_SPEED_PID, name: "vehicle_speed", frequency: 5 },
-    { pid: 0x4, name: "engine_load", frequency: 5 },
-    { pid: 0x5, name: "engine_coolant_temperature", frequency: 1 },
-    { pid: 0x33, name: "barometric_pressure", frequency: 1 },
-    { pid: 0x4c, name: "commanded_throttle_position", frequency: 1 },
-    { pid: 0x27, name: "fuel_level", frequency: 1 },
-    { pid: 0xf, name: "intake_air_temperature", frequency: 1 },
-    { pid: 0xb, name: "intake_manifold_pressure", frequency: 1 },
-    { pid: 0x1f, name: "running_time", frequency: 1 },
-    { pid: 0x11, name: "throttle_position", frequency: 5 },
-    { pid: 0xa, name: "fuel_pressure", frequency: 1 },
-    { pid: 0x10, name: "mass_airflow", frequency: 5 },
-    { pid: 0x5a, name: "accelerator_pedal_position", frequency: 5 },
-    { pid: 0x52, name: "ethanol_fuel_percentage", frequency: 1 },
-    { pid: 0x5c, name: "engine_oil_temperature", frequency: 1 },
-    { pid: 0x63, name: "engine_torque", frequency: 1 },
+    { pid: ENGINE_SPEED_PID, name: "engine_speed", frequency: 5,
+        responseLength: 2 },
+    { pid: VEHICLE_SPEED_PID, name: "vehicle_speed", frequency: 5,
+        responseLength: 1 },
+    { pid: 0x4, name: "engine_load", frequency: 5, responseLength: 1 },
+    { pid: 0x5, name: "engine_coolant_temperature", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x33, name: "barometric_pressure", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x4c, name: "commanded_throttle_position", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x27, name: "fuel_level", frequency: 1, responseLength: 4 },
+    { pid: 0xf, name: "intake_air_temperature", frequency: 1,
+        responseLength: 1 },
+    { pid: 0xb, name: "intake_manifold_pressure", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x1f, name: "running_time", frequency: 1, responseLength: 2 },
+    { pid: 0x11, name: "throttle_position", frequency: 5, responseLength: 1 },
+    { pid: 0xa, name: "fuel_pressure", frequency: 1, responseLength: 1 },
+    { pid: 0x10, name: "mass_airflow", frequency: 5, responseLength: 2 },
+    { pid: 0x5a, name: "accelerator_pedal_position", frequency: 5,
+        responseLength: 1 },
+    { pid: 0x52, name: "ethanol_fuel_percentage", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x5c, name: "engine_oil_temperature", frequency: 1,
+        responseLength: 1 },
+    { pid: 0x63, name: "engine_torque", frequency: 1, responseLength: 2 },
 };
 
+#define OBD2_PID_COUNT (sizeof(OBD2_PIDS) / sizeof(Obd2Pid))
+
+/* Private: A set of supported PIDs from one ECU that are polled together with a
+ * single, recurring mode 1 request.
+ *
+ * pids - Indexes into OBD2_PIDS for the PIDs in the group, in the order they
+ *      are requested.
+ * pidCount - The length of the pids array.
+ * baseFrequency - The configured frequency of the PIDs in the group.
+ * frequency - The frequency the group is being polled at right now, adapted to
+ *      the ECU's response latency.
+ * latencyMs - A moving average of how long the ECU takes to respond to the
+ *      group's request, or 0 if it hasn't responded yet.
+ * request - The recurring request for the group, sent to the ECU's physical
+ *      address.
+ */
+typedef struct {
+    uint8_t pids[MAX_PIDS_PER_REQUEST];
+    uint8_t pidCount;
+    float baseFrequency;
+    float frequency;
+    float latencyMs;
+    DiagnosticRequest request;
+} Obd2PollGroup;
+
+static Obd2PollGroup POLL_GROUPS[OBD2_PID_COUNT];
+static int POLL_GROUP_COUNT = 0;
+
+// The response arbitration ID of the ECU each of OBD2_PIDS is polled from, or
+// 0 if no ECU has said it supports the PID.
+static uint32_t PID_RESPONDERS[OBD2_PID_COUNT];
+
+// The supported PID bitmaps returned by each ECU, indexed by its offset from
+// OBD2_FUNCTIONAL_RESPONSE_START and then the PID range. These are cached in
+// persistent storage for each vehicle, so the next time it's started the PIDs
+// can be polled without waiting for the ECUs to answer the queries again.
+static uint8_t SUPPORTED_PIDS[OBD2_FUNCTIONAL_RESPONSE_COUNT]
+        [SUPPORTED_PID_RANGE_COUNT][SUPPORTED_PID_BITMAP_LENGTH];
+
+// A bit for each range that an ECU has answered a query for since the vehicle
+// was last started - any others are still from the cache.
+static uint8_t CONFIRMED_RANGES[OBD2_FUNCTIONAL_RESPONSE_COUNT];
+
+// The storage key for the current vehicle's supported PIDs, by VIN.
+static char VEHICLE_KEY[MAX_STORAGE_KEY_LENGTH];
+
+static bool PID_SUPPORT_QUERIED = false;
+static bool DISCOVERY_PENDING = false;
+static bool CACHE_DIRTY = false;
+
 static void checkIgnitionStatus(DiagnosticsManager* manager,
         const ActiveDiagnosticRequest* request,
         const DiagnosticResponse* response,
@@ -91,39 +187,428 @@ static void requestIgnitionStatus(DiagnosticsManager* manager) {
     }
 }
 
+static int findPid(uint16_t pid) {
+    for(size_t i = 0; i < OBD2_PID_COUNT; i++) {
+        if(OBD2_PIDS[i].pid == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static Obd2PollGroup* findPollGroup(const DiagnosticRequest* request) {
+    for(int i = 0; i < POLL_GROUP_COUNT; i++) {
+        if(POLL_GROUPS[i].request.arbitration_id == request->arbitration_id &&
+                POLL_GROUPS[i].request.pid == request->pid) {
+            return &POLL_GROUPS[i];
+        }
+    }
+    return NULL;
+}
+
+/* Private: Update the moving average of the group's response latency and, if
+ * it has moved far enough, the rate the group is polled at.
+ *
+ * The rate is whatever keeps the ECU busy with this request no more than
+ * 1/POLL_PERIOD_LATENCY_MULTIPLE of the time - up to MAX_POLL_FREQUENCY_BOOST
+ * times the configured rate for a quick ECU, and below it for a slow one.
+ */
+static void adaptPollFrequency(DiagnosticsManager* manager,
+        Obd2PollGroup* group, unsigned long latencyMs) {
+    if(group->latencyMs == 0) {
+        group->latencyMs = latencyMs;
+    } else {
+        group->latencyMs += (latencyMs - group->latencyMs) / 8;
+    }
+
+    float frequency = 1000 / (POLL_PERIOD_LATENCY_MULTIPLE *
+            (group->latencyMs < 1 ? 1 : group->latencyMs));
+    if(frequency > group->baseFrequency * MAX_POLL_FREQUENCY_BOOST) {
+        frequency = group->baseFrequency * MAX_POLL_FREQUENCY_BOOST;
+    }
+    float maxFrequency = openxc::diagnostics::getMaxRecurringFrequency(manager,
+            manager->obd2Bus, group->request.arbitration_id);
+    if(frequency > maxFrequency) {
+        frequency = maxFrequency;
+    }
+
+    float change = frequency - group->frequency;
+    if((change < 0 ? -change : change) >
+            group->frequency * POLL_FREQUENCY_HYSTERESIS &&
+            updateRecurringRequestFrequency(manager, manager->obd2Bus,
+                &group->request, frequency)) {
+        debug("Polling PID 0x%x group at %f Hz", group->request.pid,
+                frequency);
+        group->frequency = frequency;
+    }
+}
+
+/* Private: Split a response to a packed request back into each PID and its
+ * data, and publish them all.
+ *
+ * The response's payload starts with the data for the first PID, followed by
+ * each other PID and its data.
+ */
+static void handlePolledPids(DiagnosticsManager* manager,
+        const ActiveDiagnosticRequest* request,
+        const DiagnosticResponse* response,
+        float parsedPayload) {
+    if(!response->success) {
+        return;
+    }
+
+    Obd2PollGroup* group = findPollGroup(&request->handle.request);
+    if(group != NULL) {
+        adaptPollFrequency(manager, group,
+                time::systemTimeMs() - request->timeoutClock.lastTick);
+    }
+
+    uint16_t pid = response->pid;
+    int offset = 0;
+    int index;
+    while((index = findPid(pid)) != -1 &&
+            offset + OBD2_PIDS[index].responseLength <=
+                response->payload_length) {
+        DiagnosticResponse pidResponse = *response;
+        pidResponse.pid = pid;
+        pidResponse.payload_length = OBD2_PIDS[index].responseLength;
+        memcpy(pidResponse.payload, &response->payload[offset],
+                pidResponse.payload_length);
+        offset += pidResponse.payload_length;
+
+        float value = openxc::diagnostics::obd2::handleObd2Pid(&pidResponse,
+                diagnostic_payload_to_integer(&pidResponse));
+        publishNumericalMessage(OBD2_PIDS[index].name, value,
+                &getConfiguration()->pipeline);
+        checkIgnitionStatus(manager, request, &pidResponse, value);
+
+        if(offset >= response->payload_length) {
+            break;
+        }
+        pid = response->payload[offset++];
+    }
+}
+
+static int packedResponseLength(const Obd2PollGroup* group) {
+    // the mode, and then each PID followed by its data
+    int length = 1;
+    for(int i = 0; i < group->pidCount; i++) {
+        length += 1 + OBD2_PIDS[group->pids[i]].responseLength;
+    }
+    return length;
+}
+
+/* Private: Re-pack all of the PIDs an ECU supports into as few recurring
+ * requests as possible, replacing any requests that were polling it before.
+ *
+ * Only PIDs with the same configured frequency share a request. Each ECU has
+ * its own requests to its physical address, so the diagnostics module can
+ * have requests in flight to all of them at once.
+ */
+static void rebuildPollGroups(DiagnosticsManager* manager,
+        uint32_t responderId) {
+    // the ECU's physical request address is 8 below its response address
+    uint32_t arbitrationId = responderId - 0x8;
+    int groupCount = 0;
+    for(int i = 0; i < POLL_GROUP_COUNT; i++) {
+        if(POLL_GROUPS[i].request.arbitration_id == arbitrationId) {
+            cancelRecurringRequest(manager, manager->obd2Bus,
+                    &POLL_GROUPS[i].request);
+        } else {
+            POLL_GROUPS[groupCount++] = POLL_GROUPS[i];
+        }
+    }
+    POLL_GROUP_COUNT = groupCount;
+
+    int firstNewGroup = POLL_GROUP_COUNT;
+    for(size_t i = 0; i < OBD2_PID_COUNT; i++) {
+        if(PID_RESPONDERS[i] != responderId) {
+            continue;
+        }
+
+        Obd2PollGroup* group = NULL;
+        for(int j = firstNewGroup; j < POLL_GROUP_COUNT; j++) {
+            Obd2PollGroup* candidate = &POLL_GROUPS[j];
+            if(candidate->baseFrequency == OBD2_PIDS[i].frequency &&
+                    candidate->pidCount < MAX_PIDS_PER_REQUEST &&
+                    packedResponseLength(candidate) + 1 +
+                        OBD2_PIDS[i].responseLength <=
+                        MAX_PACKED_RESPONSE_LENGTH) {
+                group = candidate;
+                break;
+            }
+        }
+
+        if(group == NULL) {
+            group = &POLL_GROUPS[POLL_GROUP_COUNT++];
+            memset(group, 0, sizeof(Obd2PollGroup));
+            group->baseFrequency = group->frequency = OBD2_PIDS[i].frequency;
+            group->request.arbitration_id = arbitrationId;
+            group->request.mode = 0x1;
+            group->request.has_pid = true;
+            group->request.pid = OBD2_PIDS[i].pid;
+            group->request.pid_length = 1;
+        } else {
+            group->request.payload[group->request.payload_length++] =
+                    OBD2_PIDS[i].pid;
+        }
+        group->pids[group->pidCount++] = i;
+    }
+
+    for(int i = firstNewGroup; i < POLL_GROUP_COUNT; i++) {
+        debug("Automatically adding recurring request for %d PIDs from "
+                "0x%x, starting with 0x%x", POLL_GROUPS[i].pidCount,
+                arbitrationId, POLL_GROUPS[i].request.pid);
+        addRecurringRequest(manager, manager->obd2Bus,
+                &POLL_GROUPS[i].request, NULL, false, NULL, handlePolledPids,
+                POLL_GROUPS[i].frequency, false);
+    }
+}
+
+static void resetPollGroups() {
+    POLL_GROUP_COUNT = 0;
+    memset(PID_RESPONDERS, 0, sizeof(PID_RESPONDERS));
+}
+
+static bool isSupported(int ecu, uint8_t pid) {
+    if(pid == 0 || pid > SUPPORTED_PID_RANGE_COUNT * SUPPORTED_PID_RANGE_SIZE) {
+        return false;
+    }
+    int bit = (pid - 1) % SUPPORTED_PID_RANGE_SIZE;
+    return SUPPORTED_PIDS[ecu][(pid - 1) / SUPPORTED_PID_RANGE_SIZE]
+            [bit / CHAR_BIT] >> (CHAR_BIT - 1 - bit % CHAR_BIT) & 0x1;
+}
+
+/* Private: Assign each of the predefined PIDs to the lowest addressed ECU that
+ * supports it, and re-pack the requests for any ECU whose PIDs changed.
+ */
+static void updatePollGroups(DiagnosticsManager* manager) {
+    uint32_t responders[OBD2_PID_COUNT];
+    for(size_t i = 0; i < OBD2_PID_COUNT; i++) {
+        responders[i] = 0;
+        for(int ecu = 0; ecu < OBD2_FUNCTIONAL_RESPONSE_COUNT; ecu++) {
+            if(isSupported(ecu, OBD2_PIDS[i].pid)) {
+                responders[i] = OBD2_FUNCTIONAL_RESPONSE_START + ecu;
+                break;
+            }
+        }
+    }
+
+    bool changed[OBD2_FUNCTIONAL_RESPONSE_COUNT] = {false};
+    for(size_t i = 0; i < OBD2_PID_COUNT; i++) {
+        if(responders[i] != PID_RESPONDERS[i]) {
+            if(PID_RESPONDERS[i] != 0) {
+                changed[PID_RESPONDERS[i] - OBD2_FUNCTIONAL_RESPONSE_START] =
+                        true;
+            }
+            if(responders[i] != 0) {
+                changed[responders[i] - OBD2_FUNCTIONAL_RESPONSE_START] = true;
+            }
+        }
+    }
+    memcpy(PID_RESPONDERS, responders, sizeof(PID_RESPONDERS));
+
+    for(int ecu = 0; ecu < OBD2_FUNCTIONAL_RESPONSE_COUNT; ecu++) {
+        if(changed[ecu]) {
+            rebuildPollGroups(manager, OBD2_FUNCTIONAL_RESPONSE_START + ecu);
+        }
+    }
+}
+
+static bool havePollablePids() {
+    for(size_t i = 0; i < OBD2_PID_COUNT; i++) {
+        for(int ecu = 0; ecu < OBD2_FUNCTIONAL_RESPONSE_COUNT; ecu++) {
+            if(isSupported(ecu, OBD2_PIDS[i].pid)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Private: Load the cached supported PIDs for the vehicle, leaving the ranges
+ * that have already been confirmed since it was started alone.
+ */
+static void loadSupportedPids() {
+    uint8_t cached[OBD2_FUNCTIONAL_RESPONSE_COUNT][SUPPORTED_PID_RANGE_COUNT]
+            [SUPPORTED_PID_BITMAP_LENGTH];
+    if(openxc::storage::load(VEHICLE_KEY, (uint8_t*)cached, sizeof(cached)) !=
+            sizeof(cached)) {
+        memset(cached, 0, sizeof(cached));
+    }
+
+    for(int ecu = 0; ecu < OBD2_FUNCTIONAL_RESPONSE_COUNT; ecu++) {
+        for(int range = 0; range < SUPPORTED_PID_RANGE_COUNT; range++) {
+            if(!(CONFIRMED_RANGES[ecu] & (1 << range))) {
+                memcpy(SUPPORTED_PIDS[ecu][range], cached[ecu][range],
+                        SUPPORTED_PID_BITMAP_LENGTH);
+            }
+        }
+    }
+}
+
+static void saveSupportedPids() {
+    const char* vin = VEHICLE_KEY + strlen(SUPPORTED_PIDS_KEY_PREFIX);
+    if(openxc::storage::store(VEHICLE_KEY, (uint8_t*)SUPPORTED_PIDS,
+                sizeof(SUPPORTED_PIDS)) &&
+            openxc::storage::store(LAST_VEHICLE_KEY, (const uint8_t*)vin,
+                strlen(vin))) {
+        CACHE_DIRTY = false;
+    } else {
+        debug("Unable to cache supported PIDs for %s", VEHICLE_KEY);
+    }
+}
+
+static void setVehicle(const char* vin) {
+    snprintf(VEHICLE_KEY, sizeof(VEHICLE_KEY), "%s%s",
+            SUPPORTED_PIDS_KEY_PREFIX, vin);
+}
+
+/* Private: Switch to the cached supported PIDs for the vehicle with the VIN in
+ * the response, if it's not the one they were loaded for.
+ *
+ * The VIN is the last VIN_LENGTH bytes of the payload, after the count of data
+ * items.
+ */
+static void checkVin(DiagnosticsManager* manager,
+        const ActiveDiagnosticRequest* request,
+        const DiagnosticResponse* response,
+        float parsedPayload) {
+    if(!response->success || response->payload_length < VIN_LENGTH) {
+        return;
+    }
+
+    char vin[VIN_LENGTH + 1];
+    memcpy(vin, &response->payload[response->payload_length - VIN_LENGTH],
+            VIN_LENGTH);
+    vin[VIN_LENGTH] = '\0';
+
+    char key[MAX_STORAGE_KEY_LENGTH];
+    snprintf(key, sizeof(key), "%s%s", SUPPORTED_PIDS_KEY_PREFIX, vin);
+    if(strcmp(key, VEHICLE_KEY)) {
+        debug("Loading supported PIDs for VIN %s", vin);
+        setVehicle(vin);
+        loadSupportedPids();
+        updatePollGroups(manager);
+        CACHE_DIRTY = true;
+        if(!DISCOVERY_PENDING) {
+            saveSupportedPids();
+        }
+    }
+}
+
+/* Private: Record which PIDs in the requested range the responding ECU
+ * supports, and update the PIDs polled from it if that changed.
+ *
+ * The payload is a bitmap - the high bit of the first byte is the PID after
+ * the one requested.
+ */
 static void checkSupportedPids(DiagnosticsManager* manager,
         const ActiveDiagnosticRequest* request,
         const DiagnosticResponse* response,
         float parsedPayload) {
-    if(manager->obd2Bus == NULL || !getConfiguration()->recurringObd2Requests) {
+    if(manager->obd2Bus == NULL || !getConfiguration()->recurringObd2Requests ||
+            !response->success) {
+        return;
+    }
+
+    int ecu = response->arbitration_id - OBD2_FUNCTIONAL_RESPONSE_START;
+    int range = response->pid / SUPPORTED_PID_RANGE_SIZE;
+    if(ecu < 0 || ecu >= OBD2_FUNCTIONAL_RESPONSE_COUNT ||
+            response->pid % SUPPORTED_PID_RANGE_SIZE != 0 ||
+            range >= SUPPORTED_PID_RANGE_COUNT) {
         return;
     }
 
-    debug("%s", "Querying for supported PIDs from vehicle");
-    for(int i = 0; i < response->payload_length; i++) {
-        for(int j = CHAR_BIT - 1; j >= 0; j--) {
-            if(response->payload[i] >> j & 0x1) {
-                uint16_t pid = response->pid + (i * CHAR_BIT) + j + 1;
-                debug("Vehicle supports PID 0x%02x", pid);
-                for(size_t i = 0; i < sizeof(OBD2_PIDS) / sizeof(Obd2Pid); i++) {
-                    if(OBD2_PIDS[i].pid == pid) {
-                        debug("Automatically adding recurring request for PID 0x%x", pid);
-                        DiagnosticRequest request = {
-                                arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
-                                mode: 0x1, has_pid: true, pid: pid};
-                        addRecurringRequest(manager, manager->obd2Bus, &request,
-                                OBD2_PIDS[i].name, false,
-                                openxc::diagnostics::obd2::handleObd2Pid,
-                                checkIgnitionStatus, OBD2_PIDS[i].frequency);
-                        break;
-                    }
-                }
+    uint8_t bitmap[SUPPORTED_PID_BITMAP_LENGTH] = {0};
+    memcpy(bitmap, response->payload, response->payload_length <
+                SUPPORTED_PID_BITMAP_LENGTH ?
+            response->payload_length : SUPPORTED_PID_BITMAP_LENGTH);
+
+    CONFIRMED_RANGES[ecu] |= 1 << range;
+    if(memcmp(bitmap, SUPPORTED_PIDS[ecu][range], sizeof(bitmap))) {
+        debug("ECU 0x%x supports PIDs 0x%02x-0x%02x: %02x%02x%02x%02x",
+                response->arbitration_id, response->pid + 1,
+                response->pid + SUPPORTED_PID_RANGE_SIZE, bitmap[0],
+                bitmap[1], bitmap[2], bitmap[3]);
+        memcpy(SUPPORTED_PIDS[ecu][range], bitmap, sizeof(bitmap));
+        CACHE_DIRTY = true;
+        updatePollGroups(manager);
+    }
+}
+
+/* Private: Forget any cached supported PIDs that no ECU confirmed while the
+ * queries were outstanding, and save the result if anything changed.
+ */
+static void finishDiscovery(DiagnosticsManager* manager) {
+    DISCOVERY_PENDING = false;
+    for(int ecu = 0; ecu < OBD2_FUNCTIONAL_RESPONSE_COUNT; ecu++) {
+        for(int range = 0; range < SUPPORTED_PID_RANGE_COUNT; range++) {
+            uint8_t* bitmap = SUPPORTED_PIDS[ecu][range];
+            if(!(CONFIRMED_RANGES[ecu] & (1 << range)) &&
+                    (bitmap[0] || bitmap[1] || bitmap[2] || bitmap[3])) {
+                memset(bitmap, 0, SUPPORTED_PID_BITMAP_LENGTH);
+                CACHE_DIRTY = true;
             }
         }
     }
+
+    if(CACHE_DIRTY) {
+        updatePollGroups(manager);
+        saveSupportedPids();
+    }
+}
+
+/* Private: Start polling for the cached supported PIDs right away, and query
+ * the vehicle for its VIN and the PIDs it supports to revalidate them.
+ */
+static void discoverSupportedPids(DiagnosticsManager* manager) {
+    if(havePollablePids()) {
+        debug("Polling cached supported OBD-II PIDs for %s", VEHICLE_KEY);
+        updatePollGroups(manager);
+    }
+
+    memset(CONFIRMED_RANGES, 0, sizeof(CONFIRMED_RANGES));
+    DISCOVERY_PENDING = true;
+    time::tick(&DISCOVERY_TIMER);
+
+    DiagnosticRequest request = {
+            arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
+            mode: VIN_MODE,
+            has_pid: true,
+            pid: VIN_PID};
+    addRequest(manager, manager->obd2Bus, &request, NULL, false, NULL,
+            checkVin);
+
+    request.mode = 0x1;
+    // wait for every ECU to answer, so PIDs can be polled from each
+    for(int i = 0; i < SUPPORTED_PID_RANGE_COUNT; i++) {
+        request.pid = i * SUPPORTED_PID_RANGE_SIZE;
+        addRequest(manager, manager->obd2Bus, &request, NULL, true,
+                NULL, checkSupportedPids);
+    }
 }
 
 void openxc::diagnostics::obd2::initialize(DiagnosticsManager* manager) {
+    resetPollGroups();
+    PID_SUPPORT_QUERIED = false;
+    DISCOVERY_PENDING = false;
+    CACHE_DIRTY = false;
+    memset(SUPPORTED_PIDS, 0, sizeof(SUPPORTED_PIDS));
+    memset(CONFIRMED_RANGES, 0, sizeof(CONFIRMED_RANGES));
+
+    if(getConfiguration()->recurringObd2Requests) {
+        setVehicle(UNKNOWN_VEHICLE);
+        char vin[VIN_LENGTH + 1];
+        int length = openxc::storage::load(LAST_VEHICLE_KEY, (uint8_t*)vin,
+                VIN_LENGTH);
+        if(length > 0) {
+            vin[length] = '\0';
+            setVehicle(vin);
+        }
+        loadSupportedPids();
+    }
+
     requestIgnitionStatus(manager);
 }
 
@@ -133,7 +618,6 @@ void openxc::diagnostics::obd2::initialize(DiagnosticsManager* manager) {
 // * If normal CAN is blocked, we rely on a watchdog to wake us up every 15
 // seconds to start this process over again.
 void openxc::diagnostics::obd2::loop(DiagnosticsManager* manager) {
-    static bool pidSupportQueried = false;
     const int MAX_IGNITION_CHECK_COUNT = 3;
     static int ignitionCheckCount = 0;
 
@@ -153,7 +637,9 @@ void openxc::diagnostics::obd2::loop(DiagnosticsManager* manager) {
             // for any diagnostics messages.
             IGNITION_STATUS_TIMER.frequency = .1;
             ignitionCheckCount = 0;
-            pidSupportQueried = false;
+            PID_SUPPORT_QUERIED = false;
+            DISCOVERY_PENDING = false;
+            resetPollGroups();
         } else {
             // We haven't received an ignition in 5 seconds. Either the user didn't
             // have either OBD-II request configured as a recurring request (which
@@ -167,21 +653,16 @@ void openxc::diagnostics::obd2::loop(DiagnosticsManager* manager) {
         IGNITION_STATUS_TIMER.frequency = .5;
         ignitionCheckCount = 0;
         getConfiguration()->desiredRunLevel = RunLevel::ALL_IO;
-        if(getConfiguration()->recurringObd2Requests && !pidSupportQueried) {
+        if(getConfiguration()->recurringObd2Requests && !PID_SUPPORT_QUERIED) {
             debug("Ignition is on - querying for supported OBD-II PIDs");
-            pidSupportQueried = true;
-            DiagnosticRequest request = {
-                    arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
-                    mode: 0x1,
-                    has_pid: true,
-                    pid: 0x0};
-            for(int i = 0x0; i <= 0x80; i += 0x20) {
-                request.pid = i;
-                addRequest(manager, manager->obd2Bus, &request, NULL, false,
-                        NULL, checkSupportedPids);
-            }
+            PID_SUPPORT_QUERIED = true;
+            discoverSupportedPids(manager);
         }
     }
+
+    if(DISCOVERY_PENDING && time::elapsed(&DISCOVERY_TIMER, false)) {
+        finishDiscovery(manager);
+    }
 }
 
 bool openxc::diagnostics::obd2::isObd2Request(DiagnosticRequest* request) {
@@ -22,15 +22,23 @@ namespace obd2 {
  * If recurring OBD-II requests are enabled, this will also kick off a
  * diagnostic request for supported PIDs when the engine is on or vehicle is
  * in motion. When the supported PIDs are confirmed, a pre-defined set will be
- * added as recurring requests (see obd2.cpp for those predefined PIDs).
+ * added as recurring requests (see obd2.cpp for those predefined PIDs). The
+ * PIDs supported by each ECU are packed into multi-PID requests to its physical
+ * address, so requests to different ECUs can be in flight at the same time.
+ *
+ * The supported PIDs are cached in persistent storage for each vehicle, by VIN,
+ * where the platform supports it. If they're cached, polling starts as soon as the
+ * ignition is on and the queries for supported PIDs only revalidate the cache.
+ * The cache is written to flash when the CAN buses go quiet.
  */
 void loop(DiagnosticsManager* manager);
 
 /* Public: Initialize the OBD-II module.
  *
- * Kicks off an ignition status check (engine and vehicle speed). Make sure to
- * call loop(...) after initializing this module to continue with normal
- * functionality.
+ * Loads the cached supported PIDs for the last vehicle, if recurring OBD-II
+ * requests are enabled, and kicks off an ignition status check (engine and
+ * vehicle speed). Make sure to call loop(...) after initializing this module
+ * to continue with normal functionality.
  */
 void initialize(DiagnosticsManager* manager);
 
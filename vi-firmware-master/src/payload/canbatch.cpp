@@ -0,0 +1,178 @@
+#include "canbatch.h"
+
+#include <string.h>
+#include "protobuf.h"
+#include "util/log.h"
+#include "util/timer.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+
+// Every record starts with its length as a 2 byte varint, even if it would
+// fit in 1, so it can be filled in after the rest of the record is written.
+#define RECORD_LENGTH_SIZE 2
+#define MAX_RECORD_LENGTH ((1 << 14) - 1)
+#define MAX_VARINT_SIZE 5
+#define MAX_FRAME_SIZE (MAX_VARINT_SIZE * 4 + 1 + 8)
+
+namespace canbatch = openxc::payload::canbatch;
+namespace time = openxc::util::time;
+
+using openxc::util::log::debug;
+
+static size_t encodeVarint(uint32_t value, uint8_t* destination) {
+    size_t length = 0;
+    while(value >= 0x80) {
+        destination[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    destination[length++] = value;
+    return length;
+}
+
+/* Private: Map a signed value to an unsigned one with a small magnitude kept
+ * small, the same as a protobuf sint32.
+ */
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/* Private: Decode a varint from the start of the source.
+ *
+ * Returns the number of bytes the varint took up, or 0 if it was cut off.
+ */
+static size_t decodeVarint(const uint8_t* source, size_t length,
+        uint32_t* value) {
+    *value = 0;
+    for(size_t i = 0; i < length && i < MAX_VARINT_SIZE; i++) {
+        *value |= (uint32_t)(source[i] & 0x7f) << (7 * i);
+        if(!(source[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static void beginRecord(uint8_t* buffer, canbatch::RecordType type) {
+    buffer[RECORD_LENGTH_SIZE] = type;
+}
+
+/* Private: Fill in the length of a record, once the record is complete.
+ *
+ * Returns the total length of the record.
+ */
+static size_t finishRecord(uint8_t* buffer, size_t length) {
+    size_t contentLength = length - RECORD_LENGTH_SIZE;
+    buffer[0] = (contentLength & 0x7f) | 0x80;
+    buffer[1] = contentLength >> 7;
+    return length;
+}
+
+void openxc::payload::canbatch::begin(CanBatch* batch, uint8_t* buffer,
+        size_t capacity) {
+    batch->buffer = buffer;
+    batch->capacity = capacity < MAX_RECORD_LENGTH ?
+            capacity : MAX_RECORD_LENGTH;
+    batch->length = RECORD_LENGTH_SIZE + 1;
+    batch->frameCount = 0;
+    batch->lastTimestampUs = 0;
+    if(batch->capacity >= batch->length) {
+        beginRecord(buffer, CAN_FRAMES_RECORD);
+    }
+}
+
+bool openxc::payload::canbatch::append(CanBatch* batch,
+        openxc_CanMessage* message, uint32_t timestampUs) {
+    uint8_t frame[MAX_VARINT_SIZE + MAX_FRAME_SIZE];
+    size_t frameLength = 0;
+    if(batch->frameCount == 0) {
+        frameLength += encodeVarint(timestampUs, &frame[frameLength]);
+        batch->lastTimestampUs = timestampUs;
+    }
+
+    uint8_t dataLength = message->data.size < 8 ? message->data.size : 8;
+    frameLength += encodeVarint(
+            zigzag((int32_t)(timestampUs - batch->lastTimestampUs)),
+            &frame[frameLength]);
+    frameLength += encodeVarint(message->bus, &frame[frameLength]);
+    frameLength += encodeVarint((message->id << 1) |
+            (message->has_frame_format && message->frame_format ==
+                openxc_CanMessage_FrameFormat_EXTENDED),
+            &frame[frameLength]);
+    frame[frameLength++] = dataLength;
+    memcpy(&frame[frameLength], message->data.bytes, dataLength);
+    frameLength += dataLength;
+
+    if(batch->length + frameLength > batch->capacity) {
+        return false;
+    }
+
+    memcpy(&batch->buffer[batch->length], frame, frameLength);
+    batch->length += frameLength;
+    batch->lastTimestampUs = timestampUs;
+    ++batch->frameCount;
+    return true;
+}
+
+size_t openxc::payload::canbatch::finish(CanBatch* batch) {
+    if(batch->frameCount == 0) {
+        return 0;
+    }
+    return finishRecord(batch->buffer, batch->length);
+}
+
+size_t openxc::payload::canbatch::deserialize(uint8_t payload[], size_t length,
+        openxc_VehicleMessage* message) {
+    uint32_t contentLength;
+    size_t prefixLength = decodeVarint(payload, length, &contentLength);
+    if(prefixLength == 0 || prefixLength + contentLength > length) {
+        return 0;
+    }
+
+    size_t recordLength = prefixLength + contentLength;
+    if(contentLength == 0 || payload[prefixLength] != MESSAGE_RECORD) {
+        debug("Skipping %u byte record that isn't a message", recordLength);
+        return recordLength;
+    }
+
+    pb_istream_t stream = pb_istream_from_buffer(&payload[prefixLength + 1],
+            contentLength - 1);
+    if(!pb_decode(&stream, openxc_VehicleMessage_fields, message)) {
+        debug("Protobuf decoding failed with %s", PB_GET_ERROR(&stream));
+    }
+    return recordLength;
+}
+
+int openxc::payload::canbatch::serialize(openxc_VehicleMessage* message,
+        uint8_t payload[], size_t length, const uint32_t* timestamp,
+        const int* frame) {
+    if(message == NULL) {
+        debug("Message object is NULL");
+        return 0;
+    }
+
+    if(message->type == openxc_VehicleMessage_Type_CAN) {
+        CanBatch batch;
+        begin(&batch, payload, length);
+        if(!append(&batch, &message->can_message, timestamp != NULL ?
+                    *timestamp : time::systemTimeUs())) {
+            debug("CAN frame doesn't fit in a %u byte payload", length);
+        }
+        return finish(&batch);
+    }
+
+    if(length <= RECORD_LENGTH_SIZE + 1) {
+        return 0;
+    }
+
+    beginRecord(payload, MESSAGE_RECORD);
+    size_t maxContentLength = length - RECORD_LENGTH_SIZE - 1;
+    pb_ostream_t stream = pb_ostream_from_buffer(
+            &payload[RECORD_LENGTH_SIZE + 1],
+            maxContentLength < MAX_RECORD_LENGTH ?
+                maxContentLength : MAX_RECORD_LENGTH - 1);
+    if(!protobuf::encode(&stream, message, timestamp, frame)) {
+        debug("Error encoding protobuf: %s", PB_GET_ERROR(&stream));
+        return 0;
+    }
+    return finishRecord(payload, RECORD_LENGTH_SIZE + 1 + stream.bytes_written);
+}
@@ -0,0 +1,109 @@
+#ifndef __CANBATCH_H__
+#define __CANBATCH_H__
+
+#include "openxc.pb.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace openxc {
+namespace payload {
+namespace canbatch {
+
+/* Public: The type of a record in the CAN batch format, the byte that follows
+ * the record's length.
+ *
+ * MESSAGE_RECORD - A single OpenXC message, encoded as a Protocol Buffer.
+ * CAN_FRAMES_RECORD - Any number of raw CAN frames.
+ */
+typedef enum {
+    MESSAGE_RECORD = 0,
+    CAN_FRAMES_RECORD = 1
+} RecordType;
+
+/* Public: A CAN frames record that's being filled in.
+ *
+ * buffer - The buffer the record is written to.
+ * capacity - The size of the buffer.
+ * length - The number of bytes of the record written so far.
+ * frameCount - The number of frames in the record.
+ * lastTimestampUs - The timestamp of the last frame in the record, in
+ *      microseconds.
+ */
+typedef struct {
+    uint8_t* buffer;
+    size_t capacity;
+    size_t length;
+    int frameCount;
+    uint32_t lastTimestampUs;
+} CanBatch;
+
+/* Public: Start a new, empty CAN frames record.
+ *
+ * batch - The batch to initialize.
+ * buffer - The buffer to write the record to.
+ * capacity - The size of the buffer.
+ */
+void begin(CanBatch* batch, uint8_t* buffer, size_t capacity);
+
+/* Public: Add a CAN frame to a record.
+ *
+ * Each frame is written as the microseconds since the previous frame (0 for the
+ * first, which follows the record's base timestamp) as a zigzag varint, the
+ * bus, the ID shifted left by 1 with the lowest bit set for extended frames,
+ * then the data length and data bytes. Frames from different buses and receive
+ * queues aren't published in the order they were received, so the time since
+ * the previous frame can be negative.
+ *
+ * batch - The record to add the frame to.
+ * message - The CAN frame.
+ * timestampUs - When the frame was received, in microseconds.
+ *
+ * Returns true if the frame was added, or false if there isn't room for it.
+ */
+bool append(CanBatch* batch, openxc_CanMessage* message, uint32_t timestampUs);
+
+/* Public: Finish a CAN frames record by filling in its length.
+ *
+ * Returns the total length of the record, or 0 if it has no frames.
+ */
+size_t finish(CanBatch* batch);
+
+/* Public: Deserialize an OpenXC message record from a payload in the CAN batch
+ * format. Records of any other type are skipped.
+ *
+ * payload - The bytestream payload to parse a message from.
+ * length -  The length of the payload.
+ * message - An output parameter, the object to store the deserialized message.
+ *
+ * Returns the number of bytes read for a complete record from the payload, if
+ * any were found.
+ */
+size_t deserialize(uint8_t payload[], size_t length,
+        openxc_VehicleMessage* message);
+
+/* Public: Serialize a single OpenXC message as a record in the CAN batch
+ * format. A CAN message is written as a record with one frame, anything else
+ * as a message record.
+ *
+ * message - The message to serialize.
+ * payload - The buffer to store the payload - must be allocated by the caller.
+ * length -  The length of the payload buffer.
+ * timestamp - (optional) When the CAN message behind the message was
+ *      received, in microseconds. CAN frames always have a timestamp, the
+ *      current time if this isn't given. A message record only has one if it's
+ *      given, encoded like protobuf::serialize(...).
+ * frame - (optional) The chunk index of a diagnostic response message record,
+ *      encoded like protobuf::serialize(...).
+ *
+ * Returns the number of bytes written to the payload. If the length is 0, an
+ * error occurred while serializing.
+ */
+int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length,
+        const uint32_t* timestamp=NULL, const int* frame=NULL);
+
+} // namespace canbatch
+} // namespace payload
+} // namespace openxc
+
+#endif // __CANBATCH_H__
@@ -4,9 +4,12 @@
 #include <stdlib.h>
 #include <sys/param.h>
 #include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <strings.h>
 
 #include "json.h"
-#include "util/strutil.h"
 #include "util/log.h"
 #include "config.h"
 
@@ -21,9 +24,11 @@ const char openxc::payload::json::PASSTHROUGH_COMMAND_NAME[] = "passthrough";
 const char openxc::payload::json::ACCEPTANCE_FILTER_BYPASS_COMMAND_NAME[] = "af_bypass";
 const char openxc::payload::json::PAYLOAD_FORMAT_COMMAND_NAME[] = "payload_format";
 const char openxc::payload::json::PREDEFINED_OBD2_REQUESTS_COMMAND_NAME[] = "predefined_obd2";
+const char openxc::payload::json::SUBSCRIBE_COMMAND_NAME[] = "subscribe";
 
 const char openxc::payload::json::PAYLOAD_FORMAT_JSON_NAME[] = "json";
 const char openxc::payload::json::PAYLOAD_FORMAT_PROTOBUF_NAME[] = "protobuf";
+const char openxc::payload::json::PAYLOAD_FORMAT_CAN_BATCH_NAME[] = "can_batch";
 
 const char openxc::payload::json::COMMAND_RESPONSE_FIELD_NAME[] = "command_response";
 const char openxc::payload::json::COMMAND_RESPONSE_MESSAGE_FIELD_NAME[] = "message";
@@ -36,6 +41,7 @@ const char openxc::payload::json::NAME_FIELD_NAME[] = "name";
 const char openxc::payload::json::VALUE_FIELD_NAME[] = "value";
 const char openxc::payload::json::EVENT_FIELD_NAME[] = "event";
 const char openxc::payload::json::FRAME_FORMAT_FIELD_NAME[] = "frame_format";
+const char openxc::payload::json::TIMESTAMP_FIELD_NAME[] = "timestamp_us";
 
 const char openxc::payload::json::FRAME_FORMAT_STANDARD_NAME[] = "standard";
 const char openxc::payload::json::FRAME_FORMAT_EXTENDED_NAME[] = "extended";
@@ -46,6 +52,7 @@ const char openxc::payload::json::DIAGNOSTIC_SUCCESS_FIELD_NAME[] = "success";
 const char openxc::payload::json::DIAGNOSTIC_NRC_FIELD_NAME[] = "negative_response_code";
 const char openxc::payload::json::DIAGNOSTIC_PAYLOAD_FIELD_NAME[] = "payload";
 const char openxc::payload::json::DIAGNOSTIC_VALUE_FIELD_NAME[] = "value";
+const char openxc::payload::json::DIAGNOSTIC_FRAME_FIELD_NAME[] = "frame";
 
 static bool serializeDiagnostic(openxc_VehicleMessage* message, cJSON* root) {
     cJSON_AddNumberToObject(root, payload::json::BUS_FIELD_NAME,
@@ -105,6 +112,8 @@ static bool serializeCommandResponse(openxc_VehicleMessage* message,
         typeString = payload::json::PAYLOAD_FORMAT_COMMAND_NAME;
     } else if(message->command_response.type == openxc_ControlCommand_Type_PREDEFINED_OBD2_REQUESTS) {
         typeString = payload::json::PREDEFINED_OBD2_REQUESTS_COMMAND_NAME;
+    } else if(message->command_response.type == payload::CONTROL_COMMAND_SUBSCRIBE) {
+        typeString = payload::json::SUBSCRIBE_COMMAND_NAME;
     } else {
         return false;
     }
@@ -125,68 +134,6 @@ static bool serializeCommandResponse(openxc_VehicleMessage* message,
     return true;
 }
 
-static bool serializeCan(openxc_VehicleMessage* message, cJSON* root) {
-    cJSON_AddNumberToObject(root, payload::json::BUS_FIELD_NAME,
-            message->can_message.bus);
-    cJSON_AddNumberToObject(root, payload::json::ID_FIELD_NAME,
-            message->can_message.id);
-
-    char encodedData[67];
-    const char* maxAddress = encodedData + sizeof(encodedData);
-    char* encodedDataIndex = encodedData;
-    encodedDataIndex += sprintf(encodedDataIndex, "0x");
-    for(uint8_t i = 0; i < message->can_message.data.size &&
-            encodedDataIndex < maxAddress; i++) {
-        encodedDataIndex += snprintf(encodedDataIndex,
-                maxAddress - encodedDataIndex,
-                "%02x", message->can_message.data.bytes[i]);
-    }
-    cJSON_AddStringToObject(root, payload::json::DATA_FIELD_NAME,
-            encodedData);
-
-    if(message->can_message.has_frame_format) {
-        cJSON_AddStringToObject(root, payload::json::FRAME_FORMAT_FIELD_NAME,
-                message->can_message.frame_format == openxc_CanMessage_FrameFormat_STANDARD ?
-                    payload::json::FRAME_FORMAT_STANDARD_NAME :
-                        payload::json::FRAME_FORMAT_EXTENDED_NAME);
-    }
-    return true;
-}
-
-static cJSON* serializeDynamicField(openxc_DynamicField* field) {
-    cJSON* value = NULL;
-    if(field->has_numeric_value) {
-        value = cJSON_CreateNumber(field->numeric_value);
-    } else if(field->has_boolean_value) {
-        value = cJSON_CreateBool(field->boolean_value);
-    } else if(field->has_string_value) {
-        value = cJSON_CreateString(field->string_value);
-    }
-    return value;
-}
-
-static bool serializeSimple(openxc_VehicleMessage* message, cJSON* root) {
-    const char* name = message->simple_message.name;
-    cJSON_AddStringToObject(root, payload::json::NAME_FIELD_NAME, name);
-
-    cJSON* value = NULL;
-    if(message->simple_message.has_value) {
-        value = serializeDynamicField(&message->simple_message.value);
-        if(value != NULL) {
-            cJSON_AddItemToObject(root, payload::json::VALUE_FIELD_NAME, value);
-        }
-    }
-
-    cJSON* event = NULL;
-    if(message->simple_message.has_event) {
-        event = serializeDynamicField(&message->simple_message.event);
-        if(event != NULL) {
-            cJSON_AddItemToObject(root, payload::json::EVENT_FIELD_NAME, event);
-        }
-    }
-    return true;
-}
-
 /* Private: Parse a hex string as a byte array.
  *
  * source - The hex string to parse - each byte in the string *must* be
@@ -216,90 +163,270 @@ static size_t dehexlify(const char source[], uint8_t* destination,
     return byteIndex;
 }
 
-static void deserializePassthrough(cJSON* root, openxc_ControlCommand* command) {
+/* Private: A complete, tokenized JSON object in a payload.
+ *
+ * payload - The payload the tokens point into.
+ * tokens - The tokens, in the order they appear in the payload. The first
+ *      token is the root object.
+ * tokenCount - The number of tokens.
+ */
+typedef struct {
+    const uint8_t* payload;
+    const payload::json::JsonToken* tokens;
+    int tokenCount;
+} JsonDocument;
+
+/* Private: Find the value of a member of an object, ignoring the case of the
+ * key like cJSON_GetObjectItem(...).
+ *
+ * Returns the index of the value's token, or -1 if the object has no member
+ * with that key.
+ */
+static int findMember(const JsonDocument* document, int object,
+        const char* key) {
+    if(object < 0 || document->tokens[object].type !=
+            payload::json::JSON_TOKEN_OBJECT) {
+        return -1;
+    }
+
+    size_t keyLength = strlen(key);
+    bool expectingKey = true;
+    for(int i = object + 1; i < document->tokenCount; i++) {
+        const payload::json::JsonToken* token = &document->tokens[i];
+        if(token->parent != object) {
+            continue;
+        }
+
+        if(expectingKey && token->type == payload::json::JSON_TOKEN_STRING &&
+                (size_t)(token->end - token->start) == keyLength &&
+                !strncasecmp((const char*)&document->payload[token->start],
+                        key, keyLength)) {
+            return i + 1 < document->tokenCount &&
+                    document->tokens[i + 1].parent == object ? i + 1 : -1;
+        }
+        expectingKey = !expectingKey;
+    }
+    return -1;
+}
+
+static bool isString(const JsonDocument* document, int index) {
+    return index >= 0 &&
+            document->tokens[index].type == payload::json::JSON_TOKEN_STRING;
+}
+
+static char firstCharacter(const JsonDocument* document, int index) {
+    return document->payload[document->tokens[index].start];
+}
+
+static bool isBoolean(const JsonDocument* document, int index) {
+    return index >= 0 &&
+            document->tokens[index].type == payload::json::JSON_TOKEN_PRIMITIVE &&
+            (firstCharacter(document, index) == 't' ||
+                firstCharacter(document, index) == 'f');
+}
+
+static bool isNumber(const JsonDocument* document, int index) {
+    return index >= 0 &&
+            document->tokens[index].type == payload::json::JSON_TOKEN_PRIMITIVE &&
+            (firstCharacter(document, index) == '-' ||
+                (firstCharacter(document, index) >= '0' &&
+                    firstCharacter(document, index) <= '9'));
+}
+
+static double numberValue(const JsonDocument* document, int index) {
+    if(!isNumber(document, index)) {
+        return 0;
+    }
+
+    const payload::json::JsonToken* token = &document->tokens[index];
+    char number[32] = {0};
+    memcpy(number, &document->payload[token->start],
+            MIN(sizeof(number) - 1, (size_t)(token->end - token->start)));
+    return strtod(number, NULL);
+}
+
+/* Private: Return the value of a token as an integer, the same way cJSON sets
+ * valueint - true is 1, numbers are truncated and anything else is 0.
+ */
+static int intValue(const JsonDocument* document, int index) {
+    if(isBoolean(document, index)) {
+        return firstCharacter(document, index) == 't';
+    }
+    return (int)numberValue(document, index);
+}
+
+/* Private: Copy the value of a string token, unescaping it.
+ *
+ * destination - The buffer for the NULL terminated string. If the token isn't
+ *      a string, the destination will be empty.
+ * destinationLength - The size of the buffer. Longer strings are truncated.
+ *
+ * Returns true if the token was a string.
+ */
+static bool stringValue(const JsonDocument* document, int index,
+        char* destination, size_t destinationLength) {
+    destination[0] = '\0';
+    if(!isString(document, index)) {
+        return false;
+    }
+
+    const payload::json::JsonToken* token = &document->tokens[index];
+    size_t length = 0;
+    for(int i = token->start; i < token->end &&
+            length < destinationLength - 1; i++) {
+        char character = document->payload[i];
+        if(character == '\\' && i + 1 < token->end) {
+            character = document->payload[++i];
+            switch(character) {
+                case 'b': character = '\b'; break;
+                case 'f': character = '\f'; break;
+                case 'n': character = '\n'; break;
+                case 'r': character = '\r'; break;
+                case 't': character = '\t'; break;
+                case 'u':
+                    if(i + 4 < token->end) {
+                        char codepoint[5] = {0};
+                        memcpy(codepoint, &document->payload[i + 1], 4);
+                        unsigned long value = strtoul(codepoint, NULL, 16);
+                        // Anything outside of ASCII isn't meaningful in a
+                        // command, don't bother encoding it as UTF-8
+                        character = value < 0x80 ? (char)value : '?';
+                        i += 4;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        destination[length++] = character;
+    }
+    destination[length] = '\0';
+    return true;
+}
+
+/* Private: Return true if the value of a string token starts with the prefix.
+ */
+static bool stringStartsWith(const JsonDocument* document, int index,
+        const char* prefix) {
+    char value[32];
+    return stringValue(document, index, value, sizeof(value)) &&
+            !strncmp(value, prefix, strlen(prefix));
+}
+
+/* Private: Return true if the value of a string token is the expected string.
+ */
+static bool stringEquals(const JsonDocument* document, int index,
+        const char* expected) {
+    char value[32];
+    return stringValue(document, index, value, sizeof(value)) &&
+            !strcmp(value, expected);
+}
+
+/* Private: Parse a hex string token as a byte array, see dehexlify(...).
+ */
+static size_t hexValue(const JsonDocument* document, int index,
+        uint8_t* destination, size_t destinationLength) {
+    // 2 characters per byte plus the '0x' prefix
+    char hex[2 * destinationLength + 3];
+    stringValue(document, index, hex, sizeof(hex));
+    return dehexlify(hex, destination, destinationLength);
+}
+
+static void deserializePassthrough(const JsonDocument* document,
+        openxc_ControlCommand* command) {
     command->has_type = true;
     command->type = openxc_ControlCommand_Type_PASSTHROUGH;
     command->has_passthrough_mode_request = true;
 
-    cJSON* element = cJSON_GetObjectItem(root, "bus");
-    if(element != NULL) {
+    int element = findMember(document, 0, "bus");
+    if(element >= 0) {
         command->passthrough_mode_request.has_bus = true;
-        command->passthrough_mode_request.bus = element->valueint;
+        command->passthrough_mode_request.bus = intValue(document, element);
     }
 
-    element = cJSON_GetObjectItem(root, "enabled");
-    if(element != NULL) {
+    element = findMember(document, 0, "enabled");
+    if(element >= 0) {
         command->passthrough_mode_request.has_enabled = true;
-        command->passthrough_mode_request.enabled = bool(element->valueint);
+        command->passthrough_mode_request.enabled =
+                bool(intValue(document, element));
     }
 }
 
-static void deserializePayloadFormat(cJSON* root,
+static void deserializePayloadFormat(const JsonDocument* document,
         openxc_ControlCommand* command) {
     command->has_type = true;
     command->type = openxc_ControlCommand_Type_PAYLOAD_FORMAT;
     command->has_payload_format_command = true;
 
-    cJSON* element = cJSON_GetObjectItem(root, "format");
-    if(element != NULL) {
-        if(!strcmp(element->valuestring,
+    int element = findMember(document, 0, "format");
+    if(element >= 0) {
+        if(stringEquals(document, element,
                     openxc::payload::json::PAYLOAD_FORMAT_JSON_NAME)) {
             command->payload_format_command.has_format = true;
             command->payload_format_command.format =
                     openxc_PayloadFormatCommand_PayloadFormat_JSON;
-        } else if(!strcmp(element->valuestring,
+        } else if(stringEquals(document, element,
                     openxc::payload::json::PAYLOAD_FORMAT_PROTOBUF_NAME)) {
             command->payload_format_command.has_format = true;
             command->payload_format_command.format =
                     openxc_PayloadFormatCommand_PayloadFormat_PROTOBUF;
+        } else if(stringEquals(document, element,
+                    openxc::payload::json::PAYLOAD_FORMAT_CAN_BATCH_NAME)) {
+            command->payload_format_command.has_format = true;
+            command->payload_format_command.format =
+                    openxc::payload::PAYLOAD_FORMAT_COMMAND_CAN_BATCH;
         }
     }
 }
 
-static void deserializePredefinedObd2RequestsCommand(cJSON* root,
-        openxc_ControlCommand* command) {
+static void deserializePredefinedObd2RequestsCommand(
+        const JsonDocument* document, openxc_ControlCommand* command) {
     command->has_type = true;
     command->type = openxc_ControlCommand_Type_PREDEFINED_OBD2_REQUESTS;
     command->has_predefined_obd2_requests_command = true;
 
-    cJSON* element = cJSON_GetObjectItem(root, "enabled");
-    if(element != NULL) {
+    int element = findMember(document, 0, "enabled");
+    if(element >= 0) {
         command->predefined_obd2_requests_command.has_enabled = true;
-        command->predefined_obd2_requests_command.enabled = bool(element->valueint);
+        command->predefined_obd2_requests_command.enabled =
+                bool(intValue(document, element));
     }
 }
 
-static void deserializeAfBypass(cJSON* root, openxc_ControlCommand* command) {
+static void deserializeAfBypass(const JsonDocument* document,
+        openxc_ControlCommand* command) {
     command->has_type = true;
     command->type = openxc_ControlCommand_Type_ACCEPTANCE_FILTER_BYPASS;
     command->has_acceptance_filter_bypass_command = true;
 
-    cJSON* element = cJSON_GetObjectItem(root, "bus");
-    if(element != NULL) {
+    int element = findMember(document, 0, "bus");
+    if(element >= 0) {
         command->acceptance_filter_bypass_command.has_bus = true;
-        command->acceptance_filter_bypass_command.bus = element->valueint;
+        command->acceptance_filter_bypass_command.bus =
+                intValue(document, element);
     }
 
-    element = cJSON_GetObjectItem(root, "bypass");
-    if(element != NULL) {
+    element = findMember(document, 0, "bypass");
+    if(element >= 0) {
         command->acceptance_filter_bypass_command.has_bypass = true;
         command->acceptance_filter_bypass_command.bypass =
-            bool(element->valueint);
+            bool(intValue(document, element));
     }
 }
 
-static void deserializeDiagnostic(cJSON* root, openxc_ControlCommand* command) {
+static void deserializeDiagnostic(const JsonDocument* document,
+        openxc_ControlCommand* command) {
     command->has_type = true;
     command->type = openxc_ControlCommand_Type_DIAGNOSTIC;
     command->has_diagnostic_request = true;
 
-    cJSON* action = cJSON_GetObjectItem(root, "action");
-    if(action != NULL && action->type == cJSON_String) {
+    int action = findMember(document, 0, "action");
+    if(isString(document, action)) {
         command->diagnostic_request.has_action = true;
-        if(!strcmp(action->valuestring, "add")) {
+        if(stringEquals(document, action, "add")) {
             command->diagnostic_request.action =
                     openxc_DiagnosticControlCommand_Action_ADD;
-        } else if(!strcmp(action->valuestring, "cancel")) {
+        } else if(stringEquals(document, action, "cancel")) {
             command->diagnostic_request.action =
                     openxc_DiagnosticControlCommand_Action_CANCEL;
         } else {
@@ -307,167 +434,275 @@ static void deserializeDiagnostic(cJSON* root, openxc_ControlCommand* command) {
         }
     }
 
-    cJSON* request = cJSON_GetObjectItem(root, "request");
-    if(request != NULL) {
-        cJSON* element = cJSON_GetObjectItem(request, "bus");
-        if(element != NULL) {
+    int request = findMember(document, 0, "request");
+    if(request >= 0) {
+        int element = findMember(document, request, "bus");
+        if(element >= 0) {
             command->diagnostic_request.request.has_bus = true;
-            command->diagnostic_request.request.bus = element->valueint;
+            command->diagnostic_request.request.bus =
+                    intValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(request, "mode");
-        if(element != NULL) {
+        element = findMember(document, request, "mode");
+        if(element >= 0) {
             command->diagnostic_request.request.has_mode = true;
-            command->diagnostic_request.request.mode = element->valueint;
+            command->diagnostic_request.request.mode =
+                    intValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(request, "id");
-        if(element != NULL) {
+        element = findMember(document, request, "id");
+        if(element >= 0) {
             command->diagnostic_request.request.has_message_id = true;
-            command->diagnostic_request.request.message_id = element->valueint;
+            command->diagnostic_request.request.message_id =
+                    intValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(request, "pid");
-        if(element != NULL) {
+        element = findMember(document, request, "pid");
+        if(element >= 0) {
             command->diagnostic_request.request.has_pid = true;
-            command->diagnostic_request.request.pid = element->valueint;
+            command->diagnostic_request.request.pid =
+                    intValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(request, "payload");
-        if(element != NULL) {
+        element = findMember(document, request, "payload");
+        if(element >= 0) {
             command->diagnostic_request.request.has_payload = true;
-            command->diagnostic_request.request.payload.size = dehexlify(
-                    element->valuestring,
+            command->diagnostic_request.request.payload.size = hexValue(
+                    document, element,
                     command->diagnostic_request.request.payload.bytes,
                     sizeof(((openxc_DiagnosticRequest*)0)->payload.bytes));
         }
 
-        element = cJSON_GetObjectItem(request, "multiple_responses");
-        if(element != NULL) {
+        element = findMember(document, request, "multiple_responses");
+        if(element >= 0) {
             command->diagnostic_request.request.has_multiple_responses = true;
             command->diagnostic_request.request.multiple_responses =
-                bool(element->valueint);
+                bool(intValue(document, element));
         }
 
-        element = cJSON_GetObjectItem(request, "frequency");
-        if(element != NULL) {
+        element = findMember(document, request, "frequency");
+        if(element >= 0) {
             command->diagnostic_request.request.has_frequency = true;
             command->diagnostic_request.request.frequency =
-                element->valuedouble;
+                numberValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(request, "decoded_type");
-        if(element != NULL) {
-            if(!strcmp(element->valuestring, "obd2")) {
+        element = findMember(document, request, "decoded_type");
+        if(element >= 0) {
+            if(stringEquals(document, element, "obd2")) {
                 command->diagnostic_request.request.has_decoded_type = true;
                 command->diagnostic_request.request.decoded_type =
                         openxc_DiagnosticRequest_DecodedType_OBD2;
-            } else if(!strcmp(element->valuestring, "none")) {
+            } else if(stringEquals(document, element, "none")) {
                 command->diagnostic_request.request.has_decoded_type = true;
                 command->diagnostic_request.request.decoded_type =
                         openxc_DiagnosticRequest_DecodedType_NONE;
             }
         }
 
-        element = cJSON_GetObjectItem(request, "name");
-        if(element != NULL && element->type == cJSON_String) {
+        element = findMember(document, request, "name");
+        if(isString(document, element)) {
             command->diagnostic_request.request.has_name = true;
-            strcpy(command->diagnostic_request.request.name,
-                    element->valuestring);
+            stringValue(document, element,
+                    command->diagnostic_request.request.name,
+                    sizeof(command->diagnostic_request.request.name));
+        }
+    }
+}
+
+/* Private: Return the index of the next value in an array after the given
+ * index, or -1 if there are no more. Pass the index of the array itself to get
+ * the first value.
+ */
+static int nextElement(const JsonDocument* document, int array, int previous) {
+    for(int i = previous + 1; i < document->tokenCount; i++) {
+        if(document->tokens[i].parent == array) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Private: Return the MessageClass mask bit for a message class name, or 0 if
+ * it's not recognized.
+ */
+static uint8_t messageClassMask(const JsonDocument* document, int index) {
+    if(stringEquals(document, index, "simple")) {
+        return MESSAGE_CLASS_MASK(openxc::pipeline::MessageClass::SIMPLE);
+    } else if(stringEquals(document, index, "can")) {
+        return MESSAGE_CLASS_MASK(openxc::pipeline::MessageClass::CAN);
+    } else if(stringEquals(document, index, "diagnostic")) {
+        return MESSAGE_CLASS_MASK(openxc::pipeline::MessageClass::DIAGNOSTIC);
+    } else if(stringEquals(document, index, "log")) {
+        return MESSAGE_CLASS_MASK(openxc::pipeline::MessageClass::LOG);
+    } else if(stringEquals(document, index, "command_response")) {
+        return MESSAGE_CLASS_MASK(
+                openxc::pipeline::MessageClass::COMMAND_RESPONSE);
+    }
+    return 0;
+}
+
+/* Private: Deserialize a subscription command, e.g.:
+ *
+ *  {"command": "subscribe", "classes": ["simple", "command_response"],
+ *      "signals": ["vehicle_speed", {"name": "engine_speed", "frequency": 2}],
+ *      "can_id_range": {"min": 512, "max": 1023}}
+ *
+ * Every field is optional - a command without any subscribes to everything.
+ */
+static void deserializeSubscription(const JsonDocument* document,
+        openxc_ControlCommand* command,
+        payload::json::SubscriptionCommand* subscription) {
+    command->has_type = true;
+    command->type = payload::CONTROL_COMMAND_SUBSCRIBE;
+    if(subscription == NULL) {
+        return;
+    }
+
+    int classes = findMember(document, 0, "classes");
+    if(classes >= 0 &&
+            document->tokens[classes].type == payload::json::JSON_TOKEN_ARRAY) {
+        for(int element = nextElement(document, classes, classes);
+                element >= 0;
+                element = nextElement(document, classes, element)) {
+            uint8_t mask = messageClassMask(document, element);
+            if(mask == 0) {
+                char name[32];
+                stringValue(document, element, name, sizeof(name));
+                debug("Unrecognized message class: %s", name);
+            }
+            subscription->messageClasses |= mask;
+        }
+    }
+
+    int signals = findMember(document, 0, "signals");
+    if(signals >= 0 &&
+            document->tokens[signals].type == payload::json::JSON_TOKEN_ARRAY) {
+        for(int element = nextElement(document, signals, signals);
+                element >= 0 &&
+                    subscription->signalCount < MAX_SUBSCRIPTION_SIGNAL_COUNT;
+                element = nextElement(document, signals, element)) {
+            payload::json::SignalSubscription* signal =
+                    &subscription->signals[subscription->signalCount];
+            int name = element;
+            signal->frequency = 0;
+            if(document->tokens[element].type ==
+                    payload::json::JSON_TOKEN_OBJECT) {
+                name = findMember(document, element, "name");
+                int frequency = findMember(document, element, "frequency");
+                if(frequency >= 0) {
+                    signal->frequency = numberValue(document, frequency);
+                }
+            }
+
+            if(stringValue(document, name, signal->name,
+                        sizeof(signal->name))) {
+                ++subscription->signalCount;
+            }
+        }
+    }
+
+    int range = findMember(document, 0, "can_id_range");
+    if(range >= 0) {
+        int minimum = findMember(document, range, "min");
+        int maximum = findMember(document, range, "max");
+        if(isNumber(document, minimum) && isNumber(document, maximum)) {
+            subscription->hasCanIdRange = true;
+            subscription->minimumCanId = numberValue(document, minimum);
+            subscription->maximumCanId = numberValue(document, maximum);
         }
     }
 }
 
-static bool deserializeDynamicField(cJSON* element,
+static bool deserializeDynamicField(const JsonDocument* document, int element,
         openxc_DynamicField* field) {
     bool status = true;
     field->has_type = true;
-    switch(element->type) {
-        case cJSON_String:
-            field->type = openxc_DynamicField_Type_STRING;
-            field->has_string_value = true;
-            strcpy(field->string_value, element->valuestring);
-            break;
-        case cJSON_False:
-        case cJSON_True:
-            field->type = openxc_DynamicField_Type_BOOL;
-            field->has_boolean_value = true;
-            field->boolean_value = bool(element->valueint);
-            break;
-        case cJSON_Number:
-            field->type = openxc_DynamicField_Type_NUM;
-            field->has_numeric_value = true;
-            field->numeric_value = element->valuedouble;
-            break;
-        default:
-            debug("Unsupported type in value field: %d", element->type);
-            field->has_type = false;
-            status = false;
-            break;
+    if(isString(document, element)) {
+        field->type = openxc_DynamicField_Type_STRING;
+        field->has_string_value = true;
+        stringValue(document, element, field->string_value,
+                sizeof(field->string_value));
+    } else if(isBoolean(document, element)) {
+        field->type = openxc_DynamicField_Type_BOOL;
+        field->has_boolean_value = true;
+        field->boolean_value = bool(intValue(document, element));
+    } else if(isNumber(document, element)) {
+        field->type = openxc_DynamicField_Type_NUM;
+        field->has_numeric_value = true;
+        field->numeric_value = numberValue(document, element);
+    } else {
+        debug("Unsupported type in value field: %d",
+                document->tokens[element].type);
+        field->has_type = false;
+        status = false;
     }
     return status;
 }
 
-static void deserializeSimple(cJSON* root, openxc_VehicleMessage* message) {
+static void deserializeSimple(const JsonDocument* document,
+        openxc_VehicleMessage* message) {
     message->has_type = true;
     message->type = openxc_VehicleMessage_Type_SIMPLE;
     message->has_simple_message = true;
     openxc_SimpleMessage* simpleMessage = &message->simple_message;
 
-    cJSON* element = cJSON_GetObjectItem(root, "name");
-    if(element != NULL && element->type == cJSON_String) {
+    int element = findMember(document, 0, "name");
+    if(isString(document, element)) {
         simpleMessage->has_name = true;
-        strcpy(simpleMessage->name, element->valuestring);
+        stringValue(document, element, simpleMessage->name,
+                sizeof(simpleMessage->name));
     }
 
-    element = cJSON_GetObjectItem(root, "value");
-    if(element != NULL) {
-        if(deserializeDynamicField(element, &simpleMessage->value)) {
+    element = findMember(document, 0, "value");
+    if(element >= 0) {
+        if(deserializeDynamicField(document, element, &simpleMessage->value)) {
             simpleMessage->has_value = true;
         }
     }
 
-    element = cJSON_GetObjectItem(root, "event");
-    if(element != NULL) {
-        if(deserializeDynamicField(element, &simpleMessage->event)) {
+    element = findMember(document, 0, "event");
+    if(element >= 0) {
+        if(deserializeDynamicField(document, element, &simpleMessage->event)) {
             simpleMessage->has_event = true;
         }
     }
 }
 
-static void deserializeCan(cJSON* root, openxc_VehicleMessage* message) {
+static void deserializeCan(const JsonDocument* document,
+        openxc_VehicleMessage* message) {
     message->has_type = true;
     message->type = openxc_VehicleMessage_Type_CAN;
     message->has_can_message = true;
     openxc_CanMessage* canMessage = &message->can_message;
 
-    cJSON* element = cJSON_GetObjectItem(root, "id");
-    if(element != NULL) {
+    int element = findMember(document, 0, "id");
+    if(element >= 0) {
         canMessage->has_id = true;
-        canMessage->id = element->valueint;
+        canMessage->id = intValue(document, element);
 
-        element = cJSON_GetObjectItem(root, "data");
-        if(element != NULL) {
+        element = findMember(document, 0, "data");
+        if(element >= 0) {
             canMessage->has_data = true;
-            canMessage->data.size = dehexlify(
-                    element->valuestring,
+            canMessage->data.size = hexValue(document, element,
                     canMessage->data.bytes,
                     sizeof(((openxc_CanMessage*)0)->data.bytes));
         }
 
-        element = cJSON_GetObjectItem(root, "bus");
-        if(element != NULL) {
+        element = findMember(document, 0, "bus");
+        if(element >= 0) {
             canMessage->has_bus = true;
-            canMessage->bus = element->valueint;
+            canMessage->bus = intValue(document, element);
         }
 
-        element = cJSON_GetObjectItem(root, payload::json::FRAME_FORMAT_FIELD_NAME);
-        if(element != NULL) {
+        element = findMember(document, 0,
+                payload::json::FRAME_FORMAT_FIELD_NAME);
+        if(element >= 0) {
             canMessage->has_frame_format = true;
-            if(!strcmp(element->valuestring,
+            if(stringEquals(document, element,
                         payload::json::FRAME_FORMAT_STANDARD_NAME)) {
                 canMessage->frame_format = openxc_CanMessage_FrameFormat_STANDARD;
-            } else if(!strcmp(element->valuestring,
+            } else if(stringEquals(document, element,
                         payload::json::FRAME_FORMAT_EXTENDED_NAME)) {
                 canMessage->frame_format = openxc_CanMessage_FrameFormat_EXTENDED;
             } else {
@@ -479,97 +714,464 @@ static void deserializeCan(cJSON* root, openxc_VehicleMessage* message) {
     }
 }
 
-size_t openxc::payload::json::deserialize(uint8_t payload[], size_t length,
-        openxc_VehicleMessage* message) {
-    const char* delimiter = strnchr((const char*)payload, length - 1, '\0');
-    size_t messageLength = 0;
-    if(delimiter != NULL) {
-        messageLength = (size_t)(delimiter - (const char*)payload) + 1;
-        uint8_t messageBuffer[messageLength];
-        if(messageLength > 0) {
-            memcpy(messageBuffer, payload, messageLength);
-        }
-        // There may be junk data at the start of the payload - seek ahead to the
-        // start of the message.
-        char* jsonStart = strchr((char*)messageBuffer, '{');
-        if(jsonStart == NULL) {
-            debug("%s", "No JSON object start found");
-            // Return message length so this bogus front matter is erased
-            return messageLength;
+static void deserializeDocument(const JsonDocument* document,
+        openxc_VehicleMessage* message,
+        payload::json::SubscriptionCommand* subscription) {
+    message->has_type = true;
+    int commandName = findMember(document, 0, "command");
+    if(commandName >= 0) {
+        message->has_type = true;
+        message->type = openxc_VehicleMessage_Type_CONTROL_COMMAND;
+        message->has_control_command = true;
+        openxc_ControlCommand* command = &message->control_command;
+
+        if(stringStartsWith(document, commandName,
+                    payload::json::VERSION_COMMAND_NAME)) {
+            command->has_type = true;
+            command->type = openxc_ControlCommand_Type_VERSION;
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::DEVICE_ID_COMMAND_NAME)) {
+            command->has_type = true;
+            command->type = openxc_ControlCommand_Type_DEVICE_ID;
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::DIAGNOSTIC_COMMAND_NAME)) {
+            deserializeDiagnostic(document, command);
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::PASSTHROUGH_COMMAND_NAME)) {
+            deserializePassthrough(document, command);
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::PREDEFINED_OBD2_REQUESTS_COMMAND_NAME)) {
+            deserializePredefinedObd2RequestsCommand(document, command);
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::ACCEPTANCE_FILTER_BYPASS_COMMAND_NAME)) {
+            deserializeAfBypass(document, command);
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::PAYLOAD_FORMAT_COMMAND_NAME)) {
+            deserializePayloadFormat(document, command);
+        } else if(stringStartsWith(document, commandName,
+                    payload::json::SUBSCRIBE_COMMAND_NAME)) {
+            deserializeSubscription(document, command, subscription);
+        } else {
+            char name[32];
+            stringValue(document, commandName, name, sizeof(name));
+            debug("Unrecognized command: %s", name);
+            message->has_control_command = false;
         }
+    } else if(findMember(document, 0, "name") < 0) {
+        deserializeCan(document, message);
+    } else {
+        deserializeSimple(document, message);
+    }
+}
 
-        cJSON *root = cJSON_Parse(jsonStart);
-        if(root == NULL) {
-            debug("No JSON found in %u byte payload", length);
-            // TODO should this return messageLength to eat up corrupt data, or
-            // does it need to be 0 so we preserve partial messages?
-            return 0;
+void openxc::payload::json::resetStream(StreamState* state) {
+    state->position = 0;
+    state->tokenCount = 0;
+    state->container = -1;
+    state->discarding = false;
+}
+
+/* Private: Add a token for the value starting at the current position, as a
+ * child of the currently open container.
+ *
+ * Returns the index of the new token, or -1 if there are too many.
+ */
+static int addToken(payload::json::StreamState* state,
+        payload::json::JsonTokenType type, size_t start, size_t end) {
+    if(state->tokenCount >= JSON_MAX_TOKENS) {
+        debug("Incoming JSON has more than %d values", JSON_MAX_TOKENS);
+        return -1;
+    }
+
+    payload::json::JsonToken* token = &state->tokens[state->tokenCount];
+    token->type = type;
+    // The first token is the message itself, whatever a zeroed state says the
+    // open container is
+    token->parent = state->tokenCount > 0 ? state->container : -1;
+    token->start = start;
+    token->end = end;
+    return state->tokenCount++;
+}
+
+/* Private: Continue tokenizing a payload from where the last call left off.
+ *
+ * The first '{' starts the message and anything before it is skipped. Once
+ * the object is closed, the message ends at the next NULL delimiter.
+ *
+ * Returns the number of bytes up to and including the delimiter once the
+ * message or any junk in front of it ends, or 0 if more data is needed. If the
+ * message was invalid, the state's tokenCount is 0.
+ */
+static size_t tokenize(const uint8_t payload[], size_t length,
+        payload::json::StreamState* state) {
+    while(state->position < length) {
+        size_t position = state->position;
+        char character = payload[position];
+        if(character == '\0') {
+            if(state->discarding) {
+                debug("Invalid JSON in incoming message");
+                state->tokenCount = 0;
+            } else if(state->tokenCount > 0 && state->container >= 0) {
+                // Whatever follows the delimiter is a new message, so this
+                // one is never going to be finished - drop it
+                debug("Incoming JSON message was delimited before it ended");
+                state->tokenCount = 0;
+                state->discarding = true;
+            }
+            return position + 1;
         }
 
-        message->has_type = true;
-        cJSON* commandNameObject = cJSON_GetObjectItem(root, "command");
-        if(commandNameObject != NULL) {
-            message->has_type = true;
-            message->type = openxc_VehicleMessage_Type_CONTROL_COMMAND;
-            message->has_control_command = true;
-            openxc_ControlCommand* command = &message->control_command;
-
-            if(!strncmp(commandNameObject->valuestring, VERSION_COMMAND_NAME,
-                        strlen(VERSION_COMMAND_NAME))) {
-                command->has_type = true;
-                command->type = openxc_ControlCommand_Type_VERSION;
-            } else if(!strncmp(commandNameObject->valuestring,
-                        DEVICE_ID_COMMAND_NAME, strlen(DEVICE_ID_COMMAND_NAME))) {
-                command->has_type = true;
-                command->type = openxc_ControlCommand_Type_DEVICE_ID;
-            } else if(!strncmp(commandNameObject->valuestring,
-                        DIAGNOSTIC_COMMAND_NAME, strlen(DIAGNOSTIC_COMMAND_NAME))) {
-                deserializeDiagnostic(root, command);
-            } else if(!strncmp(commandNameObject->valuestring,
-                        PASSTHROUGH_COMMAND_NAME, strlen(PASSTHROUGH_COMMAND_NAME))) {
-                deserializePassthrough(root, command);
-            } else if(!strncmp(commandNameObject->valuestring,
-                        PREDEFINED_OBD2_REQUESTS_COMMAND_NAME,
-                            strlen(PREDEFINED_OBD2_REQUESTS_COMMAND_NAME))) {
-                deserializePredefinedObd2RequestsCommand(root, command);
-            } else if(!strncmp(commandNameObject->valuestring,
-                        ACCEPTANCE_FILTER_BYPASS_COMMAND_NAME,
-                        strlen(ACCEPTANCE_FILTER_BYPASS_COMMAND_NAME))) {
-                deserializeAfBypass(root, command);
-            } else if(!strncmp(commandNameObject->valuestring,
-                        PAYLOAD_FORMAT_COMMAND_NAME,
-                        strlen(PAYLOAD_FORMAT_COMMAND_NAME))) {
-                deserializePayloadFormat(root, command);
-            } else {
-                debug("Unrecognized command: %s", commandNameObject->valuestring);
-                message->has_control_command = false;
+        if(state->discarding || (state->tokenCount > 0 &&
+                    state->container < 0)) {
+            // Skipping a bad message, or anything between the end of the
+            // object and the delimiter
+            ++state->position;
+            continue;
+        }
+
+        if(state->tokenCount == 0 && character != '{') {
+            // Junk in front of the message
+            ++state->position;
+            continue;
+        }
+
+        switch(character) {
+            case '{':
+            case '[': {
+                int token = addToken(state, character == '{' ?
+                        payload::json::JSON_TOKEN_OBJECT :
+                        payload::json::JSON_TOKEN_ARRAY, position, 0);
+                if(token < 0) {
+                    state->discarding = true;
+                } else {
+                    state->container = token;
+                }
+                ++state->position;
+                break;
             }
-        } else {
-            cJSON* nameObject = cJSON_GetObjectItem(root, "name");
-            if(nameObject == NULL) {
-                deserializeCan(root, message);
-            } else {
-                deserializeSimple(root, message);
+            case '}':
+            case ']': {
+                payload::json::JsonToken* container =
+                        &state->tokens[state->container];
+                if(container->type != (character == '}' ?
+                            payload::json::JSON_TOKEN_OBJECT :
+                            payload::json::JSON_TOKEN_ARRAY)) {
+                    state->discarding = true;
+                } else {
+                    container->end = position + 1;
+                    state->container = container->parent;
+                }
+                ++state->position;
+                break;
+            }
+            case '"': {
+                size_t end = position + 1;
+                for(; end < length && payload[end] != '"' &&
+                        payload[end] != '\0'; end++) {
+                    if(payload[end] == '\\') {
+                        ++end;
+                    }
+                }
+
+                if(end >= length) {
+                    // Wait for the rest of the string, and scan it again
+                    return 0;
+                }
+
+                if(payload[end] == '\0' || addToken(state,
+                            payload::json::JSON_TOKEN_STRING, position + 1,
+                            end) < 0) {
+                    state->discarding = true;
+                    state->position = end;
+                } else {
+                    state->position = end + 1;
+                }
+                break;
+            }
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ':':
+            case ',':
+                ++state->position;
+                break;
+            default: {
+                size_t end = position;
+                for(; end < length && !strchr(" \t\r\n,:]}", payload[end]) &&
+                        payload[end] != '\0'; end++);
+
+                if(end >= length) {
+                    return 0;
+                }
+
+                if(addToken(state, payload::json::JSON_TOKEN_PRIMITIVE,
+                            position, end) < 0) {
+                    state->discarding = true;
+                }
+                state->position = end;
+                break;
             }
         }
-        cJSON_Delete(root);
     }
+    return 0;
+}
+
+size_t openxc::payload::json::deserialize(uint8_t payload[], size_t length,
+        openxc_VehicleMessage* message) {
+    StreamState state;
+    resetStream(&state);
+    return deserialize(payload, length, message, &state);
+}
 
+size_t openxc::payload::json::deserialize(uint8_t payload[], size_t length,
+        openxc_VehicleMessage* message, StreamState* state,
+        SubscriptionCommand* subscription) {
+    // Tokens store 16-bit offsets
+    length = MIN(length, UINT16_MAX);
+
+    size_t messageLength = tokenize(payload, length, state);
+    if(messageLength > 0) {
+        if(state->tokenCount > 0) {
+            JsonDocument document = {payload, state->tokens,
+                    state->tokenCount};
+            deserializeDocument(&document, message, subscription);
+        } else if(!state->discarding) {
+            debug("%s", "No JSON object start found");
+        }
+        resetStream(state);
+    }
     return messageLength;
 }
 
+/* Private: An output buffer for writing JSON directly, without building a cJSON
+ * tree first.
+ *
+ * buffer - The destination buffer.
+ * length - The length of the buffer. Writes past the end are dropped.
+ * position - The number of bytes written so far, including any that didn't
+ *      fit.
+ */
+typedef struct {
+    uint8_t* buffer;
+    size_t length;
+    size_t position;
+} JsonWriter;
+
+static void writeBytes(JsonWriter* writer, const char* bytes, size_t count) {
+    if(writer->position < writer->length) {
+        memcpy(&writer->buffer[writer->position], bytes,
+                MIN(count, writer->length - writer->position));
+    }
+    writer->position += count;
+}
+
+static void writeString(JsonWriter* writer, const char* string) {
+    writeBytes(writer, string, strlen(string));
+}
+
+/* Private: Write a quoted string, escaped exactly as cJSON does it.
+ */
+static void writeQuotedString(JsonWriter* writer, const char* string) {
+    writeBytes(writer, "\"", 1);
+    const char* start = string;
+    for(const char* c = string; *c != '\0'; c++) {
+        if((unsigned char)*c > 31 && *c != '\"' && *c != '\\') {
+            continue;
+        }
+
+        writeBytes(writer, start, c - start);
+        start = c + 1;
+        char escaped[7];
+        switch(*c) {
+            case '\\': strcpy(escaped, "\\\\"); break;
+            case '\"': strcpy(escaped, "\\\""); break;
+            case '\b': strcpy(escaped, "\\b"); break;
+            case '\f': strcpy(escaped, "\\f"); break;
+            case '\n': strcpy(escaped, "\\n"); break;
+            case '\r': strcpy(escaped, "\\r"); break;
+            case '\t': strcpy(escaped, "\\t"); break;
+            default:
+                snprintf(escaped, sizeof(escaped), "\\u%04x",
+                        (unsigned char)*c);
+                break;
+        }
+        writeString(writer, escaped);
+    }
+    writeString(writer, start);
+    writeBytes(writer, "\"", 1);
+}
+
+/* Private: Write an unsigned integer without going through printf.
+ */
+static void writeUnsigned(JsonWriter* writer, unsigned long value,
+        int minimumDigits) {
+    char digits[12];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0 || count < minimumDigits);
+    writeBytes(writer, &digits[sizeof(digits) - count], count);
+}
+
+/* Private: Write a number exactly as cJSON prints it - as an integer if it is
+ * one, otherwise with printf's "%f" (or "%.0f"/"%e" for very large or small
+ * values).
+ *
+ * Signal values are floats, and with a float's 24 bits of precision the
+ * fraction times 10^6 is exact in a double. So the common "%f" case can be
+ * done with integer math, rounding half to even like printf. Anything else
+ * falls back to snprintf.
+ */
+static void writeNumber(JsonWriter* writer, double value) {
+    if(value <= INT_MAX && value >= INT_MIN &&
+            fabs((double)(int)value - value) <= DBL_EPSILON) {
+        int integer = (int)value;
+        if(integer < 0) {
+            writeBytes(writer, "-", 1);
+        }
+        writeUnsigned(writer, integer < 0 ? -(unsigned long)integer : integer,
+                1);
+        return;
+    }
+
+    double magnitude = fabs(value);
+    if(fabs(floor(value) - value) <= DBL_EPSILON && magnitude < 1.0e60) {
+        char formatted[64];
+        snprintf(formatted, sizeof(formatted), "%.0f", value);
+        writeString(writer, formatted);
+    } else if(magnitude < 1.0e-6 || magnitude > 1.0e9) {
+        char formatted[64];
+        snprintf(formatted, sizeof(formatted), "%e", value);
+        writeString(writer, formatted);
+    } else if(value != (double)(float)value) {
+        char formatted[64];
+        snprintf(formatted, sizeof(formatted), "%f", value);
+        writeString(writer, formatted);
+    } else {
+        double integerPart = floor(magnitude);
+        unsigned long integer = (unsigned long)integerPart;
+        unsigned long fraction = (unsigned long)rint(
+                (magnitude - integerPart) * 1000000);
+        if(fraction >= 1000000) {
+            ++integer;
+            fraction -= 1000000;
+        }
+
+        if(value < 0) {
+            writeBytes(writer, "-", 1);
+        }
+        writeUnsigned(writer, integer, 1);
+        writeBytes(writer, ".", 1);
+        writeUnsigned(writer, fraction, 6);
+    }
+}
+
+static void writeDynamicField(JsonWriter* writer, const char* fieldName,
+        openxc_DynamicField* field) {
+    if(!field->has_numeric_value && !field->has_boolean_value &&
+            !field->has_string_value) {
+        return;
+    }
+
+    writeBytes(writer, ",", 1);
+    writeQuotedString(writer, fieldName);
+    writeBytes(writer, ":", 1);
+    if(field->has_numeric_value) {
+        writeNumber(writer, field->numeric_value);
+    } else if(field->has_boolean_value) {
+        writeString(writer, field->boolean_value ? "true" : "false");
+    } else {
+        writeQuotedString(writer, field->string_value);
+    }
+}
+
+/* Private: Write a simple vehicle message directly, in the same compact form
+ * cJSON_PrintUnformatted produces for the other types. The object is left open
+ * for any more fields.
+ */
+static void writeSimple(JsonWriter* writer, openxc_VehicleMessage* message) {
+    writeString(writer, "{\"name\":");
+    writeQuotedString(writer, message->simple_message.name);
+    if(message->simple_message.has_value) {
+        writeDynamicField(writer, payload::json::VALUE_FIELD_NAME,
+                &message->simple_message.value);
+    }
+
+    if(message->simple_message.has_event) {
+        writeDynamicField(writer, payload::json::EVENT_FIELD_NAME,
+                &message->simple_message.event);
+    }
+}
+
+/* Private: Write a raw CAN message directly, in the same compact form
+ * cJSON_PrintUnformatted produces for the other types. The object is left open
+ * for any more fields.
+ */
+static void writeCan(JsonWriter* writer, openxc_VehicleMessage* message) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    writeString(writer, "{\"bus\":");
+    writeNumber(writer, message->can_message.bus);
+    writeString(writer, ",\"id\":");
+    writeNumber(writer, message->can_message.id);
+    writeString(writer, ",\"data\":\"0x");
+    for(uint8_t i = 0; i < message->can_message.data.size; i++) {
+        char byte[2] = {
+            HEX_DIGITS[message->can_message.data.bytes[i] >> 4],
+            HEX_DIGITS[message->can_message.data.bytes[i] & 0xf]
+        };
+        writeBytes(writer, byte, sizeof(byte));
+    }
+    writeBytes(writer, "\"", 1);
+
+    if(message->can_message.has_frame_format) {
+        writeString(writer, ",\"frame_format\":");
+        writeQuotedString(writer, message->can_message.frame_format ==
+                openxc_CanMessage_FrameFormat_STANDARD ?
+                    payload::json::FRAME_FORMAT_STANDARD_NAME :
+                    payload::json::FRAME_FORMAT_EXTENDED_NAME);
+    }
+}
+
 int openxc::payload::json::serialize(openxc_VehicleMessage* message,
-        uint8_t payload[], size_t length) {
+        uint8_t payload[], size_t length, const uint32_t* timestamp,
+        const int* frame) {
+    // Simple and CAN messages are by far the most common, and always have the
+    // same shape - write them straight to the payload instead of allocating a
+    // cJSON tree for each one.
+    if(message->type == openxc_VehicleMessage_Type_SIMPLE ||
+            message->type == openxc_VehicleMessage_Type_CAN) {
+        JsonWriter writer = {payload, length, 0};
+        if(message->type == openxc_VehicleMessage_Type_SIMPLE) {
+            writeSimple(&writer, message);
+        } else {
+            writeCan(&writer, message);
+        }
+
+        if(timestamp != NULL) {
+            writeBytes(&writer, ",\"", 2);
+            writeString(&writer, payload::json::TIMESTAMP_FIELD_NAME);
+            writeBytes(&writer, "\":", 2);
+            writeUnsigned(&writer, *timestamp, 1);
+        }
+        writeBytes(&writer, "}", 1);
+        // Include the NULL character as a delimiter
+        writeBytes(&writer, "", 1);
+        return MIN(length, writer.position);
+    }
+
     cJSON* root = cJSON_CreateObject();
     size_t finalLength = 0;
     if(root != NULL) {
         bool status = true;
-        if(message->type == openxc_VehicleMessage_Type_SIMPLE) {
-            status = serializeSimple(message, root);
-        } else if(message->type == openxc_VehicleMessage_Type_CAN) {
-            status = serializeCan(message, root);
-        } else if(message->type == openxc_VehicleMessage_Type_DIAGNOSTIC) {
+        if(message->type == openxc_VehicleMessage_Type_DIAGNOSTIC) {
             status = serializeDiagnostic(message, root);
+            if(frame != NULL) {
+                cJSON_AddNumberToObject(root,
+                        payload::json::DIAGNOSTIC_FRAME_FIELD_NAME, *frame);
+            }
         } else if(message->type == openxc_VehicleMessage_Type_COMMAND_RESPONSE) {
             status = serializeCommandResponse(message, root);
         } else {
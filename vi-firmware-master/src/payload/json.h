@@ -3,6 +3,21 @@
 
 #include "openxc.pb.h"
 
+#include <stdint.h>
+#include <stddef.h>
+
+// The most keys and values an incoming JSON message can have.
+#define JSON_MAX_TOKENS 48
+
+/* Public: The signal names in a subscription command are truncated to this
+ * length, including the NULL terminator.
+ */
+#define MAX_SUBSCRIPTION_SIGNAL_NAME_LENGTH 48
+
+/* Public: The most signals that can be named in a subscription command.
+ */
+#define MAX_SUBSCRIPTION_SIGNAL_COUNT 8
+
 namespace openxc {
 namespace payload {
 namespace json {
@@ -14,9 +29,11 @@ extern const char PASSTHROUGH_COMMAND_NAME[];
 extern const char ACCEPTANCE_FILTER_BYPASS_COMMAND_NAME[];
 extern const char PAYLOAD_FORMAT_COMMAND_NAME[];
 extern const char PREDEFINED_OBD2_REQUESTS_COMMAND_NAME[];
+extern const char SUBSCRIBE_COMMAND_NAME[];
 
 extern const char PAYLOAD_FORMAT_JSON_NAME[];
 extern const char PAYLOAD_FORMAT_PROTOBUF_NAME[];
+extern const char PAYLOAD_FORMAT_CAN_BATCH_NAME[];
 
 extern const char COMMAND_RESPONSE_FIELD_NAME[];
 extern const char COMMAND_RESPONSE_MESSAGE_FIELD_NAME[];
@@ -29,6 +46,7 @@ extern const char NAME_FIELD_NAME[];
 extern const char VALUE_FIELD_NAME[];
 extern const char EVENT_FIELD_NAME[];
 extern const char FRAME_FORMAT_FIELD_NAME[];
+extern const char TIMESTAMP_FIELD_NAME[];
 
 extern const char FRAME_FORMAT_STANDARD_NAME[];
 extern const char FRAME_FORMAT_EXTENDED_NAME[];
@@ -39,28 +57,143 @@ extern const char DIAGNOSTIC_SUCCESS_FIELD_NAME[];
 extern const char DIAGNOSTIC_NRC_FIELD_NAME[];
 extern const char DIAGNOSTIC_PAYLOAD_FIELD_NAME[];
 extern const char DIAGNOSTIC_VALUE_FIELD_NAME[];
+extern const char DIAGNOSTIC_FRAME_FIELD_NAME[];
+
+/* Public: A signal named in a subscription command.
+ *
+ * name - The name of the signal.
+ * frequency - The most messages per second the host wants for the signal, or
+ *      0 for all of them.
+ */
+typedef struct {
+    char name[MAX_SUBSCRIPTION_SIGNAL_NAME_LENGTH];
+    float frequency;
+} SignalSubscription;
+
+/* Public: The parameters of a subscription command, which narrows down the
+ * messages sent out of the interface the command arrived on. The protobuf
+ * ControlCommand has no fields for them yet, so they're deserialized from JSON
+ * next to the message instead of in it.
+ *
+ * messageClasses - The openxc::pipeline::MessageClasses the host wants, a mask
+ *      of MESSAGE_CLASS_MASK(...) bits, or 0 for all of them.
+ * hasCanIdRange - True if the host only wants CAN messages and diagnostic
+ *      responses with an ID from minimumCanId to maximumCanId.
+ * signalCount - The number of signals, or 0 for all signals.
+ * signals - The signals the host wants.
+ */
+typedef struct {
+    uint8_t messageClasses;
+    bool hasCanIdRange;
+    uint32_t minimumCanId;
+    uint32_t maximumCanId;
+    int signalCount;
+    SignalSubscription signals[MAX_SUBSCRIPTION_SIGNAL_COUNT];
+} SubscriptionCommand;
+
+typedef enum {
+    JSON_TOKEN_OBJECT,
+    JSON_TOKEN_ARRAY,
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_PRIMITIVE
+} JsonTokenType;
+
+/* Public: The location of a JSON value in a payload.
+ *
+ * type - The type of the value, one of JsonTokenType. Numbers, booleans and
+ *      null are all primitives.
+ * parent - The index of the object or array containing this value, or -1 for
+ *      the root object.
+ * start - The offset of the first character of the value in the payload, not
+ *      including the opening quote of a string.
+ * end - The offset just past the last character of the value, not including
+ *      the closing quote of a string.
+ */
+typedef struct {
+    uint8_t type;
+    int8_t parent;
+    uint16_t start;
+    uint16_t end;
+} JsonToken;
+
+/* Public: The progress of tokenizing a JSON message that is still arriving,
+ * kept between calls to deserialize(...) so each byte is only tokenized once
+ * no matter how many pieces the message arrives in.
+ *
+ * The state is only valid while the payload passed in keeps the same bytes at
+ * the front and only grows - whoever owns the payload must call
+ * resetStream(...) when any of it is removed or thrown away. A zeroed state is
+ * ready to use.
+ *
+ * position - The offset of the next byte to tokenize.
+ * tokenCount - The number of tokens found so far.
+ * container - The index of the innermost object or array that's still open,
+ *      or -1.
+ * discarding - True if the message is invalid, and everything up to the next
+ *      delimiter is being skipped.
+ * tokens - The tokens found so far.
+ */
+typedef struct {
+    size_t position;
+    int tokenCount;
+    int container;
+    bool discarding;
+    JsonToken tokens[JSON_MAX_TOKENS];
+} StreamState;
 
 /* Public: Deserialize an OpenXC message from a payload containing JSON.
+ *
+ * The JSON is tokenized in place without allocating any memory.
  *
  * payload - The bytestream payload to parse a message from.
  * length -  The length of the payload.
  * message - An output parameter, the object to store the deserialized message.
  *
  * Returns the number of bytes parsed as JSON object from the payload, if any
- * was found.
+ * was found. Junk in front of a message and invalid messages are also
+ * consumed, but don't set any fields in the message.
  */
 size_t deserialize(uint8_t payload[], size_t length, openxc_VehicleMessage* message);
 
+/* Public: Deserialize an OpenXC message from a payload containing JSON that
+ * may only be partially received, resuming from where the last call with
+ * the same state left off.
+ *
+ * state - The tokenizer state for this stream of payloads.
+ * subscription - (optional) An output parameter for the parameters of a
+ *      subscription command.
+ *
+ * See deserialize(uint8_t[], size_t, openxc_VehicleMessage*) for the other
+ * arguments and return value.
+ */
+size_t deserialize(uint8_t payload[], size_t length,
+        openxc_VehicleMessage* message, StreamState* state,
+        SubscriptionCommand* subscription=NULL);
+
+/* Public: Throw away the progress of tokenizing a message, so the next call to
+ * deserialize(...) with this state starts at the beginning of the payload.
+ *
+ * deserialize(...) already does this once it returns a message, so it's only
+ * needed when the payload is changed some other way.
+ */
+void resetStream(StreamState* state);
+
 /* Public: Serialize an OpenXC message as JSON and store in the payload.
  *
  * message - The message to serialize.
  * payload - The buffer to store the payload - must be allocated by the caller.
  * length -  The length of the payload buffer.
+ * timestamp - (optional) When the CAN message behind a simple or CAN message
+ *      was received, in microseconds. It's added as a "timestamp_us" field.
+ * frame - (optional) For one chunk of a diagnostic response too long for a
+ *      single message, the index of the chunk, or -1 for the last one. It's
+ *      added as a "frame" field.
  *
  * Returns the number of bytes written to the payload. If the length is 0, an
  * error occurred while serializing.
  */
-int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length);
+int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length,
+        const uint32_t* timestamp=NULL, const int* frame=NULL);
 
 } // namespace json
 } // namespace payload
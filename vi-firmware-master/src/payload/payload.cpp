@@ -1,6 +1,7 @@
 #include "payload.h"
 #include "payload/json.h"
 #include "payload/protobuf.h"
+#include "payload/canbatch.h"
 #include "util/log.h"
 
 namespace payload = openxc::payload;
@@ -35,12 +36,24 @@ openxc_DynamicField openxc::payload::wrapBoolean(bool value) {
 }
 
 size_t openxc::payload::deserialize(uint8_t payload[], size_t length,
-        PayloadFormat format, openxc_VehicleMessage* message) {
+        PayloadFormat format, openxc_VehicleMessage* message,
+        json::StreamState* jsonState,
+        json::SubscriptionCommand* subscription) {
     size_t bytesRead = 0;
     if(format == PayloadFormat::JSON) {
-        bytesRead = payload::json::deserialize(payload, length, message);
+        if(jsonState != NULL) {
+            bytesRead = payload::json::deserialize(payload, length, message,
+                    jsonState, subscription);
+        } else {
+            payload::json::StreamState state;
+            payload::json::resetStream(&state);
+            bytesRead = payload::json::deserialize(payload, length, message,
+                    &state, subscription);
+        }
     } else if(format == PayloadFormat::PROTOBUF) {
         bytesRead = payload::protobuf::deserialize(payload, length, message);
+    } else if(format == PayloadFormat::CAN_BATCH) {
+        bytesRead = payload::canbatch::deserialize(payload, length, message);
     } else {
         debug("Invalid payload format: %d", format);
     }
@@ -48,12 +61,18 @@ size_t openxc::payload::deserialize(uint8_t payload[], size_t length,
 }
 
 int openxc::payload::serialize(openxc_VehicleMessage* message,
-        uint8_t payload[], size_t length, PayloadFormat format) {
+        uint8_t payload[], size_t length, PayloadFormat format,
+        const uint32_t* timestamp, const int* frame) {
     int serializedLength = 0;
     if(format == PayloadFormat::JSON) {
-        serializedLength = payload::json::serialize(message, payload, length);
+        serializedLength = payload::json::serialize(message, payload, length,
+                timestamp, frame);
     } else if(format == PayloadFormat::PROTOBUF) {
-        serializedLength = payload::protobuf::serialize(message, payload, length);
+        serializedLength = payload::protobuf::serialize(message, payload,
+                length, timestamp, frame);
+    } else if(format == PayloadFormat::CAN_BATCH) {
+        serializedLength = payload::canbatch::serialize(message, payload,
+                length, timestamp, frame);
     } else {
         debug("Invalid payload format: %d", format);
     }
@@ -2,18 +2,40 @@
 #define __PAYLOAD_H__
 
 #include "openxc.pb.h"
+#include "payload/json.h"
 #include <stdint.h>
 
 namespace openxc {
 namespace payload {
 
 /* Public: The available encoding formats for OpenXC payloads.
+ *
+ * JSON - JSON, following the OpenXC message format.
+ * PROTOBUF - Length delimited Protocol Buffers.
+ * CAN_BATCH - Length delimited records that pack many raw CAN messages into
+ *      one, with everything else as Protocol Buffers. See payload/canbatch.h.
  */
 typedef enum {
     JSON,
     PROTOBUF,
+    CAN_BATCH,
 } PayloadFormat;
 
+/* Public: The value of the CAN batch format in a payload format command. The
+ * OpenXC message format doesn't include it yet, so this is the next unused
+ * value of the PayloadFormat enum in openxc.proto.
+ */
+const openxc_PayloadFormatCommand_PayloadFormat
+        PAYLOAD_FORMAT_COMMAND_CAN_BATCH =
+            (openxc_PayloadFormatCommand_PayloadFormat)3;
+
+/* Public: The type of a subscription control command. The OpenXC message
+ * format doesn't include it yet, so this is the next unused value of the
+ * ControlCommand Type enum in openxc.proto.
+ */
+const openxc_ControlCommand_Type CONTROL_COMMAND_SUBSCRIBE =
+        (openxc_ControlCommand_Type)9;
+
 /* Public: Deserialize an OpenXC message from the given payload, using the given
  * format.
  *
@@ -26,12 +48,20 @@ typedef enum {
  * length -  The length of the payload.
  * format - The expected format of the message serialized in the payload.
  * message - An output parameter, the object to store the deserialized message.
+ * jsonState - (optional) If the format is JSON, the progress of parsing a
+ *      message from an earlier, shorter version of this payload. See
+ *      json::deserialize(...).
+ * subscription - (optional) An output parameter for the parameters of a
+ *      subscription command (a control command of type
+ *      CONTROL_COMMAND_SUBSCRIBE), which only JSON payloads can include. See
+ *      json::SubscriptionCommand.
  *
  * Returns the number of bytes read for a complete message from the payload, if
  * any where found.
  */
 size_t deserialize(uint8_t payload[], size_t length, PayloadFormat format,
-        openxc_VehicleMessage* message);
+        openxc_VehicleMessage* message, json::StreamState* jsonState=NULL,
+        json::SubscriptionCommand* subscription=NULL);
 
 /* Public: Serialize an OpenXC message into a payload of bytes using the OpenXC
  * message format (https://github.com/openxc/openxc-message-format).
@@ -41,12 +71,17 @@ size_t deserialize(uint8_t payload[], size_t length, PayloadFormat format,
  * length -  The length of the payload buffer.
  * format - The serialization format to use in the payload (e.g. JSON, protocol
  *      buffers, etc).
+ * timestamp - (optional) When the CAN message behind the message was
+ *      received, in microseconds, to include in the payload.
+ * frame - (optional) For one chunk of a diagnostic response too long for a
+ *      single message, the index of the chunk, or -1 for the last one.
  *
  * Returns the number of bytes written to the payload. If the length is 0, an
  * error occurred while serializing.
  */
 int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length,
-        PayloadFormat format);
+        PayloadFormat format, const uint32_t* timestamp=NULL,
+        const int* frame=NULL);
 
 /* Public: Helper functions to wrap values in an openxc_DynamicField
  */
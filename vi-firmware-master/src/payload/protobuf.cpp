@@ -16,16 +16,41 @@ size_t openxc::payload::protobuf::deserialize(uint8_t payload[], size_t length,
     return length - stream.bytes_left;
 }
 
+bool openxc::payload::protobuf::encode(pb_ostream_t* stream,
+        openxc_VehicleMessage* message, const uint32_t* timestamp,
+        const int* frame) {
+    return pb_encode(stream, openxc_VehicleMessage_fields, message) &&
+            (timestamp == NULL || (
+                pb_encode_tag(stream, PB_WT_VARINT, TIMESTAMP_FIELD_NUMBER) &&
+                pb_encode_varint(stream, *timestamp))) &&
+            (frame == NULL || (
+                pb_encode_tag(stream, PB_WT_VARINT, FRAME_FIELD_NUMBER) &&
+                pb_encode_svarint(stream, *frame)));
+}
+
 int openxc::payload::protobuf::serialize(openxc_VehicleMessage* message,
-        uint8_t payload[], size_t length) {
+        uint8_t payload[], size_t length, const uint32_t* timestamp,
+        const int* frame) {
     if(message == NULL) {
         debug("Message object is NULL");
         return 0;
     }
 
     pb_ostream_t stream = pb_ostream_from_buffer(payload, length);
-    if(!pb_encode_delimited(&stream, openxc_VehicleMessage_fields,
-            message)) {
+    if(timestamp == NULL && frame == NULL) {
+        if(!pb_encode_delimited(&stream, openxc_VehicleMessage_fields,
+                message)) {
+            debug("Error encoding protobuf: %s", PB_GET_ERROR(&stream));
+        }
+        return stream.bytes_written;
+    }
+
+    // The length prefix has to include the extra fields, so size the whole
+    // thing first
+    pb_ostream_t sizingStream = PB_OSTREAM_SIZING;
+    if(!encode(&sizingStream, message, timestamp, frame) ||
+            !pb_encode_varint(&stream, sizingStream.bytes_written) ||
+            !encode(&stream, message, timestamp, frame)) {
         debug("Error encoding protobuf: %s", PB_GET_ERROR(&stream));
     }
     return stream.bytes_written;
@@ -2,11 +2,23 @@
 #define __PROTOBUF_H__
 
 #include "openxc.pb.h"
+#include "pb_encode.h"
 
 namespace openxc {
 namespace payload {
 namespace protobuf {
 
+/* Public: The field number used for the receive timestamp of a message. It
+ * isn't part of openxc.proto, so it's encoded as an extra field that decoders
+ * without it will skip.
+ */
+const uint32_t TIMESTAMP_FIELD_NUMBER = 15;
+
+/* Public: The field number used for the chunk index of a diagnostic response
+ * that's split across messages, encoded the same way as the timestamp.
+ */
+const uint32_t FRAME_FIELD_NUMBER = 16;
+
 /* Public: Deserialize an OpenXC message from a payload containing a Protocol
  * Buffer.
  *
@@ -25,11 +37,32 @@ size_t deserialize(uint8_t payload[], size_t length, openxc_VehicleMessage* mess
  * message - The message to serialize.
  * payload - The buffer to store the payload - must be allocated by the caller.
  * length -  The length of the payload buffer.
+ * timestamp - (optional) When the CAN message behind the message was
+ *      received, in microseconds. It's added as a varint field with the number
+ *      TIMESTAMP_FIELD_NUMBER.
+ * frame - (optional) For one chunk of a diagnostic response too long for a
+ *      single message, the index of the chunk, or -1 for the last one. It's
+ *      added as a signed varint field with the number FRAME_FIELD_NUMBER.
  *
  * Returns the number of bytes written to the payload. If the length is 0, an
  * error occurred while serializing.
  */
-int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length);
+int serialize(openxc_VehicleMessage* message, uint8_t payload[], size_t length,
+        const uint32_t* timestamp=NULL, const int* frame=NULL);
+
+/* Public: Encode an OpenXC message as a Protocol Buffer into a stream, without
+ * a length prefix.
+ *
+ * stream - The stream to write to.
+ * message - The message to encode.
+ * timestamp - (optional) A receive timestamp to encode after the message.
+ * frame - (optional) A diagnostic response chunk index to encode after the
+ *      message.
+ *
+ * Returns true if the message was encoded.
+ */
+bool encode(pb_ostream_t* stream, openxc_VehicleMessage* message,
+        const uint32_t* timestamp=NULL, const int* frame=NULL);
 
 } // namespace protobuf
 } // namespace payload
@@ -1,15 +1,22 @@
+#include <string.h>
+#include <limits.h>
 #include "emqueue.h"
 #include "pipeline.h"
 #include "util/log.h"
 #include "util/timer.h"
 #include "util/statistics.h"
 #include "util/bytebuffer.h"
+#include "payload/canbatch.h"
 #include "config.h"
 #include "lights.h"
 
-#define PIPELINE_ENDPOINT_COUNT 3
 #define PIPELINE_STATS_LOG_FREQUENCY_S 15
 #define QUEUE_FLUSH_MAX_TRIES 100
+// Leave spare slots beyond what one sink can hold, so a backed up sink can't
+// starve publish() of somewhere to serialize.
+#define PAYLOAD_SLOT_COUNT 8
+#define PENDING_PAYLOAD_COUNT 6
+#define PAYLOAD_FORMAT_MASK(format) (1 << (format))
 
 namespace uart = openxc::interface::uart;
 namespace usb = openxc::interface::usb;
@@ -17,148 +24,892 @@ namespace network = openxc::interface::network;
 namespace time = openxc::util::time;
 namespace statistics = openxc::util::statistics;
 namespace config = openxc::config;
+namespace canbatch = openxc::payload::canbatch;
 
-using openxc::util::bytebuffer::conditionalEnqueue;
-using openxc::util::bytebuffer::messageFits;
+using openxc::util::bytebuffer::enqueue;
 using openxc::util::statistics::DeltaStatistic;
 using openxc::util::log::debug;
 using openxc::pipeline::Pipeline;
+using openxc::pipeline::PipelineSink;
+using openxc::pipeline::SinkOperations;
+using openxc::pipeline::SinkFilter;
+using openxc::pipeline::SignalFilter;
 using openxc::pipeline::MessageClass;
 using openxc::interface::InterfaceDescriptor;
-using openxc::interface::InterfaceType;
-using openxc::config::LoggingOutputInterface;
-
-unsigned int droppedMessages[PIPELINE_ENDPOINT_COUNT];
-unsigned int sentMessages[PIPELINE_ENDPOINT_COUNT];
-unsigned int dataSent[PIPELINE_ENDPOINT_COUNT];
-unsigned int sendQueueLength[PIPELINE_ENDPOINT_COUNT];
-unsigned int receiveQueueLength[PIPELINE_ENDPOINT_COUNT];
-
-void conditionalFlush(Pipeline* pipeline,
-        QUEUE_TYPE(uint8_t)* sendQueue, uint8_t* message, int messageSize) {
-    int timeout = QUEUE_FLUSH_MAX_TRIES;
-    while(timeout > 0 && !messageFits(sendQueue, message, messageSize)) {
+using openxc::interface::BackpressurePolicy;
+using openxc::payload::PayloadFormat;
+
+/* Private: A serialized outgoing payload shared by every sink that still has to
+ * send it.
+ *
+ * data - The serialized payload.
+ * length - The number of valid bytes in data.
+ * key - Identifies the signal in the payload for coalescing, or 0 if the
+ *      payload can't be coalesced with another.
+ * references - The number of holders of this slot - the publisher while it's
+ *      fanning out, plus one for each sink with a pending descriptor. The slot
+ *      is free when this drops to 0.
+ */
+typedef struct {
+    uint8_t data[MAX_OUTGOING_PAYLOAD_SIZE];
+    int length;
+    uint32_t key;
+    int references;
+} PayloadSlot;
+
+/* Private: A sink's reference to a payload slot that hasn't been fully moved
+ * into the sink's send queue yet.
+ *
+ * slot - The shared payload.
+ * offset - The number of bytes of the payload already in the send queue.
+ */
+typedef struct {
+    PayloadSlot* slot;
+    int offset;
+} PayloadDescriptor;
+
+/* Private: A FIFO of payloads waiting for room in one sink's send queue. While
+ * this is not empty, new messages for the sink must wait behind it to keep them
+ * in order.
+ */
+typedef struct {
+    PayloadDescriptor descriptors[PENDING_PAYLOAD_COUNT];
+    int head;
+    int length;
+} PendingPayloads;
+
+static PayloadSlot payloadSlots[PAYLOAD_SLOT_COUNT];
+// Indexed the same as the pipeline's sinks
+static PendingPayloads pendingPayloads[MAX_PIPELINE_SINK_COUNT];
+static unsigned int exhaustedSlotPool;
+
+// With the CAN batch payload format, raw CAN messages are collected in a
+// payload slot and sent together once per pass of the main loop, or when the
+// slot fills up.
+static canbatch::CanBatch canBatch;
+static PayloadSlot* canBatchSlot;
+// The sinks (a bit for each index) that accept every message in the batch
+static uint32_t canBatchSinks;
+
+static PayloadSlot* acquireSlot() {
+    for(int i = 0; i < PAYLOAD_SLOT_COUNT; i++) {
+        if(payloadSlots[i].references == 0) {
+            payloadSlots[i].references = 1;
+            payloadSlots[i].length = 0;
+            payloadSlots[i].key = 0;
+            return &payloadSlots[i];
+        }
+    }
+    ++exhaustedSlotPool;
+    return NULL;
+}
+
+static void releaseSlot(PayloadSlot* slot) {
+    if(slot != NULL && slot->references > 0) {
+        --slot->references;
+    }
+}
+
+/* Private: Move as much of the pending payloads as will fit into the sink's
+ * send queue, releasing each slot reference once its payload is completely
+ * queued.
+ *
+ * Returns true if nothing is left pending for the sink.
+ */
+static bool drainPending(PendingPayloads* pending, PipelineSink* sink) {
+    while(pending->length > 0) {
+        PayloadDescriptor* descriptor = &pending->descriptors[pending->head];
+        descriptor->offset += sink->operations->enqueue(sink->device,
+                &descriptor->slot->data[descriptor->offset],
+                descriptor->slot->length - descriptor->offset);
+        if(descriptor->offset < descriptor->slot->length) {
+            return false;
+        }
+
+        releaseSlot(descriptor->slot);
+        pending->head = (pending->head + 1) % PENDING_PAYLOAD_COUNT;
+        --pending->length;
+    }
+    return true;
+}
+
+static void removePending(PendingPayloads* pending, int index) {
+    releaseSlot(pending->descriptors[
+            (pending->head + index) % PENDING_PAYLOAD_COUNT].slot);
+    for(int i = index; i < pending->length - 1; i++) {
+        pending->descriptors[(pending->head + i) % PENDING_PAYLOAD_COUNT] =
+                pending->descriptors[(pending->head + i + 1) %
+                    PENDING_PAYLOAD_COUNT];
+    }
+    --pending->length;
+}
+
+static void discardPending(PendingPayloads* pending) {
+    while(pending->length > 0) {
+        removePending(pending, 0);
+    }
+}
+
+static bool holdPayload(PendingPayloads* pending, PayloadSlot* slot) {
+    if(slot == NULL || pending->length >= PENDING_PAYLOAD_COUNT) {
+        return false;
+    }
+
+    PayloadDescriptor* descriptor = &pending->descriptors[
+            (pending->head + pending->length) % PENDING_PAYLOAD_COUNT];
+    descriptor->slot = slot;
+    descriptor->offset = 0;
+    ++slot->references;
+    ++pending->length;
+    return true;
+}
+
+/* Private: Drop the oldest held payload that hasn't started going into the
+ * send queue yet - a partially queued payload has to be finished.
+ *
+ * Returns true if a payload was dropped.
+ */
+static bool evictOldest(PendingPayloads* pending) {
+    for(int i = 0; i < pending->length; i++) {
+        if(pending->descriptors[
+                (pending->head + i) % PENDING_PAYLOAD_COUNT].offset == 0) {
+            removePending(pending, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Replace a held payload for the same signal as the slot with the
+ * slot, keeping its place in line.
+ *
+ * Returns true if a held payload was replaced.
+ */
+static bool coalescePending(PendingPayloads* pending, PayloadSlot* slot) {
+    if(slot == NULL || slot->key == 0) {
+        return false;
+    }
+
+    for(int i = 0; i < pending->length; i++) {
+        PayloadDescriptor* descriptor = &pending->descriptors[
+                (pending->head + i) % PENDING_PAYLOAD_COUNT];
+        if(descriptor->offset == 0 && descriptor->slot->key == slot->key) {
+            releaseSlot(descriptor->slot);
+            descriptor->slot = slot;
+            ++slot->references;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Returns a non-zero key identifying a signal name.
+ */
+static uint32_t nameKey(const char* name) {
+    // FNV-1a
+    uint32_t key = 2166136261u;
+    for(const char* c = name; *c != '\0'; c++) {
+        key = (key ^ (uint8_t)*c) * 16777619u;
+    }
+    return key == 0 ? 1 : key;
+}
+
+/* Private: Returns a key identifying the signal in a simple vehicle message
+ * for coalescing, or 0 if it shouldn't be coalesced - messages with an event
+ * (e.g. one per door) share a name but not a value.
+ */
+static uint32_t coalescingKey(openxc_VehicleMessage* message) {
+    if(message->type != openxc_VehicleMessage_Type_SIMPLE ||
+            !message->simple_message.has_name ||
+            message->simple_message.has_event) {
+        return 0;
+    }
+    return nameKey(message->simple_message.name);
+}
+
+/* Private: Returns true if the sink's filter lets the message through.
+ *
+ * message - The message, or NULL if it's already serialized - then only its
+ *      class is checked.
+ * record - If true, count the message against its signal's rate limit.
+ */
+static bool filterAccepts(PipelineSink* sink,
+        const openxc_VehicleMessage* message, MessageClass messageClass,
+        bool record) {
+    SinkFilter* filter = &sink->filter;
+    if(!filter->enabled) {
+        return true;
+    }
+
+    if(!(filter->messageClasses & MESSAGE_CLASS_MASK(messageClass))) {
+        return false;
+    }
+
+    if(message == NULL) {
+        return true;
+    }
+
+    if(filter->filterCanIds && (message->type == openxc_VehicleMessage_Type_CAN
+                || message->type == openxc_VehicleMessage_Type_DIAGNOSTIC)) {
+        uint32_t id = message->type == openxc_VehicleMessage_Type_CAN ?
+                message->can_message.id :
+                message->diagnostic_response.message_id;
+        return id >= filter->minimumCanId && id <= filter->maximumCanId;
+    }
+
+    if(filter->signalCount > 0 &&
+            message->type == openxc_VehicleMessage_Type_SIMPLE) {
+        uint32_t key = nameKey(message->simple_message.name);
+        for(int i = 0; i < filter->signalCount; i++) {
+            SignalFilter* signal = &filter->signals[i];
+            if(signal->key != key) {
+                continue;
+            }
+
+            unsigned long now = time::systemTimeMs();
+            if(signal->minimumIntervalMs > 0 && signal->lastSentMs != 0 &&
+                    now - signal->lastSentMs < signal->minimumIntervalMs) {
+                return false;
+            }
+
+            if(record) {
+                // 0 means never sent, so don't let a send at time 0 look like
+                // one
+                signal->lastSentMs = now == 0 ? 1 : now;
+            }
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+static PayloadFormat sinkPayloadFormat(PipelineSink* sink) {
+    return sink->overridePayloadFormat ? sink->payloadFormat :
+            config::getConfiguration()->payloadFormat;
+}
+
+/* Private: Returns the payload formats the message has to be serialized in for
+ * the connected sinks that would be sent it, a mask of PAYLOAD_FORMAT_MASK(...)
+ * bits. If it's 0, no sink wants the message.
+ */
+static uint8_t neededPayloadFormats(Pipeline* pipeline,
+        const openxc_VehicleMessage* message, MessageClass messageClass,
+        uint8_t sinks) {
+    uint8_t formats = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if((sinks & (1 << i)) &&
+                (sink->subscriptions & MESSAGE_CLASS_MASK(messageClass)) &&
+                sink->operations->connected(sink->device) &&
+                filterAccepts(sink, message, messageClass, false)) {
+            formats |= PAYLOAD_FORMAT_MASK(sinkPayloadFormat(sink));
+        }
+    }
+    return formats;
+}
+
+/* Private: Returns true if the message plus a CRLF fits in the sink's send
+ * queue.
+ */
+static bool messageFits(PipelineSink* sink, int messageSize) {
+    return sink->operations->available(sink->device) >= messageSize + 2;
+}
+
+/* Private: Add the message to the sink's send queue if there is room.
+ *
+ * Returns true if the message was queued.
+ */
+static bool conditionalEnqueue(PipelineSink* sink, uint8_t* message,
+        int messageSize) {
+    if(messageFits(sink, messageSize)) {
+        sink->operations->enqueue(sink->device, message, messageSize);
+        return true;
+    }
+    return false;
+}
+
+/* Private: Returns true if the message can go directly into the sink's send
+ * queue, i.e. nothing is pending ahead of it and there is room.
+ */
+static bool queueAccepts(PendingPayloads* pending, PipelineSink* sink,
+        int messageSize) {
+    return drainPending(pending, sink) && messageFits(sink, messageSize);
+}
+
+/* Private: Flush the pipeline until the message fits in the sink's send queue,
+ * for no longer than the configured wait budget.
+ *
+ * Returns true if the message now fits.
+ */
+static bool waitForRoom(Pipeline* pipeline, PendingPayloads* pending,
+        PipelineSink* sink, int messageSize) {
+    unsigned long start = time::systemTimeUs();
+    unsigned int budget = config::getConfiguration()->backpressureWaitBudgetUs;
+    for(int tries = 0; tries < QUEUE_FLUSH_MAX_TRIES &&
+            time::systemTimeUs() - start <= budget; tries++) {
         process(pipeline);
-        --timeout;
+        if(queueAccepts(pending, sink, messageSize)) {
+            return true;
+        }
     }
+    return false;
 }
 
-void sendToEndpoint(openxc::interface::InterfaceType endpointType,
-        QUEUE_TYPE(uint8_t)* sendQueue, QUEUE_TYPE(uint8_t)* receiveQueue,
-        uint8_t* message, int messageSize) {
-    if(!conditionalEnqueue(sendQueue, message, messageSize)) {
-        ++droppedMessages[endpointType];
+/* Private: Apply the sink's backpressure policy to a message that doesn't fit
+ * in its send queue right now. A sink without a descriptor never waits.
+ *
+ * Returns true if the message was queued, held or coalesced, false if it was
+ * dropped.
+ */
+static bool applyBackpressure(Pipeline* pipeline, PipelineSink* sink,
+        PendingPayloads* pending, PayloadSlot* slot, uint8_t* message,
+        int messageSize) {
+    BackpressurePolicy policy = sink->descriptor != NULL ?
+            sink->descriptor->backpressure : BackpressurePolicy::DROP_NEWEST;
+    switch(policy) {
+    case BackpressurePolicy::COALESCE:
+        if(coalescePending(pending, slot)) {
+            ++sink->statistics.coalescedMessages;
+            return true;
+        }
+        // Nothing to coalesce with, make room the same way as DROP_OLDEST
+    case BackpressurePolicy::DROP_OLDEST:
+        if(slot != NULL && pending->length >= PENDING_PAYLOAD_COUNT &&
+                evictOldest(pending)) {
+            ++sink->statistics.evictedMessages;
+        }
+        return holdPayload(pending, slot);
+    case BackpressurePolicy::DROP_NEWEST:
+        return holdPayload(pending, slot);
+    case BackpressurePolicy::BOUNDED_WAIT:
+    default:
+        if(waitForRoom(pipeline, pending, sink, messageSize)) {
+            return conditionalEnqueue(sink, message, messageSize);
+        }
+        ++sink->statistics.waitTimeouts;
+        return holdPayload(pending, slot);
+    }
+}
+
+/* Private: Queue a message on one sink, applying its backpressure policy if it
+ * doesn't fit, and update the sink's counters.
+ */
+static void sendToSink(Pipeline* pipeline, PipelineSink* sink,
+        PendingPayloads* pending, PayloadSlot* slot, uint8_t* message,
+        int messageSize) {
+    bool queued;
+    if(queueAccepts(pending, sink, messageSize)) {
+        queued = conditionalEnqueue(sink, message, messageSize);
+    } else {
+        queued = applyBackpressure(pipeline, sink, pending, slot, message,
+                messageSize);
+    }
+
+    if(!queued) {
+        ++sink->statistics.droppedMessages;
     } else {
-        ++sentMessages[endpointType];
-        dataSent[endpointType] += messageSize;
+        ++sink->statistics.sentMessages;
+        sink->statistics.dataSent += messageSize;
+    }
+
+    if(sink->operations->queueLengths != NULL) {
+        int sendLength, receiveLength;
+        sink->operations->queueLengths(sink->device, &sendLength,
+                &receiveLength);
+        sink->statistics.sendQueueLength = sendLength;
+        sink->statistics.receiveQueueLength = receiveLength;
     }
-    sendQueueLength[endpointType] = QUEUE_LENGTH(uint8_t, sendQueue);
-    // TODO This may not belong here after USB refactoring
-    receiveQueueLength[endpointType] = QUEUE_LENGTH(uint8_t, receiveQueue);
 }
 
-void sendToUsb(Pipeline* pipeline, uint8_t* message, int messageSize,
-        MessageClass messageClass) {
-    if(pipeline->usb->configured) {
-        QUEUE_TYPE(uint8_t)* sendQueue;
-        if(messageClass == MessageClass::LOG) {
-            sendQueue = &pipeline->usb->endpoints[LOG_ENDPOINT_INDEX].queue;
-            if(config::getConfiguration()->loggingOutput !=
-                        LoggingOutputInterface::BOTH &&
-                    config::getConfiguration()->loggingOutput !=
-                        LoggingOutputInterface::USB) {
-                return;
+/* Private: Fan a payload out to every connected sink that subscribes to its
+ * class and whose filter accepts it. If the payload is in a slot, sinks that
+ * can't take it right away hold a descriptor of the slot instead of a copy.
+ *
+ * source - The message the payload was serialized from, or NULL.
+ * format - The payload format the message was serialized in, to send it only
+ *      to the sinks using that format, or NULL to send it to every sink.
+ * sinks - The sinks to consider, a bit for each sink index.
+ */
+static void sendPayload(Pipeline* pipeline, PayloadSlot* slot,
+        uint8_t* message, int messageSize, MessageClass messageClass,
+        const openxc_VehicleMessage* source=NULL,
+        const PayloadFormat* format=NULL, uint8_t sinks=ALL_PIPELINE_SINKS) {
+    uint8_t classMask = MESSAGE_CLASS_MASK(messageClass);
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if((sinks & (1 << i)) && (sink->subscriptions & classMask) &&
+                (format == NULL || sinkPayloadFormat(sink) == *format) &&
+                sink->operations->connected(sink->device) &&
+                filterAccepts(sink, source, messageClass, true)) {
+            sendToSink(pipeline, sink, &pendingPayloads[i], slot, message,
+                    messageSize);
+        }
+    }
+}
+
+/* Private: Send the batch of CAN messages collected so far, if there is one,
+ * to the sinks that accept every message in it.
+ */
+static void flushCanBatch(Pipeline* pipeline) {
+    if(canBatchSlot == NULL) {
+        return;
+    }
+
+    PayloadSlot* slot = canBatchSlot;
+    canBatchSlot = NULL;
+    slot->length = canbatch::finish(&canBatch);
+    if(slot->length > 0) {
+        for(int i = 0; i < pipeline->sinkCount; i++) {
+            PipelineSink* sink = &pipeline->sinks[i];
+            if((canBatchSinks & (1 << i)) &&
+                    sink->operations->connected(sink->device)) {
+                sendToSink(pipeline, sink, &pendingPayloads[i], slot,
+                        slot->data, slot->length);
             }
-        } else {
-            sendQueue = &pipeline->usb->endpoints[IN_ENDPOINT_INDEX].queue;
         }
+    }
+    releaseSlot(slot);
+}
 
-        conditionalFlush(pipeline, sendQueue, message, messageSize);
-        sendToEndpoint(pipeline->usb->descriptor.type, sendQueue,
-                &pipeline->usb->endpoints[OUT_ENDPOINT_INDEX].queue,
-                message, messageSize);
+/* Private: Returns the connected sinks using the CAN batch format whose filters
+ * accept the CAN message, a bit for each sink index.
+ */
+static uint32_t canBatchSinkMask(Pipeline* pipeline,
+        const openxc_VehicleMessage* message) {
+    uint32_t sinks = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if((sink->subscriptions & MESSAGE_CLASS_MASK(MessageClass::CAN)) &&
+                sinkPayloadFormat(sink) == PayloadFormat::CAN_BATCH &&
+                sink->operations->connected(sink->device) &&
+                filterAccepts(sink, message, MessageClass::CAN, false)) {
+            sinks |= 1 << i;
+        }
     }
+    return sinks;
 }
 
-void sendToUart(Pipeline* pipeline, uint8_t* message, int messageSize,
-        MessageClass messageClass) {
-    if(uart::connected(pipeline->uart) && messageClass != MessageClass::LOG) {
-        QUEUE_TYPE(uint8_t)* sendQueue = &pipeline->uart->sendQueue;
-        conditionalFlush(pipeline, sendQueue, message, messageSize);
-        sendToEndpoint(pipeline->uart->descriptor.type, sendQueue,
-                &pipeline->uart->receiveQueue, message, messageSize);
+/* Private: Add a CAN message to the current batch, sending the batch and
+ * starting another if it's full or the message is for a different set of
+ * sinks.
+ *
+ * receiveTimestamp - When the message was received, or NULL to use the
+ *      current time.
+ *
+ * Returns false if there was no payload slot free for a new batch, so the
+ * message still needs to be sent on its own.
+ */
+static bool batchCanMessage(Pipeline* pipeline,
+        openxc_VehicleMessage* message, const uint32_t* receiveTimestamp,
+        uint8_t sinkMask) {
+    uint32_t timestamp = receiveTimestamp != NULL ?
+            *receiveTimestamp : time::systemTimeUs();
+    uint32_t sinks = canBatchSinkMask(pipeline, message) & sinkMask;
+    if(canBatchSlot != NULL && sinks == canBatchSinks &&
+            canbatch::append(&canBatch, &message->can_message, timestamp)) {
+        return true;
     }
+
+    flushCanBatch(pipeline);
+    canBatchSlot = acquireSlot();
+    if(canBatchSlot == NULL) {
+        return false;
+    }
+
+    canBatchSinks = sinks;
+    canbatch::begin(&canBatch, canBatchSlot->data, MAX_OUTGOING_PAYLOAD_SIZE);
+    return canbatch::append(&canBatch, &message->can_message, timestamp);
 }
 
-void sendToNetwork(Pipeline* pipeline, uint8_t* message, int messageSize,
-        MessageClass messageClass) {
-    if(pipeline->network != NULL && messageClass != MessageClass::LOG) {
-        QUEUE_TYPE(uint8_t)* sendQueue = &pipeline->network->sendQueue;
-        conditionalFlush(pipeline, sendQueue, message, messageSize);
-        sendToEndpoint(pipeline->network->descriptor.type, sendQueue,
-                &pipeline->network->receiveQueue, message, messageSize);
+/* Private: Serialize a message in one payload format and send it to the sinks
+ * that use that format.
+ */
+static void publishInFormat(openxc_VehicleMessage* message,
+        MessageClass messageClass, PayloadFormat format, Pipeline* pipeline,
+        const uint32_t* timestamp, const int* frame, uint8_t sinks) {
+    // Serialize straight into a shared slot so the sinks only need a
+    // descriptor of it - fall back to the stack if the pool is exhausted.
+    uint8_t fallback[MAX_OUTGOING_PAYLOAD_SIZE];
+    PayloadSlot* slot = acquireSlot();
+    uint8_t* payload = slot != NULL ? slot->data : fallback;
+    memset(payload, 0, MAX_OUTGOING_PAYLOAD_SIZE);
+    size_t length = openxc::payload::serialize(message, payload,
+            MAX_OUTGOING_PAYLOAD_SIZE, format,
+            config::getConfiguration()->emitTimestamps ? timestamp : NULL,
+            frame);
+    if(slot != NULL) {
+        slot->length = length;
+        slot->key = coalescingKey(message);
     }
+    sendPayload(pipeline, slot, payload, length, messageClass, message,
+            &format, sinks);
+    releaseSlot(slot);
 }
 
 void openxc::pipeline::publish(openxc_VehicleMessage* message,
-        Pipeline* pipeline) {
-    uint8_t payload[MAX_OUTGOING_PAYLOAD_SIZE] = {0};
-    size_t length = payload::serialize(message, payload, sizeof(payload),
-            config::getConfiguration()->payloadFormat);
+        Pipeline* pipeline, const uint32_t* timestamp, const int* frame,
+        uint8_t sinks) {
     MessageClass messageClass;
-    bool matched = false;
     switch(message->type) {
         case openxc_VehicleMessage_Type_SIMPLE:
             messageClass = MessageClass::SIMPLE;
-            matched = true;
             break;
         case openxc_VehicleMessage_Type_CAN:
             messageClass = MessageClass::CAN;
-            matched = true;
             break;
         case openxc_VehicleMessage_Type_DIAGNOSTIC:
             messageClass = MessageClass::DIAGNOSTIC;
-            matched = true;
             break;
         case openxc_VehicleMessage_Type_COMMAND_RESPONSE:
             messageClass = MessageClass::COMMAND_RESPONSE;
-            matched = true;
-            break;
-        case openxc_VehicleMessage_Type_CONTROL_COMMAND:
             break;
+        default:
+            debug("Trying to serialize unrecognized type: %d", message->type);
+            return;
     }
-    if(matched) {
-        sendMessage(pipeline, payload, length, messageClass);
-    } else {
-        debug("Trying to serialize unrecognized type: %d", message->type);
+
+    uint8_t formats = neededPayloadFormats(pipeline, message, messageClass,
+            sinks);
+    if(formats & PAYLOAD_FORMAT_MASK(PayloadFormat::CAN_BATCH)) {
+        if(message->type == openxc_VehicleMessage_Type_CAN &&
+                batchCanMessage(pipeline, message, timestamp, sinks)) {
+            formats &= ~PAYLOAD_FORMAT_MASK(PayloadFormat::CAN_BATCH);
+        } else {
+            // Keep anything published after the batched CAN messages behind
+            // them
+            flushCanBatch(pipeline);
+        }
+    }
+
+    for(int format = 0; formats != 0; format++) {
+        if(formats & PAYLOAD_FORMAT_MASK(format)) {
+            formats &= ~PAYLOAD_FORMAT_MASK(format);
+            publishInFormat(message, messageClass, (PayloadFormat)format,
+                    pipeline, timestamp, frame, sinks);
+        }
     }
 }
 
 void openxc::pipeline::sendMessage(Pipeline* pipeline, uint8_t* message,
         int messageSize, MessageClass messageClass) {
-    sendToUsb(pipeline, message, messageSize, messageClass);
-    sendToUart(pipeline, message, messageSize, messageClass);
-    sendToNetwork(pipeline, message, messageSize, messageClass);
+    flushCanBatch(pipeline);
 
-    if((config::getConfiguration()->loggingOutput == LoggingOutputInterface::BOTH ||
-        config::getConfiguration()->loggingOutput == LoggingOutputInterface::UART)
-            && messageClass == MessageClass::LOG) {
-        openxc::util::log::debugUart((const char*)message);
-        openxc::util::log::debugUart("\r\n");
+    PayloadSlot* slot = NULL;
+    if(messageSize <= MAX_OUTGOING_PAYLOAD_SIZE) {
+        slot = acquireSlot();
+        if(slot != NULL) {
+            memcpy(slot->data, message, messageSize);
+            slot->length = messageSize;
+        }
     }
+    sendPayload(pipeline, slot, message, messageSize, messageClass);
+    releaseSlot(slot);
 }
 
 void openxc::pipeline::process(Pipeline* pipeline) {
-    // Must always process USB, because this function usually runs the MCU's USB
-    // task that handles SETUP and enumeration.
-    usb::processSendQueue(pipeline->usb);
-    if(uart::connected(pipeline->uart)) {
-        uart::processSendQueue(pipeline->uart);
+    flushCanBatch(pipeline);
+
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if(sink->operations->connected(sink->device)) {
+            drainPending(&pendingPayloads[i], sink);
+        } else {
+            // Don't let a disconnected sink hold on to payload slots
+            discardPending(&pendingPayloads[i]);
+        }
+
+        if(sink->operations->flush != NULL) {
+            sink->operations->flush(sink->device);
+        }
     }
+}
 
-    if(pipeline->network != NULL) {
-       network::processSendQueue(pipeline->network);
+uint8_t openxc::pipeline::subscribedSinks(Pipeline* pipeline,
+        MessageClass messageClass) {
+    uint8_t sinks = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if((sink->subscriptions & MESSAGE_CLASS_MASK(messageClass)) &&
+                sink->operations->connected(sink->device)) {
+            sinks |= 1 << i;
+        }
     }
+    return sinks;
+}
+
+int openxc::pipeline::sendCapacity(Pipeline* pipeline, int sink) {
+    if(sink < 0 || sink >= pipeline->sinkCount ||
+            !pipeline->sinks[sink].operations->connected(
+                pipeline->sinks[sink].device) ||
+            pendingPayloads[sink].length > 0) {
+        return 0;
+    }
+    return pipeline->sinks[sink].operations->available(
+            pipeline->sinks[sink].device);
+}
+
+static bool usbConnected(void* device) {
+    return ((UsbDevice*)device)->configured;
+}
+
+static int usbEnqueue(void* device, const uint8_t* data, int length) {
+    return enqueue(&((UsbDevice*)device)->endpoints[IN_ENDPOINT_INDEX].queue,
+            data, length);
+}
+
+static int usbAvailable(void* device) {
+    return QUEUE_AVAILABLE(uint8_t,
+            &((UsbDevice*)device)->endpoints[IN_ENDPOINT_INDEX].queue);
+}
+
+static void usbFlush(void* device) {
+    // Must always process USB, because this function usually runs the MCU's
+    // USB task that handles SETUP and enumeration.
+    usb::processSendQueue((UsbDevice*)device);
+}
+
+static void usbQueueLengths(void* device, int* sendLength,
+        int* receiveLength) {
+    UsbDevice* usbDevice = (UsbDevice*)device;
+    *sendLength = QUEUE_LENGTH(uint8_t,
+            &usbDevice->endpoints[IN_ENDPOINT_INDEX].queue);
+    *receiveLength = QUEUE_LENGTH(uint8_t,
+            &usbDevice->endpoints[OUT_ENDPOINT_INDEX].queue);
+}
+
+static int usbLogEnqueue(void* device, const uint8_t* data, int length) {
+    return enqueue(&((UsbDevice*)device)->endpoints[LOG_ENDPOINT_INDEX].queue,
+            data, length);
+}
+
+static int usbLogAvailable(void* device) {
+    return QUEUE_AVAILABLE(uint8_t,
+            &((UsbDevice*)device)->endpoints[LOG_ENDPOINT_INDEX].queue);
+}
+
+static bool uartConnected(void* device) {
+    return uart::connected((UartDevice*)device);
+}
+
+static int uartEnqueue(void* device, const uint8_t* data, int length) {
+    return enqueue(&((UartDevice*)device)->sendQueue, data, length);
+}
+
+static int uartAvailable(void* device) {
+    return QUEUE_AVAILABLE(uint8_t, &((UartDevice*)device)->sendQueue);
+}
+
+static void uartFlush(void* device) {
+    if(uart::connected((UartDevice*)device)) {
+        uart::processSendQueue((UartDevice*)device);
+    }
+}
+
+static void uartQueueLengths(void* device, int* sendLength,
+        int* receiveLength) {
+    UartDevice* uartDevice = (UartDevice*)device;
+    *sendLength = QUEUE_LENGTH(uint8_t, &uartDevice->sendQueue);
+    *receiveLength = QUEUE_LENGTH(uint8_t, &uartDevice->receiveQueue);
+}
+
+static bool alwaysConnected(void* device) {
+    return true;
+}
+
+/* Private: Write a log message straight out of the debug UART. Log messages
+ * are already NUL terminated, but copy it to be sure.
+ */
+static int uartLogEnqueue(void* device, const uint8_t* data, int length) {
+    char message[MAX_OUTGOING_PAYLOAD_SIZE + 1];
+    int messageLength = MIN(length, MAX_OUTGOING_PAYLOAD_SIZE);
+    memcpy(message, data, messageLength);
+    message[messageLength] = '\0';
+    openxc::util::log::debugUart(message);
+    openxc::util::log::debugUart("\r\n");
+    return length;
+}
+
+static int uartLogAvailable(void* device) {
+    return INT_MAX;
+}
+
+static int networkEnqueue(void* device, const uint8_t* data, int length) {
+    return enqueue(&((NetworkDevice*)device)->sendQueue, data, length);
+}
+
+static int networkAvailable(void* device) {
+    return QUEUE_AVAILABLE(uint8_t, &((NetworkDevice*)device)->sendQueue);
+}
+
+static void networkFlush(void* device) {
+    network::processSendQueue((NetworkDevice*)device);
+}
+
+static void networkQueueLengths(void* device, int* sendLength,
+        int* receiveLength) {
+    NetworkDevice* networkDevice = (NetworkDevice*)device;
+    *sendLength = QUEUE_LENGTH(uint8_t, &networkDevice->sendQueue);
+    *receiveLength = QUEUE_LENGTH(uint8_t, &networkDevice->receiveQueue);
+}
+
+const SinkOperations openxc::pipeline::USB_SINK_OPERATIONS = {
+    connected: usbConnected,
+    enqueue: usbEnqueue,
+    available: usbAvailable,
+    flush: usbFlush,
+    queueLengths: usbQueueLengths
+};
+
+// The USB sink flushes every endpoint, so the log sink doesn't need to
+const SinkOperations openxc::pipeline::USB_LOG_SINK_OPERATIONS = {
+    connected: usbConnected,
+    enqueue: usbLogEnqueue,
+    available: usbLogAvailable,
+    flush: NULL,
+    queueLengths: NULL
+};
+
+const SinkOperations openxc::pipeline::UART_SINK_OPERATIONS = {
+    connected: uartConnected,
+    enqueue: uartEnqueue,
+    available: uartAvailable,
+    flush: uartFlush,
+    queueLengths: uartQueueLengths
+};
+
+const SinkOperations openxc::pipeline::UART_LOG_SINK_OPERATIONS = {
+    connected: alwaysConnected,
+    enqueue: uartLogEnqueue,
+    available: uartLogAvailable,
+    flush: NULL,
+    queueLengths: NULL
+};
+
+// A network sink is only registered when the network interface is in use, and
+// it's always sent messages from then on.
+const SinkOperations openxc::pipeline::NETWORK_SINK_OPERATIONS = {
+    connected: alwaysConnected,
+    enqueue: networkEnqueue,
+    available: networkAvailable,
+    flush: networkFlush,
+    queueLengths: networkQueueLengths
+};
+
+bool openxc::pipeline::addSignalFilter(SinkFilter* filter, const char* name,
+        float frequency) {
+    if(filter->signalCount >= MAX_SINK_FILTER_SIGNAL_COUNT) {
+        debug("Unable to filter for %s, already at the limit of %d signals",
+                name, MAX_SINK_FILTER_SIGNAL_COUNT);
+        return false;
+    }
+
+    SignalFilter* signal = &filter->signals[filter->signalCount++];
+    signal->key = nameKey(name);
+    signal->minimumIntervalMs = frequency > 0 ? 1000 / frequency : 0;
+    signal->lastSentMs = 0;
+    return true;
+}
+
+int openxc::pipeline::setFilter(Pipeline* pipeline,
+        InterfaceDescriptor* descriptor, const SinkFilter* filter) {
+    int installed = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if(sink->descriptor == descriptor &&
+                (sink->subscriptions & NON_LOG_MESSAGE_CLASSES)) {
+            if(filter != NULL) {
+                sink->filter = *filter;
+            } else {
+                memset(&sink->filter, 0, sizeof(sink->filter));
+            }
+            ++installed;
+        }
+    }
+    return installed;
+}
+
+int openxc::pipeline::setPayloadFormat(Pipeline* pipeline,
+        InterfaceDescriptor* descriptor, const PayloadFormat* format) {
+    int changed = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if(sink->descriptor == descriptor) {
+            sink->overridePayloadFormat = format != NULL;
+            if(format != NULL) {
+                sink->payloadFormat = *format;
+            }
+            ++changed;
+        }
+    }
+    return changed;
+}
+
+PayloadFormat openxc::pipeline::getPayloadFormat(Pipeline* pipeline,
+        InterfaceDescriptor* descriptor) {
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        PipelineSink* sink = &pipeline->sinks[i];
+        if(sink->descriptor == descriptor) {
+            return sinkPayloadFormat(sink);
+        }
+    }
+    return config::getConfiguration()->payloadFormat;
+}
+
+void openxc::pipeline::initialize(Pipeline* pipeline) {
+    // the batch is addressed to sinks by index, so drop it along with them
+    releaseSlot(canBatchSlot);
+    canBatchSlot = NULL;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        discardPending(&pendingPayloads[i]);
+    }
+    pipeline->sinkCount = 0;
+}
+
+bool openxc::pipeline::addSink(Pipeline* pipeline, const char* name,
+        const SinkOperations* operations, void* device,
+        InterfaceDescriptor* descriptor, uint8_t subscriptions) {
+    if(pipeline->sinkCount >= MAX_PIPELINE_SINK_COUNT) {
+        debug("Unable to add %s to the pipeline, it's full", name);
+        return false;
+    }
+
+    PipelineSink* sink = &pipeline->sinks[pipeline->sinkCount];
+    memset(sink, 0, sizeof(PipelineSink));
+    sink->name = name;
+    sink->operations = operations;
+    sink->device = device;
+    sink->descriptor = descriptor;
+    sink->subscriptions = subscriptions;
+
+    discardPending(&pendingPayloads[pipeline->sinkCount]);
+    pendingPayloads[pipeline->sinkCount].head = 0;
+    ++pipeline->sinkCount;
+    return true;
+}
+
+void openxc::pipeline::removeSinks(Pipeline* pipeline, void* device) {
+    flushCanBatch(pipeline);
+    int kept = 0;
+    for(int i = 0; i < pipeline->sinkCount; i++) {
+        if(pipeline->sinks[i].device == device) {
+            discardPending(&pendingPayloads[i]);
+        } else {
+            if(kept != i) {
+                pipeline->sinks[kept] = pipeline->sinks[i];
+                pendingPayloads[kept] = pendingPayloads[i];
+            }
+            ++kept;
+        }
+    }
+
+    // the moved sinks' held payloads now belong to their new index, so the
+    // vacated entries mustn't release them again
+    for(int i = kept; i < pipeline->sinkCount; i++) {
+        pendingPayloads[i].head = 0;
+        pendingPayloads[i].length = 0;
+    }
+    pipeline->sinkCount = kept;
 }
 
 void openxc::pipeline::logStatistics(Pipeline* pipeline) {
@@ -167,15 +918,15 @@ void openxc::pipeline::logStatistics(Pipeline* pipeline) {
     }
 
     static unsigned long lastTimeLogged;
-    static DeltaStatistic droppedMessageStats[PIPELINE_ENDPOINT_COUNT];
-    static DeltaStatistic sentMessageStats[PIPELINE_ENDPOINT_COUNT];
-    static DeltaStatistic totalMessageStats[PIPELINE_ENDPOINT_COUNT];
-    static DeltaStatistic dataSentStats[PIPELINE_ENDPOINT_COUNT];
-    static DeltaStatistic sendQueueStats[PIPELINE_ENDPOINT_COUNT];
-    static DeltaStatistic receiveQueueStats[PIPELINE_ENDPOINT_COUNT];
+    static DeltaStatistic droppedMessageStats[MAX_PIPELINE_SINK_COUNT];
+    static DeltaStatistic sentMessageStats[MAX_PIPELINE_SINK_COUNT];
+    static DeltaStatistic totalMessageStats[MAX_PIPELINE_SINK_COUNT];
+    static DeltaStatistic dataSentStats[MAX_PIPELINE_SINK_COUNT];
+    static DeltaStatistic sendQueueStats[MAX_PIPELINE_SINK_COUNT];
+    static DeltaStatistic receiveQueueStats[MAX_PIPELINE_SINK_COUNT];
     static bool initializedStats = false;
     if(!initializedStats) {
-        for(int i = 0; i < PIPELINE_ENDPOINT_COUNT; i++) {
+        for(int i = 0; i < MAX_PIPELINE_SINK_COUNT; i++) {
             statistics::initialize(&droppedMessageStats[i]);
             statistics::initialize(&sentMessageStats[i]);
             statistics::initialize(&totalMessageStats[i]);
@@ -188,40 +939,52 @@ void openxc::pipeline::logStatistics(Pipeline* pipeline) {
 
     if(time::systemTimeMs() - lastTimeLogged >
             PIPELINE_STATS_LOG_FREQUENCY_S * 1000) {
-        for(int i = 0; i < PIPELINE_ENDPOINT_COUNT; i++) {
-            statistics::update(&sentMessageStats[i], sentMessages[i]);
-            statistics::update(&droppedMessageStats[i], droppedMessages[i]);
+        for(int i = 0; i < pipeline->sinkCount; i++) {
+            PipelineSink* sink = &pipeline->sinks[i];
+            statistics::update(&sentMessageStats[i],
+                    sink->statistics.sentMessages);
+            statistics::update(&droppedMessageStats[i],
+                    sink->statistics.droppedMessages);
             statistics::update(&totalMessageStats[i],
-                    sentMessages[i] + droppedMessages[i]);
-            statistics::update(&dataSentStats[i], dataSent[i]);
-            statistics::update(&dataSentStats[i], dataSent[i]);
+                    sink->statistics.sentMessages +
+                    sink->statistics.droppedMessages);
+            statistics::update(&dataSentStats[i], sink->statistics.dataSent);
 
-            statistics::update(&sendQueueStats[i], sendQueueLength[i]);
-            statistics::update(&receiveQueueStats[i], receiveQueueLength[i]);
+            statistics::update(&sendQueueStats[i],
+                    sink->statistics.sendQueueLength);
+            statistics::update(&receiveQueueStats[i],
+                    sink->statistics.receiveQueueLength);
 
             if(totalMessageStats[i].total > 0) {
-                InterfaceDescriptor descriptor;
-                descriptor.type = (InterfaceType) i;
                 debug("%s avg queue fill percents, Rx: %f, Tx: %f",
-                        descriptorToString(&descriptor),
+                        sink->name,
                         statistics::exponentialMovingAverage(&receiveQueueStats[i])
                             / QUEUE_MAX_LENGTH(uint8_t) * 100,
                         statistics::exponentialMovingAverage(&sendQueueStats[i])
                             / QUEUE_MAX_LENGTH(uint8_t) * 100);
                 debug("%s msgs sent: %d, dropped: %d (avg %f percent)",
-                        descriptorToString(&descriptor),
+                        sink->name,
                         sentMessageStats[i].total,
                         droppedMessageStats[i].total,
                         statistics::exponentialMovingAverage(&droppedMessageStats[i]) /
                             statistics::exponentialMovingAverage(&totalMessageStats[i]) * 100);
                 debug("%s avg throughput: %fKB / s, %d msgs / s",
-                        descriptorToString(&descriptor),
+                        sink->name,
                         statistics::exponentialMovingAverage(&dataSentStats[i])
                             / 1024.0 / PIPELINE_STATS_LOG_FREQUENCY_S,
                         (int)(statistics::exponentialMovingAverage(&sentMessageStats[i])
                             / PIPELINE_STATS_LOG_FREQUENCY_S));
+                debug("%s backpressure waits timed out: %d, msgs evicted: %d, "
+                        "coalesced: %d",
+                        sink->name, sink->statistics.waitTimeouts,
+                        sink->statistics.evictedMessages,
+                        sink->statistics.coalescedMessages);
             }
             lastTimeLogged = time::systemTimeMs();
         }
+
+        if(exhaustedSlotPool > 0) {
+            debug("Payload slot pool exhausted %d times", exhaustedSlotPool);
+        }
     }
 }
@@ -4,6 +4,7 @@
 #include "interface/usb.h"
 #include "interface/uart.h"
 #include "interface/network.h"
+#include "payload/payload.h"
 
 using openxc::interface::uart::UartDevice;
 using openxc::interface::usb::UsbDevice;
@@ -22,61 +23,308 @@ typedef enum {
     COMMAND_RESPONSE,
 } MessageClass;
 
-/* Public: A container for all output devices that want to be notified of new
- *      messages from the CAN bus.
+/* Public: Returns the bit for a MessageClass in a sink's subscriptions mask.
+ */
+#define MESSAGE_CLASS_MASK(messageClass) (1 << (messageClass))
+
+/* Public: Every MessageClass except LOG - the vehicle data and command
+ * responses that the VI's main output interfaces receive.
+ */
+#define NON_LOG_MESSAGE_CLASSES (MESSAGE_CLASS_MASK(MessageClass::SIMPLE) | \
+        MESSAGE_CLASS_MASK(MessageClass::CAN) | \
+        MESSAGE_CLASS_MASK(MessageClass::DIAGNOSTIC) | \
+        MESSAGE_CLASS_MASK(MessageClass::COMMAND_RESPONSE))
+
+/* Public: The most output interfaces (sinks) that can be registered with a
+ * pipeline.
+ */
+#define MAX_PIPELINE_SINK_COUNT 8
+
+/* Public: A mask of sinks that includes every sink in a pipeline - sink masks
+ * have a bit for each index in Pipeline.sinks.
+ */
+#define ALL_PIPELINE_SINKS 0xff
+
+/* Public: The most signals a sink's filter can pass through by name.
+ */
+#define MAX_SINK_FILTER_SIGNAL_COUNT 8
+
+/* Public: The operations the pipeline needs to send messages out of one kind of
+ * output interface. Each is passed the device the sink was registered with.
+ *
+ * connected - Returns true if the interface should be sent messages right now.
+ *      Messages held back for an interface that isn't connected are dropped.
+ * enqueue - Add up to length bytes to the interface's outgoing queue, and
+ *      return how many were added.
+ * available - Returns how many bytes enqueue can accept right now.
+ * flush - Send as much of the outgoing queue out of the physical interface as
+ *      it can take. This is called on every pass through process(), whether or
+ *      not the interface is connected.
+ * queueLengths - (optional) Report the current length of the interface's send
+ *      and receive queues, for statistics.
+ */
+typedef struct {
+    bool (*connected)(void* device);
+    int (*enqueue)(void* device, const uint8_t* data, int length);
+    int (*available)(void* device);
+    void (*flush)(void* device);
+    void (*queueLengths)(void* device, int* sendLength, int* receiveLength);
+} SinkOperations;
+
+/* Public: Counters for a sink, logged by logStatistics(...).
+ */
+typedef struct {
+    unsigned int sentMessages;
+    unsigned int droppedMessages;
+    unsigned int dataSent;
+    unsigned int sendQueueLength;
+    unsigned int receiveQueueLength;
+    unsigned int waitTimeouts;
+    unsigned int evictedMessages;
+    unsigned int coalescedMessages;
+} SinkStatistics;
+
+/* Public: A signal passed through a sink's filter, and how often.
  *
- * This structure sets up a standard interface for all output devices to receive
- * updates from CAN. Right now, this means USB and UART, but it can be extended
- * to output over another UART, Network, WiFi, etc.
+ * key - Identifies the signal's name, see addSignalFilter(...).
+ * minimumIntervalMs - The least time between two messages for the signal sent
+ *      to the sink, or 0 to send every one.
+ * lastSentMs - When the last message for the signal was sent to the sink.
+ */
+typedef struct {
+    uint32_t key;
+    unsigned int minimumIntervalMs;
+    unsigned long lastSentMs;
+} SignalFilter;
+
+/* Public: Narrows down the messages sent to a sink, installed by the host on
+ * the other end of the interface. Messages are checked against the filter
+ * before they're serialized, so nothing is spent encoding messages no sink
+ * wants.
  *
- * TODO This file could most likely be refactored and improved. Ideally these
- * output interfaces would all have the same type, so this could just be a list
- * of "receiver" functions. maybe instead of the devices, this is a list of the
- * sendQueues?
+ * enabled - If false, the sink is sent everything it subscribes to.
+ * messageClasses - The MessageClasses to send, a mask of MESSAGE_CLASS_MASK(...)
+ *      bits. This narrows the sink's subscriptions, it can't add to them.
+ * filterCanIds - If true, only send CAN messages and diagnostic responses with
+ *      an arbitration ID from minimumCanId to maximumCanId (inclusive).
+ * signalCount - If more than 0, only send the simple messages for these
+ *      signals.
+ * signals - The signals to send.
  */
 typedef struct {
-    UsbDevice* usb;
-    UartDevice* uart;
-    NetworkDevice* network;
+    bool enabled;
+    uint8_t messageClasses;
+    bool filterCanIds;
+    uint32_t minimumCanId;
+    uint32_t maximumCanId;
+    int signalCount;
+    SignalFilter signals[MAX_SINK_FILTER_SIGNAL_COUNT];
+} SinkFilter;
+
+/* Public: An output interface registered with the pipeline.
+ *
+ * name - A name for the sink in log messages.
+ * operations - How to send messages out of the interface.
+ * device - The device passed to each of the operations.
+ * descriptor - The interface's descriptor, for its backpressure policy.
+ * subscriptions - The MessageClasses sent to this sink, a mask of
+ *      MESSAGE_CLASS_MASK(...) bits.
+ * filter - The host's filter for the messages sent to the sink.
+ * overridePayloadFormat - If true, messages are serialized for the sink in
+ *      payloadFormat instead of the configured payload format.
+ * payloadFormat - The sink's own payload format.
+ * statistics - Counters for messages sent to the sink.
+ */
+typedef struct {
+    const char* name;
+    const SinkOperations* operations;
+    void* device;
+    openxc::interface::InterfaceDescriptor* descriptor;
+    uint8_t subscriptions;
+    SinkFilter filter;
+    bool overridePayloadFormat;
+    openxc::payload::PayloadFormat payloadFormat;
+    SinkStatistics statistics;
+} PipelineSink;
+
+/* Public: The output interfaces that want to be notified of new messages from
+ *      the CAN bus, diagnostic responses, command responses and logs.
+ *
+ * Any number of interfaces (up to MAX_PIPELINE_SINK_COUNT) can be registered
+ * with addSink(...), and each receives only the classes of message it
+ * subscribes to.
+ *
+ * sinks - The registered sinks, in the order they're sent each message.
+ * sinkCount - The number of registered sinks.
+ */
+typedef struct {
+    PipelineSink sinks[MAX_PIPELINE_SINK_COUNT];
+    int sinkCount;
 } Pipeline;
 
+/* Public: The operations for the VI's built-in output interfaces, to use with
+ * addSink(...).
+ *
+ * USB_SINK_OPERATIONS - The IN endpoint of a UsbDevice.
+ * USB_LOG_SINK_OPERATIONS - The log endpoint of a UsbDevice.
+ * UART_SINK_OPERATIONS - A UartDevice.
+ * UART_LOG_SINK_OPERATIONS - Debug log output on the UART, written right away
+ *      instead of queued. The device is ignored.
+ * NETWORK_SINK_OPERATIONS - A NetworkDevice.
+ */
+extern const SinkOperations USB_SINK_OPERATIONS;
+extern const SinkOperations USB_LOG_SINK_OPERATIONS;
+extern const SinkOperations UART_SINK_OPERATIONS;
+extern const SinkOperations UART_LOG_SINK_OPERATIONS;
+extern const SinkOperations NETWORK_SINK_OPERATIONS;
+
+/* Public: Remove all of the sinks from the pipeline.
+ */
+void initialize(Pipeline* pipeline);
+
+/* Public: Register an output interface with the pipeline.
+ *
+ * pipeline - The pipeline to add the sink to.
+ * name - A name for the sink in log messages.
+ * operations - How to send messages out of the interface.
+ * device - The device to pass to the operations.
+ * descriptor - The interface's descriptor, for its backpressure policy.
+ * subscriptions - The MessageClasses to send to the sink, a mask of
+ *      MESSAGE_CLASS_MASK(...) bits.
+ *
+ * Returns true if the sink was added, false if the pipeline is full.
+ */
+bool addSink(Pipeline* pipeline, const char* name,
+        const SinkOperations* operations, void* device,
+        openxc::interface::InterfaceDescriptor* descriptor,
+        uint8_t subscriptions);
+
+/* Public: Unregister every sink for a device from the pipeline, dropping any
+ *      messages held back for them.
+ *
+ * pipeline - The pipeline to remove the sinks from.
+ * device - The device the sinks were registered with.
+ */
+void removeSinks(Pipeline* pipeline, void* device);
+
+/* Public: Add a signal to pass through a sink filter.
+ *
+ * filter - The filter to add the signal to.
+ * name - The name of the signal.
+ * frequency - The most messages per second to send for the signal, or 0 for no
+ *      limit.
+ *
+ * Returns true if the signal was added, false if the filter is full.
+ */
+bool addSignalFilter(SinkFilter* filter, const char* name, float frequency);
+
+/* Public: Install a filter on every sink for an interface, replacing any
+ *      filter it already had. Sinks that only subscribe to log messages (e.g.
+ *      the USB log endpoint) are left alone.
+ *
+ * pipeline - The pipeline with the sinks.
+ * descriptor - The descriptor of the interface the sinks were registered with.
+ * filter - The filter to install, or NULL to remove the sinks' filters.
+ *
+ * Returns the number of sinks the filter was installed on.
+ */
+int setFilter(Pipeline* pipeline,
+        openxc::interface::InterfaceDescriptor* descriptor,
+        const SinkFilter* filter);
+
+/* Public: Set the payload format of every sink for an interface, so the
+ *      interface can use a different format than the rest.
+ *
+ * pipeline - The pipeline with the sinks.
+ * descriptor - The descriptor of the interface the sinks were registered with.
+ * format - The format for the sinks, or NULL to use the configured payload
+ *      format again.
+ *
+ * Returns the number of sinks that were changed.
+ */
+int setPayloadFormat(Pipeline* pipeline,
+        openxc::interface::InterfaceDescriptor* descriptor,
+        const openxc::payload::PayloadFormat* format);
+
+/* Public: Return the payload format an interface's sinks use, which is the
+ *      configured payload format unless it was changed with
+ *      setPayloadFormat(...).
+ */
+openxc::payload::PayloadFormat getPayloadFormat(Pipeline* pipeline,
+        openxc::interface::InterfaceDescriptor* descriptor);
+
 /* Public: Serialize the message to a bytestream (conforming to the OpenXC
- * standard and the currently selected payload format) and send it out to the
- * pipeline.
+ * standard and each sink's payload format) and send it out to the pipeline.
+ *
+ * The message is serialized at most once per payload format, and only in the
+ * formats of the sinks that will be sent it.
  *
- * This will accept both raw and translated typed messages.
+ * This will accept both raw and translated typed messages. The message isn't
+ * serialized at all if every sink's filter rejects it.
+ *
+ * Raw CAN messages for sinks using the CAN batch payload format are batched if
+ * any of those sinks accepts them, and the batches are sent to every one of
+ * them subscribed to CAN messages.
  *
  * message - A message structure containing the type and data for the message.
  * pipeline - The pipeline to send on.
+ * timestamp - (optional) When the CAN message the message came from was
+ *      received, in microseconds. It's included in the payload if the
+ *      emitTimestamps config option is set.
+ * frame - (optional) For a diagnostic response too long to publish as one
+ *      message, the index of this chunk of it, or -1 for the last chunk.
+ * sinks - (optional) Only consider these sinks, a mask with a bit for each
+ *      index in pipeline->sinks.
  */
 void publish(openxc_VehicleMessage* message,
-        openxc::pipeline::Pipeline* pipeline);
+        openxc::pipeline::Pipeline* pipeline, const uint32_t* timestamp=NULL,
+        const int* frame=NULL, uint8_t sinks=ALL_PIPELINE_SINKS);
 
-/* Public: Queue the message to send on all of the interfaces registered with
- *      the pipeline. If the any of the queues does not have sufficient capacity
- *      to store the message, it will be dropped for that interface only (i.e.
- *      UART can be overloaded and dropping messages but USB will continue
- *      with a 100% translation rate).
+/* Public: Queue the message to send on all of the sinks registered with the
+ *      pipeline that subscribe to its class. If the any of the queues does not
+ *      have sufficient capacity to store the message, it will be dropped for
+ *      that sink only (i.e. UART can be overloaded and dropping messages but
+ *      USB will continue with a 100% translation rate).
+ *
+ * The message is copied once into a shared payload slot. An interface whose
+ * queue is full holds a reference to the slot instead of its own copy, and
+ * the payload is moved into the queue by process() as it drains. What happens
+ * when an interface is too far behind to hold any more depends on its
+ * backpressure policy (see InterfaceDescriptor).
  *
  * pipeline - Container of all pipelines to send the message on.
  * message - The message data as an array of uint8_t.
  * messageSize - The length of the message's byte array.
- * messageClass - the class of the message, used to decide which endpoints in
- *      the pipeline receive the message.
+ * messageClass - the class of the message, used to decide which sinks in the
+ *      pipeline receive the message.
  */
 void sendMessage(Pipeline* pipeline, uint8_t* message, int messageSize,
         MessageClass messageClass);
 
-/* Public: Perform interface-specific functions to flush all message queues out
- *      to their respective physical interfaces.
+/* Public: Flush all of the sinks' message queues out to their respective
+ *      physical interfaces.
  *
- * TODO This is the tricky part with making the pipeline more generic - this
- * needs to call an interface-specific method for each queue.
- *
- * pipeline - Pipeline instance with the interface queues to flush.
+ * pipeline - Pipeline instance with the sinks to flush.
  */
 void process(Pipeline* pipeline);
 
+/* Public: Return the connected sinks that subscribe to a class of message.
+ *
+ * Returns a mask with a bit for each index in pipeline->sinks.
+ */
+uint8_t subscribedSinks(Pipeline* pipeline, MessageClass messageClass);
+
+/* Public: Return how many bytes one sink can accept right now, without waiting
+ *      or holding anything back.
+ *
+ * pipeline - The pipeline the sink is registered with.
+ * sink - The index of the sink in pipeline->sinks.
+ *
+ * Returns the free space in the sink's send queue, or 0 if it's disconnected or
+ * already has messages held back.
+ */
+int sendCapacity(Pipeline* pipeline, int sink);
+
 void logStatistics(Pipeline* pipeline);
 
 } // namespace interface
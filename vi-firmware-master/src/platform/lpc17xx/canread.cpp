@@ -2,11 +2,13 @@
 #include "canutil_lpc17xx.h"
 #include "signals.h"
 #include "util/log.h"
+#include "util/timer.h"
 
 using openxc::util::log::debug;
+using openxc::util::time::systemTimeUs;
 using openxc::signals::getCanBusCount;
 using openxc::signals::getCanBuses;
-using openxc::can::shouldAcceptMessage;
+using openxc::can::classifyMessage;
 
 CanMessage receiveCanMessage(CanBus* bus) {
     CAN_MSG_Type message;
@@ -17,7 +19,8 @@ CanMessage receiveCanMessage(CanBus* bus) {
         format: message.format == STD_ID_FORMAT ?
             CanMessageFormat::STANDARD : CanMessageFormat::EXTENDED,
         data: {0},
-        length: message.len
+        length: message.len,
+        timestamp: systemTimeUs()
     };
 
     memcpy(result.data, message.dataA, 4);
@@ -32,8 +35,10 @@ void CAN_IRQHandler() {
         CanBus* bus = &getCanBuses()[i];
         if((CAN_IntGetStatus(CAN_CONTROLLER(bus)) & 0x01) == 1) {
             CanMessage message = receiveCanMessage(bus);
-            if(shouldAcceptMessage(bus, message.id) &&
-                    !QUEUE_PUSH(CanMessage, &bus->receiveQueue, message)) {
+            CanReceiveClass receiveClass;
+            if(classifyMessage(bus, message.id, &receiveClass) &&
+                    !QUEUE_PUSH(CanMessage, &bus->receiveQueues[receiveClass],
+                        message)) {
                 // An exception to the "don't leave commented out code" rule,
                 // this log statement is useful for debugging performance issues
                 // but if left enabled all of the time, it can can slown down
@@ -43,6 +48,7 @@ void CAN_IRQHandler() {
                 // debug("Dropped CAN message with ID 0x%02x -- queue is full",
                 // message.id);
                 ++bus->messagesDropped;
+                ++bus->classMessagesDropped[receiveClass];
             }
         }
     }
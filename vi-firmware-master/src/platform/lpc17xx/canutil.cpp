@@ -61,42 +61,78 @@ bool openxc::can::resetAcceptanceFilterStatus(CanBus* bus, bool enabled) {
     return true;
 }
 
+/* Private: Load the compacted acceptance filters of one format for a bus into
+ * the AF table - single IDs as explicit entries and everything else as group
+ * entries.
+ *
+ * filterCount - the number of entries in the table so far, incremented for
+ *      each entry loaded.
+ *
+ * Returns false if the filters don't fit in the table.
+ */
+static bool loadAcceptanceFilters(CanBus* bus, CanMessageFormat format,
+        uint16_t* filterCount) {
+    AcceptanceFilterRange ranges[MAX_ACCEPTANCE_FILTERS];
+    int rangeCount = openxc::can::compactAcceptanceFilters(bus, format,
+            ranges, MAX_ACCEPTANCE_FILTERS);
+    if(rangeCount < 0 ||
+            *filterCount + rangeCount > MAX_ACCEPTANCE_FILTERS) {
+        debug("Filters for bus %d don't fit in the AF table", bus->address);
+        return false;
+    }
+
+    CAN_ID_FORMAT_Type idFormat = format == CanMessageFormat::STANDARD ?
+            STD_ID_FORMAT : EXT_ID_FORMAT;
+    for(int i = 0; i < rangeCount; i++) {
+        CAN_ERROR result;
+        if(ranges[i].first == ranges[i].last) {
+            result = CAN_LoadExplicitEntry(CAN_CONTROLLER(bus),
+                    ranges[i].first, idFormat);
+        } else {
+            result = CAN_LoadGroupEntry(CAN_CONTROLLER(bus),
+                    ranges[i].first, ranges[i].last, idFormat);
+        }
+
+        if(result != CAN_OK) {
+            debug("Couldn't add filter 0x%x-0x%x to bus %d", ranges[i].first,
+                    ranges[i].last, bus->address);
+            return false;
+        }
+        ++*filterCount;
+    }
+    return true;
+}
+
 bool openxc::can::updateAcceptanceFilterTable(CanBus* buses, const int busCount) {
     clearAcceptanceFilterTable();
 
     uint16_t filterCount = 0;
-    CAN_ERROR result = CAN_OK;
+    bool tableFull = false;
     bool bypassFilters = false;
     for(int i = 0; i < busCount; i++) {
         CanBus* bus = &buses[i];
         bypassFilters |= bus->bypassFilters;
-        AcceptanceFilterListEntry* entry;
-        LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
-            if(filterCount >= MAX_ACCEPTANCE_FILTERS) {
-                break;
-            }
-            result = CAN_LoadExplicitEntry(CAN_CONTROLLER(bus), entry->filter,
-                   entry->format == CanMessageFormat::STANDARD ?
-                       STD_ID_FORMAT : EXT_ID_FORMAT);
-           if(result != CAN_OK) {
-                debug("Couldn't add filter 0x%x to bus %d", entry->filter,
-                        bus->address);
-                break;
-           }
-           ++filterCount;
+        if(!tableFull) {
+            tableFull = !loadAcceptanceFilters(bus, CanMessageFormat::STANDARD,
+                        &filterCount) ||
+                    !loadAcceptanceFilters(bus, CanMessageFormat::EXTENDED,
+                        &filterCount);
         }
     }
 
     // On the LPC17xx, the AF mode is global - if it's off, it's off for
     // both controllers. That's why this is outside the loop above, and
     // we're counting *total* filters, not filters per bus. We also disable the
-    // AF if any of the busses has bypassFilters == true.
-    bypassFilters |= filterCount == 0;
+    // AF if any of the busses has bypassFilters == true. If the filters didn't
+    // fit in the table, the hardware AF is bypassed and messages are only
+    // filtered in software by shouldAcceptMessage.
+    bypassFilters |= filterCount == 0 || tableFull;
     if(bypassFilters) {
-        debug("No filters configured or a bus in bypass, disabling AF");
+        debug("No filters configured, AF table full or a bus in bypass, "
+                "disabling AF");
     }
     resetAcceptanceFilterStatus(NULL, !bypassFilters);
-    return result == CAN_OK;
+    return true;
 }
 
 void openxc::can::deinitialize(CanBus* bus) { }
@@ -0,0 +1,97 @@
+#include "storage.h"
+#include "util/log.h"
+#include "LPC17xx.h"
+#include <string.h>
+
+// The last 32KB sector of flash is kept out of the program image by the linker
+// scripts, and holds a log of StorageRecords.
+#define STORAGE_SECTOR 29
+#define STORAGE_START_ADDRESS 0x78000
+#define STORAGE_SIZE 0x8000
+#define STORAGE_RECORD_COUNT (STORAGE_SIZE / sizeof(StorageRecord))
+
+#define IAP_LOCATION 0x1fff1ff1
+#define IAP_PREPARE_SECTORS 50
+#define IAP_COPY_RAM_TO_FLASH 51
+#define IAP_ERASE_SECTORS 52
+#define IAP_CMD_SUCCESS 0
+
+using openxc::util::log::debug;
+using openxc::storage::StorageRecord;
+
+typedef void (*IapEntry)(uint32_t command[], uint32_t result[]);
+
+static const IapEntry iapEntry = (IapEntry) IAP_LOCATION;
+static const StorageRecord* RECORDS =
+        (const StorageRecord*) STORAGE_START_ADDRESS;
+
+/* Private: Run a command with the In-Application Programming routines in the
+ * boot ROM. Flash can't be read while it's being written, so interrupts are
+ * disabled for the duration.
+ */
+static bool runIapCommand(uint32_t command[]) {
+    uint32_t result[5];
+    __disable_irq();
+    iapEntry(command, result);
+    __enable_irq();
+    return result[0] == IAP_CMD_SUCCESS;
+}
+
+static bool prepareSector() {
+    uint32_t command[5] = {IAP_PREPARE_SECTORS, STORAGE_SECTOR,
+            STORAGE_SECTOR};
+    return runIapCommand(command);
+}
+
+static bool eraseSector() {
+    uint32_t command[5] = {IAP_ERASE_SECTORS, STORAGE_SECTOR, STORAGE_SECTOR,
+            SystemCoreClock / 1000};
+    return prepareSector() && runIapCommand(command);
+}
+
+static bool programRecord(const StorageRecord* record, int index) {
+    uint32_t command[5] = {IAP_COPY_RAM_TO_FLASH, (uint32_t) &RECORDS[index],
+            (uint32_t) record, sizeof(StorageRecord), SystemCoreClock / 1000};
+    return prepareSector() && runIapCommand(command);
+}
+
+/* Private: Find the last record written for a key, and the first free slot
+ * after all of the written records.
+ */
+static const StorageRecord* findRecord(const char* key, size_t* freeIndex) {
+    const StorageRecord* found = NULL;
+    size_t i;
+    for(i = 0; i < STORAGE_RECORD_COUNT &&
+            RECORDS[i].magic == STORAGE_RECORD_MAGIC; i++) {
+        if(!strncmp(RECORDS[i].key, key, MAX_STORAGE_KEY_LENGTH)) {
+            found = &RECORDS[i];
+        }
+    }
+
+    if(freeIndex != NULL) {
+        *freeIndex = i;
+    }
+    return found;
+}
+
+bool openxc::storage::readRecord(const char* key, StorageRecord* record) {
+    const StorageRecord* found = findRecord(key, NULL);
+    if(found != NULL) {
+        *record = *found;
+    }
+    return found != NULL;
+}
+
+bool openxc::storage::writeRecord(const StorageRecord* record) {
+    size_t freeIndex;
+    findRecord(record->key, &freeIndex);
+    if(freeIndex >= STORAGE_RECORD_COUNT) {
+        debug("Persistent storage is full, erasing it");
+        if(!eraseSector()) {
+            debug("Unable to erase persistent storage");
+            return false;
+        }
+        freeIndex = 0;
+    }
+    return programRecord(record, freeIndex);
+}
@@ -5,7 +5,7 @@
 
 #define DELAY_TIMER LPC_TIM0
 
-unsigned int SYSTEM_TICK_COUNT;
+volatile unsigned int SYSTEM_TICK_COUNT;
 
 extern "C" {
 
@@ -35,6 +35,30 @@ unsigned long openxc::util::time::systemTimeMs() {
     return SYSTEM_TICK_COUNT;
 }
 
+unsigned long openxc::util::time::systemTimeUs() {
+    // SysTick counts down from LOAD to 0 once per 1ms tick - read the tick
+    // count again in case it rolled over between the two reads. The SysTick
+    // interrupt has the lowest priority, so when this is called from another
+    // ISR the counter may have reloaded without the tick being counted yet.
+    unsigned int ticks;
+    uint32_t value;
+    bool tickPending;
+    do {
+        ticks = SYSTEM_TICK_COUNT;
+        value = SysTick->VAL;
+        tickPending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+        if(tickPending) {
+            // read the counter again, in case it reloaded after the first read
+            value = SysTick->VAL;
+        }
+    } while(ticks != SYSTEM_TICK_COUNT);
+
+    if(tickPending) {
+        ++ticks;
+    }
+    return ticks * 1000 + (SysTick->LOAD - value) * 1000 / (SysTick->LOAD + 1);
+}
+
 void openxc::util::time::initialize() {
     // Configure for 1ms tick
     SysTick_Config(SystemCoreClock / 1000);
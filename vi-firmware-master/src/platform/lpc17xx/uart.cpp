@@ -1,6 +1,7 @@
 #include <string.h>
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_uart.h"
+#include "lpc17xx_gpdma.h"
 #include "interface/uart.h"
 #include "pipeline.h"
 #include "config.h"
@@ -14,6 +15,11 @@
 #define UART_STATUS_PORT 0
 #define UART_STATUS_PIN 18
 
+// Leave channel 0, the highest priority, for anything more latency sensitive
+#define UART1_TX_DMA_CHANNEL 1
+// The transfer size field of a DMA channel's control register is 12 bits
+#define MAX_DMA_TRANSFER_SIZE 0xfff
+
 #ifdef BLUEBOARD
 
 #define UART1_FUNCNUM 2
@@ -45,11 +51,19 @@ using openxc::config::getConfiguration;
 using openxc::util::log::debug;
 using openxc::pipeline::Pipeline;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::peek;
+using openxc::util::bytebuffer::discard;
+using openxc::interface::uart::UartDevice;
 using openxc::gpio::GpioValue;
 using openxc::gpio::GpioDirection;
 
 __IO int32_t RTS_STATE;
-__IO FlagStatus TRANSMIT_INTERRUPT_STATUS;
+// The number of bytes at the head of the send queue that the DMA channel is
+// sending, or 0 if it's idle. They're left in the queue until the transfer
+// completes.
+__IO int32_t TRANSMIT_DMA_LENGTH;
+// The second half of a transfer, if the data wraps around the end of the queue
+static GPDMA_LLI_Type WRAPPED_TRANSMIT_DMA;
 
 /* Disable request to send through RTS line. We cannot handle any more data
  * right now.
@@ -71,15 +85,6 @@ void resumeReceive() {
     }
 }
 
-void disableTransmitInterrupt() {
-    UART_IntConfig(UART1_DEVICE, UART_INTCFG_THRE, DISABLE);
-}
-
-void enableTransmitInterrupt() {
-    TRANSMIT_INTERRUPT_STATUS = SET;
-    UART_IntConfig(UART1_DEVICE, UART_INTCFG_THRE, ENABLE);
-}
-
 void handleReceiveInterrupt() {
     while(!QUEUE_FULL(uint8_t, &getConfiguration()->uart.receiveQueue)) {
         uint8_t byte;
@@ -95,34 +100,66 @@ void handleReceiveInterrupt() {
     }
 }
 
-void handleTransmitInterrupt() {
-    disableTransmitInterrupt();
-
-    while(UART_CheckBusy(UART1_DEVICE) == SET);
-
-    while(!QUEUE_EMPTY(uint8_t, &getConfiguration()->uart.sendQueue)) {
-        uint8_t byte = QUEUE_PEEK(uint8_t, &getConfiguration()->uart.sendQueue);
-        // We used to use non-blocking here, but then we got into a race
-        // condition - if the transmit interrupt occurred while adding more data
-        // to the queue, you could lose data. We should be able to switch back
-        // to non-blocking if we disabled interrupts while modifying the queue
-        // (good practice anyway) but for now switching this to block sends
-        // seems to work OK without any significant impacts.
-        if(UART_Send(UART1_DEVICE, &byte, 1, BLOCKING)) {
-            QUEUE_POP(uint8_t, &getConfiguration()->uart.sendQueue);
-        } else {
-            break;
-        }
+/* Private: Start the DMA channel sending everything in the send queue, straight
+ * out of the queue's storage. If the data wraps around the end of storage, a
+ * second linked list descriptor picks up the rest from the start.
+ *
+ * Must be called with the DMA interrupt disabled or from the DMA interrupt
+ * handler, and only when no transfer is running.
+ */
+static void startTransmitDma(UartDevice* device) {
+    int length;
+    uint8_t* data = peek(&device->sendQueue, &length);
+    length = MIN(length, MAX_DMA_TRANSFER_SIZE);
+    if(length == 0) {
+        return;
     }
 
-    if(QUEUE_EMPTY(uint8_t, &getConfiguration()->uart.sendQueue)) {
-        disableTransmitInterrupt();
-        TRANSMIT_INTERRUPT_STATUS = RESET;
-    } else {
-        enableTransmitInterrupt();
+    int wrappedLength = MIN(QUEUE_LENGTH(uint8_t, &device->sendQueue) - length,
+            MAX_DMA_TRANSFER_SIZE);
+
+    GPDMA_Channel_CFG_Type transfer;
+    transfer.ChannelNum = UART1_TX_DMA_CHANNEL;
+    transfer.TransferSize = length;
+    transfer.TransferWidth = 0;
+    transfer.SrcMemAddr = (uint32_t) data;
+    transfer.DstMemAddr = 0;
+    transfer.TransferType = GPDMA_TRANSFERTYPE_M2P;
+    transfer.SrcConn = 0;
+    transfer.DstConn = GPDMA_CONN_UART1_Tx;
+    transfer.DMALLI = 0;
+
+    if(wrappedLength > 0) {
+        WRAPPED_TRANSMIT_DMA.SrcAddr = (uint32_t) device->sendQueue.elements;
+        WRAPPED_TRANSMIT_DMA.DstAddr = (uint32_t) &LPC_UART1->THR;
+        WRAPPED_TRANSMIT_DMA.NextLLI = 0;
+        WRAPPED_TRANSMIT_DMA.Control =
+                GPDMA_DMACCxControl_TransferSize(wrappedLength)
+                | GPDMA_DMACCxControl_SBSize(GPDMA_BSIZE_1)
+                | GPDMA_DMACCxControl_DBSize(GPDMA_BSIZE_1)
+                | GPDMA_DMACCxControl_SWidth(GPDMA_WIDTH_BYTE)
+                | GPDMA_DMACCxControl_DWidth(GPDMA_WIDTH_BYTE)
+                | GPDMA_DMACCxControl_SI
+                | GPDMA_DMACCxControl_I;
+        transfer.DMALLI = (uint32_t) &WRAPPED_TRANSMIT_DMA;
+        length += wrappedLength;
+    }
+
+    if(GPDMA_Setup(&transfer) == SUCCESS) {
+        TRANSMIT_DMA_LENGTH = length;
+        GPDMA_ChannelCmd(UART1_TX_DMA_CHANNEL, ENABLE);
     }
 }
 
+/* Private: Drop the bytes that were just sent from the send queue, and start
+ * sending whatever was queued in the meantime.
+ */
+static void handleTransmitDmaComplete() {
+    discard(&getConfiguration()->uart.sendQueue, TRANSMIT_DMA_LENGTH);
+    TRANSMIT_DMA_LENGTH = 0;
+    startTransmitDma(&getConfiguration()->uart);
+}
+
 extern "C" {
 
 void UART1_IRQHandler() {
@@ -148,14 +185,29 @@ void UART1_IRQHandler() {
         case UART_IIR_INTID_CTI:
             handleReceiveInterrupt();
             break;
-        case UART_IIR_INTID_THRE:
-            handleTransmitInterrupt();
-            break;
         default:
             break;
     }
 }
 
+void DMA_IRQHandler() {
+    if(GPDMA_IntGetStatus(GPDMA_STAT_INTTC, UART1_TX_DMA_CHANNEL)) {
+        GPDMA_ClearIntPending(GPDMA_STATCLR_INTTC, UART1_TX_DMA_CHANNEL);
+        // A transfer that wraps around the queue interrupts after each
+        // descriptor - it's only done once the channel disables itself
+        if(!GPDMA_IntGetStatus(GPDMA_STAT_ENABLED_CH, UART1_TX_DMA_CHANNEL)) {
+            handleTransmitDmaComplete();
+        }
+    }
+
+    if(GPDMA_IntGetStatus(GPDMA_STAT_INTERR, UART1_TX_DMA_CHANNEL)) {
+        GPDMA_ClearIntPending(GPDMA_STATCLR_INTERR, UART1_TX_DMA_CHANNEL);
+        // nothing was discarded, so start over from the head of the queue
+        TRANSMIT_DMA_LENGTH = 0;
+        startTransmitDma(&getConfiguration()->uart);
+    }
+}
+
 }
 
 void openxc::interface::uart::read(UartDevice* device,
@@ -209,15 +261,29 @@ void configureUartPins() {
 void configureFifo() {
     UART_FIFO_CFG_Type fifoConfig;
     UART_FIFOConfigStructInit(&fifoConfig);
+    // The transmit FIFO requests more data from the DMA channel instead of
+    // interrupting the CPU
+    fifoConfig.FIFO_DMAMode = ENABLE;
     UART_FIFOConfig(UART1_DEVICE, &fifoConfig);
 }
 
+/* Transmitting is all done by DMA, so the UART only interrupts for received
+ * data and flow control, and the DMA channel only interrupts when it's sent
+ * everything it was given - not once per FIFO's worth.
+ */
 void configureInterrupts() {
     UART_IntConfig(UART1_DEVICE, UART_INTCFG_RBR, ENABLE);
-    enableTransmitInterrupt();
     /* preemption = 1, sub-priority = 1 */
     NVIC_SetPriority(UART1_IRQn, ((0x01<<3)|0x01));
     NVIC_EnableIRQ(UART1_IRQn);
+
+    NVIC_DisableIRQ(DMA_IRQn);
+    // any transfer in progress was cut off by the reset, so start the queue
+    // over
+    GPDMA_Init();
+    TRANSMIT_DMA_LENGTH = 0;
+    NVIC_SetPriority(DMA_IRQn, ((0x01<<3)|0x01));
+    NVIC_EnableIRQ(DMA_IRQn);
 }
 
 void openxc::interface::uart::changeBaudRate(UartDevice* device, int baud) {
@@ -227,7 +293,6 @@ void openxc::interface::uart::changeBaudRate(UartDevice* device, int baud) {
     UART_Init(UART1_DEVICE, &UARTConfigStruct);
 
     RTS_STATE = INACTIVE;
-    TRANSMIT_INTERRUPT_STATUS = RESET;
 
     configureFifo();
     configureInterrupts();
@@ -270,11 +335,13 @@ void openxc::interface::uart::initialize(UartDevice* device) {
 
 void openxc::interface::uart::processSendQueue(UartDevice* device) {
     if(!QUEUE_EMPTY(uint8_t, &device->sendQueue)) {
-        if(TRANSMIT_INTERRUPT_STATUS == RESET) {
-            handleTransmitInterrupt();
-        } else {
-            enableTransmitInterrupt();
+        // if a transfer is running, the DMA interrupt picks up the new data
+        // when it's done
+        NVIC_DisableIRQ(DMA_IRQn);
+        if(TRANSMIT_DMA_LENGTH == 0) {
+            startTransmitDma(device);
         }
+        NVIC_EnableIRQ(DMA_IRQn);
     }
 }
 
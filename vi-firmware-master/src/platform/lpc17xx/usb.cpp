@@ -41,6 +41,10 @@ using openxc::interface::usb::UsbDevice;
 using openxc::interface::usb::UsbEndpoint;
 using openxc::interface::usb::UsbEndpointDirection;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::reserve;
+using openxc::util::bytebuffer::commit;
+using openxc::util::bytebuffer::peek;
+using openxc::util::bytebuffer::discard;
 using openxc::gpio::GPIO_VALUE_HIGH;
 using openxc::gpio::GPIO_VALUE_LOW;
 
@@ -95,7 +99,7 @@ void EVENT_USB_Device_ControlRequest() {
     uint8_t snapshot[length];
     if(length > 0) {
         QUEUE_SNAPSHOT(uint8_t, &payloadQueue, snapshot, length);
-        openxc::interface::usb::handleIncomingMessage(snapshot, length);
+        openxc::interface::usb::handleControlMessage(snapshot, length);
     }
 }
 
@@ -110,7 +114,15 @@ void EVENT_USB_Device_ConfigurationChanged(void) {
 
 }
 
-/* Private: Flush any queued data out to the USB host. */
+/* Private: Flush any queued data out to the USB host.
+ *
+ * The endpoints are double banked, so while the USB controller's DMA engine is
+ * sending one bank to the host the other can be filled - keep going until
+ * neither is free or the queue is empty, so the host always has the next
+ * packet waiting. Each write comes straight from the contiguous run of bytes
+ * at the head of the queue, and they're only dropped from the queue once the
+ * bank is handed off to the controller.
+ */
 static void flushQueueToHost(UsbDevice* usbDevice, UsbEndpoint* endpoint) {
     if(!usb::connected(usbDevice) || QUEUE_EMPTY(uint8_t, &endpoint->queue)) {
         return;
@@ -118,19 +130,13 @@ static void flushQueueToHost(UsbDevice* usbDevice, UsbEndpoint* endpoint) {
 
     uint8_t previousEndpoint = Endpoint_GetCurrentEndpoint();
     Endpoint_SelectEndpoint(endpoint->address);
-    if(Endpoint_IsINReady()) {
-        // get bytes from transmit FIFO into intermediate buffer
-        int byteCount = 0;
-        while(!QUEUE_EMPTY(uint8_t, &endpoint->queue)
-                && byteCount < USB_SEND_BUFFER_SIZE) {
-            endpoint->sendBuffer[byteCount++] = QUEUE_POP(uint8_t,
-                    &endpoint->queue);
-        }
-
-        if(byteCount > 0) {
-            Endpoint_Write_Stream_LE(endpoint->sendBuffer, byteCount, NULL);
-            Endpoint_ClearIN();
-        }
+    while(Endpoint_IsINReady() && !QUEUE_EMPTY(uint8_t, &endpoint->queue)) {
+        int byteCount;
+        uint8_t* data = peek(&endpoint->queue, &byteCount);
+        byteCount = MIN(byteCount, USB_SEND_BUFFER_SIZE);
+        Endpoint_Write_Stream_LE(data, byteCount, NULL);
+        Endpoint_ClearIN();
+        discard(&endpoint->queue, byteCount);
     }
     Endpoint_SelectEndpoint(previousEndpoint);
 }
@@ -251,8 +257,19 @@ void openxc::interface::usb::read(UsbDevice* device, UsbEndpoint* endpoint,
     bool receivedData = false;
     while(Endpoint_IsOUTReceived()) {
         while(Endpoint_BytesInEndpoint()) {
-            if(!QUEUE_PUSH(uint8_t, &endpoint->queue, Endpoint_Read_8())) {
+            // Stream straight into the free space at the end of the queue
+            int available;
+            uint8_t* tail = reserve(&endpoint->queue, &available);
+            uint16_t byteCount = Endpoint_BytesInEndpoint();
+            if(available == 0) {
+                Endpoint_Read_8();
                 debug("Dropped write from host -- queue is full");
+            } else {
+                if(byteCount > available) {
+                    byteCount = available;
+                }
+                Endpoint_Read_Stream_LE(tail, byteCount, NULL);
+                commit(&endpoint->queue, byteCount);
             }
             receivedData = true;
         }
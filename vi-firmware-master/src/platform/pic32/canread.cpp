@@ -2,12 +2,15 @@
 #include "canutil_pic32.h"
 #include "signals.h"
 #include "util/log.h"
+#include "util/timer.h"
 #include "power.h"
 
 namespace power = openxc::power;
 
 using openxc::util::log::debug;
+using openxc::util::time::systemTimeUs;
 using openxc::signals::getCanBuses;
+using openxc::can::classifyMessage;
 
 static CanMessage receiveCanMessage(CanBus* bus) {
     CAN::RxMessageBuffer* message = CAN_CONTROLLER(bus)->getRxMessage(
@@ -17,7 +20,8 @@ static CanMessage receiveCanMessage(CanBus* bus) {
         id: message->msgSID.SID,
         format: CanMessageFormat::STANDARD,
         data: {0},
-        length: (uint8_t) message->msgEID.DLC
+        length: (uint8_t) message->msgEID.DLC,
+        timestamp: systemTimeUs()
     };
     memcpy(result.data, message->data, CAN_MESSAGE_SIZE);
 
@@ -47,7 +51,12 @@ void openxc::can::pic32::handleCanInterrupt(CanBus* bus) {
                 CAN::RX_CHANNEL_NOT_EMPTY, false);
 
         CanMessage message = receiveCanMessage(bus);
-        if(!QUEUE_PUSH(CanMessage, &bus->receiveQueue, message)) {
+        // The hardware AF is turned off if it can't hold every filter, so the
+        // messages are filtered in software as well
+        CanReceiveClass receiveClass;
+        if(classifyMessage(bus, message.id, &receiveClass) &&
+                !QUEUE_PUSH(CanMessage, &bus->receiveQueues[receiveClass],
+                    message)) {
             // An exception to the "don't leave commented out code" rule,
             // this log statement is useful for debugging performance issues
             // but if left enabled all of the time, it can can slown down
@@ -55,8 +64,10 @@ void openxc::can::pic32::handleCanInterrupt(CanBus* bus) {
             // permanent interrupt handling land.
             //
             // debug("Dropped CAN message with ID 0x%02x -- queue is full with %d",
-                    // message.id, QUEUE_LENGTH(CanMessage, &bus->receiveQueue));
+                    // message.id, QUEUE_LENGTH(CanMessage,
+                    // &bus->receiveQueues[receiveClass]));
             ++bus->messagesDropped;
+            ++bus->classMessagesDropped[receiveClass];
         }
 
         /* Call the CAN::updateChannel() function to let the CAN module know
@@ -73,18 +73,86 @@ bool openxc::can::resetAcceptanceFilterStatus(CanBus* bus, bool enabled) {
     return true;
 }
 
+/* Private: Count the IDs in the compacted acceptance filters of one format, to
+ * see if they fit in the controller's filters.
+ *
+ * Returns the number of IDs, or -1 if there are too many.
+ */
+static int compactAcceptanceFilters(CanBus* bus, CanMessageFormat format,
+        AcceptanceFilterRange* ranges, int* rangeCount) {
+    *rangeCount = openxc::can::compactAcceptanceFilters(bus, format, ranges,
+            MAX_ACCEPTANCE_FILTERS);
+    if(*rangeCount < 0) {
+        return -1;
+    }
+
+    int idCount = 0;
+    for(int i = 0; i < *rangeCount; i++) {
+        if(ranges[i].last - ranges[i].first >= MAX_ACCEPTANCE_FILTERS) {
+            return -1;
+        }
+        idCount += ranges[i].last - ranges[i].first + 1;
+    }
+    return idCount > MAX_ACCEPTANCE_FILTERS ? -1 : idCount;
+}
+
+static void configureFilters(CanBus* bus, AcceptanceFilterRange* ranges,
+        int rangeCount, CanMessageFormat format, uint16_t* busFilterCount) {
+    for(int i = 0; i < rangeCount; i++) {
+        for(uint32_t id = ranges[i].first; id <= ranges[i].last; id++) {
+            CAN::FILTER filter = CAN::FILTER(*busFilterCount);
+            // Must disable before changing or else the filters do not work!
+            CAN_CONTROLLER(bus)->enableFilter(filter, false);
+            if(format == CanMessageFormat::STANDARD) {
+                // Standard format message IDs match filter mask 0
+                debug("Added acceptance filter for STD 0x%x on bus %d to AF",
+                        id, bus->address);
+                CAN_CONTROLLER(bus)->configureFilter(filter, id, CAN::SID);
+                CAN_CONTROLLER(bus)->linkFilterToChannel(filter,
+                        CAN::FILTER_MASK0, CAN::CHANNEL(CAN_RX_CHANNEL));
+            } else {
+                // Extended format message IDs match filter mask 1
+                debug("Added acceptance filter for EXT 0x%x on bus %d to AF",
+                        id, bus->address);
+                CAN_CONTROLLER(bus)->configureFilter(filter, id, CAN::EID);
+                CAN_CONTROLLER(bus)->linkFilterToChannel(filter,
+                        CAN::FILTER_MASK1, CAN::CHANNEL(CAN_RX_CHANNEL));
+            }
+            CAN_CONTROLLER(bus)->enableFilter(filter, true);
+            ++*busFilterCount;
+        }
+    }
+}
+
 bool openxc::can::updateAcceptanceFilterTable(CanBus* buses, const int busCount) {
     // For the PIC32 we *could* only change the filters for one bus, but to
     // simplify things we'll reset everything like we have to with the LPC1768
-    uint16_t totalFilterCount = 0;
     for(int i = 0; i < busCount; i++) {
         CanBus* bus = &buses[i];
         uint16_t busFilterCount = 0;
         CAN::OP_MODE previousMode = switchControllerMode(bus, CAN::CONFIGURATION);
 
-        if(LIST_EMPTY(&bus->acceptanceFilters) || bus->bypassFilters) {
-            debug("Bus %d has no filters configured or manually set to bypass, "
-                    "turning off acceptance filter", bus->address);
+        // The controller only has exact match filters for the masks we use,
+        // so ranges are expanded to one filter per ID. If they don't all fit,
+        // the hardware AF is turned off and messages are filtered in software
+        // by shouldAcceptMessage.
+        AcceptanceFilterRange standardRanges[MAX_ACCEPTANCE_FILTERS];
+        AcceptanceFilterRange extendedRanges[MAX_ACCEPTANCE_FILTERS];
+        int standardRangeCount, extendedRangeCount;
+        int standardIdCount = compactAcceptanceFilters(bus,
+                CanMessageFormat::STANDARD, standardRanges,
+                &standardRangeCount);
+        int extendedIdCount = compactAcceptanceFilters(bus,
+                CanMessageFormat::EXTENDED, extendedRanges,
+                &extendedRangeCount);
+        bool filtersFit = standardIdCount >= 0 && extendedIdCount >= 0 &&
+                standardIdCount + extendedIdCount <= MAX_ACCEPTANCE_FILTERS;
+
+        if(LIST_EMPTY(&bus->acceptanceFilters) || bus->bypassFilters ||
+                !filtersFit) {
+            debug("Bus %d has no filters configured, too many filters or is "
+                    "manually set to bypass, turning off acceptance filter",
+                    bus->address);
             resetAcceptanceFilterStatus(bus, false);
         } else {
             // Must set the controller's AF filter status first and only once,
@@ -92,36 +160,10 @@ bool openxc::can::updateAcceptanceFilterTable(CanBus* buses, const int busCount)
             // when you set it.
             resetAcceptanceFilterStatus(bus, true);
 
-            AcceptanceFilterListEntry* entry;
-            LIST_FOREACH(entry, &bus->acceptanceFilters, entries) {
-                if(busFilterCount >= MAX_ACCEPTANCE_FILTERS) {
-                    break;
-                }
-
-                // Must disable before changing or else the filters do not work!
-                CAN_CONTROLLER(bus)->enableFilter(CAN::FILTER(totalFilterCount), false);
-                if(entry->format == CanMessageFormat::STANDARD) {
-                    // Standard format message IDs match filter mask 0
-                    debug("Added acceptance filter for STD 0x%x on bus %d to AF",
-                            entry->filter, bus->address);
-                    CAN_CONTROLLER(bus)->configureFilter(
-                            CAN::FILTER(totalFilterCount), entry->filter, CAN::SID);
-                    CAN_CONTROLLER(bus)->linkFilterToChannel(CAN::FILTER(totalFilterCount),
-                            CAN::FILTER_MASK0, CAN::CHANNEL(CAN_RX_CHANNEL));
-                } else {
-                    // Extended format message IDs match filter mask 1
-                    debug("Added acceptance filter for EXT 0x%x on bus %d to AF",
-                            entry->filter, bus->address);
-                    CAN_CONTROLLER(bus)->configureFilter(
-                            CAN::FILTER(totalFilterCount), entry->filter, CAN::EID);
-                    CAN_CONTROLLER(bus)->linkFilterToChannel(CAN::FILTER(totalFilterCount),
-                            CAN::FILTER_MASK1, CAN::CHANNEL(CAN_RX_CHANNEL));
-                }
-                CAN_CONTROLLER(bus)->enableFilter(CAN::FILTER(totalFilterCount), true);
-
-                ++totalFilterCount;
-                ++busFilterCount;
-            }
+            configureFilters(bus, standardRanges, standardRangeCount,
+                    CanMessageFormat::STANDARD, &busFilterCount);
+            configureFilters(bus, extendedRanges, extendedRangeCount,
+                    CanMessageFormat::EXTENDED, &busFilterCount);
 
             // Disable the remaining unused filters. When AF is "off" we are
             // actually using filter 0, so we don't want to disable that.
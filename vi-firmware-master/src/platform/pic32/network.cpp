@@ -15,6 +15,7 @@
 
 using openxc::util::log::debug;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::dequeue;
 
 Server server = Server(DEFAULT_NETWORK_PORT);
 
@@ -34,17 +35,12 @@ void openxc::interface::network::initialize(NetworkDevice* device) {
     }
 }
 
-// The message bytes are sequentially popped from the
-// send queue to the send buffer. After the buffer is full
-// or the queue is empty, the contents of the buffer are
+// The message bytes are copied in a block from the send queue to the send
+// buffer, up to the size of the buffer. The contents of the buffer are then
 // sent over the network to listening clients.
 void openxc::interface::network::processSendQueue(NetworkDevice* device) {
-    unsigned int byteCount = 0;
-    char sendBuffer[MAX_MESSAGE_SIZE];
-    while(!QUEUE_EMPTY(uint8_t, &device->sendQueue) &&
-            byteCount < MAX_MESSAGE_SIZE) {
-        sendBuffer[byteCount++] = QUEUE_POP(uint8_t, &device->sendQueue);
-    }
+    uint8_t sendBuffer[MAX_MESSAGE_SIZE];
+    int byteCount = dequeue(&device->sendQueue, sendBuffer, MAX_MESSAGE_SIZE);
 
     // must call at least one Network method to keep the TCP/IP stack alive,
     // because it's implemented all in software - a quirk of the chipKIT
@@ -0,0 +1,12 @@
+#include "storage.h"
+
+// TODO persistent storage isn't implemented for the PIC32 yet, so nothing is
+// ever found and nothing is written - values only last until a reset.
+
+bool openxc::storage::readRecord(const char* key, StorageRecord* record) {
+    return false;
+}
+
+bool openxc::storage::writeRecord(const StorageRecord* record) {
+    return false;
+}
@@ -50,6 +50,7 @@ namespace gpio = openxc::gpio;
 
 using openxc::util::log::debug;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::dequeue;
 
 extern const AtCommanderPlatform AT_PLATFORM_RN42;
 extern HardwareSerial Serial;
@@ -127,13 +128,8 @@ void openxc::interface::uart::initialize(UartDevice* device) {
 // The chipKIT version of this function is blocking. It will entirely flush the
 // send queue before returning.
 void openxc::interface::uart::processSendQueue(UartDevice* device) {
-    int byteCount = 0;
-    char sendBuffer[MAX_MESSAGE_SIZE];
-    while(!QUEUE_EMPTY(uint8_t, &device->sendQueue) &&
-                    byteCount < MAX_MESSAGE_SIZE) {
-        sendBuffer[byteCount++] = QUEUE_POP(uint8_t, &device->sendQueue);
-    }
-
+    uint8_t sendBuffer[MAX_MESSAGE_SIZE];
+    int byteCount = dequeue(&device->sendQueue, sendBuffer, MAX_MESSAGE_SIZE);
     if(byteCount > 0) {
         ((HardwareSerial*)device->controller)->write((const uint8_t*)sendBuffer,
                 byteCount);
@@ -17,6 +17,8 @@ using openxc::interface::usb::UsbEndpoint;
 using openxc::interface::usb::UsbEndpointDirection;
 using openxc::gpio::GPIO_DIRECTION_INPUT;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::enqueue;
+using openxc::util::bytebuffer::dequeue;
 using openxc::config::getConfiguration;
 
 // This is a reference to the last packet read
@@ -42,7 +44,7 @@ static uint8_t INCOMING_EP0_DATA_BUFFER[256];
 static size_t INCOMING_EP0_DATA_SIZE;
 static void handleCompletedEP0OutTransfer() {
     if(INCOMING_EP0_DATA_SIZE > 0) {
-        openxc::interface::usb::handleIncomingMessage(INCOMING_EP0_DATA_BUFFER,
+        openxc::interface::usb::handleControlMessage(INCOMING_EP0_DATA_BUFFER,
                 INCOMING_EP0_DATA_SIZE);
     }
     memset(INCOMING_EP0_DATA_BUFFER, sizeof(INCOMING_EP0_DATA_BUFFER), 0);
@@ -133,12 +135,8 @@ void openxc::interface::usb::processSendQueue(UsbDevice* usbDevice) {
 
         while(usbDevice->configured &&
                 !QUEUE_EMPTY(uint8_t, &endpoint->queue)) {
-            int byteCount = 0;
-            while(!QUEUE_EMPTY(uint8_t, &endpoint->queue) &&
-                    byteCount < USB_SEND_BUFFER_SIZE) {
-                endpoint->sendBuffer[byteCount++] = QUEUE_POP(uint8_t,
-                        &endpoint->queue);
-            }
+            int byteCount = dequeue(&endpoint->queue, endpoint->sendBuffer,
+                    USB_SEND_BUFFER_SIZE);
 
             int nextByteIndex = 0;
             while(nextByteIndex < byteCount) {
@@ -188,11 +186,10 @@ void openxc::interface::usb::read(UsbDevice* device, UsbEndpoint* endpoint,
             !device->device.HandleBusy(endpoint->hostToDeviceHandle)) {
         size_t length = device->device.HandleGetLength(
                 endpoint->hostToDeviceHandle);
-        for(int i = 0; i < endpoint->size && i < length; i++) {
-            if(!QUEUE_PUSH(uint8_t, &endpoint->queue,
-                        endpoint->receiveBuffer[i])) {
-                debug("Dropped write from host -- queue is full");
-            }
+        int received = min((int)endpoint->size, (int)length);
+        if(enqueue(&endpoint->queue, endpoint->receiveBuffer, received)
+                < received) {
+            debug("Dropped write from host -- queue is full");
         }
 
         if(length > 0) {
@@ -31,7 +31,7 @@ void openxc::platform::suspend(Pipeline* pipeline) {
     }
 
     lights::deinitialize();
-    usb::deinitialize(pipeline->usb);
+    usb::deinitialize(&getConfiguration()->usb);
     bluetooth::deinitialize();
 
     if(getConfiguration()->powerManagement == PowerManagement::OBD2_IGNITION_CHECK) {
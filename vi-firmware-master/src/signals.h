@@ -95,6 +95,10 @@ CanBus* getCanBuses() __attribute__((weak));
  * by getSignals(), this function is called with the message ID and 64-bit data
  * field.
  *
+ * Implementations that don't need per-message custom handlers can pass the
+ * message to openxc::can::read::translateSignals, which only visits the
+ * signals defined for that message.
+ *
  * bus - The CAN bus this message was received on.
  * message - The received CAN message.
  */
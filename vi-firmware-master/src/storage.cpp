@@ -0,0 +1,83 @@
+#include "storage.h"
+#include "util/log.h"
+#include <string.h>
+
+using openxc::util::log::debug;
+using openxc::storage::StorageRecord;
+
+static StorageRecord PENDING_RECORDS[MAX_PENDING_STORAGE_RECORDS];
+static int PENDING_RECORD_COUNT = 0;
+
+static StorageRecord* findPendingRecord(const char* key) {
+    for(int i = 0; i < PENDING_RECORD_COUNT; i++) {
+        if(!strncmp(PENDING_RECORDS[i].key, key, MAX_STORAGE_KEY_LENGTH)) {
+            return &PENDING_RECORDS[i];
+        }
+    }
+    return NULL;
+}
+
+/* Private: Find the latest value for a key, whether it's waiting to be written
+ * or already in non-volatile storage.
+ */
+static bool findRecord(const char* key, StorageRecord* record) {
+    StorageRecord* pending = findPendingRecord(key);
+    if(pending != NULL) {
+        *record = *pending;
+        return true;
+    }
+    return openxc::storage::readRecord(key, record);
+}
+
+int openxc::storage::load(const char* key, uint8_t* value, size_t length) {
+    StorageRecord record;
+    if(!findRecord(key, &record) || record.length > length) {
+        return -1;
+    }
+    memcpy(value, record.value, record.length);
+    return record.length;
+}
+
+bool openxc::storage::store(const char* key, const uint8_t* value,
+        size_t length) {
+    if(strlen(key) >= MAX_STORAGE_KEY_LENGTH ||
+            length > MAX_STORAGE_VALUE_LENGTH) {
+        debug("Can't store %d bytes under key %s", length, key);
+        return false;
+    }
+
+    StorageRecord existing;
+    if(findRecord(key, &existing) && existing.length == length &&
+            !memcmp(existing.value, value, length)) {
+        return true;
+    }
+
+    StorageRecord* record = findPendingRecord(key);
+    if(record == NULL) {
+        if(PENDING_RECORD_COUNT >= MAX_PENDING_STORAGE_RECORDS) {
+            debug("Too many values waiting to be stored, dropping %s", key);
+            return false;
+        }
+        record = &PENDING_RECORDS[PENDING_RECORD_COUNT++];
+    }
+
+    memset(record, 0xff, sizeof(StorageRecord));
+    record->magic = STORAGE_RECORD_MAGIC;
+    strncpy(record->key, key, MAX_STORAGE_KEY_LENGTH);
+    record->length = length;
+    memcpy(record->value, value, length);
+    return true;
+}
+
+bool openxc::storage::flush() {
+    int kept = 0;
+    for(int i = 0; i < PENDING_RECORD_COUNT; i++) {
+        if(!writeRecord(&PENDING_RECORDS[i])) {
+            debug("Unable to write %s to persistent storage",
+                    PENDING_RECORDS[i].key);
+            PENDING_RECORDS[kept++] = PENDING_RECORDS[i];
+        }
+    }
+    PENDING_RECORD_COUNT = kept;
+    return kept == 0;
+}
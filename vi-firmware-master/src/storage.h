@@ -0,0 +1,114 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Public: The maximum length for a storage key, including the NULL
+ * terminator.
+ */
+#define MAX_STORAGE_KEY_LENGTH 24
+
+/* Public: The maximum number of bytes that can be stored under one key.
+ */
+#define MAX_STORAGE_VALUE_LENGTH 224
+
+/* Private: Marks a storage record that has been written - erased flash reads
+ * back as all 1s.
+ */
+#define STORAGE_RECORD_MAGIC 0x4f584b56
+
+/* Private: The number of different keys that can be waiting to be written to
+ * non-volatile storage.
+ */
+#define MAX_PENDING_STORAGE_RECORDS 3
+
+namespace openxc {
+namespace storage {
+
+/* Private: A single key and value, as written to non-volatile storage. Each
+ * store(...) appends a new record, and the last record for a key wins.
+ *
+ * The size is fixed at 256 bytes, the smallest block that can be programmed
+ * into flash on the LPC17xx.
+ *
+ * magic - STORAGE_RECORD_MAGIC if the record has been written.
+ * key - The NULL terminated key.
+ * length - The length of the value.
+ * value - The stored value.
+ */
+typedef struct {
+    uint32_t magic;
+    char key[MAX_STORAGE_KEY_LENGTH];
+    uint16_t length;
+    uint8_t reserved[2];
+    uint8_t value[MAX_STORAGE_VALUE_LENGTH];
+} StorageRecord;
+
+/* Public: Read the value last stored under a key.
+ *
+ * key - The NULL terminated key, shorter than MAX_STORAGE_KEY_LENGTH.
+ * value - A buffer to copy the value into.
+ * length - The length of the value buffer.
+ *
+ * Returns the length of the stored value, or -1 if nothing is stored under the
+ * key or it wouldn't fit in the buffer.
+ */
+int load(const char* key, uint8_t* value, size_t length);
+
+/* Public: Store a value under a key, replacing any value already stored under
+ * it.
+ *
+ * Writing to flash disables interrupts for long enough to drop CAN messages, so
+ * the value is only kept in RAM until flush() is called - it's safe to call this
+ * from a diagnostic response callback. load(...) returns the new value right
+ * away.
+ *
+ * Writing the same value that's already stored is a no-op, so this is cheap to
+ * call when nothing has changed.
+ *
+ * key - The NULL terminated key, shorter than MAX_STORAGE_KEY_LENGTH.
+ * value - The value to store.
+ * length - The length of the value, at most MAX_STORAGE_VALUE_LENGTH.
+ *
+ * Returns true if the value was stored, or false if it's invalid or
+ * MAX_PENDING_STORAGE_RECORDS other keys are already waiting for flush().
+ */
+bool store(const char* key, const uint8_t* value, size_t length);
+
+/* Public: Write the values stored since the last flush to non-volatile
+ * storage.
+ *
+ * This can block with interrupts disabled for 100ms or more, so only call it
+ * when the CAN buses are quiet. If the storage area is full it's erased before
+ * writing the new values, which drops the values for any other keys.
+ *
+ * Returns true if every waiting value was written. Any that weren't are kept
+ * for the next flush.
+ */
+bool flush();
+
+/* Private: Copy the last record written to non-volatile storage for a key.
+ *
+ * This is implemented by each platform.
+ *
+ * key - The NULL terminated key.
+ * record - The record to copy into.
+ *
+ * Returns true if a record was found for the key.
+ */
+bool readRecord(const char* key, StorageRecord* record);
+
+/* Private: Append a record to non-volatile storage, erasing it first if it's
+ * full.
+ *
+ * This is implemented by each platform.
+ *
+ * Returns true if the record was written.
+ */
+bool writeRecord(const StorageRecord* record);
+
+} // namespace storage
+} // namespace openxc
+
+#endif // __STORAGE_H__
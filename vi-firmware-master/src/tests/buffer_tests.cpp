@@ -4,17 +4,25 @@
 
 using openxc::util::bytebuffer::conditionalEnqueue;
 using openxc::util::bytebuffer::processQueue;
+using openxc::util::bytebuffer::enqueue;
+using openxc::util::bytebuffer::dequeue;
+using openxc::util::bytebuffer::snapshot;
+using openxc::util::bytebuffer::discard;
+using openxc::util::bytebuffer::reserve;
+using openxc::util::bytebuffer::commit;
 
 QUEUE_TYPE(uint8_t) queue;
 bool called;
 size_t callbackDataRead;
 int calledTimes;
+int resetTimes;
 
 void setup() {
     QUEUE_INIT(uint8_t, &queue);
     called = false;
     callbackDataRead = 0;
     calledTimes = 0;
+    resetTimes = 0;
 }
 
 void teardown() {
@@ -22,6 +30,10 @@ void teardown() {
 
 uint8_t received_message[8];
 size_t callback(uint8_t* message, size_t length) {
+    if(message == NULL) {
+        resetTimes++;
+        return 0;
+    }
     called = true;
     calledTimes++;
     memcpy(received_message, message, length);
@@ -105,6 +117,39 @@ START_TEST (test_full_clears)
 }
 END_TEST
 
+START_TEST (test_partial_message_not_reset)
+{
+    callbackDataRead = 0;
+    QUEUE_PUSH(uint8_t, &queue, 128);
+    processQueue(&queue, callback);
+    fail_unless(called);
+    ck_assert_int_eq(resetTimes, 0);
+}
+END_TEST
+
+START_TEST (test_reset_after_consumed)
+{
+    callbackDataRead = 2;
+    QUEUE_PUSH(uint8_t, &queue, 128);
+    QUEUE_PUSH(uint8_t, &queue, 0);
+    QUEUE_PUSH(uint8_t, &queue, 64);
+    processQueue(&queue, callback);
+    ck_assert_int_eq(resetTimes, 1);
+}
+END_TEST
+
+START_TEST (test_reset_after_full_cleared)
+{
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
+        QUEUE_PUSH(uint8_t, &queue, 128);
+    }
+
+    callbackDataRead = 0;
+    processQueue(&queue, callback);
+    ck_assert_int_eq(resetTimes, 1);
+}
+END_TEST
+
 START_TEST (test_null_queue)
 {
     char* message = "a message";
@@ -158,6 +203,98 @@ START_TEST (test_enqueue_no_room_for_crlf)
 }
 END_TEST
 
+/* Move the head and tail of the queue near the end of its storage so the next
+ * write wraps around.
+ */
+void advanceToEndOfStorage(int remaining) {
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1 - remaining; i++) {
+        QUEUE_PUSH(uint8_t, &queue, 0);
+        QUEUE_POP(uint8_t, &queue);
+    }
+}
+
+START_TEST (test_enqueue_wraps)
+{
+    advanceToEndOfStorage(4);
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    ck_assert_int_eq(enqueue(&queue, data, sizeof(data)), sizeof(data));
+    ck_assert_int_eq(QUEUE_LENGTH(uint8_t, &queue), sizeof(data));
+
+    for(size_t i = 0; i < sizeof(data); i++) {
+        ck_assert_int_eq(QUEUE_POP(uint8_t, &queue), data[i]);
+    }
+}
+END_TEST
+
+START_TEST (test_enqueue_partial_when_full)
+{
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) - 3; i++) {
+        QUEUE_PUSH(uint8_t, &queue, 128);
+    }
+
+    uint8_t data[] = {1, 2, 3, 4, 5, 6};
+    ck_assert_int_eq(enqueue(&queue, data, sizeof(data)), 3);
+    fail_unless(QUEUE_FULL(uint8_t, &queue));
+}
+END_TEST
+
+START_TEST (test_snapshot_and_dequeue_wrapped)
+{
+    advanceToEndOfStorage(3);
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    enqueue(&queue, data, sizeof(data));
+
+    uint8_t buffer[sizeof(data)] = {0};
+    ck_assert_int_eq(snapshot(&queue, buffer, sizeof(buffer)), sizeof(data));
+    ck_assert_int_eq(memcmp(buffer, data, sizeof(data)), 0);
+    ck_assert_int_eq(QUEUE_LENGTH(uint8_t, &queue), sizeof(data));
+
+    memset(buffer, 0, sizeof(buffer));
+    ck_assert_int_eq(dequeue(&queue, buffer, 5), 5);
+    ck_assert_int_eq(memcmp(buffer, data, 5), 0);
+    ck_assert_int_eq(QUEUE_LENGTH(uint8_t, &queue), 3);
+    ck_assert_int_eq(QUEUE_PEEK(uint8_t, &queue), 6);
+
+    discard(&queue, 100);
+    fail_unless(QUEUE_EMPTY(uint8_t, &queue));
+}
+END_TEST
+
+START_TEST (test_reserve_commit)
+{
+    advanceToEndOfStorage(2);
+    int length;
+    uint8_t* tail = reserve(&queue, &length);
+    ck_assert_int_eq(length, 2);
+    tail[0] = 1;
+    tail[1] = 2;
+    commit(&queue, length);
+
+    tail = reserve(&queue, &length);
+    ck_assert_int_eq(length, QUEUE_MAX_LENGTH(uint8_t) - 2);
+    tail[0] = 3;
+    commit(&queue, 1);
+
+    ck_assert_int_eq(QUEUE_LENGTH(uint8_t, &queue), 3);
+    ck_assert_int_eq(QUEUE_POP(uint8_t, &queue), 1);
+    ck_assert_int_eq(QUEUE_POP(uint8_t, &queue), 2);
+    ck_assert_int_eq(QUEUE_POP(uint8_t, &queue), 3);
+}
+END_TEST
+
+START_TEST (test_process_wrapped_queue)
+{
+    advanceToEndOfStorage(1);
+    callbackDataRead = 2;
+    uint8_t data[] = {128, 0};
+    enqueue(&queue, data, sizeof(data));
+    fail_unless(processQueue(&queue, callback));
+    ck_assert_int_eq(received_message[0], 128);
+    ck_assert_int_eq(received_message[1], 0);
+    fail_unless(QUEUE_EMPTY(uint8_t, &queue));
+}
+END_TEST
+
 Suite* buffersSuite(void) {
     Suite* s = suite_create("buffers");
     TCase *tc_core = tcase_create("core");
@@ -169,6 +306,9 @@ Suite* buffersSuite(void) {
     tcase_add_test(tc_core, test_full_clears);
     tcase_add_test(tc_core, test_missing_callback);
     tcase_add_test(tc_core, test_parse_multiple);
+    tcase_add_test(tc_core, test_partial_message_not_reset);
+    tcase_add_test(tc_core, test_reset_after_consumed);
+    tcase_add_test(tc_core, test_reset_after_full_cleared);
     suite_add_tcase(s, tc_core);
 
     TCase *tc_conditional = tcase_create("conditional");
@@ -180,6 +320,15 @@ Suite* buffersSuite(void) {
     tcase_add_test(tc_conditional, test_enqueue_just_enough_room);
     suite_add_tcase(s, tc_conditional);
 
+    TCase *tc_bulk = tcase_create("bulk");
+    tcase_add_checked_fixture (tc_bulk, setup, teardown);
+    tcase_add_test(tc_bulk, test_enqueue_wraps);
+    tcase_add_test(tc_bulk, test_enqueue_partial_when_full);
+    tcase_add_test(tc_bulk, test_snapshot_and_dequeue_wrapped);
+    tcase_add_test(tc_bulk, test_reserve_commit);
+    tcase_add_test(tc_bulk, test_process_wrapped_queue);
+    suite_add_tcase(s, tc_bulk);
+
     return s;
 }
 
@@ -47,8 +47,8 @@ void setup() {
 }
 
 openxc_VehicleMessage decodeProtobufMessage(Pipeline* pipeline) {
-    uint8_t snapshot[QUEUE_LENGTH(uint8_t, &pipeline->usb->endpoints[IN_ENDPOINT_INDEX].queue) + 1];
-    QUEUE_SNAPSHOT(uint8_t, &pipeline->usb->endpoints[IN_ENDPOINT_INDEX].queue, snapshot, sizeof(snapshot));
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, &getConfiguration()->usb.endpoints[IN_ENDPOINT_INDEX].queue) + 1];
+    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->usb.endpoints[IN_ENDPOINT_INDEX].queue, snapshot, sizeof(snapshot));
 
     openxc_VehicleMessage decodedMessage = {0};
     pb_istream_t stream = pb_istream_from_buffer(snapshot, sizeof(snapshot));
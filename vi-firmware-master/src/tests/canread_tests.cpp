@@ -19,6 +19,7 @@ using openxc::can::read::publishBooleanMessage;
 using openxc::can::read::publishNumericalMessage;
 using openxc::can::read::publishStringMessage;
 using openxc::can::read::publishVehicleMessage;
+using openxc::can::read::publishLatestValues;
 using openxc::pipeline::Pipeline;
 using openxc::signals::getSignalCount;
 using openxc::signals::getSignals;
@@ -53,6 +54,7 @@ void setup() {
     SENT_BYTES = 0;
     initializeVehicleInterface();
     getConfiguration()->payloadFormat = openxc::payload::PayloadFormat::JSON;
+    getConfiguration()->coalesceOutput = false;
     usb::initialize(&getConfiguration()->usb);
     getConfiguration()->usb.configured = true;
     for(int i = 0; i < getSignalCount(); i++) {
@@ -363,7 +365,8 @@ END_TEST
 
 START_TEST (test_translate_many_signals)
 {
-    getConfiguration()->pipeline.uart = NULL;
+    openxc::pipeline::removeSinks(&getConfiguration()->pipeline,
+            &getConfiguration()->uart);
     ck_assert_int_eq(0, SENT_BYTES);
     for(int i = 7; i < 23; i++) {
         can::read::translateSignal(&getSignals()[i],
@@ -379,6 +382,49 @@ START_TEST (test_translate_many_signals)
 }
 END_TEST
 
+START_TEST (test_translate_signals_only_for_message)
+{
+    CanMessage message = TEST_MESSAGE;
+    message.id = 3;
+    can::read::translateSignals(&getCanBuses()[0], &message, getMessages(),
+            getMessageCount(), getSignals(), getSignalCount(),
+            &getConfiguration()->pipeline);
+    fail_if(queueEmpty());
+    fail_unless(getSignals()[3].received);
+    fail_if(getSignals()[0].received);
+    fail_if(getSignals()[2].received);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert(strstr((char*)snapshot, "measurement") != NULL);
+    ck_assert(strstr((char*)snapshot, "torque_at_transmission") == NULL);
+}
+END_TEST
+
+START_TEST (test_translate_signals_multiple_per_message)
+{
+    can::read::translateSignals(&getCanBuses()[0], &TEST_MESSAGE, getMessages(),
+            getMessageCount(), getSignals(), getSignalCount(),
+            &getConfiguration()->pipeline);
+    fail_unless(getSignals()[0].received);
+    fail_unless(getSignals()[6].received);
+    fail_if(getSignals()[1].received);
+    fail_if(getSignals()[3].received);
+}
+END_TEST
+
+START_TEST (test_translate_signals_unknown_message)
+{
+    CanMessage message = TEST_MESSAGE;
+    message.id = 999;
+    can::read::translateSignals(&getCanBuses()[0], &message, getMessages(),
+            getMessageCount(), getSignals(), getSignalCount(),
+            &getConfiguration()->pipeline);
+    fail_unless(queueEmpty());
+}
+END_TEST
+
 START_TEST (test_translate_float)
 {
     getSignals()[0].decoder = floatDecoder;
@@ -395,6 +441,72 @@ START_TEST (test_translate_float)
 }
 END_TEST
 
+START_TEST (test_coalesce_output_publishes_latest_value)
+{
+    getConfiguration()->coalesceOutput = true;
+    can::read::translateSignal(&getSignals()[0],
+            &TEST_MESSAGE, getSignals(), getSignalCount(), &getConfiguration()->pipeline);
+    CanMessage message = {
+        id: 0,
+        format: STANDARD,
+        data: {0x12},
+    };
+    can::read::translateSignal(&getSignals()[0],
+            &message, getSignals(), getSignalCount(), &getConfiguration()->pipeline);
+    fail_unless(queueEmpty());
+    fail_unless(getSignals()[0].received);
+
+    publishLatestValues(&getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert_str_eq((char*)snapshot,
+            "{\"name\":\"torque_at_transmission\",\"value\":-25996}\0");
+    ck_assert_int_eq(strlen((char*)snapshot) + 1, sizeof(snapshot) - 1);
+
+    QUEUE_INIT(uint8_t, OUTPUT_QUEUE);
+    publishLatestValues(&getConfiguration()->pipeline);
+    fail_unless(queueEmpty());
+}
+END_TEST
+
+START_TEST (test_coalesce_output_full_sink_doesnt_hold_back_others)
+{
+    getConfiguration()->coalesceOutput = true;
+    QUEUE_TYPE(uint8_t)* uartQueue = &getConfiguration()->uart.sendQueue;
+    QUEUE_INIT(uint8_t, uartQueue);
+    while(!QUEUE_FULL(uint8_t, uartQueue)) {
+        QUEUE_PUSH(uint8_t, uartQueue, (uint8_t) 128);
+    }
+
+    can::read::translateSignal(&getSignals()[0],
+            &TEST_MESSAGE, getSignals(), getSignalCount(), &getConfiguration()->pipeline);
+    publishLatestValues(&getConfiguration()->pipeline);
+    fail_if(queueEmpty());
+
+    QUEUE_INIT(uint8_t, OUTPUT_QUEUE);
+    QUEUE_INIT(uint8_t, uartQueue);
+    publishLatestValues(&getConfiguration()->pipeline);
+    fail_unless(queueEmpty());
+    fail_if(QUEUE_EMPTY(uint8_t, uartQueue));
+
+    // Sent to every sink, so it's not published again
+    QUEUE_INIT(uint8_t, uartQueue);
+    publishLatestValues(&getConfiguration()->pipeline);
+    fail_unless(QUEUE_EMPTY(uint8_t, uartQueue));
+}
+END_TEST
+
+START_TEST (test_coalesce_output_sends_strings_immediately)
+{
+    getConfiguration()->coalesceOutput = true;
+    getSignals()[1].decoder = stateDecoder;
+    can::read::translateSignal(&getSignals()[1], &TEST_MESSAGE, getSignals(),
+            getSignalCount(), &getConfiguration()->pipeline);
+    fail_if(queueEmpty());
+}
+END_TEST
+
 int frequencyTestCounter = 0;
 openxc_DynamicField floatDecoderFrequencyTest(CanSignal* signal, CanSignal* signals,
         int signalCount, Pipeline* pipeline, float value, bool* send) {
@@ -581,6 +693,12 @@ Suite* canreadSuite(void) {
     TCase *tc_translate = tcase_create("translate");
     tcase_add_checked_fixture(tc_translate, setup, NULL);
     tcase_add_test(tc_translate, test_translate_float);
+    tcase_add_test(tc_translate, test_coalesce_output_publishes_latest_value);
+    tcase_add_test(tc_translate, test_coalesce_output_full_sink_doesnt_hold_back_others);
+    tcase_add_test(tc_translate, test_coalesce_output_sends_strings_immediately);
+    tcase_add_test(tc_translate, test_translate_signals_only_for_message);
+    tcase_add_test(tc_translate, test_translate_signals_multiple_per_message);
+    tcase_add_test(tc_translate, test_translate_signals_unknown_message);
     tcase_add_test(tc_translate, test_translate_string);
     tcase_add_test(tc_translate, test_limited_frequency);
     tcase_add_test(tc_translate, test_unlimited_frequency);
@@ -15,6 +15,15 @@ using openxc::can::lookupMessageDefinition;
 using openxc::can::registerMessageDefinition;
 using openxc::can::unregisterMessageDefinition;
 using openxc::can::setAcceptanceFilterStatus;
+using openxc::can::addAcceptanceFilter;
+using openxc::can::removeAcceptanceFilter;
+using openxc::can::addAcceptanceFilterRange;
+using openxc::can::removeAcceptanceFilterRange;
+using openxc::can::addAcceptanceFilterMask;
+using openxc::can::removeAcceptanceFilterMask;
+using openxc::can::compactAcceptanceFilters;
+using openxc::can::classifyMessage;
+using openxc::can::shouldAcceptMessage;
 using openxc::signals::getCanBusCount;
 using openxc::signals::getCanBuses;
 using openxc::signals::getMessages;
@@ -207,6 +216,55 @@ START_TEST (test_unregister_predefined)
 }
 END_TEST
 
+START_TEST (test_get_can_message_definition_wrong_format)
+{
+    CanMessageDefinition* message = lookupMessageDefinition(&getCanBuses()[0], 1,
+            CanMessageFormat::EXTENDED, getMessages(), getMessageCount());
+    ck_assert(message == NULL);
+}
+END_TEST
+
+START_TEST (test_register_can_message_both_formats)
+{
+    ck_assert(registerMessageDefinition(&getCanBuses()[0], MESSAGE_ID,
+                CanMessageFormat::STANDARD, getMessages(), getMessageCount()));
+    ck_assert(registerMessageDefinition(&getCanBuses()[0], MESSAGE_ID,
+                CanMessageFormat::EXTENDED, getMessages(), getMessageCount()));
+    CanMessageDefinition* standard = lookupMessageDefinition(&getCanBuses()[0],
+            MESSAGE_ID, CanMessageFormat::STANDARD, getMessages(), getMessageCount());
+    CanMessageDefinition* extended = lookupMessageDefinition(&getCanBuses()[0],
+            MESSAGE_ID, CanMessageFormat::EXTENDED, getMessages(), getMessageCount());
+    ck_assert(standard != NULL);
+    ck_assert(extended != NULL);
+    ck_assert(standard != extended);
+    ck_assert(extended->format == CanMessageFormat::EXTENDED);
+}
+END_TEST
+
+START_TEST (test_unregister_keeps_other_dynamic_messages)
+{
+    for(int i = 0; i < MAX_DYNAMIC_MESSAGE_COUNT; i++) {
+        ck_assert(registerMessageDefinition(&getCanBuses()[0],
+                    MESSAGE_ID + i * DYNAMIC_MESSAGE_TABLE_SIZE,
+                    CanMessageFormat::STANDARD, getMessages(), getMessageCount()));
+    }
+    ck_assert(!registerMessageDefinition(&getCanBuses()[0], MESSAGE_ID + 1,
+                CanMessageFormat::STANDARD, getMessages(), getMessageCount()));
+
+    ck_assert(unregisterMessageDefinition(&getCanBuses()[0], MESSAGE_ID,
+                CanMessageFormat::STANDARD));
+    for(int i = 1; i < MAX_DYNAMIC_MESSAGE_COUNT; i++) {
+        CanMessageDefinition* message = lookupMessageDefinition(
+                &getCanBuses()[0], MESSAGE_ID + i * DYNAMIC_MESSAGE_TABLE_SIZE,
+                CanMessageFormat::STANDARD, getMessages(), getMessageCount());
+        ck_assert(message != NULL);
+        ck_assert_int_eq(message->id, MESSAGE_ID + i * DYNAMIC_MESSAGE_TABLE_SIZE);
+    }
+    ck_assert(registerMessageDefinition(&getCanBuses()[0], MESSAGE_ID + 1,
+                CanMessageFormat::STANDARD, getMessages(), getMessageCount()));
+}
+END_TEST
+
 START_TEST (test_set_acceptance_filter_status)
 {
     ck_assert(setAcceptanceFilterStatus(&getCanBuses()[0], true, getCanBuses(), getCanBusCount()));
@@ -219,6 +277,145 @@ START_TEST (test_set_acceptance_filter_status)
 }
 END_TEST
 
+START_TEST (test_should_accept_filtered_messages)
+{
+    CanBus* bus = &getCanBuses()[0];
+    bus->bypassFilters = false;
+    ck_assert(!shouldAcceptMessage(bus, 0x7e8));
+
+    ck_assert(addAcceptanceFilter(bus, 0x7e8, CanMessageFormat::STANDARD,
+                getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilter(bus, 0x18daf110, CanMessageFormat::EXTENDED,
+                getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilter(bus, 0x18daf100, CanMessageFormat::EXTENDED,
+                getCanBuses(), getCanBusCount()));
+    ck_assert(shouldAcceptMessage(bus, 0x7e8));
+    ck_assert(!shouldAcceptMessage(bus, 0x7e9));
+    ck_assert(shouldAcceptMessage(bus, 0x18daf100));
+    ck_assert(shouldAcceptMessage(bus, 0x18daf110));
+    ck_assert(!shouldAcceptMessage(bus, 0x18daf101));
+    ck_assert(!shouldAcceptMessage(&getCanBuses()[1], 0x7e8));
+
+    // Still in use by one more user
+    ck_assert(addAcceptanceFilter(bus, 0x18daf100, CanMessageFormat::EXTENDED,
+                getCanBuses(), getCanBusCount()));
+    removeAcceptanceFilter(bus, 0x18daf100, CanMessageFormat::EXTENDED,
+            getCanBuses(), getCanBusCount());
+    ck_assert(shouldAcceptMessage(bus, 0x18daf100));
+
+    removeAcceptanceFilter(bus, 0x18daf100, CanMessageFormat::EXTENDED,
+            getCanBuses(), getCanBusCount());
+    removeAcceptanceFilter(bus, 0x7e8, CanMessageFormat::STANDARD,
+            getCanBuses(), getCanBusCount());
+    ck_assert(!shouldAcceptMessage(bus, 0x18daf100));
+    ck_assert(!shouldAcceptMessage(bus, 0x7e8));
+    ck_assert(shouldAcceptMessage(bus, 0x18daf110));
+
+    bus->bypassFilters = true;
+    ck_assert(shouldAcceptMessage(bus, 0x7e8));
+}
+END_TEST
+
+START_TEST (test_should_accept_range_and_mask_filters)
+{
+    CanBus* bus = &getCanBuses()[0];
+    bus->bypassFilters = false;
+
+    ck_assert(addAcceptanceFilterRange(bus, 0x7e8, 0x7ef,
+                CanMessageFormat::STANDARD, getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilterMask(bus, 0x18daf100, 0x1fff00ff,
+                CanMessageFormat::EXTENDED, getCanBuses(), getCanBusCount()));
+    ck_assert(!shouldAcceptMessage(bus, 0x7e7));
+    ck_assert(shouldAcceptMessage(bus, 0x7e8));
+    ck_assert(shouldAcceptMessage(bus, 0x7ef));
+    ck_assert(!shouldAcceptMessage(bus, 0x7f0));
+    ck_assert(shouldAcceptMessage(bus, 0x18daf100));
+    ck_assert(shouldAcceptMessage(bus, 0x18da1000));
+    ck_assert(!shouldAcceptMessage(bus, 0x18daf101));
+
+    // A mask that only ignores the lowest bits is stored as a range
+    ck_assert(addAcceptanceFilterMask(bus, 0x18db33f1, 0x1ffffff0,
+                CanMessageFormat::EXTENDED, getCanBuses(), getCanBusCount()));
+    ck_assert(shouldAcceptMessage(bus, 0x18db33f0));
+    ck_assert(shouldAcceptMessage(bus, 0x18db33ff));
+    ck_assert(!shouldAcceptMessage(bus, 0x18db3400));
+
+    removeAcceptanceFilterRange(bus, 0x7e8, 0x7ef, CanMessageFormat::STANDARD,
+            getCanBuses(), getCanBusCount());
+    removeAcceptanceFilterMask(bus, 0x18daf100, 0x1fff00ff,
+            CanMessageFormat::EXTENDED, getCanBuses(), getCanBusCount());
+    removeAcceptanceFilterMask(bus, 0x18db33f1, 0x1ffffff0,
+            CanMessageFormat::EXTENDED, getCanBuses(), getCanBusCount());
+    ck_assert(!shouldAcceptMessage(bus, 0x7e8));
+    ck_assert(!shouldAcceptMessage(bus, 0x18daf100));
+    ck_assert(!shouldAcceptMessage(bus, 0x18db33f0));
+    ck_assert(LIST_EMPTY(&bus->acceptanceFilters));
+}
+END_TEST
+
+START_TEST (test_classify_messages)
+{
+    CanBus* bus = &getCanBuses()[0];
+    bus->bypassFilters = false;
+    ck_assert(addAcceptanceFilter(bus, 0x7e8, CanMessageFormat::STANDARD,
+                getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilterRange(bus, 0x7e8, 0x7ef,
+                CanMessageFormat::STANDARD, getCanBuses(), getCanBusCount(),
+                RECEIVE_CLASS_DIAGNOSTIC));
+
+    CanReceiveClass receiveClass;
+    ck_assert(classifyMessage(bus, 0x7e8, &receiveClass));
+    ck_assert_int_eq(RECEIVE_CLASS_DIAGNOSTIC, receiveClass);
+    ck_assert(classifyMessage(bus, 0x7ef, &receiveClass));
+    ck_assert_int_eq(RECEIVE_CLASS_DIAGNOSTIC, receiveClass);
+    ck_assert(!classifyMessage(bus, 0x100, &receiveClass));
+
+    // The message set filter for the same ID is still there
+    removeAcceptanceFilterRange(bus, 0x7e8, 0x7ef, CanMessageFormat::STANDARD,
+            getCanBuses(), getCanBusCount(), RECEIVE_CLASS_DIAGNOSTIC);
+    ck_assert(classifyMessage(bus, 0x7e8, &receiveClass));
+    ck_assert_int_eq(RECEIVE_CLASS_MESSAGE_SET, receiveClass);
+    ck_assert(!classifyMessage(bus, 0x7e9, &receiveClass));
+
+    bus->bypassFilters = true;
+    ck_assert(classifyMessage(bus, 0x100, &receiveClass));
+    ck_assert_int_eq(RECEIVE_CLASS_PASSTHROUGH, receiveClass);
+}
+END_TEST
+
+START_TEST (test_compact_acceptance_filters)
+{
+    CanBus* bus = &getCanBuses()[0];
+    for(uint32_t id = 0x7e8; id < 0x7f0; id++) {
+        ck_assert(addAcceptanceFilter(bus, id, CanMessageFormat::STANDARD,
+                    getCanBuses(), getCanBusCount()));
+    }
+    ck_assert(addAcceptanceFilter(bus, 0x100, CanMessageFormat::STANDARD,
+                getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilterMask(bus, 0x200, 0x6ff,
+                CanMessageFormat::STANDARD, getCanBuses(), getCanBusCount()));
+    ck_assert(addAcceptanceFilter(bus, 0x18daf110, CanMessageFormat::EXTENDED,
+                getCanBuses(), getCanBusCount()));
+
+    AcceptanceFilterRange ranges[MAX_ACCEPTANCE_FILTERS];
+    ck_assert_int_eq(compactAcceptanceFilters(bus, CanMessageFormat::STANDARD,
+                ranges, MAX_ACCEPTANCE_FILTERS), 4);
+    ck_assert_int_eq(ranges[0].first, 0x100);
+    ck_assert_int_eq(ranges[0].last, 0x100);
+    ck_assert_int_eq(ranges[1].first, 0x200);
+    ck_assert_int_eq(ranges[1].last, 0x200);
+    ck_assert_int_eq(ranges[2].first, 0x300);
+    ck_assert_int_eq(ranges[2].last, 0x300);
+    ck_assert_int_eq(ranges[3].first, 0x7e8);
+    ck_assert_int_eq(ranges[3].last, 0x7ef);
+
+    ck_assert_int_eq(compactAcceptanceFilters(bus, CanMessageFormat::EXTENDED,
+                ranges, MAX_ACCEPTANCE_FILTERS), 1);
+    ck_assert_int_eq(compactAcceptanceFilters(bus, CanMessageFormat::STANDARD,
+                ranges, 3), -1);
+}
+END_TEST
+
 Suite* canutilSuite(void) {
     Suite* s = suite_create("canutil");
     TCase *tc_core = tcase_create("core");
@@ -232,6 +429,10 @@ Suite* canutilSuite(void) {
     tcase_add_test(tc_core, test_lookup_signal_state_by_value);
     tcase_add_test(tc_core, test_lookup_command);
     tcase_add_test(tc_core, test_set_acceptance_filter_status);
+    tcase_add_test(tc_core, test_should_accept_filtered_messages);
+    tcase_add_test(tc_core, test_should_accept_range_and_mask_filters);
+    tcase_add_test(tc_core, test_compact_acceptance_filters);
+    tcase_add_test(tc_core, test_classify_messages);
     suite_add_tcase(s, tc_core);
 
     TCase *tc_message_def = tcase_create("message_definitions");
@@ -244,6 +445,9 @@ Suite* canutilSuite(void) {
     tcase_add_test(tc_message_def, test_unregister_can_message);
     tcase_add_test(tc_message_def, test_unregister_can_message_not_registered);
     tcase_add_test(tc_message_def, test_unregister_predefined);
+    tcase_add_test(tc_message_def, test_get_can_message_definition_wrong_format);
+    tcase_add_test(tc_message_def, test_register_can_message_both_formats);
+    tcase_add_test(tc_message_def, test_unregister_keeps_other_dynamic_messages);
     suite_add_tcase(s, tc_message_def);
 
     return s;
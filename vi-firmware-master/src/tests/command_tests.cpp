@@ -21,6 +21,8 @@ using openxc::config::getFirmwareDescriptor;
 using openxc::signals::getCanBuses;
 using openxc::signals::getCanBusCount;
 using openxc::payload::PayloadFormat;
+using openxc::pipeline::getPayloadFormat;
+using openxc::pipeline::setPayloadFormat;
 using openxc::interface::InterfaceDescriptor;
 using openxc::interface::InterfaceType;
 
@@ -70,6 +72,7 @@ void setup() {
     getActiveMessageSet()->busCount = 2;
     getCanBuses()[0].rawWritable = true;
     resetQueues();
+    openxc::commands::resetIncomingMessage(&DESCRIPTOR);
 
     CAN_MESSAGE.has_type = true;
     CAN_MESSAGE.type = openxc_VehicleMessage_Type_CAN;
@@ -480,7 +483,24 @@ END_TEST
 START_TEST (test_non_complete_message)
 {
     uint8_t request[] = "{\"name\": \"turn_signal_status\", ";
-    ck_assert(!handleIncomingMessage(request, sizeof(request), &DESCRIPTOR));
+    ck_assert(!handleIncomingMessage(request, sizeof(request) - 1,
+                &DESCRIPTOR));
+}
+END_TEST
+
+START_TEST (test_message_resumes_until_reset)
+{
+    uint8_t request[] = "{\"command\": \"version\"}\0";
+    ck_assert(!handleIncomingMessage(request, 12, &DESCRIPTOR));
+    ck_assert(handleIncomingMessage(request, sizeof(request), &DESCRIPTOR));
+    ck_assert(!outputQueueEmpty());
+
+    resetQueues();
+    uint8_t junk[] = "{\"bus\": 1, \"id\": 2}";
+    ck_assert(!handleIncomingMessage(junk, 10, &DESCRIPTOR));
+    ck_assert(!handleIncomingMessage(NULL, 0, &DESCRIPTOR));
+    ck_assert(handleIncomingMessage(request, sizeof(request), &DESCRIPTOR));
+    ck_assert(!outputQueueEmpty());
 }
 END_TEST
 
@@ -843,10 +863,39 @@ END_TEST
 
 START_TEST (test_payload_format_command)
 {
+    InterfaceDescriptor* usbDescriptor = &getConfiguration()->usb.descriptor;
     uint8_t request[] = "{\"command\": \"payload_format\", \"bus\": 1, \"format\": \"protobuf\"}\0";
+    ck_assert_int_eq(PayloadFormat::JSON, getPayloadFormat(
+                &getConfiguration()->pipeline, usbDescriptor));
+    ck_assert(handleIncomingMessage(request, sizeof(request), usbDescriptor));
+    ck_assert_int_eq(PayloadFormat::PROTOBUF, getPayloadFormat(
+                &getConfiguration()->pipeline, usbDescriptor));
+    // only the interface the command came from changes
     ck_assert_int_eq(PayloadFormat::JSON, getConfiguration()->payloadFormat);
+    ck_assert_int_eq(PayloadFormat::JSON, getPayloadFormat(
+                &getConfiguration()->pipeline,
+                &getConfiguration()->uart.descriptor));
+    setPayloadFormat(&getConfiguration()->pipeline, usbDescriptor, NULL);
+
+    // an interface without any output can't change format
+    resetQueues();
     ck_assert(handleIncomingMessage(request, sizeof(request), &DESCRIPTOR));
-    ck_assert_int_eq(PayloadFormat::PROTOBUF, getConfiguration()->payloadFormat);
+    ck_assert_int_eq(PayloadFormat::JSON, getConfiguration()->payloadFormat);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert(strstr((char*)snapshot, "\"status\":false") != NULL);
+}
+END_TEST
+
+START_TEST (test_payload_format_command_can_batch)
+{
+    InterfaceDescriptor* usbDescriptor = &getConfiguration()->usb.descriptor;
+    uint8_t request[] = "{\"command\": \"payload_format\", \"format\": \"can_batch\"}\0";
+    ck_assert(handleIncomingMessage(request, sizeof(request), usbDescriptor));
+    ck_assert_int_eq(PayloadFormat::CAN_BATCH, getPayloadFormat(
+                &getConfiguration()->pipeline, usbDescriptor));
+    setPayloadFormat(&getConfiguration()->pipeline, usbDescriptor, NULL);
 }
 END_TEST
 
@@ -872,11 +921,64 @@ START_TEST (test_predefined_obd2_command)
 }
 END_TEST
 
+START_TEST (test_subscribe_command)
+{
+    InterfaceDescriptor* usbDescriptor = &getConfiguration()->usb.descriptor;
+    uint8_t request[] = "{\"command\": \"subscribe\", \"signals\": "
+            "[\"vehicle_speed\", {\"name\": \"engine_speed\", "
+            "\"frequency\": 2}], \"can_id_range\": {\"min\": 512, "
+            "\"max\": 1023}}\0";
+    ck_assert(handleIncomingMessage(request, sizeof(request), usbDescriptor));
+    // the response is sent before the filter applies
+    ck_assert(!outputQueueEmpty());
+
+    openxc::pipeline::PipelineSink* sink =
+            &getConfiguration()->pipeline.sinks[0];
+    ck_assert(sink->descriptor == usbDescriptor);
+    ck_assert(sink->filter.enabled);
+    ck_assert_int_eq(2, sink->filter.signalCount);
+    ck_assert_int_eq(500, sink->filter.signals[1].minimumIntervalMs);
+    ck_assert(sink->filter.filterCanIds);
+    ck_assert_int_eq(512, sink->filter.minimumCanId);
+    ck_assert_int_eq(1023, sink->filter.maximumCanId);
+
+    resetQueues();
+    openxc::pipeline::publish(&SIMPLE_MESSAGE, &getConfiguration()->pipeline);
+    ck_assert(outputQueueEmpty());
+    strcpy(SIMPLE_MESSAGE.simple_message.name, "vehicle_speed");
+    openxc::pipeline::publish(&SIMPLE_MESSAGE, &getConfiguration()->pipeline);
+    ck_assert(!outputQueueEmpty());
+
+    uint8_t clear[] = "{\"command\": \"subscribe\"}\0";
+    ck_assert(handleIncomingMessage(clear, sizeof(clear), usbDescriptor));
+    ck_assert(!sink->filter.enabled);
+}
+END_TEST
+
+START_TEST (test_subscribe_to_message_classes)
+{
+    InterfaceDescriptor* usbDescriptor = &getConfiguration()->usb.descriptor;
+    uint8_t request[] = "{\"command\": \"subscribe\", \"classes\": "
+            "[\"can\", \"command_response\"]}\0";
+    ck_assert(handleIncomingMessage(request, sizeof(request), usbDescriptor));
+
+    resetQueues();
+    openxc::pipeline::publish(&SIMPLE_MESSAGE, &getConfiguration()->pipeline);
+    ck_assert(outputQueueEmpty());
+    openxc::pipeline::publish(&CAN_MESSAGE, &getConfiguration()->pipeline);
+    ck_assert(!outputQueueEmpty());
+
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline, usbDescriptor,
+            NULL);
+}
+END_TEST
+
 Suite* suite(void) {
     Suite* s = suite_create("commands");
     TCase *tc_complex_commands = tcase_create("complex_commands");
     tcase_add_checked_fixture(tc_complex_commands, setup, NULL);
     tcase_add_test(tc_complex_commands, test_non_complete_message);
+    tcase_add_test(tc_complex_commands, test_message_resumes_until_reset);
     tcase_add_test(tc_complex_commands, test_raw_write_no_matching_bus);
     tcase_add_test(tc_complex_commands, test_raw_write_missing_bus);
     tcase_add_test(tc_complex_commands, test_raw_write_missing_bus_no_buses);
@@ -929,7 +1031,10 @@ Suite* suite(void) {
     tcase_add_test(tc_control_commands, test_passthrough_request_message);
     tcase_add_test(tc_control_commands, test_bypass_command);
     tcase_add_test(tc_control_commands, test_payload_format_command);
+    tcase_add_test(tc_control_commands, test_payload_format_command_can_batch);
     tcase_add_test(tc_control_commands, test_predefined_obd2_command);
+    tcase_add_test(tc_control_commands, test_subscribe_command);
+    tcase_add_test(tc_control_commands, test_subscribe_to_message_classes);
     suite_add_tcase(s, tc_control_commands);
 
     TCase *tc_validation = tcase_create("validation");
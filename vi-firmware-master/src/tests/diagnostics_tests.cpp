@@ -3,10 +3,12 @@
 #include "signals.h"
 #include "config.h"
 #include "diagnostics.h"
+#include "obd2.h"
 #include "platform/platform.h"
 
 #include "canutil_spy.h"
 #include "power_spy.h"
+#include "storage_spy.h"
 
 namespace diagnostics = openxc::diagnostics;
 namespace usb = openxc::interface::usb;
@@ -62,6 +64,7 @@ void setup() {
     getCanBuses()[0].rawWritable = true;
     request.pid = 2;
     request.arbitration_id = 0x7e0;
+    openxc::storage::spy::reset();
     initializeVehicleInterface();
     getConfiguration()->payloadFormat = openxc::payload::PayloadFormat::JSON;
     resetQueues();
@@ -169,6 +172,95 @@ START_TEST (test_simultaneous_recurring_nonrecurring)
 }
 END_TEST
 
+START_TEST (test_waiting_request_sent_after_response)
+{
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &request));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    ck_assert_int_eq(1, QUEUE_LENGTH(CanMessage, &getCanBuses()[0].sendQueue));
+    resetQueues();
+
+    DiagnosticRequest sameArbId = request;
+    sameArbId.pid = 3;
+    DiagnosticRequest otherArbId = request;
+    otherArbId.arbitration_id = 0x7e1;
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &sameArbId));
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &otherArbId));
+
+    // a request to a different arb ID doesn't have to wait
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    ck_assert_int_eq(1, QUEUE_LENGTH(CanMessage, &getCanBuses()[0].sendQueue));
+    CanMessage sent = QUEUE_POP(CanMessage, &getCanBuses()[0].sendQueue);
+    ck_assert_int_eq(0x7e1, sent.id);
+
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_unless(canQueueEmpty(0));
+
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &message, &getConfiguration()->pipeline);
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    ck_assert_int_eq(1, QUEUE_LENGTH(CanMessage, &getCanBuses()[0].sendQueue));
+    sent = QUEUE_POP(CanMessage, &getCanBuses()[0].sendQueue);
+    ck_assert_int_eq(0x7e0, sent.id);
+    ck_assert_int_eq(3, sent.data[2]);
+}
+END_TEST
+
+START_TEST (test_recurring_not_sent_until_due)
+{
+    ck_assert(diagnostics::addRecurringRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &request, 1));
+    FAKE_TIME += 1000;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_if(canQueueEmpty(0));
+    resetQueues();
+
+    // times out after 100ms, and isn't due again until 1s after it was sent
+    FAKE_TIME += 500;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_unless(canQueueEmpty(0));
+
+    FAKE_TIME += 500;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_if(canQueueEmpty(0));
+}
+END_TEST
+
+START_TEST (test_response_routed_to_owning_request)
+{
+    DiagnosticRequest otherRequest = request;
+    otherRequest.arbitration_id = 0x7e1;
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &request, "foo", false));
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0], &otherRequest, "bar", false));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    ck_assert_int_eq(2, QUEUE_LENGTH(CanMessage, &getCanBuses()[0].sendQueue));
+
+    CanMessage unrelated = message;
+    unrelated.id = 0x123;
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &unrelated, &getConfiguration()->pipeline);
+    fail_unless(outputQueueEmpty());
+
+    CanMessage otherResponse = message;
+    otherResponse.id = otherRequest.arbitration_id + 0x8;
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &otherResponse, &getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert(strstr((char*)snapshot, "foo") == NULL);
+    ck_assert(strstr((char*)snapshot, "bar") != NULL);
+    ck_assert_int_eq(1,
+            getConfiguration()->diagnosticsManager.inFlightCount);
+    ck_assert_int_eq(request.arbitration_id,
+            getConfiguration()->diagnosticsManager.inFlightRequests[0]->arbitration_id);
+}
+END_TEST
+
 START_TEST (test_cancel_invalid)
 {
     ck_assert(!diagnostics::cancelRecurringRequest(
@@ -444,6 +536,120 @@ START_TEST (test_recurring_obd2_build)
 }
 END_TEST
 
+static void respondToObd2Request(const CanMessage* sent) {
+    CanMessage response = {
+        id: 0x7e8,
+        format: CanMessageFormat::STANDARD,
+        data: {0x03, 0x41, sent->data[2]},
+        length: 8
+    };
+    if(sent->data[2] == 0xd) {
+        response.data[3] = 0x32;
+    } else if(sent->data[2] == 0x0) {
+        // supports PIDs 0xc and 0xd
+        response.data[0] = 0x06;
+        response.data[4] = 0x18;
+    } else {
+        return;
+    }
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &response, &getConfiguration()->pipeline);
+}
+
+static bool pollObd2Requests(int iterations, bool answerSupportedPids) {
+    bool packedRequestSent = false;
+    for(int i = 0; i < iterations && !packedRequestSent; i++) {
+        diagnostics::sendRequests(&getConfiguration()->diagnosticsManager,
+                &getCanBuses()[0]);
+        while(!canQueueEmpty(0)) {
+            CanMessage sent = QUEUE_POP(CanMessage, &getCanBuses()[0].sendQueue);
+            if(sent.id == 0x7e0) {
+                const uint8_t expected[] = {0x03, 0x01, 0xc, 0xd};
+                ck_assert(!memcmp(expected, sent.data, sizeof(expected)));
+                packedRequestSent = true;
+            } else if(answerSupportedPids || sent.data[2] != 0x0) {
+                respondToObd2Request(&sent);
+            }
+        }
+        openxc::diagnostics::obd2::loop(&getConfiguration()->diagnosticsManager);
+        FAKE_TIME += 100;
+    }
+    return packedRequestSent;
+}
+
+START_TEST (test_obd2_supported_pids_cached)
+{
+    getConfiguration()->recurringObd2Requests = true;
+    getConfiguration()->obd2BusAddress = 1;
+    initializeVehicleInterface();
+    ck_assert(pollObd2Requests(20, true));
+    // keep going until the supported PID queries finish and are cached
+    for(int i = 0; i < 20; i++) {
+        pollObd2Requests(1, true);
+    }
+    // nothing is written to flash until the bus is quiet
+    ck_assert_int_eq(0, openxc::storage::spy::writtenRecordCount());
+    ck_assert(openxc::storage::flush());
+    ck_assert(openxc::storage::spy::writtenRecordCount() > 0);
+
+    // after a restart, the PIDs should be polled as soon as the ignition is on
+    // without the ECU answering the supported PID queries
+    initializeVehicleInterface();
+    resetQueues();
+    ck_assert(pollObd2Requests(10, false));
+}
+END_TEST
+
+START_TEST (test_obd2_pids_packed_per_ecu)
+{
+    getConfiguration()->recurringObd2Requests = true;
+    getConfiguration()->obd2BusAddress = 1;
+    initializeVehicleInterface();
+
+    // answer the ignition check and supported PID queries until the supported
+    // PIDs are polled from the ECU that has them, in a single request
+    ck_assert(pollObd2Requests(20, true));
+
+    resetQueues();
+    CanMessage response = {
+        id: 0x7e8,
+        format: CanMessageFormat::STANDARD,
+        data: {0x06, 0x41, 0xc, 0x1a, 0xf8, 0xd, 0x32},
+        length: 8
+    };
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &response, &getConfiguration()->pipeline);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    // one message for each PID, none with the raw payload
+    char* second = (char*)snapshot + strlen((char*)snapshot) + 1;
+    ck_assert(strstr((char*)snapshot, "engine_speed") != NULL);
+    ck_assert(strstr(second, "vehicle_speed") != NULL);
+    ck_assert(strstr((char*)snapshot, "payload") == NULL);
+    ck_assert(strstr(second, "payload") == NULL);
+
+    // the response adapted the group's polling rate, and the recurring request
+    // should still be found once (and only once) in the list
+    DiagnosticRequest packed = {
+        arbitration_id: 0x7e0,
+        mode: 0x1,
+        has_pid: true,
+        pid: 0xc,
+        pid_length: 1,
+        payload: {0xd},
+        payload_length: 1
+    };
+    ck_assert(diagnostics::cancelRecurringRequest(
+            &getConfiguration()->diagnosticsManager, &getCanBuses()[0],
+            &packed));
+    ck_assert(!diagnostics::cancelRecurringRequest(
+            &getConfiguration()->diagnosticsManager, &getCanBuses()[0],
+            &packed));
+}
+END_TEST
+
 START_TEST (test_ignition_check_power_management_uses_watchdog)
 {
     getConfiguration()->powerManagement = openxc::config::PowerManagement::OBD2_IGNITION_CHECK;
@@ -468,6 +674,160 @@ START_TEST (test_request_callback)
 }
 END_TEST
 
+static DiagnosticRequest VIN_REQUEST = {
+    arbitration_id: 0x7e0,
+    mode: 0x9,
+    has_pid: true,
+    pid: 0x2,
+    pid_length: 1
+};
+
+// the VIN, after the mode, PID and count of data items
+static const CanMessage VIN_RESPONSE_FRAMES[] = {
+    {id: 0x7e8, format: CanMessageFormat::STANDARD,
+        data: {0x10, 0x14, 0x49, 0x02, 0x01, '1', 'F', 'A'}, length: 8},
+    {id: 0x7e8, format: CanMessageFormat::STANDARD,
+        data: {0x21, 'D', 'P', '3', 'F', '2', '4', 'D'}, length: 8},
+    {id: 0x7e8, format: CanMessageFormat::STANDARD,
+        data: {0x22, 'L', '1', '2', '3', '4', '5', '6'}, length: 8}
+};
+
+static void receiveVinResponseFrame(int index) {
+    CanMessage frame = VIN_RESPONSE_FRAMES[index];
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &frame, &getConfiguration()->pipeline);
+}
+
+static void checkFlowControlSent(uint8_t blockSize, uint8_t separationTimeMs) {
+    fail_if(canQueueEmpty(0));
+    CanMessage flowControl = QUEUE_POP(CanMessage,
+            &getCanBuses()[0].sendQueue);
+    ck_assert_int_eq(flowControl.id, VIN_REQUEST.arbitration_id);
+    ck_assert_int_eq(flowControl.data[0], 0x30);
+    ck_assert_int_eq(flowControl.data[1], blockSize);
+    ck_assert_int_eq(flowControl.data[2], separationTimeMs);
+    fail_unless(canQueueEmpty(0));
+}
+
+START_TEST (test_multi_frame_response_reassembled)
+{
+    CALLBACK_RESPONSE = {0};
+    diagnostics::setIsoTpFlowControl(&getConfiguration()->diagnosticsManager,
+            1, 5);
+    fail_unless(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &VIN_REQUEST, NULL, false, NULL, myCallback));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0]);
+    resetQueues();
+
+    receiveVinResponseFrame(0);
+    checkFlowControlSent(1, 5);
+    receiveVinResponseFrame(1);
+    // a block size of 1 needs flow control after every frame
+    checkFlowControlSent(1, 5);
+    ck_assert_int_eq(CALLBACK_RESPONSE.payload_length, 0);
+
+    receiveVinResponseFrame(2);
+    fail_unless(canQueueEmpty(0));
+    ck_assert(CALLBACK_RESPONSE.completed);
+    ck_assert(CALLBACK_RESPONSE.success);
+    ck_assert(CALLBACK_RESPONSE.multi_frame);
+    ck_assert_int_eq(CALLBACK_RESPONSE.mode, 0x9);
+    ck_assert_int_eq(CALLBACK_RESPONSE.pid, 0x2);
+    ck_assert_int_eq(CALLBACK_RESPONSE.payload_length, 18);
+    ck_assert(!memcmp(&CALLBACK_RESPONSE.payload[1], "1FADP3F24DL123456",
+            17));
+
+    // the response is too long for one message, so it's published in chunks
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    for(size_t i = 0; i < sizeof(snapshot) - 1; i++) {
+        if(snapshot[i] == NULL) {
+            snapshot[i] = ' ';
+        }
+    }
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert(strstr((char*)snapshot, "\"frame\":0") != NULL);
+    ck_assert(strstr((char*)snapshot, "\"frame\":1") != NULL);
+    ck_assert(strstr((char*)snapshot, "\"frame\":-1") != NULL);
+}
+END_TEST
+
+static int COMPLETED_RESPONSE_COUNT;
+
+static void countingCallback(DiagnosticsManager* manager,
+        const ActiveDiagnosticRequest* request,
+        const DiagnosticResponse* response,
+        float parsed_payload) {
+    ck_assert_int_eq(response->payload_length, 18);
+    ++COMPLETED_RESPONSE_COUNT;
+}
+
+START_TEST (test_multi_frame_response_for_physical_and_functional)
+{
+    COMPLETED_RESPONSE_COUNT = 0;
+    DiagnosticRequest functionalRequest = VIN_REQUEST;
+    functionalRequest.arbitration_id = OBD2_FUNCTIONAL_BROADCAST_ID;
+    fail_unless(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &VIN_REQUEST, NULL, false, NULL,
+            countingCallback));
+    fail_unless(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &functionalRequest, NULL, false, NULL,
+            countingCallback));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0]);
+    resetQueues();
+
+    receiveVinResponseFrame(0);
+    // only one flow control frame for the response
+    checkFlowControlSent(DEFAULT_ISOTP_BLOCK_SIZE,
+            DEFAULT_ISOTP_SEPARATION_TIME_MS);
+    receiveVinResponseFrame(1);
+    receiveVinResponseFrame(2);
+    fail_unless(canQueueEmpty(0));
+    ck_assert_int_eq(COMPLETED_RESPONSE_COUNT, 2);
+}
+END_TEST
+
+START_TEST (test_multi_frame_response_streamed)
+{
+    fail_unless(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &VIN_REQUEST));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0]);
+    resetQueues();
+
+    receiveVinResponseFrame(0);
+    checkFlowControlSent(DEFAULT_ISOTP_BLOCK_SIZE,
+            DEFAULT_ISOTP_SEPARATION_TIME_MS);
+    receiveVinResponseFrame(1);
+    // the first full chunk is published as soon as more data arrives
+    fail_if(outputQueueEmpty());
+    receiveVinResponseFrame(2);
+    fail_unless(canQueueEmpty(0));
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    // join the messages up to search them all at once
+    for(size_t i = 0; i < sizeof(snapshot) - 1; i++) {
+        if(snapshot[i] == NULL) {
+            snapshot[i] = ' ';
+        }
+    }
+    snapshot[sizeof(snapshot) - 1] = NULL;
+    ck_assert(strstr((char*)snapshot, "\"frame\":0") != NULL);
+    ck_assert(strstr((char*)snapshot, "\"frame\":1") != NULL);
+    ck_assert(strstr((char*)snapshot, "\"frame\":-1") != NULL);
+    ck_assert(strstr((char*)snapshot, "\"frame\":2") == NULL);
+
+    // the request is done, so the frames aren't received again
+    resetQueues();
+    receiveVinResponseFrame(0);
+    fail_unless(canQueueEmpty(0));
+    fail_unless(outputQueueEmpty());
+}
+END_TEST
+
 START_TEST (test_add_request_with_name_and_decoder)
 {
     fail_unless(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
@@ -578,15 +938,92 @@ START_TEST (test_nonrecurring_timeout)
     diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
     fail_unless(canQueueEmpty(0));
 
+    // nothing answered, so it's re-sent with double the timeout each time
+    FAKE_TIME += 100;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_if(canQueueEmpty(0));
+    resetQueues();
+
+    FAKE_TIME += 100;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_unless(canQueueEmpty(0));
+
     FAKE_TIME += 100;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_if(canQueueEmpty(0));
+    resetQueues();
 
-    // the request timed out and it's non-recurring, so it should *not* be sent
-    // again
+    FAKE_TIME += 400;
+
+    // the request timed out after all of its retries and it's non-recurring, so
+    // it should *not* be sent again
     diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
     fail_unless(canQueueEmpty(0));
 }
 END_TEST
 
+START_TEST (test_timeout_adapts_to_response_time)
+{
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &request));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    FAKE_TIME += 10;
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &message, &getConfiguration()->pipeline);
+    resetQueues();
+
+    // a 10ms response time with 5ms deviation gives a 30ms timeout
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &request));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_if(canQueueEmpty(0));
+    resetQueues();
+
+    FAKE_TIME += 20;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    fail_unless(canQueueEmpty(0));
+
+    FAKE_TIME += 11;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    // retried
+    fail_if(canQueueEmpty(0));
+
+    // and it can be polled faster than an unknown ECU
+    ck_assert(diagnostics::getMaxRecurringFrequency(
+            &getConfiguration()->diagnosticsManager, &getCanBuses()[0],
+            request.arbitration_id) > MAX_RECURRING_DIAGNOSTIC_FREQUENCY_HZ);
+    ck_assert(diagnostics::addRecurringRequest(
+            &getConfiguration()->diagnosticsManager, &getCanBuses()[0],
+            &request, 20));
+}
+END_TEST
+
+START_TEST (test_broadcast_completes_when_known_responders_answer)
+{
+    request.arbitration_id = OBD2_FUNCTIONAL_BROADCAST_ID;
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &request, NULL, true));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &message, &getConfiguration()->pipeline);
+    FAKE_TIME += 100;
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+
+    ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &request, NULL, true));
+    diagnostics::sendRequests(&getConfiguration()->diagnosticsManager, &getCanBuses()[0]);
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &message, &getConfiguration()->pipeline);
+    resetQueues();
+
+    // the only ECU that answered before has answered, so the request is done
+    // without waiting for the timeout
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            &getCanBuses()[0], &message, &getConfiguration()->pipeline);
+    fail_unless(outputQueueEmpty());
+}
+END_TEST
+
 START_TEST(test_clear_to_send_blocked)
 {
     // add 2 requests for 2 pids from same arb id. send one request, then the other -
@@ -956,7 +1393,7 @@ START_TEST(test_broadcast_can_filters)
     ck_assert(diagnostics::addRequest(&getConfiguration()->diagnosticsManager,
             &getCanBuses()[0], &request));
 
-    ck_assert_int_eq(countFilters(&getCanBuses()[0]), 8);
+    ck_assert_int_eq(countFilters(&getCanBuses()[0]), 1);
 }
 END_TEST
 
@@ -1013,6 +1450,9 @@ Suite* suite(void) {
     tcase_add_test(tc_core, test_add_recurring_too_frequent);
     tcase_add_test(tc_core, test_add_twice_diff_frequency_fails);
     tcase_add_test(tc_core, test_add_twice_fails);
+    tcase_add_test(tc_core, test_waiting_request_sent_after_response);
+    tcase_add_test(tc_core, test_recurring_not_sent_until_due);
+    tcase_add_test(tc_core, test_response_routed_to_owning_request);
     tcase_add_test(tc_core, test_padding_on_by_default);
     tcase_add_test(tc_core, test_padding_enabled);
     tcase_add_test(tc_core, test_padding_disabled);
@@ -1024,6 +1464,8 @@ Suite* suite(void) {
     tcase_add_test(tc_core, test_add_nonrecurring_doesnt_clobber_recurring);
     tcase_add_test(tc_core, test_receive_nonrecurring_twice);
     tcase_add_test(tc_core, test_nonrecurring_timeout);
+    tcase_add_test(tc_core, test_timeout_adapts_to_response_time);
+    tcase_add_test(tc_core, test_broadcast_completes_when_known_responders_answer);
     tcase_add_test(tc_core, test_recognized_obd2_request);
     tcase_add_test(tc_core, test_recognized_obd2_request_overridden);
 
@@ -1052,8 +1494,13 @@ Suite* suite(void) {
     tcase_add_test(tc_core, test_command_missing_request);
 
     tcase_add_test(tc_core, test_request_callback);
+    tcase_add_test(tc_core, test_multi_frame_response_reassembled);
+    tcase_add_test(tc_core, test_multi_frame_response_streamed);
+    tcase_add_test(tc_core, test_multi_frame_response_for_physical_and_functional);
 
     tcase_add_test(tc_core, test_recurring_obd2_build);
+    tcase_add_test(tc_core, test_obd2_pids_packed_per_ecu);
+    tcase_add_test(tc_core, test_obd2_supported_pids_cached);
 
     tcase_add_test(tc_core, test_ignition_check_power_management_uses_watchdog);
 
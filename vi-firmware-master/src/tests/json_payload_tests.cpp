@@ -142,6 +142,265 @@ START_TEST (test_predefined_obd2_requests_request)
 }
 END_TEST
 
+START_TEST (test_deserialize_in_pieces)
+{
+    uint8_t rawRequest[] = "{\"name\": \"turn_signal_status\", \"value\": \"le\\\"ft\", \"event\": 2.5}\0";
+    json::StreamState state = {0};
+    openxc_VehicleMessage deserialized = {0};
+    for(size_t length = 1; length < sizeof(rawRequest) - 1; length++) {
+        ck_assert_int_eq(0, json::deserialize(rawRequest, length,
+                    &deserialized, &state));
+    }
+    ck_assert_int_eq(sizeof(rawRequest) - 1, json::deserialize(rawRequest,
+                sizeof(rawRequest), &deserialized, &state));
+
+    ck_assert(validate(&deserialized));
+    ck_assert_str_eq("turn_signal_status", deserialized.simple_message.name);
+    ck_assert(deserialized.simple_message.value.has_string_value);
+    ck_assert_str_eq("le\"ft", deserialized.simple_message.value.string_value);
+    ck_assert(deserialized.simple_message.event.has_numeric_value);
+    ck_assert(deserialized.simple_message.event.numeric_value == 2.5);
+}
+END_TEST
+
+START_TEST (test_deserialize_restarts_after_reset)
+{
+    uint8_t partial[] = "{\"bus\": 1, \"id\": 42, \"da";
+    json::StreamState state = {0};
+    openxc_VehicleMessage deserialized = {0};
+    ck_assert_int_eq(0, json::deserialize(partial, sizeof(partial) - 1,
+                &deserialized, &state));
+
+    json::resetStream(&state);
+    uint8_t rawRequest[] = "{\"command\": \"version\"}\0";
+    ck_assert_int_eq(sizeof(rawRequest) - 1, json::deserialize(rawRequest,
+                sizeof(rawRequest), &deserialized, &state));
+    ck_assert(validate(&deserialized));
+    ck_assert_int_eq(openxc_ControlCommand_Type_VERSION,
+            deserialized.control_command.type);
+}
+END_TEST
+
+START_TEST (test_deserialize_delimited_partial_message_dropped)
+{
+    uint8_t rawRequest[] = "{\"bus\": 1,\0{\"command\": \"version\"}\0";
+    json::StreamState state = {0};
+    openxc_VehicleMessage deserialized = {0};
+    ck_assert_int_eq(11, json::deserialize(rawRequest, sizeof(rawRequest),
+                &deserialized, &state));
+    ck_assert(!validate(&deserialized));
+
+    ck_assert_int_eq(sizeof(rawRequest) - 12, json::deserialize(
+                rawRequest + 11, sizeof(rawRequest) - 11, &deserialized,
+                &state));
+    ck_assert(validate(&deserialized));
+    ck_assert_int_eq(openxc_ControlCommand_Type_VERSION,
+            deserialized.control_command.type);
+}
+END_TEST
+
+START_TEST (test_deserialize_invalid_message_consumed)
+{
+    uint8_t rawRequest[] = "{\"bus\": 1]\0{\"bus\": 1, \"id\": 42, \"data\": \"0x1234\"}\0";
+    openxc_VehicleMessage deserialized = {0};
+    ck_assert_int_eq(11, json::deserialize(rawRequest, sizeof(rawRequest),
+                &deserialized));
+    ck_assert(!validate(&deserialized));
+
+    ck_assert(json::deserialize(rawRequest + 11, sizeof(rawRequest) - 11,
+                &deserialized) > 0);
+    ck_assert(validate(&deserialized));
+    ck_assert_int_eq(42, deserialized.can_message.id);
+    ck_assert_int_eq(2, deserialized.can_message.data.size);
+    ck_assert_int_eq(0x34, deserialized.can_message.data.bytes[1]);
+}
+END_TEST
+
+START_TEST (test_deserialize_diagnostic_request)
+{
+    uint8_t rawRequest[] = "{\"command\": \"diagnostic_request\", \"action\": \"add\", \"request\": {\"bus\": 1, \"id\": 2016, \"mode\": 1, \"pid\": 12, \"payload\": \"0x12\", \"frequency\": 0.5, \"name\": \"rpm\"}}\0";
+    openxc_VehicleMessage deserialized = {0};
+    ck_assert(json::deserialize(rawRequest, sizeof(rawRequest),
+                &deserialized) > 0);
+    ck_assert(validate(&deserialized));
+
+    openxc_DiagnosticRequest* request =
+            &deserialized.control_command.diagnostic_request.request;
+    ck_assert_int_eq(openxc_DiagnosticControlCommand_Action_ADD,
+            deserialized.control_command.diagnostic_request.action);
+    ck_assert_int_eq(1, request->bus);
+    ck_assert_int_eq(2016, request->message_id);
+    ck_assert_int_eq(1, request->mode);
+    ck_assert_int_eq(12, request->pid);
+    ck_assert_int_eq(1, request->payload.size);
+    ck_assert_int_eq(0x12, request->payload.bytes[0]);
+    ck_assert(request->frequency == 0.5);
+    ck_assert_str_eq("rpm", request->name);
+}
+END_TEST
+
+static openxc_VehicleMessage simpleMessage(const char* name) {
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_SIMPLE;
+    message.has_simple_message = true;
+    message.simple_message.has_name = true;
+    strcpy(message.simple_message.name, name);
+    return message;
+}
+
+static void checkNumericValue(double value, const char* expected) {
+    openxc_VehicleMessage message = simpleMessage("foo");
+    message.simple_message.has_value = true;
+    message.simple_message.value.has_type = true;
+    message.simple_message.value.type = openxc_DynamicField_Type_NUM;
+    message.simple_message.value.has_numeric_value = true;
+    message.simple_message.value.numeric_value = value;
+
+    uint8_t payload[256] = {0};
+    std::string expectedPayload = std::string("{\"name\":\"foo\",\"value\":") +
+            expected + "}";
+    ck_assert_int_eq(expectedPayload.length() + 1,
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert_str_eq(expectedPayload.c_str(), (char*)payload);
+}
+
+START_TEST (test_serialize_simple_numbers)
+{
+    checkNumericValue(42, "42");
+    checkNumericValue(-7, "-7");
+    checkNumericValue(0, "0");
+    checkNumericValue(42.5, "42.500000");
+    checkNumericValue(-0.25, "-0.250000");
+    checkNumericValue((float)3.14159, "3.141590");
+    checkNumericValue((float)0.1, "0.100000");
+    checkNumericValue(0.0078125, "0.007812");
+    checkNumericValue(0.0234375, "0.023438");
+    checkNumericValue((float)0.9999999, "1.000000");
+    checkNumericValue(3000000000.0, "3000000000");
+    checkNumericValue(1234567890.5, "1.234568e+09");
+    checkNumericValue(0.0000005, "5.000000e-07");
+}
+END_TEST
+
+START_TEST (test_serialize_simple_boolean_and_event)
+{
+    openxc_VehicleMessage message = simpleMessage("door_status");
+    message.simple_message.has_value = true;
+    message.simple_message.value.has_type = true;
+    message.simple_message.value.type = openxc_DynamicField_Type_STRING;
+    message.simple_message.value.has_string_value = true;
+    strcpy(message.simple_message.value.string_value, "driver");
+    message.simple_message.has_event = true;
+    message.simple_message.event.has_type = true;
+    message.simple_message.event.type = openxc_DynamicField_Type_BOOL;
+    message.simple_message.event.has_boolean_value = true;
+    message.simple_message.event.boolean_value = false;
+
+    uint8_t payload[256] = {0};
+    const char* expected =
+            "{\"name\":\"door_status\",\"value\":\"driver\",\"event\":false}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert_str_eq(expected, (char*)payload);
+}
+END_TEST
+
+START_TEST (test_serialize_simple_escapes_strings)
+{
+    openxc_VehicleMessage message = simpleMessage("a\"b\\c\td\x01");
+    uint8_t payload[256] = {0};
+    const char* expected = "{\"name\":\"a\\\"b\\\\c\\td\\u0001\"}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert_str_eq(expected, (char*)payload);
+}
+END_TEST
+
+START_TEST (test_serialize_simple_truncated)
+{
+    openxc_VehicleMessage message = simpleMessage("foo");
+    uint8_t payload[8] = {0};
+    ck_assert_int_eq(sizeof(payload),
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert(!memcmp("{\"name\":", payload, sizeof(payload)));
+}
+END_TEST
+
+START_TEST (test_serialize_can_message)
+{
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_CAN;
+    message.has_can_message = true;
+    message.can_message.has_bus = true;
+    message.can_message.bus = 1;
+    message.can_message.has_id = true;
+    message.can_message.id = 0x7e8;
+    message.can_message.has_data = true;
+    message.can_message.data.size = 3;
+    message.can_message.data.bytes[0] = 0x0a;
+    message.can_message.data.bytes[1] = 0xff;
+    message.can_message.data.bytes[2] = 0x00;
+
+    uint8_t payload[256] = {0};
+    const char* expected = "{\"bus\":1,\"id\":2024,\"data\":\"0x0aff00\"}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert_str_eq(expected, (char*)payload);
+
+    message.can_message.has_frame_format = true;
+    message.can_message.frame_format = openxc_CanMessage_FrameFormat_EXTENDED;
+    expected = "{\"bus\":1,\"id\":2024,\"data\":\"0x0aff00\","
+            "\"frame_format\":\"extended\"}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload)));
+    ck_assert_str_eq(expected, (char*)payload);
+}
+END_TEST
+
+START_TEST (test_serialize_with_timestamp)
+{
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_CAN;
+    message.has_can_message = true;
+    message.can_message.has_bus = true;
+    message.can_message.bus = 1;
+    message.can_message.has_id = true;
+    message.can_message.id = 0x7e8;
+    message.can_message.has_data = true;
+    message.can_message.data.size = 1;
+    message.can_message.data.bytes[0] = 0x0a;
+
+    uint32_t timestamp = 4000000123;
+    uint8_t payload[256] = {0};
+    const char* expected = "{\"bus\":1,\"id\":2024,\"data\":\"0x0a\","
+            "\"timestamp_us\":4000000123}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload), &timestamp));
+    ck_assert_str_eq(expected, (char*)payload);
+
+    message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_SIMPLE;
+    message.has_simple_message = true;
+    message.simple_message.has_name = true;
+    strcpy(message.simple_message.name, "foo");
+    message.simple_message.has_value = true;
+    message.simple_message.value.has_type = true;
+    message.simple_message.value.type = openxc_DynamicField_Type_BOOL;
+    message.simple_message.value.has_boolean_value = true;
+    message.simple_message.value.boolean_value = true;
+
+    timestamp = 0;
+    expected = "{\"name\":\"foo\",\"value\":true,\"timestamp_us\":0}";
+    ck_assert_int_eq(strlen(expected) + 1,
+            json::serialize(&message, payload, sizeof(payload), &timestamp));
+    ck_assert_str_eq(expected, (char*)payload);
+}
+END_TEST
+
 START_TEST (test_deserialize_can_message_write)
 {
     uint8_t rawRequest[] = "{\"bus\": 1, \"id\": 42, \"data\": \"0x1234\"}\0";
@@ -188,6 +447,17 @@ Suite* suite(void) {
     tcase_add_test(tc_json_payload, test_deserialize_can_message_write);
     tcase_add_test(tc_json_payload, test_deserialize_can_message_write_with_format);
     tcase_add_test(tc_json_payload, test_deserialize_message_after_junk);
+    tcase_add_test(tc_json_payload, test_deserialize_in_pieces);
+    tcase_add_test(tc_json_payload, test_deserialize_restarts_after_reset);
+    tcase_add_test(tc_json_payload, test_deserialize_delimited_partial_message_dropped);
+    tcase_add_test(tc_json_payload, test_deserialize_invalid_message_consumed);
+    tcase_add_test(tc_json_payload, test_deserialize_diagnostic_request);
+    tcase_add_test(tc_json_payload, test_serialize_simple_numbers);
+    tcase_add_test(tc_json_payload, test_serialize_simple_boolean_and_event);
+    tcase_add_test(tc_json_payload, test_serialize_simple_escapes_strings);
+    tcase_add_test(tc_json_payload, test_serialize_simple_truncated);
+    tcase_add_test(tc_json_payload, test_serialize_can_message);
+    tcase_add_test(tc_json_payload, test_serialize_with_timestamp);
     suite_add_tcase(s, tc_json_payload);
 
     return s;
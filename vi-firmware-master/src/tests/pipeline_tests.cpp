@@ -3,6 +3,7 @@
 #include "pipeline.h"
 #include "emqueue.h"
 #include "config.h"
+#include "can/canread.h"
 
 namespace uart = openxc::interface::uart;
 namespace network = openxc::interface::network;
@@ -10,7 +11,12 @@ namespace usb = openxc::interface::usb;
 
 using openxc::pipeline::Pipeline;
 using openxc::pipeline::MessageClass;
+using openxc::pipeline::addSink;
+using openxc::pipeline::removeSinks;
 using openxc::config::getConfiguration;
+using openxc::interface::BackpressurePolicy;
+using openxc::can::read::publishNumericalMessage;
+using openxc::payload::PayloadFormat;
 
 QUEUE_TYPE(uint8_t)* OUTPUT_QUEUE = &getConfiguration()->usb.endpoints[IN_ENDPOINT_INDEX].queue;
 QUEUE_TYPE(uint8_t)* LOG_QUEUE = &getConfiguration()->usb.endpoints[LOG_ENDPOINT_INDEX].queue;
@@ -18,15 +24,40 @@ QUEUE_TYPE(uint8_t)* LOG_QUEUE = &getConfiguration()->usb.endpoints[LOG_ENDPOINT
 extern bool USB_PROCESSED;
 extern bool UART_PROCESSED;
 extern bool NETWORK_PROCESSED;
+extern unsigned long FAKE_TIME;
+
+static void addUartSink() {
+    addSink(&getConfiguration()->pipeline, "UART",
+            &openxc::pipeline::UART_SINK_OPERATIONS, &getConfiguration()->uart,
+            &getConfiguration()->uart.descriptor, NON_LOG_MESSAGE_CLASSES);
+}
+
+static void addNetworkSink() {
+    addSink(&getConfiguration()->pipeline, "Network",
+            &openxc::pipeline::NETWORK_SINK_OPERATIONS,
+            &getConfiguration()->network,
+            &getConfiguration()->network.descriptor, NON_LOG_MESSAGE_CLASSES);
+}
 
 void setup() {
-    getConfiguration()->pipeline.usb = &getConfiguration()->usb;
-    getConfiguration()->pipeline.uart = NULL;
-    getConfiguration()->pipeline.network = NULL;
+    initialize(&getConfiguration()->pipeline);
+    addSink(&getConfiguration()->pipeline, "USB",
+            &openxc::pipeline::USB_SINK_OPERATIONS, &getConfiguration()->usb,
+            &getConfiguration()->usb.descriptor, NON_LOG_MESSAGE_CLASSES);
+    addSink(&getConfiguration()->pipeline, "USB log",
+            &openxc::pipeline::USB_LOG_SINK_OPERATIONS,
+            &getConfiguration()->usb, &getConfiguration()->usb.descriptor,
+            MESSAGE_CLASS_MASK(MessageClass::LOG));
+    getConfiguration()->uart.descriptor.backpressure =
+            BackpressurePolicy::BOUNDED_WAIT;
     usb::initialize(&getConfiguration()->usb);
     uart::initialize(&getConfiguration()->uart);
     network::initialize(&getConfiguration()->network);
     getConfiguration()->usb.configured = true;
+    getConfiguration()->payloadFormat = PayloadFormat::JSON;
+    getConfiguration()->emitTimestamps = false;
+    // flush out anything a previous test left waiting for room in a queue
+    process(&getConfiguration()->pipeline);
     USB_PROCESSED = false;
     UART_PROCESSED = false;
     NETWORK_PROCESSED = false;
@@ -58,11 +89,11 @@ END_TEST
 
 START_TEST (test_full_network)
 {
-    getConfiguration()->pipeline.network = &getConfiguration()->network;
+    addNetworkSink();
     for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
-        QUEUE_PUSH(uint8_t, &getConfiguration()->pipeline.network->sendQueue, (uint8_t) 128);
+        QUEUE_PUSH(uint8_t, &getConfiguration()->network.sendQueue, (uint8_t) 128);
     }
-    fail_unless(QUEUE_FULL(uint8_t, &getConfiguration()->pipeline.network->sendQueue));
+    fail_unless(QUEUE_FULL(uint8_t, &getConfiguration()->network.sendQueue));
 
     const char* message = "message";
     sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
@@ -71,11 +102,11 @@ END_TEST
 
 START_TEST (test_full_uart)
 {
-    getConfiguration()->pipeline.uart = &getConfiguration()->uart;
+    addUartSink();
     for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
-        QUEUE_PUSH(uint8_t, &getConfiguration()->pipeline.uart->sendQueue, (uint8_t) 128);
+        QUEUE_PUSH(uint8_t, &getConfiguration()->uart.sendQueue, (uint8_t) 128);
     }
-    fail_unless(QUEUE_FULL(uint8_t, &getConfiguration()->pipeline.uart->sendQueue));
+    fail_unless(QUEUE_FULL(uint8_t, &getConfiguration()->uart.sendQueue));
 
     const char* message = "message";
     sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
@@ -94,9 +125,296 @@ START_TEST (test_full_usb)
 }
 END_TEST
 
+START_TEST (test_full_uart_holds_message)
+{
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
+        QUEUE_PUSH(uint8_t, queue, (uint8_t) 128);
+    }
+    fail_unless(QUEUE_FULL(uint8_t, queue));
+
+    const char* message = "message";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
+    QUEUE_INIT(uint8_t, queue);
+
+    const char* second = "second";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)second, 7, MessageClass::SIMPLE);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(sizeof(snapshot), 15);
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "message");
+    ck_assert_str_eq((char*)snapshot + 8, "second");
+}
+END_TEST
+
+/* Fill the UART send queue and attach UART to the pipeline with the given
+ * backpressure policy.
+ */
+QUEUE_TYPE(uint8_t)* fillUart(BackpressurePolicy policy) {
+    getConfiguration()->uart.descriptor.backpressure = policy;
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
+        QUEUE_PUSH(uint8_t, queue, (uint8_t) 128);
+    }
+    return queue;
+}
+
+START_TEST (test_drop_newest_doesnt_wait)
+{
+    QUEUE_TYPE(uint8_t)* queue = fillUart(BackpressurePolicy::DROP_NEWEST);
+    char message[2] = {0};
+    for(int i = 0; i < 7; i++) {
+        message[0] = 'a' + i;
+        sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 2, MessageClass::SIMPLE);
+    }
+    fail_if(UART_PROCESSED);
+
+    QUEUE_INIT(uint8_t, queue);
+    process(&getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(sizeof(snapshot), 12);
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "a");
+    ck_assert_str_eq((char*)snapshot + 10, "f");
+}
+END_TEST
+
+START_TEST (test_drop_oldest)
+{
+    QUEUE_TYPE(uint8_t)* queue = fillUart(BackpressurePolicy::DROP_OLDEST);
+    char message[2] = {0};
+    for(int i = 0; i < 7; i++) {
+        message[0] = 'a' + i;
+        sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 2, MessageClass::SIMPLE);
+    }
+    fail_if(UART_PROCESSED);
+
+    QUEUE_INIT(uint8_t, queue);
+    process(&getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(sizeof(snapshot), 12);
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "b");
+    ck_assert_str_eq((char*)snapshot + 10, "g");
+}
+END_TEST
+
+START_TEST (test_coalesce_by_signal_name)
+{
+    QUEUE_TYPE(uint8_t)* queue = fillUart(BackpressurePolicy::COALESCE);
+    publishNumericalMessage("first", 1, &getConfiguration()->pipeline);
+    publishNumericalMessage("second", 1, &getConfiguration()->pipeline);
+    publishNumericalMessage("first", 2, &getConfiguration()->pipeline);
+    fail_if(UART_PROCESSED);
+
+    QUEUE_INIT(uint8_t, queue);
+    process(&getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "{\"name\":\"first\",\"value\":2}");
+    ck_assert_str_eq((char*)snapshot + strlen((char*)snapshot) + 1,
+            "{\"name\":\"second\",\"value\":1}");
+    ck_assert_int_eq(sizeof(snapshot), strlen((char*)snapshot) + 1 +
+            strlen((char*)snapshot + strlen((char*)snapshot) + 1) + 1);
+}
+END_TEST
+
+static void publishCan(int bus, uint32_t id, bool extended,
+        const uint8_t* data, int length) {
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_CAN;
+    message.has_can_message = true;
+    message.can_message.has_bus = true;
+    message.can_message.bus = bus;
+    message.can_message.has_id = true;
+    message.can_message.id = id;
+    message.can_message.has_frame_format = extended;
+    message.can_message.frame_format = openxc_CanMessage_FrameFormat_EXTENDED;
+    message.can_message.has_data = true;
+    message.can_message.data.size = length;
+    memcpy(message.can_message.data.bytes, data, length);
+    publish(&message, &getConfiguration()->pipeline);
+}
+
+START_TEST (test_can_batch)
+{
+    getConfiguration()->payloadFormat = PayloadFormat::CAN_BATCH;
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+
+    const uint8_t first[] = {0x1, 0x2};
+    const uint8_t second[] = {0xff};
+    FAKE_TIME = 1000;
+    publishCan(1, 0x7e8, false, first, sizeof(first));
+    FAKE_TIME = 1001;
+    publishCan(2, 0x12345678, true, second, sizeof(second));
+    ck_assert(QUEUE_EMPTY(uint8_t, queue));
+
+    process(&getConfiguration()->pipeline);
+    FAKE_TIME = 1000;
+
+    const uint8_t expected[] = {
+        // length, record type, base timestamp
+        0x95, 0x00, 0x01, 0xc0, 0x84, 0x3d,
+        // delta, bus, id, length, data
+        0x00, 0x01, 0xd0, 0x1f, 0x02, 0x01, 0x02,
+        0xd0, 0x0f, 0x02, 0xf1, 0xd9, 0xa2, 0xa3, 0x02, 0x01, 0xff};
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(sizeof(expected), sizeof(snapshot));
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert(!memcmp(expected, snapshot, sizeof(expected)));
+}
+END_TEST
+
+static bool containsBytes(QUEUE_TYPE(uint8_t)* queue, const uint8_t* bytes,
+        size_t length) {
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    for(size_t i = 0; i + length <= sizeof(snapshot); i++) {
+        if(!memcmp(&snapshot[i], bytes, length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+START_TEST (test_can_batch_per_sink_filter)
+{
+    getConfiguration()->payloadFormat = PayloadFormat::CAN_BATCH;
+    addUartSink();
+    addNetworkSink();
+
+    openxc::pipeline::SinkFilter filter = {0};
+    filter.enabled = true;
+    filter.messageClasses = MESSAGE_CLASS_MASK(MessageClass::CAN);
+    filter.filterCanIds = true;
+    filter.minimumCanId = filter.maximumCanId = 0x100;
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline,
+            &getConfiguration()->uart.descriptor, &filter);
+    filter.minimumCanId = filter.maximumCanId = 0x200;
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline,
+            &getConfiguration()->network.descriptor, &filter);
+
+    const uint8_t data[] = {0x1};
+    publishCan(1, 0x100, false, data, sizeof(data));
+    publishCan(1, 0x200, false, data, sizeof(data));
+    process(&getConfiguration()->pipeline);
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline,
+            &getConfiguration()->uart.descriptor, NULL);
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline,
+            &getConfiguration()->network.descriptor, NULL);
+
+    // each ID shifted left by 1, as a varint
+    const uint8_t first[] = {0x80, 0x04};
+    const uint8_t second[] = {0x80, 0x08};
+    ck_assert(containsBytes(&getConfiguration()->uart.sendQueue, first,
+            sizeof(first)));
+    ck_assert(!containsBytes(&getConfiguration()->uart.sendQueue, second,
+            sizeof(second)));
+    ck_assert(!containsBytes(&getConfiguration()->network.sendQueue, first,
+            sizeof(first)));
+    ck_assert(containsBytes(&getConfiguration()->network.sendQueue, second,
+            sizeof(second)));
+}
+END_TEST
+
+START_TEST (test_can_batch_sent_before_other_messages)
+{
+    getConfiguration()->payloadFormat = PayloadFormat::CAN_BATCH;
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+
+    const uint8_t data[] = {0x1};
+    publishCan(1, 0x42, false, data, sizeof(data));
+    const char* message = "message";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8,
+            MessageClass::SIMPLE);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    ck_assert_int_eq(0x01, snapshot[2]);
+    int recordLength = snapshot[0] & 0x7f;
+    ck_assert_int_eq(sizeof(snapshot), recordLength + 2 + 8);
+    ck_assert_str_eq((char*)snapshot + recordLength + 2, "message");
+}
+END_TEST
+
+START_TEST (test_emit_timestamps)
+{
+    const uint8_t data[] = {0x1};
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_CAN;
+    message.has_can_message = true;
+    message.can_message.has_bus = true;
+    message.can_message.bus = 1;
+    message.can_message.has_id = true;
+    message.can_message.id = 0x42;
+    message.can_message.has_data = true;
+    message.can_message.data.size = sizeof(data);
+    memcpy(message.can_message.data.bytes, data, sizeof(data));
+
+    uint32_t timestamp = 1234;
+    publish(&message, &getConfiguration()->pipeline, &timestamp);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = 0;
+    ck_assert(strstr((char*)snapshot, "timestamp_us") == NULL);
+
+    QUEUE_INIT(uint8_t, OUTPUT_QUEUE);
+    getConfiguration()->emitTimestamps = true;
+    publish(&message, &getConfiguration()->pipeline, &timestamp);
+    uint8_t stamped[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, stamped, sizeof(stamped));
+    stamped[sizeof(stamped) - 1] = 0;
+    ck_assert(strstr((char*)stamped, ",\"timestamp_us\":1234}") != NULL);
+}
+END_TEST
+
+START_TEST (test_can_batch_uses_receive_timestamp)
+{
+    getConfiguration()->payloadFormat = PayloadFormat::CAN_BATCH;
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+
+    openxc_VehicleMessage message = {0};
+    message.has_type = true;
+    message.type = openxc_VehicleMessage_Type_CAN;
+    message.has_can_message = true;
+    message.can_message.has_bus = true;
+    message.can_message.bus = 1;
+    message.can_message.has_id = true;
+    message.can_message.id = 0x42;
+
+    FAKE_TIME = 1000;
+    uint32_t timestamp = 300;
+    publish(&message, &getConfiguration()->pipeline, &timestamp);
+    // received on another bus before the first message
+    message.can_message.bus = 2;
+    timestamp = 250;
+    publish(&message, &getConfiguration()->pipeline, &timestamp);
+    process(&getConfiguration()->pipeline);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(15, sizeof(snapshot));
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
+    // length, record type, then the base timestamp 300 as a varint
+    ck_assert_int_eq(0x01, snapshot[2]);
+    ck_assert_int_eq(0xac, snapshot[3]);
+    ck_assert_int_eq(0x02, snapshot[4]);
+    // the second frame is -50us after the first, zigzag encoded
+    ck_assert_int_eq(0x63, snapshot[10]);
+    ck_assert_int_eq(0x02, snapshot[11]);
+}
+END_TEST
+
 START_TEST (test_with_uart)
 {
-    getConfiguration()->pipeline.uart = &getConfiguration()->uart;
+    addUartSink();
     const char* message = "message";
     sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
 
@@ -104,15 +422,15 @@ START_TEST (test_with_uart)
     QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
     ck_assert_str_eq((char*)snapshot, "message");
 
-    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->pipeline.uart->sendQueue, snapshot, sizeof(snapshot));
+    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->uart.sendQueue, snapshot, sizeof(snapshot));
     ck_assert_str_eq((char*)snapshot, "message");
 }
 END_TEST
 
 START_TEST (test_with_uart_and_network)
 {
-    getConfiguration()->pipeline.uart = &getConfiguration()->uart;
-    getConfiguration()->pipeline.network = &getConfiguration()->network;
+    addUartSink();
+    addNetworkSink();
     const char* message = "message";
     sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
 
@@ -120,11 +438,165 @@ START_TEST (test_with_uart_and_network)
     QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
     ck_assert_str_eq((char*)snapshot, "message");
 
-    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->pipeline.uart->sendQueue, snapshot, sizeof(snapshot));
+    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->uart.sendQueue, snapshot, sizeof(snapshot));
     ck_assert_str_eq((char*)snapshot, "message");
 
-    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->pipeline.network->sendQueue, snapshot, sizeof(snapshot));
+    QUEUE_SNAPSHOT(uint8_t, &getConfiguration()->network.sendQueue, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "message");
+}
+END_TEST
+
+static int CUSTOM_SINK_RECEIVED;
+
+static bool customConnected(void* device) {
+    return true;
+}
+
+static int customEnqueue(void* device, const uint8_t* data, int length) {
+    ++CUSTOM_SINK_RECEIVED;
+    return length;
+}
+
+static int customAvailable(void* device) {
+    return QUEUE_MAX_LENGTH(uint8_t);
+}
+
+static const openxc::pipeline::SinkOperations CUSTOM_SINK_OPERATIONS = {
+    connected: customConnected,
+    enqueue: customEnqueue,
+    available: customAvailable,
+    flush: NULL,
+    queueLengths: NULL
+};
+
+START_TEST (test_sink_receives_only_subscribed_classes)
+{
+    CUSTOM_SINK_RECEIVED = 0;
+    ck_assert(addSink(&getConfiguration()->pipeline, "custom",
+            &CUSTOM_SINK_OPERATIONS, NULL, NULL,
+            MESSAGE_CLASS_MASK(MessageClass::DIAGNOSTIC)));
+
+    const char* message = "message";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::LOG);
+    ck_assert_int_eq(0, CUSTOM_SINK_RECEIVED);
+
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::DIAGNOSTIC);
+    ck_assert_int_eq(1, CUSTOM_SINK_RECEIVED);
+    process(&getConfiguration()->pipeline);
+}
+END_TEST
+
+START_TEST (test_remove_sinks)
+{
+    addUartSink();
+    removeSinks(&getConfiguration()->pipeline, &getConfiguration()->uart);
+
+    const char* message = "message";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
+    ck_assert(QUEUE_EMPTY(uint8_t, &getConfiguration()->uart.sendQueue));
+    ck_assert(!QUEUE_EMPTY(uint8_t, OUTPUT_QUEUE));
+
+    removeSinks(&getConfiguration()->pipeline, &getConfiguration()->usb);
+    ck_assert_int_eq(0, getConfiguration()->pipeline.sinkCount);
+}
+END_TEST
+
+START_TEST (test_remove_sinks_keeps_held_payloads)
+{
+    addUartSink();
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+    for(int i = 0; i < QUEUE_MAX_LENGTH(uint8_t) + 1; i++) {
+        QUEUE_PUSH(uint8_t, queue, (uint8_t) 128);
+    }
+
+    const char* message = "message";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)message, 8, MessageClass::SIMPLE);
+
+    // UART moves down to the first sink, and the new sinks take the places it
+    // and the USB log sink had
+    removeSinks(&getConfiguration()->pipeline, &getConfiguration()->usb);
+    addNetworkSink();
+    ck_assert(addSink(&getConfiguration()->pipeline, "custom",
+            &CUSTOM_SINK_OPERATIONS, NULL, NULL, NON_LOG_MESSAGE_CLASSES));
+
+    const char* second = "second";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)second, 7, MessageClass::SIMPLE);
+
+    QUEUE_INIT(uint8_t, queue);
+    process(&getConfiguration()->pipeline);
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, queue)];
+    ck_assert_int_eq(sizeof(snapshot), 15);
+    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, sizeof(snapshot));
     ck_assert_str_eq((char*)snapshot, "message");
+    ck_assert_str_eq((char*)snapshot + 8, "second");
+}
+END_TEST
+
+START_TEST (test_filter_signal_rate)
+{
+    openxc::pipeline::SinkFilter filter = {0};
+    filter.enabled = true;
+    filter.messageClasses = NON_LOG_MESSAGE_CLASSES;
+    ck_assert(openxc::pipeline::addSignalFilter(&filter, "first", 10));
+    // not the USB log sink, which shares the descriptor
+    ck_assert_int_eq(1, openxc::pipeline::setFilter(
+            &getConfiguration()->pipeline, &getConfiguration()->usb.descriptor,
+            &filter));
+    const char* log = "log";
+    sendMessage(&getConfiguration()->pipeline, (uint8_t*)log, 4, MessageClass::LOG);
+    ck_assert(!QUEUE_EMPTY(uint8_t, LOG_QUEUE));
+
+    FAKE_TIME = 1000;
+    publishNumericalMessage("first", 1, &getConfiguration()->pipeline);
+    publishNumericalMessage("second", 1, &getConfiguration()->pipeline);
+    publishNumericalMessage("first", 2, &getConfiguration()->pipeline);
+    FAKE_TIME = 1100;
+    publishNumericalMessage("first", 3, &getConfiguration()->pipeline);
+    FAKE_TIME = 1000;
+    openxc::pipeline::setFilter(&getConfiguration()->pipeline,
+            &getConfiguration()->usb.descriptor, NULL);
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE)];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    ck_assert_str_eq((char*)snapshot, "{\"name\":\"first\",\"value\":1}");
+    ck_assert_str_eq((char*)snapshot + strlen((char*)snapshot) + 1,
+            "{\"name\":\"first\",\"value\":3}");
+    ck_assert_int_eq(sizeof(snapshot), 2 * (strlen((char*)snapshot) + 1));
+}
+END_TEST
+
+START_TEST (test_payload_format_per_sink)
+{
+    addUartSink();
+    const PayloadFormat canBatch = PayloadFormat::CAN_BATCH;
+    ck_assert_int_eq(1, openxc::pipeline::setPayloadFormat(
+            &getConfiguration()->pipeline, &getConfiguration()->uart.descriptor,
+            &canBatch));
+    ck_assert_int_eq(PayloadFormat::CAN_BATCH, openxc::pipeline::getPayloadFormat(
+            &getConfiguration()->pipeline, &getConfiguration()->uart.descriptor));
+    ck_assert_int_eq(PayloadFormat::JSON, openxc::pipeline::getPayloadFormat(
+            &getConfiguration()->pipeline, &getConfiguration()->usb.descriptor));
+
+    const uint8_t data[] = {0x1};
+    publishCan(1, 0x42, false, data, sizeof(data));
+    QUEUE_TYPE(uint8_t)* queue = &getConfiguration()->uart.sendQueue;
+    ck_assert(QUEUE_EMPTY(uint8_t, queue));
+
+    uint8_t snapshot[QUEUE_LENGTH(uint8_t, OUTPUT_QUEUE) + 1];
+    QUEUE_SNAPSHOT(uint8_t, OUTPUT_QUEUE, snapshot, sizeof(snapshot));
+    snapshot[sizeof(snapshot) - 1] = 0;
+    ck_assert(strstr((char*)snapshot, "\"id\":66") != NULL);
+
+    process(&getConfiguration()->pipeline);
+    openxc::pipeline::setPayloadFormat(&getConfiguration()->pipeline,
+            &getConfiguration()->uart.descriptor, NULL);
+
+    uint8_t batch[QUEUE_LENGTH(uint8_t, queue)];
+    QUEUE_SNAPSHOT(uint8_t, queue, batch, sizeof(batch));
+    // length, then the CAN batch record type
+    ck_assert_int_eq(sizeof(batch) - 2, batch[0] & 0x7f);
+    ck_assert_int_eq(0x01, batch[2]);
 }
 END_TEST
 
@@ -139,7 +611,7 @@ END_TEST
 
 START_TEST (test_process_usb_and_uart)
 {
-    getConfiguration()->pipeline.uart = &getConfiguration()->uart;
+    addUartSink();
     process(&getConfiguration()->pipeline);
     fail_unless(USB_PROCESSED);
     fail_unless(UART_PROCESSED);
@@ -149,8 +621,8 @@ END_TEST
 
 START_TEST (test_process_all)
 {
-    getConfiguration()->pipeline.uart = &getConfiguration()->uart;
-    getConfiguration()->pipeline.network = &getConfiguration()->network;
+    addUartSink();
+    addNetworkSink();
     process(&getConfiguration()->pipeline);
     fail_unless(USB_PROCESSED);
     fail_unless(UART_PROCESSED);
@@ -166,12 +638,26 @@ Suite* pipelineSuite(void) {
     tcase_add_test(tc_core, test_with_uart);
     tcase_add_test(tc_core, test_with_uart_and_network);
     tcase_add_test(tc_core, test_full_usb);
+    tcase_add_test(tc_core, test_full_uart_holds_message);
+    tcase_add_test(tc_core, test_drop_newest_doesnt_wait);
+    tcase_add_test(tc_core, test_drop_oldest);
+    tcase_add_test(tc_core, test_coalesce_by_signal_name);
     tcase_add_test(tc_core, test_full_uart);
     tcase_add_test(tc_core, test_full_network);
     tcase_add_test(tc_core, test_process_all);
     tcase_add_test(tc_core, test_process_usb_and_uart);
     tcase_add_test(tc_core, test_process_usb);
     tcase_add_test(tc_core, test_log_to_usb);
+    tcase_add_test(tc_core, test_sink_receives_only_subscribed_classes);
+    tcase_add_test(tc_core, test_remove_sinks);
+    tcase_add_test(tc_core, test_remove_sinks_keeps_held_payloads);
+    tcase_add_test(tc_core, test_filter_signal_rate);
+    tcase_add_test(tc_core, test_payload_format_per_sink);
+    tcase_add_test(tc_core, test_can_batch);
+    tcase_add_test(tc_core, test_can_batch_per_sink_filter);
+    tcase_add_test(tc_core, test_can_batch_sent_before_other_messages);
+    tcase_add_test(tc_core, test_can_batch_uses_receive_timestamp);
+    tcase_add_test(tc_core, test_emit_timestamps);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -0,0 +1,59 @@
+#include "storage_spy.h"
+#include <stdio.h>
+#include <string.h>
+
+// A file stands in for the flash sector - records are appended to it the same
+// way.
+#define STORAGE_FILE "build/storage.bin"
+
+using openxc::storage::StorageRecord;
+
+void openxc::storage::spy::reset() {
+    // write out anything still waiting, so the next test starts without it
+    flush();
+    remove(STORAGE_FILE);
+}
+
+int openxc::storage::spy::writtenRecordCount() {
+    FILE* file = fopen(STORAGE_FILE, "rb");
+    if(file == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    StorageRecord record;
+    while(fread(&record, sizeof(record), 1, file) == 1) {
+        ++count;
+    }
+    fclose(file);
+    return count;
+}
+
+bool openxc::storage::readRecord(const char* key, StorageRecord* found) {
+    FILE* file = fopen(STORAGE_FILE, "rb");
+    if(file == NULL) {
+        return false;
+    }
+
+    bool matched = false;
+    StorageRecord record;
+    while(fread(&record, sizeof(record), 1, file) == 1) {
+        if(record.magic == STORAGE_RECORD_MAGIC &&
+                !strncmp(record.key, key, MAX_STORAGE_KEY_LENGTH)) {
+            *found = record;
+            matched = true;
+        }
+    }
+    fclose(file);
+    return matched;
+}
+
+bool openxc::storage::writeRecord(const StorageRecord* record) {
+    FILE* file = fopen(STORAGE_FILE, "ab");
+    if(file == NULL) {
+        return false;
+    }
+    bool stored = fwrite(record, sizeof(StorageRecord), 1, file) == 1;
+    fclose(file);
+    return stored;
+}
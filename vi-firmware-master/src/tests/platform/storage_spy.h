@@ -0,0 +1,18 @@
+#ifndef __STORAGE_SPY_H__
+#define __STORAGE_SPY_H__
+
+#include "storage.h"
+
+namespace openxc {
+namespace storage {
+namespace spy {
+
+void reset();
+
+int writtenRecordCount();
+
+} // namespace spy
+} // namespace storage
+} // namespace openxc
+
+#endif
@@ -29,7 +29,8 @@ bool queueEmpty() {
 }
 
 void setup() {
-    getConfiguration()->pipeline.uart = NULL;
+    openxc::pipeline::removeSinks(&getConfiguration()->pipeline,
+            &getConfiguration()->uart);
     openxc::config::getConfiguration()->messageSetIndex = 1;
     usb::initialize(&getConfiguration()->usb);
     getConfiguration()->usb.configured = true;
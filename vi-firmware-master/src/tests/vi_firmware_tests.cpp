@@ -14,13 +14,14 @@ using openxc::pipeline::Pipeline;
 using openxc::signals::getCanBuses;
 using openxc::signals::getCanBusCount;
 using openxc::config::getConfiguration;
+using openxc::pipeline::MessageClass;
 
 extern openxc::lights::RGB LIGHT_A_LAST_COLOR;
 extern unsigned long FAKE_TIME;
 
 // TODO this should be refactored out of vi_firmware.cpp, and include a header
 // file so we don't have to use extern.
-extern void receiveCan(Pipeline* pipeline, CanBus* bus);
+extern int receiveCan(Pipeline* pipeline, CanBus* bus);
 extern void checkBusActivity();
 extern void initializeVehicleInterface();
 extern void firmwareLoop();
@@ -30,8 +31,39 @@ static bool canQueueEmpty(int bus) {
     return QUEUE_EMPTY(CanMessage, &getCanBuses()[bus].sendQueue);
 }
 
+// A sink that takes a while to send each message, to run out the CAN receive
+// time budget
+static int SLOW_SINK_DEVICE;
+static unsigned long SLOW_SINK_DELAY_MS;
+
+static bool slowSinkConnected(void* device) {
+    return true;
+}
+
+static int slowSinkEnqueue(void* device, const uint8_t* data, int length) {
+    FAKE_TIME += SLOW_SINK_DELAY_MS;
+    return length;
+}
+
+static int slowSinkAvailable(void* device) {
+    return QUEUE_MAX_LENGTH(uint8_t);
+}
+
+static const openxc::pipeline::SinkOperations SLOW_SINK_OPERATIONS = {
+    connected: slowSinkConnected,
+    enqueue: slowSinkEnqueue,
+    available: slowSinkAvailable,
+    flush: NULL,
+    queueLengths: NULL
+};
+
 void setup() {
     initializeVehicleInterface();
+    getConfiguration()->canReceiveBatchSize = DEFAULT_CAN_RECEIVE_BATCH_SIZE;
+    getConfiguration()->canReceiveTimeBudgetMs =
+            DEFAULT_CAN_RECEIVE_TIME_BUDGET_MS;
+    openxc::pipeline::removeSinks(&getConfiguration()->pipeline,
+            &SLOW_SINK_DEVICE);
     fail_unless(canQueueEmpty(0));
 }
 
@@ -44,7 +76,7 @@ CanMessage message = {
 START_TEST (test_update_data_lights_can_active)
 {
     CanBus* bus = &getCanBuses()[0];
-    QUEUE_PUSH(CanMessage, &bus->receiveQueue, message);
+    QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET], message);
     receiveCan(&getConfiguration()->pipeline, bus);
 
     checkBusActivity();
@@ -61,7 +93,7 @@ START_TEST (test_update_data_lights_can_inactive)
                 openxc::lights::COLORS.red));
 
     CanBus* bus = &getCanBuses()[0];
-    QUEUE_PUSH(CanMessage, &bus->receiveQueue, message);
+    QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET], message);
     receiveCan(&getConfiguration()->pipeline, bus);
 
     FAKE_TIME += (openxc::can::CAN_ACTIVE_TIMEOUT_S * 1000) * 2;
@@ -72,7 +104,7 @@ END_TEST
 START_TEST (test_update_data_lights_suspend)
 {
     CanBus* bus = &getCanBuses()[0];
-    QUEUE_PUSH(CanMessage, &bus->receiveQueue, message);
+    QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET], message);
     receiveCan(&getConfiguration()->pipeline, bus);
 
     FAKE_TIME += (openxc::can::CAN_ACTIVE_TIMEOUT_S * 1000) * 2;
@@ -89,6 +121,90 @@ START_TEST (test_update_data_lights_suspend)
 }
 END_TEST
 
+START_TEST (test_receive_can_batch)
+{
+    CanBus* bus = &getCanBuses()[0];
+    for(int i = 0; i < 3; i++) {
+        QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET], message);
+    }
+    unsigned int messagesReceived = bus->messagesReceived;
+    ck_assert_int_eq(3, receiveCan(&getConfiguration()->pipeline, bus));
+    ck_assert(QUEUE_EMPTY(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET]));
+    ck_assert_int_eq(messagesReceived + 3, bus->messagesReceived);
+    ck_assert_int_eq(0, receiveCan(&getConfiguration()->pipeline, bus));
+}
+END_TEST
+
+START_TEST (test_receive_can_batch_limit)
+{
+    CanBus* bus = &getCanBuses()[0];
+    getConfiguration()->canReceiveBatchSize = 2;
+    for(int i = 0; i < 3; i++) {
+        QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET], message);
+    }
+    ck_assert_int_eq(2, receiveCan(&getConfiguration()->pipeline, bus));
+    ck_assert_int_eq(1, QUEUE_LENGTH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET]));
+    ck_assert_int_eq(1, receiveCan(&getConfiguration()->pipeline, bus));
+}
+END_TEST
+
+START_TEST (test_receive_can_time_budget)
+{
+    CanBus* bus = &getCanBuses()[0];
+    getConfiguration()->canReceiveTimeBudgetMs = 10;
+    SLOW_SINK_DELAY_MS = 6;
+    ck_assert(openxc::pipeline::addSink(&getConfiguration()->pipeline, "slow",
+            &SLOW_SINK_OPERATIONS, &SLOW_SINK_DEVICE, NULL,
+            MESSAGE_CLASS_MASK(MessageClass::CAN)));
+
+    CanMessage rawMessage = {
+        id: 0x3,
+        format: CanMessageFormat::STANDARD,
+        data: {0x1, 0x2}
+    };
+    for(int i = 0; i < 5; i++) {
+        QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET],
+                rawMessage);
+    }
+
+    // The budget runs out while handling the second message
+    ck_assert_int_eq(2, receiveCan(&getConfiguration()->pipeline, bus));
+    ck_assert_int_eq(3, QUEUE_LENGTH(CanMessage,
+                &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET]));
+
+    // A message that takes longer than the whole budget is still handled,
+    // then the drain stops
+    SLOW_SINK_DELAY_MS = 20;
+    ck_assert_int_eq(1, receiveCan(&getConfiguration()->pipeline, bus));
+    ck_assert_int_eq(2, QUEUE_LENGTH(CanMessage,
+                &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET]));
+}
+END_TEST
+
+START_TEST (test_receive_can_priority)
+{
+    CanBus* bus = &getCanBuses()[0];
+    getConfiguration()->canReceiveBatchSize = 6;
+    for(int i = 0; i < 6; i++) {
+        QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_PASSTHROUGH],
+                message);
+        QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET],
+                message);
+    }
+    QUEUE_PUSH(CanMessage, &bus->receiveQueues[RECEIVE_CLASS_DIAGNOSTIC],
+            message);
+
+    // One diagnostic response, then 4 from the message set and 1 passthrough
+    ck_assert_int_eq(6, receiveCan(&getConfiguration()->pipeline, bus));
+    ck_assert(QUEUE_EMPTY(CanMessage,
+                &bus->receiveQueues[RECEIVE_CLASS_DIAGNOSTIC]));
+    ck_assert_int_eq(2, QUEUE_LENGTH(CanMessage,
+                &bus->receiveQueues[RECEIVE_CLASS_MESSAGE_SET]));
+    ck_assert_int_eq(5, QUEUE_LENGTH(CanMessage,
+                &bus->receiveQueues[RECEIVE_CLASS_PASSTHROUGH]));
+}
+END_TEST
+
 START_TEST (test_loop)
 {
     firmwareLoop();
@@ -102,6 +218,10 @@ Suite* suite(void) {
     tcase_add_test(tc_core, test_update_data_lights_can_active);
     tcase_add_test(tc_core, test_update_data_lights_can_inactive);
     tcase_add_test(tc_core, test_update_data_lights_suspend);
+    tcase_add_test(tc_core, test_receive_can_batch);
+    tcase_add_test(tc_core, test_receive_can_batch_limit);
+    tcase_add_test(tc_core, test_receive_can_time_budget);
+    tcase_add_test(tc_core, test_receive_can_priority);
 
     tcase_add_test(tc_core, test_loop);
 
@@ -1,9 +1,16 @@
+#include <string.h>
 #include "bytebuffer.h"
 #include "strutil.h"
 #include "util/log.h"
 
+// The number of bytes of storage in a byte queue - emqueue keeps one slot
+// empty to tell a full queue from an empty one.
+#define QUEUE_STORAGE_LENGTH (QUEUE_MAX_LENGTH(uint8_t) + 1)
+
 QUEUE_DEFINE(uint8_t)
 
+namespace bytebuffer = openxc::util::bytebuffer;
+
 using openxc::util::log::debug;
 using openxc::util::bytebuffer::IncomingMessageCallback;
 
@@ -14,22 +21,36 @@ bool openxc::util::bytebuffer::processQueue(QUEUE_TYPE(uint8_t)* queue,
         return false;
     }
 
-    uint8_t snapshot[length];
-    QUEUE_SNAPSHOT(uint8_t, queue, snapshot, length);
     if(callback == NULL) {
         debug("Callback is NULL (%p) -- unable to handle queue at %p",
                 callback, queue);
         return false;
     }
 
-    size_t parsedLength = callback(snapshot, length);
-    for(size_t i = 0; i < parsedLength; i++) {
-        QUEUE_POP(uint8_t, queue);
+    // Only copy the queue out to a contiguous buffer if it wraps around the
+    // end of its storage, otherwise hand the callback the queue's own bytes.
+    size_t parsedLength;
+    int contiguousLength;
+    uint8_t* head = bytebuffer::peek(queue, &contiguousLength);
+    if(contiguousLength == length) {
+        parsedLength = callback(head, length);
+    } else {
+        uint8_t buffer[length];
+        bytebuffer::snapshot(queue, buffer, length);
+        parsedLength = callback(buffer, length);
     }
+    bytebuffer::discard(queue, parsedLength);
 
+    bool dumped = false;
     if(QUEUE_FULL(uint8_t, queue)) {
         debug("Incoming write is too long - dumping queue");
         QUEUE_INIT(uint8_t, queue);
+        dumped = true;
+    }
+
+    if(parsedLength > 0 || dumped) {
+        // The front of the queue moved, so any partial parse is stale
+        callback(NULL, 0);
     }
     return parsedLength > 0;
 }
@@ -42,10 +63,79 @@ bool openxc::util::bytebuffer::messageFits(QUEUE_TYPE(uint8_t)* queue, uint8_t*
 bool openxc::util::bytebuffer::conditionalEnqueue(QUEUE_TYPE(uint8_t)* queue, uint8_t* message,
         int messageSize) {
     if(messageFits(queue, message, messageSize)) {
-        for(int i = 0; i < messageSize; i++) {
-            QUEUE_PUSH(uint8_t, queue, (uint8_t)message[i]);
-        }
+        bytebuffer::enqueue(queue, message, messageSize);
         return true;
     }
     return false;
 }
+
+uint8_t* openxc::util::bytebuffer::reserve(QUEUE_TYPE(uint8_t)* queue,
+        int* length) {
+    int available = QUEUE_AVAILABLE(uint8_t, queue);
+    int span = QUEUE_STORAGE_LENGTH - queue->tail;
+    *length = available < span ? available : span;
+    return &queue->elements[queue->tail];
+}
+
+void openxc::util::bytebuffer::commit(QUEUE_TYPE(uint8_t)* queue, int length) {
+    queue->tail = (queue->tail + length) % QUEUE_STORAGE_LENGTH;
+}
+
+uint8_t* openxc::util::bytebuffer::peek(QUEUE_TYPE(uint8_t)* queue,
+        int* length) {
+    int queued = QUEUE_LENGTH(uint8_t, queue);
+    int span = QUEUE_STORAGE_LENGTH - queue->head;
+    *length = queued < span ? queued : span;
+    return &queue->elements[queue->head];
+}
+
+void openxc::util::bytebuffer::discard(QUEUE_TYPE(uint8_t)* queue, int count) {
+    int queued = QUEUE_LENGTH(uint8_t, queue);
+    if(count > queued) {
+        count = queued;
+    }
+    if(count > 0) {
+        queue->head = (queue->head + count) % QUEUE_STORAGE_LENGTH;
+    }
+}
+
+int openxc::util::bytebuffer::enqueue(QUEUE_TYPE(uint8_t)* queue,
+        const uint8_t* data, int length) {
+    int written = 0;
+    while(written < length) {
+        int span;
+        uint8_t* tail = reserve(queue, &span);
+        if(span == 0) {
+            break;
+        }
+
+        int count = length - written < span ? length - written : span;
+        memcpy(tail, &data[written], count);
+        commit(queue, count);
+        written += count;
+    }
+    return written;
+}
+
+int openxc::util::bytebuffer::snapshot(QUEUE_TYPE(uint8_t)* queue,
+        uint8_t* buffer, int max) {
+    int queued = QUEUE_LENGTH(uint8_t, queue);
+    int total = queued < max ? queued : max;
+
+    int span;
+    uint8_t* head = peek(queue, &span);
+    int count = total < span ? total : span;
+    memcpy(buffer, head, count);
+    if(count < total) {
+        // The rest wrapped around to the start of the queue's storage
+        memcpy(&buffer[count], queue->elements, total - count);
+    }
+    return total;
+}
+
+int openxc::util::bytebuffer::dequeue(QUEUE_TYPE(uint8_t)* queue,
+        uint8_t* buffer, int max) {
+    int count = snapshot(queue, buffer, max);
+    discard(queue, count);
+    return count;
+}
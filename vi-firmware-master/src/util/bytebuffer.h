@@ -18,6 +18,11 @@ namespace bytebuffer {
  *
  * The callback should return the number of bytes read from the buffer for a
  * message, if any was found.
+ *
+ * Callbacks can keep the progress of parsing an incomplete message between
+ * calls - whenever bytes are removed from the front of the queue, the callback
+ * is called with a NULL buffer and 0 length to say that progress is stale, and
+ * should return 0.
  */
 typedef size_t (*IncomingMessageCallback)(uint8_t* buffer, size_t length);
 
@@ -29,6 +34,9 @@ typedef size_t (*IncomingMessageCallback)(uint8_t* buffer, size_t length);
  * callback - A function that will return true if an OpenXC message is found in
  *          the queue.
  *
+ * Whenever bytes are removed, the callback is then called again with a NULL
+ * buffer so it can reset anything it kept about the old contents.
+ *
  * Returns true if a completed message was found in the queue and removed.
  */
 bool processQueue(QUEUE_TYPE(uint8_t)* queue, IncomingMessageCallback callback);
@@ -56,6 +64,80 @@ bool conditionalEnqueue(QUEUE_TYPE(uint8_t)* queue, uint8_t* message,
  */
 bool messageFits(QUEUE_TYPE(uint8_t)* queue, uint8_t* message, int messageSize);
 
+/* Public: Find the contiguous free space at the tail of the byte queue, so it
+ * can be filled in place (e.g. by a DMA or stream read) and then published
+ * with commit().
+ *
+ * The free space may wrap around the end of the queue's storage, so this can
+ * return less than QUEUE_AVAILABLE - call it again after committing to get
+ * the rest.
+ *
+ * queue - The queue to write to.
+ * length - Set to the number of bytes that can be written at the returned
+ *      pointer.
+ *
+ * Returns a pointer to the first free byte in the queue's storage.
+ */
+uint8_t* reserve(QUEUE_TYPE(uint8_t)* queue, int* length);
+
+/* Public: Publish bytes written in place after a call to reserve().
+ *
+ * queue - The queue that was written to.
+ * length - The number of bytes written, no more than reserve() allowed.
+ */
+void commit(QUEUE_TYPE(uint8_t)* queue, int length);
+
+/* Public: Find the contiguous run of queued bytes at the head of the byte
+ * queue, without removing them. Like reserve(), this may be less than the
+ * full queue length if the data wraps around the end of storage.
+ *
+ * queue - The queue to read from.
+ * length - Set to the number of bytes readable at the returned pointer.
+ *
+ * Returns a pointer to the oldest byte in the queue's storage.
+ */
+uint8_t* peek(QUEUE_TYPE(uint8_t)* queue, int* length);
+
+/* Public: Remove bytes from the head of the byte queue without copying them.
+ *
+ * queue - The queue to remove bytes from.
+ * count - The number of bytes to remove. If larger than the queue length, the
+ *      queue is emptied.
+ */
+void discard(QUEUE_TYPE(uint8_t)* queue, int count);
+
+/* Public: Copy as much of the data as will fit onto the end of the byte queue,
+ * using at most two block copies.
+ *
+ * queue - The queue to add the data.
+ * data - The bytes to add.
+ * length - The number of bytes to add.
+ *
+ * Returns the number of bytes added, which is less than length if the queue
+ * filled up.
+ */
+int enqueue(QUEUE_TYPE(uint8_t)* queue, const uint8_t* data, int length);
+
+/* Public: Copy bytes from the head of the byte queue without removing them.
+ *
+ * queue - The queue to copy from.
+ * buffer - The destination for the bytes.
+ * max - The maximum number of bytes to copy.
+ *
+ * Returns the number of bytes copied.
+ */
+int snapshot(QUEUE_TYPE(uint8_t)* queue, uint8_t* buffer, int max);
+
+/* Public: Copy bytes from the head of the byte queue and remove them.
+ *
+ * queue - The queue to read from.
+ * buffer - The destination for the bytes.
+ * max - The maximum number of bytes to read.
+ *
+ * Returns the number of bytes read.
+ */
+int dequeue(QUEUE_TYPE(uint8_t)* queue, uint8_t* buffer, int max);
+
 } // namespace bytebuffer
 } // namespace util
 } // namespace openxc
@@ -68,6 +68,11 @@ void delayMs(unsigned long delayInMs);
  */
 unsigned long systemTimeMs();
 
+/* Public: Return the current system time in microseconds. This wraps around
+ * much sooner than systemTimeMs(), so only use it to measure short intervals.
+ */
+unsigned long systemTimeUs();
+
 /* Public: Perform any one-time initialization required to use system times,
  * including those for system time and the delayMs function.
  */
@@ -13,6 +13,7 @@
 #include "platform/platform.h"
 #include "diagnostics.h"
 #include "obd2.h"
+#include "storage.h"
 #include "data_emulator.h"
 #include "config.h"
 #include "commands/commands.h"
@@ -30,6 +31,8 @@ namespace power = openxc::power;
 namespace bluetooth = openxc::bluetooth;
 namespace commands = openxc::commands;
 namespace config = openxc::config;
+namespace statistics = openxc::util::statistics;
+namespace storage = openxc::storage;
 
 using openxc::util::log::debug;
 using openxc::signals::getCanBuses;
@@ -91,6 +94,9 @@ void checkBusActivity() {
         lights::enable(lights::LIGHT_A, lights::COLORS.red);
         SUSPENDED = true;
         BUS_WAS_ACTIVE = false;
+        // Writing to flash blocks interrupts for long enough to drop CAN
+        // messages, so wait until there aren't any to save what's changed
+        storage::flush();
         if(getConfiguration()->powerManagement != PowerManagement::ALWAYS_ON) {
             // stay awake at least CAN_ACTIVE_TIMEOUT_S after power on
             platform::suspend(&getConfiguration()->pipeline);
@@ -112,24 +118,72 @@ void initializeAllCan() {
 }
 
 /*
- * Check to see if a packet has been received. If so, read the packet and print
- * the packet payload to the uart monitor.
+ * The number of messages to take from each CAN receive queue in a round of
+ * receiveCan, in CanReceiveClass order. Diagnostic responses get the largest
+ * share and passthrough messages the smallest, so if the firmware can't keep
+ * up it's the passthrough queue that fills up and drops messages first.
  */
-void receiveCan(Pipeline* pipeline, CanBus* bus) {
-    if(!QUEUE_EMPTY(CanMessage, &bus->receiveQueue)) {
-        CanMessage message = QUEUE_POP(CanMessage, &bus->receiveQueue);
-        signals::decodeCanMessage(pipeline, bus, &message);
-        if(bus->passthroughCanMessages) {
-            openxc::can::read::passthroughMessage(bus, &message, getMessages(),
-                    getMessageCount(), pipeline);
+static const int CAN_RECEIVE_CLASS_WEIGHTS[CAN_RECEIVE_CLASS_COUNT] = {8, 4, 1};
+
+static void handleCanMessage(Pipeline* pipeline, CanBus* bus,
+        CanMessage* message) {
+    signals::decodeCanMessage(pipeline, bus, message);
+    if(bus->passthroughCanMessages) {
+        openxc::can::read::passthroughMessage(bus, message, getMessages(),
+                getMessageCount(), pipeline);
+    }
+
+    diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
+            bus, message, pipeline);
+}
+
+/*
+ * Check to see if any packets have been received. If so, read and process them
+ * until the queues are empty, the configured batch size is reached or the time
+ * budget for this bus runs out, whichever comes first.
+ *
+ * The receive queues are drained in weighted rounds, highest priority first -
+ * see CAN_RECEIVE_CLASS_WEIGHTS.
+ *
+ * Returns the number of messages processed.
+ */
+int receiveCan(Pipeline* pipeline, CanBus* bus) {
+    int batchSize = MAX(getConfiguration()->canReceiveBatchSize, 1);
+    unsigned int timeBudget = getConfiguration()->canReceiveTimeBudgetMs;
+    unsigned long startTime = time::systemTimeMs();
+
+    int handled = 0;
+    bool pending = true;
+    bool budgetRemaining = true;
+    while(pending && budgetRemaining) {
+        pending = false;
+        for(int i = 0; i < CAN_RECEIVE_CLASS_COUNT && budgetRemaining; i++) {
+            QUEUE_TYPE(CanMessage)* queue = &bus->receiveQueues[i];
+            for(int taken = 0; taken < CAN_RECEIVE_CLASS_WEIGHTS[i] &&
+                    !QUEUE_EMPTY(CanMessage, queue); taken++) {
+                budgetRemaining = handled < batchSize && (handled == 0 ||
+                        timeBudget == 0 ||
+                        time::systemTimeMs() - startTime < timeBudget);
+                if(!budgetRemaining) {
+                    break;
+                }
+
+                CanMessage message = QUEUE_POP(CanMessage, queue);
+                handleCanMessage(pipeline, bus, &message);
+                ++handled;
+            }
+            pending |= !QUEUE_EMPTY(CanMessage, queue);
         }
+    }
 
+    if(handled > 0) {
         bus->lastMessageReceived = time::systemTimeMs();
-        ++bus->messagesReceived;
-
-        diagnostics::receiveCanMessage(&getConfiguration()->diagnosticsManager,
-                bus, &message, pipeline);
+        bus->messagesReceived += handled;
+        if(getConfiguration()->calculateMetrics) {
+            statistics::update(&bus->receiveBatchStats, handled);
+        }
     }
+    return handled;
 }
 
 void initializeIO() {
@@ -236,5 +290,6 @@ void firmwareLoop() {
         }
     }
 
+    can::read::publishLatestValues(&getConfiguration()->pipeline);
     openxc::pipeline::process(&getConfiguration()->pipeline);
 }